@@ -4,28 +4,110 @@ include $(CLEAR_VARS)
 
 LOCAL_MODULE := jnicrash
 
+# The unwinder and register dumps are per architecture; 64-bit targets
+# unwind with DWARF CFI, 32-bit ARM with the EHABI tables.
+ifeq ($(TARGET_ARCH),arm64)
+JNICRASH_ARCH := arm64
+else ifeq ($(TARGET_ARCH),x86_64)
+JNICRASH_ARCH := x86_64
+else
+JNICRASH_ARCH := arm
+endif
+
 LOCAL_SRC_FILES := \
     handler/exception_handler.cpp \
+    debuggerd/crash_snapshot.c \
     debuggerd/getevent.c \
+    debuggerd/hang_watchdog.c \
     debuggerd/tombstone.c \
     debuggerd/utility.c \
-    debuggerd/arm/machine.c \
+    debuggerd/$(JNICRASH_ARCH)/machine.c \
     corkscrew/ptrace.c \
     corkscrew/backtrace.c \
     corkscrew/demangle.c \
+    corkscrew/embedded_symbols.c \
     corkscrew/map_info.c \
+    corkscrew/module_table.c \
+    corkscrew/offline.c \
     corkscrew/symbol_table.c \
+    corkscrew/symbolizer.c \
     corkscrew/backtrace-helper.c \
-    corkscrew/arch-arm/backtrace-arm.c \
-	corkscrew/arch-arm/ptrace-arm.c \
+    corkscrew/dwarf_cfi.c \
+    corkscrew/jit_code.c \
+    corkscrew/stack_depot.c \
+    corkscrew/stack_scan.c \
+    corkscrew/arch-$(JNICRASH_ARCH)/backtrace-$(JNICRASH_ARCH).c \
+	corkscrew/arch-$(JNICRASH_ARCH)/ptrace-$(JNICRASH_ARCH).c \
+    profiler/cpu_profiler.c \
+    profiler/heap_profiler.c \
+    profiler/lock_profiler.c \
+    profiler/perf_sampler.c \
+    profiler/stack_counts.c \
+    profiler/thread_info.c \
+    profiler/wall_profiler.c \
 	native_crash_capture.cpp
 
-LOCAL_CFLAGS := -Wall -Wno-unused-parameter -std=gnu99
+LOCAL_CFLAGS := -Wall -Wno-unused-parameter -std=gnu99 -DCORKSCREW_HAVE_ARCH
+
+# Interposes malloc() and friends; only useful when the library is preloaded.
+# Its samples follow the frame-pointer chain.
+ifeq ($(JNICRASH_HEAP_PROFILER),true)
+LOCAL_CFLAGS += -DJNICRASH_HEAP_PROFILER -fno-omit-frame-pointer
+endif
+
+# Interposes pthread_mutex_lock() and the rwlock functions, same caveat.
+ifeq ($(JNICRASH_LOCK_PROFILER),true)
+LOCAL_CFLAGS += -DJNICRASH_LOCK_PROFILER
+endif
+
+# Embeds a table of every function's range and name in the library, for
+# symbolizing it once it is stripped (see cmake/embed_symbols.cmake).  The
+# default "note" table is mapped and read from memory; its capacity is
+# reserved at compile time and must hold it.  The library's own functions
+# take about 11 KiB, so 32 KiB leaves room for the STL and for growth.  A
+# "gzip" table is smaller and read from the file, only when a backtrace goes
+# through the library.
+JNICRASH_EMBEDDED_SYMBOLS_FORMAT ?= note
+JNICRASH_EMBEDDED_SYMBOLS_SIZE ?= 32768
+ifeq ($(JNICRASH_EMBEDDED_SYMBOLS)-$(JNICRASH_EMBEDDED_SYMBOLS_FORMAT),true-note)
+LOCAL_CFLAGS += -DJNICRASH_EMBEDDED_SYMBOLS_SIZE=$(JNICRASH_EMBEDDED_SYMBOLS_SIZE)
+endif
 
 LOCAL_C_INCLUDES := $(LOCAL_PATH)/cutils
 
 LOCAL_EXPORT_C_INCLUDES := $(LOCAL_C_INCLUDES)
 
-LOCAL_LDLIBS := -llog
+LOCAL_LDLIBS := -llog -lm -lz
 
 include $(BUILD_SHARED_LIBRARY)
+
+# The table is filled in on the unstripped library, before it is stripped
+# into libs/; the binutils are found next to the toolchain's strip.
+ifeq ($(JNICRASH_EMBEDDED_SYMBOLS),true)
+JNICRASH_CMAKE ?= cmake
+JNICRASH_SYMBOLS_STAMP := $(TARGET_OBJS)/jnicrash/embedded_symbols.stamp
+
+$(JNICRASH_SYMBOLS_STAMP): PRIVATE_LIBRARY := $(LOCAL_BUILT_MODULE)
+$(JNICRASH_SYMBOLS_STAMP): PRIVATE_WORK_DIR := $(TARGET_OBJS)/jnicrash/embedded_symbols
+$(JNICRASH_SYMBOLS_STAMP): PRIVATE_THUMB := $(if $(filter arm,$(TARGET_ARCH)),ON,OFF)
+$(JNICRASH_SYMBOLS_STAMP): PRIVATE_SCRIPT := $(LOCAL_PATH)/cmake/embed_symbols.cmake
+$(JNICRASH_SYMBOLS_STAMP): PRIVATE_NM := $(patsubst %strip,%nm,$(TARGET_STRIP))
+$(JNICRASH_SYMBOLS_STAMP): PRIVATE_OBJCOPY := $(patsubst %strip,%objcopy,$(TARGET_STRIP))
+$(JNICRASH_SYMBOLS_STAMP): PRIVATE_CC := $(TARGET_CC)
+$(JNICRASH_SYMBOLS_STAMP): PRIVATE_CC_FLAGS := $(subst $(space),;,$(strip $(GLOBAL_CFLAGS) $(TARGET_CFLAGS)))
+$(JNICRASH_SYMBOLS_STAMP): $(LOCAL_BUILT_MODULE) $(LOCAL_PATH)/cmake/embed_symbols.cmake
+	$(hide) $(JNICRASH_CMAKE) \
+	    -DLIBRARY=$(PRIVATE_LIBRARY) \
+	    -DFORMAT=$(JNICRASH_EMBEDDED_SYMBOLS_FORMAT) \
+	    -DCAPACITY=$(JNICRASH_EMBEDDED_SYMBOLS_SIZE) \
+	    -DNM=$(PRIVATE_NM) \
+	    -DOBJCOPY=$(PRIVATE_OBJCOPY) \
+	    -DCC=$(PRIVATE_CC) \
+	    "-DCC_FLAGS=$(PRIVATE_CC_FLAGS)" \
+	    -DCLEAR_THUMB_BIT=$(PRIVATE_THUMB) \
+	    -DWORK_DIR=$(PRIVATE_WORK_DIR) \
+	    -P $(PRIVATE_SCRIPT)
+	$(hide) touch $@
+
+$(LOCAL_INSTALLED): $(JNICRASH_SYMBOLS_STAMP)
+endif
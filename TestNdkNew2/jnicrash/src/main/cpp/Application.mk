@@ -1,5 +1,5 @@
 APP_STL := stlport_static
-APP_ABI := armeabi-v7a
+APP_ABI := armeabi-v7a arm64-v8a x86_64
 APP_PLATFORM := android-9
 
 
@@ -0,0 +1,213 @@
+# Embeds a table of a library's functions (corkscrew/embedded_symbols.h),
+# made from the library's own symbols, so that it can be symbolized after it
+# is stripped.
+#
+#   cmake -DLIBRARY=libfoo.so -DNM=nm -DOBJCOPY=objcopy -DCC=cc
+#         [-DFORMAT=note|gzip] [-DCAPACITY=32768] [-DCC_FLAGS=...]
+#         [-DCLEAR_THUMB_BIT=ON] [-DWORK_DIR=dir] -P embed_symbols.cmake
+#
+# Runs on the linked, unstripped library.  The table is generated as C and
+# compiled with the target's compiler to lay it out.  Then, by FORMAT:
+#
+#   note  It is copied over the section the library reserved with
+#         DEFINE_EMBEDDED_SYMBOLS(), in place.  The section keeps its size, so
+#         nothing else in the library moves.  CAPACITY must be the one the
+#         library was built with.  The table is mapped with the library and
+#         read from memory at crash time.
+#   gzip  It is gzipped into a section of its own, outside the loadable
+#         segments, and read from the file when a backtrace needs it.  Needs
+#         CMake 3.18.
+
+if(NOT DEFINED FORMAT)
+    set(FORMAT note)
+endif()
+set(required LIBRARY NM OBJCOPY CC)
+if(FORMAT STREQUAL "note")
+    list(APPEND required CAPACITY)
+elseif(NOT FORMAT STREQUAL "gzip")
+    message(FATAL_ERROR "embed_symbols: unknown FORMAT ${FORMAT}")
+elseif(CMAKE_VERSION VERSION_LESS 3.18)
+    message(FATAL_ERROR "embed_symbols: FORMAT gzip needs CMake 3.18")
+endif()
+foreach(var IN LISTS required)
+    if(NOT DEFINED ${var})
+        message(FATAL_ERROR "embed_symbols: ${var} is not set")
+    endif()
+endforeach()
+if(NOT DEFINED WORK_DIR)
+    set(WORK_DIR "${LIBRARY}.symbols")
+endif()
+
+set(note_section ".note.jnicrash.symbols")
+set(gzip_section ".jnicrash.symbols.gz")
+set(note_name "JNICRASH")
+set(note_type 1)
+set(magic 1297699658)  # "JSYM"
+
+# Functions with a size, in address order, in decimal.
+execute_process(COMMAND ${NM} --defined-only --print-size --numeric-sort --radix=d
+                        "${LIBRARY}"
+                OUTPUT_VARIABLE nm_output
+                RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "embed_symbols: ${NM} failed on ${LIBRARY}")
+endif()
+string(REGEX MATCHALL "[0-9]+ [0-9]+ [TtWw] [^\n]+" lines "${nm_output}")
+
+# One entry per address; names are kept mangled, the runtime demangles.
+set(count 0)
+set(names_size 0)
+set(last_start -1)
+set(symbols "")
+set(names "")
+foreach(line IN LISTS lines)
+    if(NOT line MATCHES "^([0-9]+) ([0-9]+) . (.+)$")
+        continue()
+    endif()
+    set(start ${CMAKE_MATCH_1})
+    set(size ${CMAKE_MATCH_2})
+    set(name "${CMAKE_MATCH_3}")
+    if(CLEAR_THUMB_BIT)
+        math(EXPR start "${start} / 2 * 2")
+    else()
+        math(EXPR start "${start}")
+    endif()
+    math(EXPR size "${size}")
+    if(size EQUAL 0 OR start EQUAL last_start)
+        continue()
+    endif()
+    set(last_start ${start})
+    string(LENGTH "${name}" length)
+    string(REPLACE "\\" "\\\\" name "${name}")
+    string(REPLACE "\"" "\\\"" name "${name}")
+    string(APPEND symbols "    ${start}, ${size}, ${names_size},\n")
+    string(APPEND names "    \"${name}\\0\"\n")
+    math(EXPR names_size "${names_size} + ${length} + 1")
+    math(EXPR count "${count} + 1")
+endforeach()
+if(count EQUAL 0)
+    message(FATAL_ERROR "embed_symbols: ${LIBRARY} has no function symbols; is it stripped?")
+endif()
+
+math(EXPR names_offset "16 + ${count} * 12")
+math(EXPR names_array "(${names_size} + 3) / 4 * 4")
+math(EXPR table_size "${names_offset} + ${names_array}")
+
+# The note wraps the table, which is padded to the reserved capacity.
+set(section ${gzip_section})
+set(note_members "")
+set(note_values "")
+set(padding_member "")
+set(padding_value "")
+if(FORMAT STREQUAL "note")
+    set(section ${note_section})
+    math(EXPR capacity "${CAPACITY} / 4 * 4")
+    math(EXPR padding "${capacity} - ${table_size}")
+    if(padding LESS 0)
+        message(FATAL_ERROR "embed_symbols: ${LIBRARY} needs ${table_size} bytes for its "
+                            "symbols but reserved ${capacity}; raise the capacity")
+    endif()
+    set(note_members "\
+    unsigned int name_size;
+    unsigned int desc_size;
+    unsigned int type;
+    char name[12];
+")
+    set(note_values "\
+    sizeof(\"${note_name}\"), ${capacity}, ${note_type}, \"${note_name}\",
+")
+    if(padding GREATER 0)
+        set(padding_member "    char padding[${padding}];\n")
+        set(padding_value ",\n    { 0 }")
+    endif()
+endif()
+
+get_filename_component(library_name "${LIBRARY}" NAME)
+file(MAKE_DIRECTORY "${WORK_DIR}")
+set(source "${WORK_DIR}/embedded_symbols.c")
+set(object "${WORK_DIR}/embedded_symbols.o")
+set(contents "${WORK_DIR}/embedded_symbols.bin")
+file(WRITE "${source}" "\
+/* Generated by embed_symbols.cmake from ${library_name}; do not edit. */
+
+__attribute__((section(\"${section}\"), used, aligned(4)))
+static const struct {
+${note_members}\
+    unsigned int magic;
+    unsigned int count;
+    unsigned int names_offset;
+    unsigned int names_size;
+    unsigned int symbols[${count} * 3];
+    char names[${names_array}];
+${padding_member}} embedded_symbols_table = {
+${note_values}\
+    ${magic}, ${count}, ${names_offset}, ${names_size},
+    {
+${symbols}    },
+${names}${padding_value}
+};
+")
+
+execute_process(COMMAND ${CC} ${CC_FLAGS} -c "${source}" -o "${object}"
+                RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "embed_symbols: could not compile ${source}")
+endif()
+execute_process(COMMAND ${OBJCOPY} -O binary --only-section=${section}
+                        "${object}" "${contents}"
+                RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "embed_symbols: could not extract ${section} from ${object}")
+endif()
+
+if(FORMAT STREQUAL "gzip")
+    file(ARCHIVE_CREATE OUTPUT "${contents}.gz" PATHS "${contents}"
+         FORMAT raw COMPRESSION GZip)
+    # Replaces the table of an earlier run.
+    execute_process(COMMAND ${OBJCOPY} --remove-section=${section} "${LIBRARY}"
+                    RESULT_VARIABLE result)
+    if(result EQUAL 0)
+        execute_process(COMMAND ${OBJCOPY} --add-section ${section}=${contents}.gz
+                                "${LIBRARY}"
+                        RESULT_VARIABLE result)
+    endif()
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "embed_symbols: could not add ${section} to ${LIBRARY}")
+    endif()
+    file(READ "${contents}.gz" compressed HEX)
+    string(LENGTH "${compressed}" compressed_size)
+    math(EXPR compressed_size "${compressed_size} / 2")
+    message(STATUS "embed_symbols: ${count} functions in ${compressed_size} bytes "
+                   "(${table_size} inflated) of ${library_name}")
+    return()
+endif()
+
+# A section of another size would be moved, and everything after it with it.
+set(reserved "${WORK_DIR}/reserved.bin")
+file(REMOVE "${reserved}")
+execute_process(COMMAND ${OBJCOPY} -O binary --only-section=${section}
+                        "${LIBRARY}" "${reserved}"
+                RESULT_VARIABLE result)
+set(reserved_hex "")
+if(result EQUAL 0 AND EXISTS "${reserved}")
+    file(READ "${reserved}" reserved_hex HEX)
+endif()
+file(READ "${contents}" contents_hex HEX)
+string(LENGTH "${reserved_hex}" reserved_length)
+string(LENGTH "${contents_hex}" contents_length)
+if(NOT reserved_length EQUAL contents_length)
+    math(EXPR reserved_size "${reserved_length} / 2")
+    math(EXPR contents_size "${contents_length} / 2")
+    message(FATAL_ERROR "embed_symbols: ${section} of ${LIBRARY} has ${reserved_size} "
+                        "bytes, not ${contents_size}; was it built with a capacity of "
+                        "${capacity}?")
+endif()
+
+execute_process(COMMAND ${OBJCOPY} --update-section ${section}=${contents} "${LIBRARY}"
+                RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "embed_symbols: could not update ${section} of ${LIBRARY}")
+endif()
+
+message(STATUS "embed_symbols: ${count} functions in ${table_size} of ${capacity} bytes "
+               "of ${library_name}")
@@ -17,6 +17,36 @@ JNIEXPORT jint
 JNICALL Java_com_disasterrecovery_jnicrash_NativeCrashCapture_nativeInit
         (JNIEnv *, jobject, jstring);
 
+/*
+ * Class:     com_crashcapture_NativeCrashCapture
+ * Method:    nativeSetTombstoneFlags
+ * Signature: (I)V
+ */
+JNIEXPORT void
+
+JNICALL Java_com_disasterrecovery_jnicrash_NativeCrashCapture_nativeSetTombstoneFlags
+        (JNIEnv *, jobject, jint);
+
+/*
+ * Class:     com_crashcapture_NativeCrashCapture
+ * Method:    nativeEnableSnapshotCapture
+ * Signature: ()I
+ */
+JNIEXPORT jint
+
+JNICALL Java_com_disasterrecovery_jnicrash_NativeCrashCapture_nativeEnableSnapshotCapture
+        (JNIEnv *, jobject);
+
+/*
+ * Class:     com_crashcapture_NativeCrashCapture
+ * Method:    nativeWriteDumpNow
+ * Signature: ()I
+ */
+JNIEXPORT jint
+
+JNICALL Java_com_disasterrecovery_jnicrash_NativeCrashCapture_nativeWriteDumpNow
+        (JNIEnv *, jobject);
+
 /*
  * Class:     com_crashcapture_NativeCrashCapture
  * Method:    nativeCrash
@@ -27,6 +57,156 @@ JNIEXPORT jint
 JNICALL Java_com_disasterrecovery_jnicrash_NativeCrashCapture_nativeCrash
         (JNIEnv *, jobject);
 
+/*
+ * Class:     com_crashcapture_NativeCrashCapture
+ * Method:    nativeStartProfiler
+ * Signature: (II)I
+ */
+JNIEXPORT jint
+
+JNICALL Java_com_disasterrecovery_jnicrash_NativeCrashCapture_nativeStartProfiler
+        (JNIEnv *, jobject, jint, jint);
+
+/*
+ * Class:     com_crashcapture_NativeCrashCapture
+ * Method:    nativeStopProfiler
+ * Signature: (Ljava/lang/String;)I
+ */
+JNIEXPORT jint
+
+JNICALL Java_com_disasterrecovery_jnicrash_NativeCrashCapture_nativeStopProfiler
+        (JNIEnv *, jobject, jstring);
+
+/*
+ * Class:     com_crashcapture_NativeCrashCapture
+ * Method:    nativeStartWallProfiler
+ * Signature: (I)I
+ */
+JNIEXPORT jint
+
+JNICALL Java_com_disasterrecovery_jnicrash_NativeCrashCapture_nativeStartWallProfiler
+        (JNIEnv *, jobject, jint);
+
+/*
+ * Class:     com_crashcapture_NativeCrashCapture
+ * Method:    nativeStopWallProfiler
+ * Signature: (Ljava/lang/String;)I
+ */
+JNIEXPORT jint
+
+JNICALL Java_com_disasterrecovery_jnicrash_NativeCrashCapture_nativeStopWallProfiler
+        (JNIEnv *, jobject, jstring);
+
+/*
+ * Class:     com_crashcapture_NativeCrashCapture
+ * Method:    nativeStartHeapProfiler
+ * Signature: (I)I
+ */
+JNIEXPORT jint
+
+JNICALL Java_com_disasterrecovery_jnicrash_NativeCrashCapture_nativeStartHeapProfiler
+        (JNIEnv *, jobject, jint);
+
+/*
+ * Class:     com_crashcapture_NativeCrashCapture
+ * Method:    nativeStopHeapProfiler
+ * Signature: ()V
+ */
+JNIEXPORT void
+
+JNICALL Java_com_disasterrecovery_jnicrash_NativeCrashCapture_nativeStopHeapProfiler
+        (JNIEnv *, jobject);
+
+/*
+ * Class:     com_crashcapture_NativeCrashCapture
+ * Method:    nativeDumpHeapProfile
+ * Signature: (Ljava/lang/String;)I
+ */
+JNIEXPORT jint
+
+JNICALL Java_com_disasterrecovery_jnicrash_NativeCrashCapture_nativeDumpHeapProfile
+        (JNIEnv *, jobject, jstring);
+
+/*
+ * Class:     com_crashcapture_NativeCrashCapture
+ * Method:    nativeStartLockProfiler
+ * Signature: ()I
+ */
+JNIEXPORT jint
+
+JNICALL Java_com_disasterrecovery_jnicrash_NativeCrashCapture_nativeStartLockProfiler
+        (JNIEnv *, jobject);
+
+/*
+ * Class:     com_crashcapture_NativeCrashCapture
+ * Method:    nativeStopLockProfiler
+ * Signature: ()V
+ */
+JNIEXPORT void
+
+JNICALL Java_com_disasterrecovery_jnicrash_NativeCrashCapture_nativeStopLockProfiler
+        (JNIEnv *, jobject);
+
+/*
+ * Class:     com_crashcapture_NativeCrashCapture
+ * Method:    nativeDumpLockProfile
+ * Signature: (Ljava/lang/String;)I
+ */
+JNIEXPORT jint
+
+JNICALL Java_com_disasterrecovery_jnicrash_NativeCrashCapture_nativeDumpLockProfile
+        (JNIEnv *, jobject, jstring);
+
+/*
+ * Class:     com_crashcapture_NativeCrashCapture
+ * Method:    nativeStartHangWatchdog
+ * Signature: (II)I
+ */
+JNIEXPORT jint
+
+JNICALL Java_com_disasterrecovery_jnicrash_NativeCrashCapture_nativeStartHangWatchdog
+        (JNIEnv *, jobject, jint, jint);
+
+/*
+ * Class:     com_crashcapture_NativeCrashCapture
+ * Method:    nativeStopHangWatchdog
+ * Signature: ()V
+ */
+JNIEXPORT void
+
+JNICALL Java_com_disasterrecovery_jnicrash_NativeCrashCapture_nativeStopHangWatchdog
+        (JNIEnv *, jobject);
+
+/*
+ * Class:     com_crashcapture_NativeCrashCapture
+ * Method:    nativeRegisterHangThread
+ * Signature: (Ljava/lang/String;I)J
+ */
+JNIEXPORT jlong
+
+JNICALL Java_com_disasterrecovery_jnicrash_NativeCrashCapture_nativeRegisterHangThread
+        (JNIEnv *, jobject, jstring, jint);
+
+/*
+ * Class:     com_crashcapture_NativeCrashCapture
+ * Method:    nativeHangHeartbeat
+ * Signature: (J)V
+ */
+JNIEXPORT void
+
+JNICALL Java_com_disasterrecovery_jnicrash_NativeCrashCapture_nativeHangHeartbeat
+        (JNIEnv *, jobject, jlong);
+
+/*
+ * Class:     com_crashcapture_NativeCrashCapture
+ * Method:    nativeUnregisterHangThread
+ * Signature: (J)V
+ */
+JNIEXPORT void
+
+JNICALL Java_com_disasterrecovery_jnicrash_NativeCrashCapture_nativeUnregisterHangThread
+        (JNIEnv *, jobject, jlong);
+
 #ifdef __cplusplus
 }
 #endif
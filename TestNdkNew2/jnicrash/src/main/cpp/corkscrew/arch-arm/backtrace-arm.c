@@ -50,10 +50,13 @@
 
 #include "../backtrace-arch.h"
 #include "../backtrace-helper.h"
+#include "../jit_code.h"
+#include "../module_table.h"
 #include "../ptrace-arch.h"
 #include "../ptrace.h"
 
 #include <stdlib.h>
+#include <string.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <limits.h>
@@ -100,27 +103,93 @@ static const uint32_t EXIDX_CANTUNWIND = 1;
  * absolute program counter address.
  *
  * Bionic exports a helpful function called __gnu_Unwind_Find_exidx that
- * handles both cases, so we use that here.
+ * handles both cases, but it walks every loaded object under the linker's
+ * lock, so it is only asked about modules the module table does not know.
  */
 typedef long unsigned int *_Unwind_Ptr;
 
 extern _Unwind_Ptr __gnu_Unwind_Find_exidx(_Unwind_Ptr pc, int *pcount);
 
-static uintptr_t find_exidx(uintptr_t pc, size_t *out_exidx_size) {
+/*
+ * The module of the last frame, copied out of the module table as a memo,
+ * since consecutive frames are mostly in the same module.  The table is only
+ * held while it is searched, so a writer replacing it never waits for a
+ * whole unwind, or for one that crashed.
+ */
+typedef struct {
+    uintptr_t start;
+    uintptr_t end;
+    uintptr_t exidx_start;
+    size_t exidx_count;
+    bool exidx_mapped;
+} module_cache_t;
+
+static void init_module_cache(module_cache_t *cache) {
+    memset(cache, 0, sizeof(*cache));
+}
+
+static bool find_cached_module(module_cache_t *cache, const memory_t *memory, uintptr_t pc) {
+    if (pc >= cache->start && pc < cache->end) {
+        return true;
+    }
+    const module_table_t *table = module_table_acquire();
+    const module_entry_t *entry = module_table_find(table, pc);
+    if (entry) {
+        cache->start = entry->module.start;
+        cache->end = entry->module.end;
+        cache->exidx_start = entry->exidx_start;
+        cache->exidx_count = entry->exidx_count;
+    }
+    module_table_release(table);
+    if (!entry) {
+        return false;
+    }
+
+    // A module unloaded without module_table_dlclose() stays in the table
+    // until the next update, so its index is only read directly while it
+    // lies in one readable map of the live map list.
+    const map_info_t *mi = find_map_info(memory->map_info_list, cache->exidx_start);
+    cache->exidx_mapped = mi && mi->is_readable
+            && cache->exidx_start + cache->exidx_count * 8 <= mi->end;
+    return true;
+}
+
+/* Sets *out_mapped if the section is known to be mapped, so that it can be
+ * read without asking the map list. */
+static uintptr_t find_exidx(module_cache_t *cache, const memory_t *memory, uintptr_t pc,
+                            size_t *out_exidx_size, bool *out_mapped) {
+    if (find_cached_module(cache, memory, pc)) {
+        *out_exidx_size = cache->exidx_count;
+        *out_mapped = cache->exidx_mapped;
+        return cache->exidx_start;
+    }
+
     int count;
     uintptr_t start = (uintptr_t) __gnu_Unwind_Find_exidx((_Unwind_Ptr) pc, &count);
     *out_exidx_size = count;
+    *out_mapped = false;
     return start;
 }
 
+static bool read_exidx_word(const memory_t *memory, bool mapped, uintptr_t ptr,
+                            uint32_t *out_value) {
+    if (mapped) {
+        *out_value = *(const uint32_t *) ptr;
+        return true;
+    }
+    return try_get_word(memory, ptr, out_value);
+}
+
 /* Transforms a 31-bit place-relative offset to an absolute address.
  * We assume the most significant bit is clear. */
 static uintptr_t prel_to_absolute(uintptr_t place, uint32_t prel_offset) {
     return place + (((int32_t)(prel_offset << 1)) >> 1);
 }
 
+/* modules is only used, and must only be non-NULL, for this process. */
 static uintptr_t get_exception_handler(const memory_t *memory,
-                                       const map_info_t *map_info_list, uintptr_t pc) {
+                                       const map_info_t *map_info_list,
+                                       module_cache_t *modules, uintptr_t pc) {
     if (!pc) {
 //        ALOGV("get_exception_handler: pc is zero, no handler");
         return 0;
@@ -128,10 +197,11 @@ static uintptr_t get_exception_handler(const memory_t *memory,
 
     uintptr_t exidx_start;
     size_t exidx_size;
+    bool mapped = false;
     const map_info_t *mi;
-    if (memory->tid < 0) {
+    if (modules) {
         mi = NULL;
-        exidx_start = find_exidx(pc, &exidx_size);
+        exidx_start = find_exidx(modules, memory, pc, &exidx_size, &mapped);
     } else {
         mi = find_map_info(map_info_list, pc);
         if (mi && mi->data) {
@@ -154,7 +224,7 @@ static uintptr_t get_exception_handler(const memory_t *memory,
             uintptr_t entry = exidx_start + index * 8;
             uint32_t entry_prel_pc;
 //            ALOGV("XXX low=%u, high=%u, index=%u", low, high, index);
-            if (!try_get_word(memory, entry, &entry_prel_pc)) {
+            if (!read_exidx_word(memory, mapped, entry, &entry_prel_pc)) {
                 break;
             }
             uintptr_t entry_pc = prel_to_absolute(entry, entry_prel_pc);
@@ -166,7 +236,7 @@ static uintptr_t get_exception_handler(const memory_t *memory,
             if (index + 1 < exidx_size) {
                 uintptr_t next_entry = entry + 8;
                 uint32_t next_entry_prel_pc;
-                if (!try_get_word(memory, next_entry, &next_entry_prel_pc)) {
+                if (!read_exidx_word(memory, mapped, next_entry, &next_entry_prel_pc)) {
                     break;
                 }
                 uintptr_t next_entry_pc = prel_to_absolute(next_entry, next_entry_prel_pc);
@@ -179,7 +249,7 @@ static uintptr_t get_exception_handler(const memory_t *memory,
 
             uintptr_t entry_handler_ptr = entry + 4;
             uint32_t entry_handler;
-            if (!try_get_word(memory, entry_handler_ptr, &entry_handler)) {
+            if (!read_exidx_word(memory, mapped, entry_handler_ptr, &entry_handler)) {
                 break;
             }
             if (entry_handler & (1L << 31)) {
@@ -485,16 +555,161 @@ uintptr_t rewind_pc_arch(const memory_t *memory, uintptr_t pc) {
     return pc;
 }
 
+uintptr_t check_return_address_arch(const memory_t *memory,
+                                    const exec_range_index_t *exec_ranges, uintptr_t value) {
+    if (value & 1) {
+        /* Thumb mode: a 32-bit bl or blx, or a 16-bit blx to a register. */
+        uintptr_t pc = value & ~1;
+        if (!is_in_exec_range(exec_ranges, pc - 2)) {
+            return 0;
+        }
+        uint16_t hw1, hw2;
+        if (try_get_half_word(memory, pc - 2, &hw2)) {
+            if ((hw2 & 0xff87) == 0x4780) {
+                return value;
+            }
+            if ((hw2 & 0xc000) == 0xc000
+                && try_get_half_word(memory, pc - 4, &hw1)
+                && (hw1 & 0xf800) == 0xf000) {
+                return value;
+            }
+        }
+    } else if (!(value & 3) && is_in_exec_range(exec_ranges, value - 4)) {
+        /* ARM mode: bl, blx to an immediate, or blx to a register. */
+        uint32_t insn;
+        if (try_get_word(memory, value - 4, &insn)) {
+            if (((insn & 0x0f000000) == 0x0b000000 && (insn >> 28) != 0xf)
+                || (insn & 0xfe000000) == 0xfa000000
+                || (insn & 0x0ffffff0) == 0x012fff30) {
+                return value;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Frame-pointer chain walk.
+ *
+ * Code built with frame pointers keeps a two-word frame record {caller's
+ * frame pointer, return address} on the stack and points the frame pointer
+ * register at it: r7 in Thumb code, r11 in ARM code.  Following the records
+ * costs two loads per frame.  Every record must lie on the thread's stack
+ * above the previous one and every return address must be in an executable
+ * map, so a broken chain is detected rather than followed.
+ */
+static const int R_FP_THUMB = 7;
+static const int R_FP_ARM = 11;
+
+typedef struct {
+    const memory_t *memory;
+    const map_info_t *map_info_list;
+    uintptr_t stack_end;            /* end of the stack map, 0 if unknown */
+    bool direct;                    /* stack words can be dereferenced directly */
+    const map_info_t *last_code_map;
+} frame_walk_t;
+
+static void init_frame_walk(frame_walk_t *walk, const memory_t *memory,
+                            const map_info_t *map_info_list, uintptr_t sp) {
+    walk->memory = memory;
+    walk->map_info_list = map_info_list;
+    walk->last_code_map = NULL;
+    const map_info_t *mi = find_map_info(map_info_list, sp);
+    walk->stack_end = mi && mi->is_readable ? mi->end : 0;
+    // Anything between sp and the end of its map is mapped, so it is safe to
+    // read without asking the map list each time.
+    walk->direct = walk->stack_end && memory->tid < 0 && !memory->stack_size;
+}
+
+static bool is_code_address(frame_walk_t *walk, uintptr_t pc) {
+    const map_info_t *mi = walk->last_code_map;
+    if (mi && pc >= mi->start && pc < mi->end) {
+        return true;
+    }
+    mi = find_map_info(walk->map_info_list, pc);
+    if (mi && mi->is_executable) {
+        walk->last_code_map = mi;
+        return true;
+    }
+    return false;
+}
+
+static bool read_stack_word(const frame_walk_t *walk, uintptr_t ptr, uint32_t *out_value) {
+    if (walk->direct) {
+        *out_value = *(const uint32_t *) ptr;
+        return true;
+    }
+    return try_get_word(walk->memory, ptr, out_value);
+}
+
+/* Steps to the caller using the frame record; leaves state alone on failure. */
+static bool step_frame_pointer(frame_walk_t *walk, unwind_state_t *state) {
+    uint32_t fp = state->gregs[state->gregs[R_PC] & 1 ? R_FP_THUMB : R_FP_ARM];
+    if (!fp || (fp & 3) || fp < state->gregs[R_SP]
+        || (walk->stack_end && fp + 8 > walk->stack_end)) {
+        return false;
+    }
+    uint32_t next_fp, return_address;
+    if (!read_stack_word(walk, fp, &next_fp)
+        || !read_stack_word(walk, fp + 4, &return_address)
+        || !return_address || !is_code_address(walk, return_address)) {
+        return false;
+    }
+    // The saved frame pointer belongs to the caller, whose instruction set is
+    // given by the return address.
+    set_reg(state, return_address & 1 ? R_FP_THUMB : R_FP_ARM, next_fp);
+    set_reg(state, R_SP, fp + 8);
+    set_reg(state, R_LR, 0);
+    set_reg(state, R_PC, return_address);
+    return true;
+}
+
+/* Steps to the caller using the rule of registered JIT code. */
+static bool step_jit_frame(const memory_t *memory, const jit_code_t *code,
+                           unwind_state_t *state) {
+    int fp_reg = state->gregs[R_PC] & 1 ? R_FP_THUMB : R_FP_ARM;
+    uintptr_t sp = state->gregs[R_SP];
+    uintptr_t fp = state->gregs[fp_reg];
+    uintptr_t return_address;
+    if (!step_jit_code(memory, code, &sp, &fp, state->gregs[R_LR], &return_address)) {
+        return false;
+    }
+    set_reg(state, return_address & 1 ? R_FP_THUMB : R_FP_ARM, fp);
+    set_reg(state, R_SP, sp);
+    set_reg(state, R_LR, 0);
+    set_reg(state, R_PC, return_address);
+    return true;
+}
+
+/*
+ * context is NULL when unwinding this process, otherwise it is the context of
+ * the traced process and supplies its JIT code.
+ */
 static ssize_t unwind_backtrace_common(const memory_t *memory,
                                        const map_info_t *map_info_list,
+                                       const ptrace_context_t *context,
                                        unwind_state_t *state, backtrace_frame_t *backtrace,
-                                       size_t ignore_depth, size_t max_depth) {
+                                       size_t ignore_depth, size_t max_depth,
+                                       unwind_mode_t mode, backtrace_fold_t *fold) {
     size_t ignored_frames = 0;
     size_t returned_frames = 0;
 
-    for (size_t index = 0; returned_frames < max_depth; index++) {
+    // Only the fast and hybrid modes walk the chain, but the walk is set up
+    // in every mode rather than left for each use to check.
+    frame_walk_t walk;
+    init_frame_walk(&walk, memory, map_info_list, state->gregs[R_SP]);
+
+    module_cache_t modules;
+    init_module_cache(&modules);
+
+    // Where the unwind tables gave up, if they did: the bottom of the frame
+    // they could not unwind.
+    uintptr_t lost_sp = 0;
+    for (size_t index = 0; has_backtrace_room(fold, backtrace, max_depth, &returned_frames);
+         index++) {
         uintptr_t pc = index ? rewind_pc_arch(memory, state->gregs[R_PC])
                              : state->gregs[R_PC];
+        uintptr_t sp = state->gregs[R_SP];
         backtrace_frame_t *frame = add_backtrace_entry(pc,
                                                        backtrace, ignore_depth, max_depth,
                                                        &ignored_frames, &returned_frames);
@@ -502,7 +717,31 @@ static ssize_t unwind_backtrace_common(const memory_t *memory,
             frame->stack_top = state->gregs[R_SP];
         }
 
-        uintptr_t handler = get_exception_handler(memory, map_info_list, pc);
+        // JIT code has no unwind tables, but it may have registered a rule.
+        jit_code_t jit;
+        if (find_jit_code(context, pc, &jit) && step_jit_frame(memory, &jit, state)) {
+            if (frame && state->gregs[R_SP] > frame->stack_top) {
+                frame->stack_size = state->gregs[R_SP] - frame->stack_top;
+            }
+            continue;
+        }
+
+        // The innermost frame may not have pushed its record yet (a leaf, or
+        // a prologue), so hybrid mode unwinds it from the tables.
+        if (mode == UNWIND_MODE_FAST || (mode == UNWIND_MODE_HYBRID && index)) {
+            if (step_frame_pointer(&walk, state)) {
+                if (frame && state->gregs[R_SP] > frame->stack_top) {
+                    frame->stack_size = state->gregs[R_SP] - frame->stack_top;
+                }
+                continue;
+            }
+            if (mode == UNWIND_MODE_FAST) {
+                break;
+            }
+        }
+
+        uintptr_t handler = get_exception_handler(memory, map_info_list,
+                                                  memory->tid < 0 ? &modules : NULL, pc);
         if (!handler) {
             // If there is no handler for the PC and this is the first frame,
             // then the program may have branched to an invalid address.
@@ -512,6 +751,7 @@ static ssize_t unwind_backtrace_common(const memory_t *memory,
                 set_reg(state, R_PC, state->gregs[R_LR]);
                 continue;
             } else {
+                lost_sp = sp;
                 break;
             }
         }
@@ -520,17 +760,20 @@ static ssize_t unwind_backtrace_common(const memory_t *memory,
         stream.ptr = handler;
         uint8_t pr;
         if (!try_next_byte(memory, &stream, &pr)) {
+            lost_sp = sp;
             break;
         }
         if ((pr & 0xf0) != 0x80) {
             // The first word is a place-relative pointer to a generic personality
             // routine function.  We don't support invoking such functions, so stop here.
+            lost_sp = sp;
             break;
         }
 
         // The first byte indicates the personality routine to execute.
         // Following bytes provide instructions to the personality routine.
         if (!execute_personality_routine(memory, state, &stream, pr & 0x0f)) {
+            lost_sp = sp;
             break;
         }
         if (frame && state->gregs[R_SP] > frame->stack_top) {
@@ -543,6 +786,7 @@ static ssize_t unwind_backtrace_common(const memory_t *memory,
 
     // Ran out of frames that we could unwind using handlers.
     // Add a final entry for the LR if it looks sane and call it good.
+    // A frame-pointer step clears the LR, so this only follows the tables.
     if (returned_frames < max_depth
         && state->gregs[R_LR]
         && state->gregs[R_LR] != state->gregs[R_PC]
@@ -552,13 +796,19 @@ static ssize_t unwind_backtrace_common(const memory_t *memory,
         add_backtrace_entry(rewind_pc_arch(memory, state->gregs[R_LR]),
                             backtrace, ignore_depth, max_depth, &ignored_frames, &returned_frames);
     }
+
+    // Guess the rest from what is left on the stack above the lost frame.
+    if (mode == UNWIND_MODE_SCAN && lost_sp) {
+        scan_stack_for_frames(memory, map_info_list, lost_sp, backtrace,
+                              ignore_depth, max_depth, &ignored_frames, &returned_frames);
+    }
     return returned_frames;
 }
 
 ssize_t unwind_backtrace_signal_arch(siginfo_t *siginfo, void *sigcontext,
                                      const map_info_t *map_info_list,
                                      backtrace_frame_t *backtrace, size_t ignore_depth,
-                                     size_t max_depth) {
+                                     size_t max_depth, unwind_mode_t mode) {
     const ucontext_t *uc = (const ucontext_t *) sigcontext;
 
     unwind_state_t state;
@@ -582,8 +832,50 @@ ssize_t unwind_backtrace_signal_arch(siginfo_t *siginfo, void *sigcontext,
 
     memory_t memory;
     init_memory(&memory, map_info_list);
-    return unwind_backtrace_common(&memory, map_info_list, &state,
-                                   backtrace, ignore_depth, max_depth);
+    return unwind_backtrace_common(&memory, map_info_list, NULL, &state,
+                                   backtrace, ignore_depth, max_depth, mode, NULL);
+}
+
+ssize_t __attribute__((noinline)) unwind_backtrace_local_arch(const map_info_t *map_info_list,
+                                                              backtrace_frame_t *backtrace,
+                                                              size_t ignore_depth,
+                                                              size_t max_depth,
+                                                              unwind_mode_t mode) {
+    // The unwind starts in this function, from registers that agree with its
+    // unwind rule at the mov from pc, which reads a few bytes ahead of itself;
+    // asking for the frame address gives it a frame record in the register
+    // of its instruction set.  The tables restore whatever else the callers
+    // need from the stack.
+    unwind_state_t state;
+    memset(&state, 0, sizeof(state));
+    uint32_t pc, sp;
+    __asm__ volatile("mov %0, pc\n\t"
+                     "mov %1, sp"
+                     : "=r"(pc), "=r"(sp));
+#ifdef __thumb__
+    pc |= 1;
+#endif
+    state.gregs[pc & 1 ? R_FP_THUMB : R_FP_ARM] = (uintptr_t) __builtin_frame_address(0);
+    state.gregs[R_SP] = sp;
+    state.gregs[R_PC] = pc;
+
+    memory_t memory;
+    init_memory(&memory, map_info_list);
+    return unwind_backtrace_common(&memory, map_info_list, NULL, &state,
+                                   backtrace, ignore_depth + 1, max_depth, mode, NULL);
+}
+
+ssize_t unwind_backtrace_regs_arch(const uintptr_t *regs, const memory_t *memory,
+                                   backtrace_frame_t *backtrace, size_t ignore_depth,
+                                   size_t max_depth) {
+    // PERF_REG_ARM_R0 .. PERF_REG_ARM_PC are the core registers in order.
+    unwind_state_t state;
+    for (int i = 0; i < 16; i++) {
+        state.gregs[i] = regs[i];
+    }
+    return unwind_backtrace_common(memory, memory->map_info_list, NULL, &state,
+                                   backtrace, ignore_depth, max_depth, UNWIND_MODE_ACCURATE,
+                                   NULL);
 }
 
 struct pt_regs crash_regs;
@@ -610,7 +902,7 @@ void get_regs_from_ucontext(const struct ucontext *const uc) {
 
 ssize_t unwind_backtrace_ptrace_arch(pid_t tid, const ptrace_context_t *context,
                                      backtrace_frame_t *backtrace, size_t ignore_depth,
-                                     size_t max_depth, bool at_fault) {
+                                     size_t max_depth, bool at_fault, backtrace_fold_t *fold) {
     struct pt_regs regs;
     if (at_fault) {
         regs = crash_regs;
@@ -627,6 +919,7 @@ ssize_t unwind_backtrace_ptrace_arch(pid_t tid, const ptrace_context_t *context,
 
     memory_t memory;
     init_memory_ptrace(&memory, tid);
-    return unwind_backtrace_common(&memory, context->map_info_list, &state,
-                                   backtrace, ignore_depth, max_depth);
+    return unwind_backtrace_common(&memory, context->map_info_list, context, &state,
+                                   backtrace, ignore_depth, max_depth, at_fault ? UNWIND_MODE_SCAN : UNWIND_MODE_ACCURATE,
+                                   fold);
 }
@@ -19,51 +19,36 @@
 
 #include "../ptrace-arch.h"
 
-#include <sys/exec_elf.h>
+#include "../elf_view.h"
 
 #ifndef PT_ARM_EXIDX
 #define PT_ARM_EXIDX 0x70000001
 #endif
 
-static void load_exidx_header(pid_t pid, map_info_t* mi,
+static void load_exidx_header(const memory_t* memory, const map_info_t* mi,
         uintptr_t* out_exidx_start, size_t* out_exidx_size) {
-    uint32_t elf_phoff;
-    uint32_t elf_phentsize_ehsize;
-    uint32_t elf_shentsize_phnum;
-    if (try_get_word_ptrace(pid, mi->start + offsetof(Elf32_Ehdr, e_phoff), &elf_phoff)
-            && try_get_word_ptrace(pid, mi->start + offsetof(Elf32_Ehdr, e_ehsize),
-                    &elf_phentsize_ehsize)
-            && try_get_word_ptrace(pid, mi->start + offsetof(Elf32_Ehdr, e_phnum),
-                    &elf_shentsize_phnum)) {
-        uint32_t elf_phentsize = elf_phentsize_ehsize >> 16;
-        uint32_t elf_phnum = elf_shentsize_phnum & 0xffff;
-        for (uint32_t i = 0; i < elf_phnum; i++) {
-            uintptr_t elf_phdr = mi->start + elf_phoff + i * elf_phentsize;
-            uint32_t elf_phdr_type;
-            if (!try_get_word_ptrace(pid, elf_phdr + offsetof(Elf32_Phdr, p_type), &elf_phdr_type)) {
-                break;
-            }
-            if (elf_phdr_type == PT_ARM_EXIDX) {
-                uint32_t elf_phdr_offset;
-                uint32_t elf_phdr_filesz;
-                if (!try_get_word_ptrace(pid, elf_phdr + offsetof(Elf32_Phdr, p_offset),
-                        &elf_phdr_offset)
-                        || !try_get_word_ptrace(pid, elf_phdr + offsetof(Elf32_Phdr, p_filesz),
-                                &elf_phdr_filesz)) {
-                    break;
-                }
-                *out_exidx_start = mi->start + elf_phdr_offset;
-                *out_exidx_size = elf_phdr_filesz / 8;
-                return;
-            }
-        }
+    uint32_t headers[MAX_ELF_HEADERS_SIZE / sizeof(uint32_t)];
+    elf_view_t view;
+    elf_segment_t exidx;
+    if (elf_view_init(&view, headers,
+                    read_elf_headers(memory, mi->start, headers, sizeof(headers)))
+            && elf_view_find_program_header(&view, PT_ARM_EXIDX, &exidx)) {
+        *out_exidx_start = mi->start + exidx.offset;
+        *out_exidx_size = exidx.filesz / 8;
+        return;
     }
     *out_exidx_start = 0;
     *out_exidx_size = 0;
 }
 
-void load_ptrace_map_info_data_arch(pid_t pid, map_info_t* mi, map_info_data_t* data) {
-    load_exidx_header(pid, mi, &data->exidx_start, &data->exidx_size);
+void load_ptrace_map_info_data_arch(const memory_t* memory, const map_info_t* mi,
+        map_info_data_t* data) {
+    load_exidx_header(memory, mi, &data->exidx_start, &data->exidx_size);
+}
+
+void load_module_map_info_data_arch(const module_entry_t* entry, map_info_data_t* data) {
+    data->exidx_start = entry->exidx_start;
+    data->exidx_size = entry->exidx_count;
 }
 
 void free_ptrace_map_info_data_arch(map_info_t* mi, map_info_data_t* data) {
@@ -0,0 +1,362 @@
+/*
+ * Backtracing functions for AArch64.
+ *
+ * Frames are unwound with the DWARF call frame information in .eh_frame,
+ * see dwarf_cfi.c.  The unwind state is x0-x30 and sp, which are also DWARF
+ * registers 0-31, followed by the pc.
+ *
+ * The AAPCS64 frame record {x29, x30} makes the frame-pointer walk of the
+ * fast and hybrid modes the same as on other targets.  Return addresses may
+ * carry a pointer authentication code, which is stripped before use.
+ */
+
+#define LOG_TAG "Corkscrew"
+//#define LOG_NDEBUG 0
+
+#include "../backtrace-arch.h"
+#include "../backtrace-helper.h"
+#include "../dwarf_cfi.h"
+#include "../jit_code.h"
+#include "../ptrace-arch.h"
+#include "../ptrace.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <elf.h>
+#include <ucontext.h>
+#include <sys/ptrace.h>
+#include <sys/uio.h>
+
+#ifndef PTRACE_GETREGSET
+#define PTRACE_GETREGSET 0x4204
+#endif
+
+#ifndef NT_PRSTATUS
+#define NT_PRSTATUS 1
+#endif
+
+static const int R_FP = 29;
+static const int R_LR = 30;
+static const int R_SP = 31;
+static const int R_PC = 32;
+
+/* Registers the CFI can refer to: x0-x30 and sp. */
+#define DWARF_REGS 32
+
+/* Unwind state. */
+typedef struct {
+    uintptr_t regs[DWARF_REGS + 1];
+} unwind_state_t;
+
+static uintptr_t get_eh_frame_hdr(const memory_t* memory,
+        const map_info_t* map_info_list, uintptr_t pc) {
+    if (memory->tid < 0) {
+        return find_eh_frame_hdr(pc);
+    }
+    const map_info_t* mi = find_map_info(map_info_list, pc);
+    if (mi && mi->data) {
+        return ((const map_info_data_t*) mi->data)->eh_frame_hdr;
+    }
+    return 0;
+}
+
+/* Removes a pointer authentication code from a return address. */
+static uintptr_t strip_pac(uintptr_t pc) {
+    // xpaclri is in the hint space, so cores without pointer authentication
+    // treat it as a nop and leave the address alone.
+    register uintptr_t x30 __asm__("x30") = pc;
+    __asm__("hint 0x7" : "+r"(x30));
+    return x30;
+}
+
+uintptr_t rewind_pc_arch(const memory_t* memory, uintptr_t pc) {
+    /* All instructions are 32bit. */
+    return pc - 4;
+}
+
+uintptr_t check_return_address_arch(const memory_t* memory,
+        const exec_range_index_t* exec_ranges, uintptr_t value) {
+    uintptr_t pc = strip_pac(value);
+    if ((pc & 3) || pc < 4 || !is_in_exec_range(exec_ranges, pc - 4)) {
+        return 0;
+    }
+    uint32_t insn;
+    if (!try_get_word(memory, pc - 4, &insn)) {
+        return 0;
+    }
+    if ((insn & 0xfc000000) == 0x94000000           /* bl */
+            || (insn & 0xfffffc1f) == 0xd63f0000    /* blr */
+            || (insn & 0xfefff800) == 0xd63f0800) { /* blraa, blrab and friends */
+        return pc;
+    }
+    return 0;
+}
+
+/*
+ * Frame-pointer chain walk.
+ *
+ * x29 points at the frame record {caller's x29, x30}.  Every record must lie
+ * on the thread's stack above the previous one and every return address must
+ * be in an executable map, so a broken chain is detected rather than followed.
+ */
+typedef struct {
+    const memory_t* memory;
+    const map_info_t* map_info_list;
+    uintptr_t stack_end;            /* end of the stack map, 0 if unknown */
+    bool direct;                    /* stack words can be dereferenced directly */
+    const map_info_t* last_code_map;
+} frame_walk_t;
+
+static void init_frame_walk(frame_walk_t* walk, const memory_t* memory,
+        const map_info_t* map_info_list, uintptr_t sp) {
+    walk->memory = memory;
+    walk->map_info_list = map_info_list;
+    walk->last_code_map = NULL;
+    const map_info_t* mi = find_map_info(map_info_list, sp);
+    walk->stack_end = mi && mi->is_readable ? mi->end : 0;
+    walk->direct = walk->stack_end && memory->tid < 0 && !memory->stack_size;
+}
+
+static bool is_code_address(frame_walk_t* walk, uintptr_t pc) {
+    const map_info_t* mi = walk->last_code_map;
+    if (mi && pc >= mi->start && pc < mi->end) {
+        return true;
+    }
+    mi = find_map_info(walk->map_info_list, pc);
+    if (mi && mi->is_executable) {
+        walk->last_code_map = mi;
+        return true;
+    }
+    return false;
+}
+
+static bool read_stack_pointer(const frame_walk_t* walk, uintptr_t ptr, uintptr_t* out_value) {
+    if (walk->direct) {
+        *out_value = *(const uintptr_t*) ptr;
+        return true;
+    }
+    return try_get_pointer(walk->memory, ptr, out_value);
+}
+
+/* Steps to the caller using the frame record; leaves state alone on failure. */
+static bool step_frame_pointer(frame_walk_t* walk, unwind_state_t* state) {
+    uintptr_t fp = state->regs[R_FP];
+    if (!fp || (fp & 7) || fp < state->regs[R_SP]
+            || (walk->stack_end && fp + 16 > walk->stack_end)) {
+        return false;
+    }
+    uintptr_t next_fp, return_address;
+    if (!read_stack_pointer(walk, fp, &next_fp)
+            || !read_stack_pointer(walk, fp + 8, &return_address)) {
+        return false;
+    }
+    return_address = strip_pac(return_address);
+    if (!return_address || !is_code_address(walk, return_address)) {
+        return false;
+    }
+    state->regs[R_FP] = next_fp;
+    state->regs[R_SP] = fp + 16;
+    state->regs[R_PC] = return_address;
+    return true;
+}
+
+/* Steps to the caller using the rule of registered JIT code. */
+static bool step_jit_frame(const memory_t* memory, const jit_code_t* code,
+        unwind_state_t* state) {
+    uintptr_t sp = state->regs[R_SP];
+    uintptr_t fp = state->regs[R_FP];
+    uintptr_t return_address;
+    if (!step_jit_code(memory, code, &sp, &fp, strip_pac(state->regs[R_LR]),
+            &return_address)) {
+        return false;
+    }
+    state->regs[R_FP] = fp;
+    state->regs[R_SP] = sp;
+    state->regs[R_PC] = strip_pac(return_address);
+    return true;
+}
+
+/*
+ * context is NULL when unwinding this process, otherwise it is the context of
+ * the traced process and supplies its JIT code.
+ */
+static ssize_t unwind_backtrace_common(const memory_t* memory,
+        const map_info_t* map_info_list, const ptrace_context_t* context,
+        unwind_state_t* state, backtrace_frame_t* backtrace,
+        size_t ignore_depth, size_t max_depth, unwind_mode_t mode,
+        backtrace_fold_t* fold) {
+    size_t ignored_frames = 0;
+    size_t returned_frames = 0;
+
+    // Only the fast and hybrid modes walk the chain, but the walk is set up
+    // in every mode rather than left for each use to check.
+    frame_walk_t walk;
+    init_frame_walk(&walk, memory, map_info_list, state->regs[R_SP]);
+
+    // Where the unwind tables gave up, if they did: the bottom of the frame
+    // they could not unwind.
+    uintptr_t lost_sp = 0;
+    for (size_t index = 0; has_backtrace_room(fold, backtrace, max_depth, &returned_frames);
+            index++) {
+        uintptr_t pc = index ? rewind_pc_arch(memory, state->regs[R_PC])
+                : state->regs[R_PC];
+        backtrace_frame_t* frame = add_backtrace_entry(pc,
+                backtrace, ignore_depth, max_depth,
+                &ignored_frames, &returned_frames);
+        if (frame) {
+            frame->stack_top = state->regs[R_SP];
+        }
+
+        // JIT code has no unwind tables, but it may have registered a rule.
+        jit_code_t jit;
+        if (find_jit_code(context, pc, &jit) && step_jit_frame(memory, &jit, state)) {
+            if (frame && state->regs[R_SP] > frame->stack_top) {
+                frame->stack_size = state->regs[R_SP] - frame->stack_top;
+            }
+            continue;
+        }
+
+        // The innermost frame may not have pushed its record yet (a leaf, or
+        // a prologue), so hybrid mode unwinds it from the tables.
+        if (mode == UNWIND_MODE_FAST || (mode == UNWIND_MODE_HYBRID && index)) {
+            if (step_frame_pointer(&walk, state)) {
+                if (frame && state->regs[R_SP] > frame->stack_top) {
+                    frame->stack_size = state->regs[R_SP] - frame->stack_top;
+                }
+                continue;
+            }
+            if (mode == UNWIND_MODE_FAST) {
+                break;
+            }
+        }
+
+        uintptr_t sp = state->regs[R_SP];
+        uintptr_t return_address;
+        if (!step_dwarf_cfi(memory, get_eh_frame_hdr(memory, map_info_list, pc), pc,
+                R_SP, state->regs, DWARF_REGS, &return_address)) {
+            // If there is no CFI for the PC and this is the first frame,
+            // then the program may have branched to an invalid address.
+            // Try starting from the LR instead, otherwise stop unwinding.
+            uintptr_t lr = strip_pac(state->regs[R_LR]);
+            if (index == 0 && lr && lr != state->regs[R_PC]) {
+                state->regs[R_PC] = lr;
+                continue;
+            }
+            lost_sp = sp;
+            break;
+        }
+        if (frame && state->regs[R_SP] > frame->stack_top) {
+            frame->stack_size = state->regs[R_SP] - frame->stack_top;
+        }
+        return_address = strip_pac(return_address);
+        if (!return_address) {
+            break;
+        }
+        if (state->regs[R_SP] == sp && return_address == state->regs[R_PC]) {
+            lost_sp = sp;
+            break;
+        }
+        state->regs[R_PC] = return_address;
+    }
+
+    // Guess the rest from what is left on the stack above the lost frame.
+    if (mode == UNWIND_MODE_SCAN && lost_sp) {
+        scan_stack_for_frames(memory, map_info_list, lost_sp, backtrace,
+                ignore_depth, max_depth, &ignored_frames, &returned_frames);
+    }
+    return returned_frames;
+}
+
+ssize_t unwind_backtrace_signal_arch(siginfo_t* siginfo, void* sigcontext,
+        const map_info_t* map_info_list,
+        backtrace_frame_t* backtrace, size_t ignore_depth, size_t max_depth,
+        unwind_mode_t mode) {
+    const ucontext_t* uc = (const ucontext_t*) sigcontext;
+
+    unwind_state_t state;
+    for (int i = 0; i < 31; i++) {
+        state.regs[i] = uc->uc_mcontext.regs[i];
+    }
+    state.regs[R_SP] = uc->uc_mcontext.sp;
+    state.regs[R_PC] = uc->uc_mcontext.pc;
+
+    memory_t memory;
+    init_memory(&memory, map_info_list);
+    return unwind_backtrace_common(&memory, map_info_list, NULL, &state,
+            backtrace, ignore_depth, max_depth, mode, NULL);
+}
+
+ssize_t __attribute__((noinline)) unwind_backtrace_local_arch(
+        const map_info_t* map_info_list,
+        backtrace_frame_t* backtrace, size_t ignore_depth, size_t max_depth,
+        unwind_mode_t mode) {
+    // The unwind starts in this function, from registers that agree with its
+    // unwind rule at the adr; asking for the frame address gives it a frame
+    // record whatever the compiler's defaults.  The tables restore whatever
+    // else the callers need from the stack.
+    unwind_state_t state;
+    memset(&state, 0, sizeof(state));
+    __asm__ volatile("adr %0, .\n\t"
+                     "mov %1, sp"
+                     : "=r"(state.regs[R_PC]), "=r"(state.regs[R_SP]));
+    state.regs[R_FP] = (uintptr_t) __builtin_frame_address(0);
+
+    memory_t memory;
+    init_memory(&memory, map_info_list);
+    return unwind_backtrace_common(&memory, map_info_list, NULL, &state,
+            backtrace, ignore_depth + 1, max_depth, mode, NULL);
+}
+
+ssize_t unwind_backtrace_regs_arch(const uintptr_t* regs, const memory_t* memory,
+        backtrace_frame_t* backtrace, size_t ignore_depth, size_t max_depth) {
+    // PERF_REG_ARM64_X0 .. PERF_REG_ARM64_PC match our layout.
+    unwind_state_t state;
+    for (int i = 0; i <= R_PC; i++) {
+        state.regs[i] = regs[i];
+    }
+    return unwind_backtrace_common(memory, memory->map_info_list, NULL, &state,
+            backtrace, ignore_depth, max_depth, UNWIND_MODE_ACCURATE, NULL);
+}
+
+struct user_pt_regs crash_regs;
+
+void get_regs_from_ucontext(const struct ucontext* const uc) {
+    for (int i = 0; i < 31; i++) {
+        crash_regs.regs[i] = uc->uc_mcontext.regs[i];
+    }
+    crash_regs.sp = uc->uc_mcontext.sp;
+    crash_regs.pc = uc->uc_mcontext.pc;
+    crash_regs.pstate = uc->uc_mcontext.pstate;
+}
+
+ssize_t unwind_backtrace_ptrace_arch(pid_t tid, const ptrace_context_t* context,
+        backtrace_frame_t* backtrace, size_t ignore_depth, size_t max_depth, bool at_fault,
+        backtrace_fold_t* fold) {
+    struct user_pt_regs regs;
+    if (at_fault) {
+        regs = crash_regs;
+    } else {
+        // There is no PTRACE_GETREGS on AArch64.
+        struct iovec iov;
+        iov.iov_base = &regs;
+        iov.iov_len = sizeof(regs);
+        if (ptrace(PTRACE_GETREGSET, tid, (void*) NT_PRSTATUS, &iov)) {
+            return -1;
+        }
+    }
+    unwind_state_t state;
+    for (int i = 0; i < 31; i++) {
+        state.regs[i] = regs.regs[i];
+    }
+    state.regs[R_SP] = regs.sp;
+    state.regs[R_PC] = regs.pc;
+
+    memory_t memory;
+    init_memory_ptrace(&memory, tid);
+    return unwind_backtrace_common(&memory, context->map_info_list, context, &state,
+            backtrace, ignore_depth, max_depth, at_fault ? UNWIND_MODE_SCAN : UNWIND_MODE_ACCURATE,
+            fold);
+}
@@ -0,0 +1,19 @@
+/* Loads the .eh_frame_hdr location of each module for unwinding over ptrace(). */
+
+#define LOG_TAG "Corkscrew"
+//#define LOG_NDEBUG 0
+
+#include "../ptrace-arch.h"
+#include "../dwarf_cfi.h"
+
+void load_ptrace_map_info_data_arch(const memory_t* memory, const map_info_t* mi,
+        map_info_data_t* data) {
+    data->eh_frame_hdr = load_eh_frame_hdr_ptrace(memory, mi);
+}
+
+void load_module_map_info_data_arch(const module_entry_t* entry, map_info_data_t* data) {
+    data->eh_frame_hdr = entry->eh_frame_hdr;
+}
+
+void free_ptrace_map_info_data_arch(map_info_t* mi, map_info_data_t* data) {
+}
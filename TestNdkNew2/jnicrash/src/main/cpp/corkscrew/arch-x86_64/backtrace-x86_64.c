@@ -0,0 +1,454 @@
+/*
+ * Backtracing functions for x86-64.
+ *
+ * Frames are unwound with the DWARF call frame information in .eh_frame,
+ * which the ABI requires for every function, see dwarf_cfi.c.  The unwind
+ * state is the 16 core registers and rip in DWARF numbering.
+ *
+ * Code built with frame pointers can also be unwound by following the rbp
+ * chain, which is what the fast and hybrid modes do.
+ */
+
+#define LOG_TAG "Corkscrew"
+//#define LOG_NDEBUG 0
+
+#include "../backtrace-arch.h"
+#include "../backtrace-helper.h"
+#include "../dwarf_cfi.h"
+#include "../jit_code.h"
+#include "../ptrace-arch.h"
+#include "../ptrace.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <ucontext.h>
+#include <sys/ptrace.h>
+#include <sys/user.h>
+
+/* DWARF register numbers. */
+enum {
+    DWARF_RAX = 0,
+    DWARF_RDX,
+    DWARF_RCX,
+    DWARF_RBX,
+    DWARF_RSI,
+    DWARF_RDI,
+    DWARF_RBP,
+    DWARF_RSP,
+    DWARF_R8,
+    DWARF_R9,
+    DWARF_R10,
+    DWARF_R11,
+    DWARF_R12,
+    DWARF_R13,
+    DWARF_R14,
+    DWARF_R15,
+    DWARF_RIP,
+    DWARF_REGS
+};
+
+/* Unwind state. */
+typedef struct {
+    uintptr_t regs[DWARF_REGS];
+} unwind_state_t;
+
+static uintptr_t get_eh_frame_hdr(const memory_t* memory,
+        const map_info_t* map_info_list, uintptr_t pc) {
+    if (memory->tid < 0) {
+        return find_eh_frame_hdr(pc);
+    }
+    const map_info_t* mi = find_map_info(map_info_list, pc);
+    if (mi && mi->data) {
+        return ((const map_info_data_t*) mi->data)->eh_frame_hdr;
+    }
+    return 0;
+}
+
+uintptr_t rewind_pc_arch(const memory_t* memory, uintptr_t pc) {
+    /* Instructions have no fixed length; any byte of the call will do. */
+    return pc - 1;
+}
+
+/* Reads code bytes a word at a time. */
+static bool read_code_bytes(const memory_t* memory, uintptr_t addr, uint8_t* out, size_t count) {
+    uintptr_t word_addr = addr & ~3;
+    uint32_t word = 0;
+    for (size_t i = 0; i < count; i++) {
+        uintptr_t byte_addr = addr + i;
+        if (i == 0 || (byte_addr & ~3) != word_addr) {
+            word_addr = byte_addr & ~3;
+            if (!try_get_word(memory, word_addr, &word)) {
+                return false;
+            }
+        }
+        out[i] = word >> ((byte_addr & 3) * 8);
+    }
+    return true;
+}
+
+/* Length of the call described by an ff /2 opcode and the bytes after it,
+ * or 0 if the bytes are some other instruction. */
+static size_t indirect_call_length(const uint8_t* insn) {
+    uint8_t modrm = insn[1];
+    if (insn[0] != 0xff || ((modrm >> 3) & 7) != 2) {
+        return 0;
+    }
+    int mod = modrm >> 6;
+    int rm = modrm & 7;
+    size_t length = 2;
+    if (mod == 3) {
+        return length;
+    }
+    if (rm == 4) {
+        length++;   /* SIB byte */
+        if (mod == 0 && (insn[2] & 7) == 5) {
+            length += 4;
+        }
+    } else if (mod == 0 && rm == 5) {
+        length += 4;   /* rip-relative */
+    }
+    if (mod == 1) {
+        length += 1;
+    } else if (mod == 2) {
+        length += 4;
+    }
+    return length;
+}
+
+uintptr_t check_return_address_arch(const memory_t* memory,
+        const exec_range_index_t* exec_ranges, uintptr_t value) {
+    if (value < 7 || !is_in_exec_range(exec_ranges, value - 1)) {
+        return 0;
+    }
+    // The seven bytes before the return address and the one at it, which an
+    // indirect call with a SIB byte may need to look at.
+    uint8_t code[8];
+    if (!read_code_bytes(memory, value - 7, code, sizeof(code))) {
+        return 0;
+    }
+    // call rel32
+    if (code[2] == 0xe8) {
+        return value;
+    }
+    // call r/m64, REX prefixes aside.
+    static const size_t lengths[] = { 2, 3, 4, 6, 7 };
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        if (indirect_call_length(&code[7 - lengths[i]]) == lengths[i]) {
+            return value;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Frame-pointer chain walk.
+ *
+ * A frame built with frame pointers starts with push %rbp; mov %rsp, %rbp,
+ * so rbp points at {caller's rbp, return address}.  Every record must lie on
+ * the thread's stack above the previous one and every return address must be
+ * in an executable map, so a broken chain is detected rather than followed.
+ */
+typedef struct {
+    const memory_t* memory;
+    const map_info_t* map_info_list;
+    uintptr_t stack_end;            /* end of the stack map, 0 if unknown */
+    bool direct;                    /* stack words can be dereferenced directly */
+    const map_info_t* last_code_map;
+} frame_walk_t;
+
+static void init_frame_walk(frame_walk_t* walk, const memory_t* memory,
+        const map_info_t* map_info_list, uintptr_t sp) {
+    walk->memory = memory;
+    walk->map_info_list = map_info_list;
+    walk->last_code_map = NULL;
+    const map_info_t* mi = find_map_info(map_info_list, sp);
+    walk->stack_end = mi && mi->is_readable ? mi->end : 0;
+    walk->direct = walk->stack_end && memory->tid < 0 && !memory->stack_size;
+}
+
+static bool is_code_address(frame_walk_t* walk, uintptr_t pc) {
+    const map_info_t* mi = walk->last_code_map;
+    if (mi && pc >= mi->start && pc < mi->end) {
+        return true;
+    }
+    mi = find_map_info(walk->map_info_list, pc);
+    if (mi && mi->is_executable) {
+        walk->last_code_map = mi;
+        return true;
+    }
+    return false;
+}
+
+static bool read_stack_pointer(const frame_walk_t* walk, uintptr_t ptr, uintptr_t* out_value) {
+    if (walk->direct) {
+        *out_value = *(const uintptr_t*) ptr;
+        return true;
+    }
+    return try_get_pointer(walk->memory, ptr, out_value);
+}
+
+/* Steps to the caller using the frame record; leaves state alone on failure. */
+static bool step_frame_pointer(frame_walk_t* walk, unwind_state_t* state) {
+    uintptr_t fp = state->regs[DWARF_RBP];
+    if (!fp || (fp & 7) || fp < state->regs[DWARF_RSP]
+            || (walk->stack_end && fp + 16 > walk->stack_end)) {
+        return false;
+    }
+    uintptr_t next_fp, return_address;
+    if (!read_stack_pointer(walk, fp, &next_fp)
+            || !read_stack_pointer(walk, fp + 8, &return_address)
+            || !return_address || !is_code_address(walk, return_address)) {
+        return false;
+    }
+    state->regs[DWARF_RBP] = next_fp;
+    state->regs[DWARF_RSP] = fp + 16;
+    state->regs[DWARF_RIP] = return_address;
+    return true;
+}
+
+/* Steps to the caller using the rule of registered JIT code. */
+static bool step_jit_frame(const memory_t* memory, const jit_code_t* code,
+        unwind_state_t* state) {
+    uintptr_t sp = state->regs[DWARF_RSP];
+    uintptr_t fp = state->regs[DWARF_RBP];
+    uintptr_t return_address;
+    if (!step_jit_code(memory, code, &sp, &fp, 0, &return_address)) {
+        return false;
+    }
+    state->regs[DWARF_RBP] = fp;
+    state->regs[DWARF_RSP] = sp;
+    state->regs[DWARF_RIP] = return_address;
+    return true;
+}
+
+/*
+ * context is NULL when unwinding this process, otherwise it is the context of
+ * the traced process and supplies its JIT code.
+ */
+static ssize_t unwind_backtrace_common(const memory_t* memory,
+        const map_info_t* map_info_list, const ptrace_context_t* context,
+        unwind_state_t* state, backtrace_frame_t* backtrace,
+        size_t ignore_depth, size_t max_depth, unwind_mode_t mode,
+        backtrace_fold_t* fold) {
+    size_t ignored_frames = 0;
+    size_t returned_frames = 0;
+
+    // Only the fast and hybrid modes walk the chain, but the walk is set up
+    // in every mode rather than left for each use to check.
+    frame_walk_t walk;
+    init_frame_walk(&walk, memory, map_info_list, state->regs[DWARF_RSP]);
+
+    // Where the unwind tables gave up, if they did: the bottom of the frame
+    // they could not unwind.
+    uintptr_t lost_sp = 0;
+    for (size_t index = 0; has_backtrace_room(fold, backtrace, max_depth, &returned_frames);
+            index++) {
+        uintptr_t pc = index ? rewind_pc_arch(memory, state->regs[DWARF_RIP])
+                : state->regs[DWARF_RIP];
+        backtrace_frame_t* frame = add_backtrace_entry(pc,
+                backtrace, ignore_depth, max_depth,
+                &ignored_frames, &returned_frames);
+        if (frame) {
+            frame->stack_top = state->regs[DWARF_RSP];
+        }
+
+        // JIT code has no unwind tables, but it may have registered a rule.
+        jit_code_t jit;
+        if (find_jit_code(context, pc, &jit) && step_jit_frame(memory, &jit, state)) {
+            if (frame && state->regs[DWARF_RSP] > frame->stack_top) {
+                frame->stack_size = state->regs[DWARF_RSP] - frame->stack_top;
+            }
+            continue;
+        }
+
+        // The innermost frame may not have pushed its record yet (a leaf, or
+        // a prologue), so hybrid mode unwinds it from the tables.
+        if (mode == UNWIND_MODE_FAST || (mode == UNWIND_MODE_HYBRID && index)) {
+            if (step_frame_pointer(&walk, state)) {
+                if (frame && state->regs[DWARF_RSP] > frame->stack_top) {
+                    frame->stack_size = state->regs[DWARF_RSP] - frame->stack_top;
+                }
+                continue;
+            }
+            if (mode == UNWIND_MODE_FAST) {
+                break;
+            }
+        }
+
+        uintptr_t sp = state->regs[DWARF_RSP];
+        uintptr_t previous_pc = state->regs[DWARF_RIP];
+        uintptr_t return_address;
+        if (!step_dwarf_cfi(memory, get_eh_frame_hdr(memory, map_info_list, pc), pc,
+                DWARF_RSP, state->regs, DWARF_REGS, &return_address)) {
+            // If there is no CFI for the PC and this is the first frame, then
+            // the program may have called an invalid address, in which case
+            // the return address is on top of the stack.
+            if (index == 0 && try_get_pointer(memory, sp, &return_address)
+                    && is_executable_map(map_info_list, return_address)) {
+                state->regs[DWARF_RSP] = sp + 8;
+                state->regs[DWARF_RIP] = return_address;
+                continue;
+            }
+            lost_sp = sp;
+            break;
+        }
+        if (frame && state->regs[DWARF_RSP] > frame->stack_top) {
+            frame->stack_size = state->regs[DWARF_RSP] - frame->stack_top;
+        }
+        if (!return_address) {
+            break;
+        }
+        if (state->regs[DWARF_RSP] == sp && return_address == previous_pc) {
+            lost_sp = sp;
+            break;
+        }
+        state->regs[DWARF_RIP] = return_address;
+    }
+
+    // Guess the rest from what is left on the stack above the lost frame.
+    if (mode == UNWIND_MODE_SCAN && lost_sp) {
+        scan_stack_for_frames(memory, map_info_list, lost_sp, backtrace,
+                ignore_depth, max_depth, &ignored_frames, &returned_frames);
+    }
+    return returned_frames;
+}
+
+static void get_state_from_ucontext(const ucontext_t* uc, unwind_state_t* state) {
+    const greg_t* gregs = uc->uc_mcontext.gregs;
+    state->regs[DWARF_RAX] = gregs[REG_RAX];
+    state->regs[DWARF_RDX] = gregs[REG_RDX];
+    state->regs[DWARF_RCX] = gregs[REG_RCX];
+    state->regs[DWARF_RBX] = gregs[REG_RBX];
+    state->regs[DWARF_RSI] = gregs[REG_RSI];
+    state->regs[DWARF_RDI] = gregs[REG_RDI];
+    state->regs[DWARF_RBP] = gregs[REG_RBP];
+    state->regs[DWARF_RSP] = gregs[REG_RSP];
+    state->regs[DWARF_R8] = gregs[REG_R8];
+    state->regs[DWARF_R9] = gregs[REG_R9];
+    state->regs[DWARF_R10] = gregs[REG_R10];
+    state->regs[DWARF_R11] = gregs[REG_R11];
+    state->regs[DWARF_R12] = gregs[REG_R12];
+    state->regs[DWARF_R13] = gregs[REG_R13];
+    state->regs[DWARF_R14] = gregs[REG_R14];
+    state->regs[DWARF_R15] = gregs[REG_R15];
+    state->regs[DWARF_RIP] = gregs[REG_RIP];
+}
+
+ssize_t unwind_backtrace_signal_arch(siginfo_t* siginfo, void* sigcontext,
+        const map_info_t* map_info_list,
+        backtrace_frame_t* backtrace, size_t ignore_depth, size_t max_depth,
+        unwind_mode_t mode) {
+    unwind_state_t state;
+    get_state_from_ucontext((const ucontext_t*) sigcontext, &state);
+
+    memory_t memory;
+    init_memory(&memory, map_info_list);
+    return unwind_backtrace_common(&memory, map_info_list, NULL, &state,
+            backtrace, ignore_depth, max_depth, mode, NULL);
+}
+
+ssize_t __attribute__((noinline)) unwind_backtrace_local_arch(
+        const map_info_t* map_info_list,
+        backtrace_frame_t* backtrace, size_t ignore_depth, size_t max_depth,
+        unwind_mode_t mode) {
+    // The unwind starts in this function, from registers that agree with its
+    // unwind rule at the instruction after the lea; asking for the frame
+    // address gives it a frame record even without -fno-omit-frame-pointer.
+    // The tables restore whatever else the callers need from the stack.
+    unwind_state_t state;
+    memset(&state, 0, sizeof(state));
+    __asm__ volatile("leaq 0(%%rip), %0\n\t"
+                     "movq %%rsp, %1"
+                     : "=r"(state.regs[DWARF_RIP]), "=r"(state.regs[DWARF_RSP]));
+    state.regs[DWARF_RBP] = (uintptr_t) __builtin_frame_address(0);
+
+    memory_t memory;
+    init_memory(&memory, map_info_list);
+    return unwind_backtrace_common(&memory, map_info_list, NULL, &state,
+            backtrace, ignore_depth + 1, max_depth, mode, NULL);
+}
+
+ssize_t unwind_backtrace_regs_arch(const uintptr_t* regs, const memory_t* memory,
+        backtrace_frame_t* backtrace, size_t ignore_depth, size_t max_depth) {
+    // The perf numbering follows the kernel's pt_regs, not DWARF.
+    unwind_state_t state;
+    state.regs[DWARF_RAX] = regs[0];
+    state.regs[DWARF_RBX] = regs[1];
+    state.regs[DWARF_RCX] = regs[2];
+    state.regs[DWARF_RDX] = regs[3];
+    state.regs[DWARF_RSI] = regs[4];
+    state.regs[DWARF_RDI] = regs[5];
+    state.regs[DWARF_RBP] = regs[6];
+    state.regs[DWARF_RSP] = regs[7];
+    state.regs[DWARF_RIP] = regs[8];
+    for (int i = 0; i < 8; i++) {
+        state.regs[DWARF_R8 + i] = regs[16 + i];
+    }
+    return unwind_backtrace_common(memory, memory->map_info_list, NULL, &state,
+            backtrace, ignore_depth, max_depth, UNWIND_MODE_ACCURATE, NULL);
+}
+
+struct user_regs_struct crash_regs;
+
+void get_regs_from_ucontext(const struct ucontext* const uc) {
+    const greg_t* gregs = uc->uc_mcontext.gregs;
+    crash_regs.rax = gregs[REG_RAX];
+    crash_regs.rbx = gregs[REG_RBX];
+    crash_regs.rcx = gregs[REG_RCX];
+    crash_regs.rdx = gregs[REG_RDX];
+    crash_regs.rsi = gregs[REG_RSI];
+    crash_regs.rdi = gregs[REG_RDI];
+    crash_regs.rbp = gregs[REG_RBP];
+    crash_regs.rsp = gregs[REG_RSP];
+    crash_regs.r8 = gregs[REG_R8];
+    crash_regs.r9 = gregs[REG_R9];
+    crash_regs.r10 = gregs[REG_R10];
+    crash_regs.r11 = gregs[REG_R11];
+    crash_regs.r12 = gregs[REG_R12];
+    crash_regs.r13 = gregs[REG_R13];
+    crash_regs.r14 = gregs[REG_R14];
+    crash_regs.r15 = gregs[REG_R15];
+    crash_regs.rip = gregs[REG_RIP];
+    crash_regs.eflags = gregs[REG_EFL];
+    // cs, gs, fs and ss, 16 bits each.
+    crash_regs.cs = gregs[REG_CSGSFS] & 0xffff;
+    crash_regs.ss = (gregs[REG_CSGSFS] >> 48) & 0xffff;
+}
+
+ssize_t unwind_backtrace_ptrace_arch(pid_t tid, const ptrace_context_t* context,
+        backtrace_frame_t* backtrace, size_t ignore_depth, size_t max_depth, bool at_fault,
+        backtrace_fold_t* fold) {
+    struct user_regs_struct regs;
+    if (at_fault) {
+        regs = crash_regs;
+    } else if (ptrace(PTRACE_GETREGS, tid, 0, &regs)) {
+        return -1;
+    }
+    unwind_state_t state;
+    state.regs[DWARF_RAX] = regs.rax;
+    state.regs[DWARF_RDX] = regs.rdx;
+    state.regs[DWARF_RCX] = regs.rcx;
+    state.regs[DWARF_RBX] = regs.rbx;
+    state.regs[DWARF_RSI] = regs.rsi;
+    state.regs[DWARF_RDI] = regs.rdi;
+    state.regs[DWARF_RBP] = regs.rbp;
+    state.regs[DWARF_RSP] = regs.rsp;
+    state.regs[DWARF_R8] = regs.r8;
+    state.regs[DWARF_R9] = regs.r9;
+    state.regs[DWARF_R10] = regs.r10;
+    state.regs[DWARF_R11] = regs.r11;
+    state.regs[DWARF_R12] = regs.r12;
+    state.regs[DWARF_R13] = regs.r13;
+    state.regs[DWARF_R14] = regs.r14;
+    state.regs[DWARF_R15] = regs.r15;
+    state.regs[DWARF_RIP] = regs.rip;
+
+    memory_t memory;
+    init_memory_ptrace(&memory, tid);
+    return unwind_backtrace_common(&memory, context->map_info_list, context, &state,
+            backtrace, ignore_depth, max_depth, at_fault ? UNWIND_MODE_SCAN : UNWIND_MODE_ACCURATE,
+            fold);
+}
@@ -21,6 +21,7 @@
 
 #include "ptrace-arch.h"
 #include "backtrace.h"
+#include "stack_scan.h"
 
 #include <signal.h>
 
@@ -31,12 +32,37 @@ extern "C" {
 /* Rewind the program counter by one instruction. */
 uintptr_t rewind_pc_arch(const memory_t* memory, uintptr_t pc);
 
+/*
+ * Checks whether a word found on the stack looks like a return address: it
+ * must be in one of exec_ranges, just past a call instruction.  Returns the
+ * return address, or 0 if the word is not one.
+ */
+uintptr_t check_return_address_arch(const memory_t* memory,
+        const exec_range_index_t* exec_ranges, uintptr_t value);
+
 ssize_t unwind_backtrace_signal_arch(siginfo_t* siginfo, void* sigcontext,
         const map_info_t* map_info_list,
-        backtrace_frame_t* backtrace, size_t ignore_depth, size_t max_depth);
+        backtrace_frame_t* backtrace, size_t ignore_depth, size_t max_depth,
+        unwind_mode_t mode);
+
+/* Unwinds the calling thread; its first frame is the caller of this function. */
+ssize_t unwind_backtrace_local_arch(const map_info_t* map_info_list,
+        backtrace_frame_t* backtrace, size_t ignore_depth, size_t max_depth,
+        unwind_mode_t mode);
 
+/* fold may be NULL; see unwind_backtrace_ptrace_folded(). */
 ssize_t unwind_backtrace_ptrace_arch(pid_t tid, const ptrace_context_t* context,
-        backtrace_frame_t* backtrace, size_t ignore_depth, size_t max_depth, bool at_fault);
+        backtrace_frame_t* backtrace, size_t ignore_depth, size_t max_depth, bool at_fault,
+        backtrace_fold_t* fold);
+
+/*
+ * Unwinds a thread of this process from registers captured elsewhere, for
+ * example by perf_event_open().  regs holds the core registers indexed by
+ * the kernel's perf register number for the architecture.  memory is
+ * usually backed by a snapshot of the stack taken together with the registers.
+ */
+ssize_t unwind_backtrace_regs_arch(const uintptr_t* regs, const memory_t* memory,
+        backtrace_frame_t* backtrace, size_t ignore_depth, size_t max_depth);
 
 void get_regs_from_ucontext(const struct ucontext* const uc);
 
@@ -19,6 +19,9 @@
 
 #include "backtrace-helper.h"
 
+#include <string.h>
+#include <time.h>
+
 
 backtrace_frame_t* add_backtrace_entry(uintptr_t pc, backtrace_frame_t* backtrace,
         size_t ignore_depth, size_t max_depth,
@@ -34,6 +37,161 @@ backtrace_frame_t* add_backtrace_entry(uintptr_t pc, backtrace_frame_t* backtrac
     frame->absolute_pc = pc;
     frame->stack_top = 0;
     frame->stack_size = 0;
+    frame->flags = 0;
     *returned_frames += 1;
     return frame;
 }
+
+/* Check the clock this often, in frames. */
+#define FOLD_CLOCK_INTERVAL 32
+
+static int64_t monotonic_ns() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+void init_backtrace_fold(backtrace_fold_t* fold, size_t top_frames, int time_limit_ms) {
+    fold->top_frames = top_frames;
+    fold->deadline_ns = time_limit_ms > 0 ? monotonic_ns() + time_limit_ms * 1000000LL : 0;
+    fold->repeat_count = 0;
+    fold->elided_at = 0;
+    fold->elided_frames = 0;
+    fold->timed_out = false;
+    fold->steps = 0;
+}
+
+size_t get_backtrace_fold_depth(const backtrace_fold_t* fold, size_t index) {
+    size_t depth = index;
+    for (size_t i = 0; i < fold->repeat_count; i++) {
+        const backtrace_repeat_t* repeat = &fold->repeats[i];
+        if (repeat->first + repeat->period <= index) {
+            depth += (repeat->repeats - 1) * repeat->period;
+        }
+    }
+    if (fold->elided_frames && index >= fold->elided_at) {
+        depth += fold->elided_frames;
+    }
+    return depth;
+}
+
+static bool same_frames(const backtrace_frame_t* backtrace, size_t a, size_t b, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (backtrace[a + i].absolute_pc != backtrace[b + i].absolute_pc) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Folds the frame just added if it completes another copy of a cycle. */
+static void fold_tail(backtrace_fold_t* fold, const backtrace_frame_t* backtrace,
+        size_t* returned_frames) {
+    size_t n = *returned_frames;
+    // Cycles never span the point frames were dropped at.
+    size_t floor = fold->elided_frames ? fold->elided_at : 0;
+
+    if (fold->repeat_count) {
+        backtrace_repeat_t* last = &fold->repeats[fold->repeat_count - 1];
+        size_t end = last->first + last->period;
+        bool contiguous = !fold->elided_frames || last->first >= fold->elided_at;
+        if (contiguous && n > end && n - end <= last->period
+                && same_frames(backtrace, last->first, end, n - end)) {
+            if (n - end == last->period) {
+                last->repeats++;
+                *returned_frames = end;
+            }
+            // Otherwise another copy may be under way; wait for the rest.
+            return;
+        }
+        if (end > floor) {
+            floor = end;
+        }
+    }
+    if (fold->repeat_count == MAX_BACKTRACE_FOLDS) {
+        return;
+    }
+
+    for (size_t period = 1; period <= MAX_BACKTRACE_FOLD_PERIOD
+            && floor + 2 * period <= n; period++) {
+        if (same_frames(backtrace, n - 2 * period, n - period, period)) {
+            backtrace_repeat_t* repeat = &fold->repeats[fold->repeat_count++];
+            repeat->first = n - 2 * period;
+            repeat->period = period;
+            repeat->repeats = 2;
+            *returned_frames = n - period;
+            return;
+        }
+    }
+}
+
+/* Drops frames from the middle of a full backtrace.  Returns false if there
+ * is nothing left that may be dropped. */
+static bool elide_middle(backtrace_fold_t* fold, backtrace_frame_t* backtrace,
+        size_t* returned_frames) {
+    size_t n = *returned_frames;
+    if (!fold->elided_frames) {
+        // Keep the top frames, and whole cycles that ended among them.
+        fold->elided_at = fold->top_frames;
+        for (size_t i = 0; i < fold->repeat_count; i++) {
+            const backtrace_repeat_t* repeat = &fold->repeats[i];
+            if (repeat->first < fold->elided_at
+                    && repeat->first + repeat->period > fold->elided_at) {
+                fold->elided_at = repeat->first + repeat->period;
+            }
+        }
+    }
+    size_t start = fold->elided_at;
+    if (start + 2 > n) {
+        return false;
+    }
+    // Drop the older half of the frames below the top, and whole cycles only.
+    size_t end = start + (n - start) / 2;
+    for (size_t i = 0; i < fold->repeat_count; i++) {
+        const backtrace_repeat_t* repeat = &fold->repeats[i];
+        if (repeat->first < end && repeat->first + repeat->period > end) {
+            end = repeat->first + repeat->period;
+        }
+    }
+    if (end >= n) {
+        return false;
+    }
+
+    size_t dropped = end - start;
+    size_t kept = 0;
+    for (size_t i = 0; i < fold->repeat_count; i++) {
+        backtrace_repeat_t repeat = fold->repeats[i];
+        if (repeat.first >= start && repeat.first < end) {
+            dropped += (repeat.repeats - 1) * repeat.period;
+            continue;
+        }
+        if (repeat.first >= end) {
+            repeat.first -= end - start;
+        }
+        fold->repeats[kept++] = repeat;
+    }
+    fold->repeat_count = kept;
+    memmove(&backtrace[start], &backtrace[end], (n - end) * sizeof(backtrace_frame_t));
+    *returned_frames = n - (end - start);
+    fold->elided_frames += dropped;
+    return true;
+}
+
+bool has_backtrace_room(backtrace_fold_t* fold, backtrace_frame_t* backtrace,
+        size_t max_depth, size_t* returned_frames) {
+    if (!fold) {
+        return *returned_frames < max_depth;
+    }
+    if (*returned_frames) {
+        fold_tail(fold, backtrace, returned_frames);
+    }
+    if (*returned_frames >= max_depth && !elide_middle(fold, backtrace, returned_frames)) {
+        return false;
+    }
+    if (fold->deadline_ns && ++fold->steps % FOLD_CLOCK_INTERVAL == 0
+            && monotonic_ns() >= fold->deadline_ns) {
+        fold->timed_out = true;
+        return false;
+    }
+    return true;
+}
@@ -36,6 +36,15 @@ backtrace_frame_t* add_backtrace_entry(uintptr_t pc,
         size_t ignore_depth, size_t max_depth,
         size_t* ignored_frames, size_t* returned_frames);
 
+/*
+ * Checks whether an unwinder should go on to another frame, which it does
+ * while the backtrace has room.  With a fold, repeating frames at the end of
+ * the backtrace are folded and the middle is dropped to make room, and false
+ * is returned once the deadline has passed.  fold may be NULL.
+ */
+bool has_backtrace_room(backtrace_fold_t* fold, backtrace_frame_t* backtrace,
+        size_t max_depth, size_t* returned_frames);
+
 #ifdef __cplusplus
 }
 #endif
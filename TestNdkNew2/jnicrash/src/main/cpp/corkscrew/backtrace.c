@@ -24,18 +24,21 @@
 #include "symbol_table.h"
 #include "ptrace.h"
 #include "demangle.h"
+#include "jit_code.h"
+#include "symbolizer.h"
 
 #include <unistd.h>
+#include <inttypes.h>
 #include <signal.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <limits.h>
+#include <time.h>
 #include <unwind.h>
-#include "../cutils/atomic.h"
-
-#define __USE_GNU // For dladdr(3) in glibc.
-
-#include <dlfcn.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #if defined(__BIONIC__)
 
@@ -53,11 +56,12 @@ static pid_t gettid() {
 
 #else
 
-// glibc doesn't implement or export either gettid or tgkill.
-
 #include <unistd.h>
 #include <sys/syscall.h>
 
+// glibc only implements gettid and tgkill from 2.30 on.
+#if !defined(__GLIBC__) || !__GLIBC_PREREQ(2, 30)
+
 static pid_t gettid() {
     return syscall(__NR_gettid);
 }
@@ -68,6 +72,8 @@ static int tgkill(int tgid, int tid, int sig) {
 
 #endif
 
+#endif
+
 typedef struct {
     backtrace_frame_t *backtrace;
     size_t ignore_depth;
@@ -115,34 +121,127 @@ ssize_t unwind_backtrace(backtrace_frame_t *backtrace, size_t ignore_depth, size
     return rc == _URC_END_OF_STACK ? 0 : -1;
 }
 
+ssize_t unwind_backtrace_mode(backtrace_frame_t *backtrace, size_t ignore_depth,
+                              size_t max_depth, unwind_mode_t mode) {
+#ifdef CORKSCREW_HAVE_ARCH
+    map_info_t *milist = acquire_my_map_info_list();
+    ssize_t frames = unwind_backtrace_local_arch(milist, backtrace, ignore_depth, max_depth,
+                                                 mode);
+    release_my_map_info_list(milist);
+    return frames;
+#else
+    return -1;
+#endif
+}
+
 #ifdef CORKSCREW_HAVE_ARCH
+/*
+ * Remote-thread unwinding is a handshake between the requesting thread and the
+ * target thread through a request slot.  The slot's state word doubles as the
+ * futex both sides sleep on, so the requester is woken as soon as the target
+ * has picked up or finished the request instead of polling.
+ *
+ * A state greater than zero is the tid of the thread that should pick up the
+ * request; the other states are listed below.  Several slots may be in flight
+ * at once, so unrelated threads can be unwound concurrently.
+ */
+static const int32_t STATE_FREE = 0;
 static const int32_t STATE_DUMPING = -1;
 static const int32_t STATE_DONE = -2;
 static const int32_t STATE_CANCEL = -3;
+static const int32_t STATE_CLAIMED = -4;
+
+/* How long to wait for the target thread to start dumping its stack. */
+static const int64_t START_TIMEOUT_NS = 250 * 1000000LL;
 
-static pthread_mutex_t g_unwind_signal_mutex = PTHREAD_MUTEX_INITIALIZER;
-static volatile struct {
-    int32_t tid_state;
+#define MAX_UNWIND_REQUESTS 16
+
+typedef struct {
+    int32_t state;
     const map_info_t* map_info_list;
     backtrace_frame_t* backtrace;
     size_t ignore_depth;
     size_t max_depth;
-    size_t returned_frames;
-} g_unwind_signal_state;
+    unwind_mode_t mode;
+    ssize_t returned_frames;
+} unwind_request_t;
+
+static unwind_request_t g_unwind_requests[MAX_UNWIND_REQUESTS];
+
+static pthread_once_t g_unwind_signal_once = PTHREAD_ONCE_INIT;
+static bool g_unwind_signal_installed;
+static struct sigaction g_old_sigurg_action;
 
-static void unwind_backtrace_thread_signal_handler(int n __attribute__((unused)), siginfo_t* siginfo, void* sigcontext) {
-    if (!android_atomic_acquire_cas(gettid(), STATE_DUMPING, &g_unwind_signal_state.tid_state)) {
-        g_unwind_signal_state.returned_frames = unwind_backtrace_signal_arch(
+static int futex_wait(int32_t* addr, int32_t value, const struct timespec* timeout) {
+    return syscall(__NR_futex, addr, FUTEX_WAIT_PRIVATE, value, timeout, NULL, 0);
+}
+
+static void futex_wake(int32_t* addr) {
+    syscall(__NR_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+static int64_t monotonic_ns() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static void unwind_backtrace_thread_signal_handler(int n, siginfo_t* siginfo, void* sigcontext) {
+    int32_t tid = gettid();
+    bool handled = false;
+
+    // Several requests for this thread may have been coalesced into one signal.
+    for (size_t i = 0; i < MAX_UNWIND_REQUESTS; i++) {
+        unwind_request_t* request = &g_unwind_requests[i];
+        int32_t expected = tid;
+        if (!__atomic_compare_exchange_n(&request->state, &expected, STATE_DUMPING,
+                false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        // The requester stops waiting to cancel once the dump has started.
+        futex_wake(&request->state);
+        request->returned_frames = unwind_backtrace_signal_arch(
                 siginfo, sigcontext,
-                g_unwind_signal_state.map_info_list,
-                g_unwind_signal_state.backtrace,
-                g_unwind_signal_state.ignore_depth,
-                g_unwind_signal_state.max_depth);
-        android_atomic_release_store(STATE_DONE, &g_unwind_signal_state.tid_state);
-    } else {
-//        ALOGV("Received spurious SIGURG on thread %d that was intended for thread %d.",
-//                gettid(), android_atomic_acquire_load(&g_unwind_signal_state.tid_state));
+                request->map_info_list,
+                request->backtrace,
+                request->ignore_depth,
+                request->max_depth,
+                request->mode);
+        __atomic_store_n(&request->state, STATE_DONE, __ATOMIC_RELEASE);
+        futex_wake(&request->state);
+        handled = true;
     }
+
+    if (!handled) {
+        // Not one of ours, most likely out-of-band socket data.
+        if (g_old_sigurg_action.sa_flags & SA_SIGINFO) {
+            g_old_sigurg_action.sa_sigaction(n, siginfo, sigcontext);
+        } else if (g_old_sigurg_action.sa_handler != SIG_DFL
+                && g_old_sigurg_action.sa_handler != SIG_IGN) {
+            g_old_sigurg_action.sa_handler(n);
+        }
+    }
+}
+
+/* The handler stays installed once set up; unrelated SIGURGs are chained. */
+static void install_unwind_signal_handler() {
+    struct sigaction act;
+    memset(&act, 0, sizeof(act));
+    act.sa_sigaction = unwind_backtrace_thread_signal_handler;
+    act.sa_flags = SA_RESTART | SA_SIGINFO | SA_ONSTACK;
+    sigemptyset(&act.sa_mask);
+    g_unwind_signal_installed = !sigaction(SIGURG, &act, &g_old_sigurg_action);
+}
+
+static unwind_request_t* claim_unwind_request() {
+    for (size_t i = 0; i < MAX_UNWIND_REQUESTS; i++) {
+        int32_t expected = STATE_FREE;
+        if (__atomic_compare_exchange_n(&g_unwind_requests[i].state, &expected, STATE_CLAIMED,
+                false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return &g_unwind_requests[i];
+        }
+    }
+    return NULL;
 }
 #endif
 
@@ -151,98 +250,127 @@ ssize_t unwind_backtrace_thread(pid_t tid, backtrace_frame_t *backtrace,
     if (tid == gettid()) {
         return unwind_backtrace(backtrace, ignore_depth + 1, max_depth);
     }
+    return unwind_backtrace_thread_mode(tid, backtrace, ignore_depth, max_depth,
+                                        UNWIND_MODE_ACCURATE);
+}
+
+ssize_t unwind_backtrace_thread_mode(pid_t tid, backtrace_frame_t *backtrace,
+                                     size_t ignore_depth, size_t max_depth, unwind_mode_t mode) {
+    if (tid == gettid()) {
+        return unwind_backtrace(backtrace, ignore_depth + 1, max_depth);
+    }
 
 //    ALOGV("Unwinding thread %d from thread %d.", tid, gettid());
 
     // TODO: there's no tgkill(2) on Mac OS, so we'd either need the
     // mach_port_t or the pthread_t rather than the tid.
 #if defined(CORKSCREW_HAVE_ARCH) && !defined(__APPLE__)
-    struct sigaction act;
-    struct sigaction oact;
-    memset(&act, 0, sizeof(act));
-    act.sa_sigaction = unwind_backtrace_thread_signal_handler;
-    act.sa_flags = SA_RESTART | SA_SIGINFO | SA_ONSTACK;
-    sigemptyset(&act.sa_mask);
+    pthread_once(&g_unwind_signal_once, install_unwind_signal_handler);
+    if (!g_unwind_signal_installed) {
+        return -1;
+    }
 
-    pthread_mutex_lock(&g_unwind_signal_mutex);
-    map_info_t* milist = acquire_my_map_info_list();
+    unwind_request_t* request = claim_unwind_request();
+    if (!request) {
+//        ALOGV("Too many concurrent unwind requests.");
+        return -1;
+    }
 
-    ssize_t frames = -1;
-    if (!sigaction(SIGURG, &act, &oact)) {
-        g_unwind_signal_state.map_info_list = milist;
-        g_unwind_signal_state.backtrace = backtrace;
-        g_unwind_signal_state.ignore_depth = ignore_depth;
-        g_unwind_signal_state.max_depth = max_depth;
-        g_unwind_signal_state.returned_frames = 0;
-        android_atomic_release_store(tid, &g_unwind_signal_state.tid_state);
-
-        // Signal the specific thread that we want to dump.
-        int32_t tid_state = tid;
-        if (tgkill(getpid(), tid, SIGURG)) {
- //           ALOGV("Failed to send SIGURG to thread %d.", tid);
-        } else {
-            // Wait for the other thread to start dumping the stack, or time out.
-            int wait_millis = 250;
-            for (;;) {
-                tid_state = android_atomic_acquire_load(&g_unwind_signal_state.tid_state);
-                if (tid_state != tid) {
-                    break;
-                }
-                if (wait_millis--) {
-//                    ALOGV("Waiting for thread %d to start dumping the stack...", tid);
-                    usleep(1000);
-                } else {
- //                   ALOGV("Timed out waiting for thread %d to start dumping the stack.", tid);
-                    break;
-                }
+    map_info_t* milist = acquire_my_map_info_list();
+    request->map_info_list = milist;
+    request->backtrace = backtrace;
+    request->ignore_depth = ignore_depth;
+    request->max_depth = max_depth;
+    request->mode = mode;
+    request->returned_frames = 0;
+    __atomic_store_n(&request->state, tid, __ATOMIC_RELEASE);
+
+    // Signal the specific thread that we want to dump.
+    int32_t tid_state = tid;
+    if (tgkill(getpid(), tid, SIGURG)) {
+//        ALOGV("Failed to send SIGURG to thread %d.", tid);
+    } else {
+        // Wait for the other thread to start dumping the stack, or time out.
+        int64_t deadline = monotonic_ns() + START_TIMEOUT_NS;
+        for (;;) {
+            tid_state = __atomic_load_n(&request->state, __ATOMIC_ACQUIRE);
+            if (tid_state != tid) {
+                break;
             }
-        }
-
-        // Try to cancel the dump if it has not started yet.
-        if (tid_state == tid) {
-            if (!android_atomic_acquire_cas(tid, STATE_CANCEL, &g_unwind_signal_state.tid_state)) {
-//                ALOGV("Canceled thread %d stack dump.", tid);
-                tid_state = STATE_CANCEL;
-            } else {
-                tid_state = android_atomic_acquire_load(&g_unwind_signal_state.tid_state);
+            int64_t remaining = deadline - monotonic_ns();
+            if (remaining <= 0) {
+//                ALOGV("Timed out waiting for thread %d to start dumping the stack.", tid);
+                break;
             }
+            struct timespec timeout;
+            timeout.tv_sec = remaining / 1000000000LL;
+            timeout.tv_nsec = remaining % 1000000000LL;
+            futex_wait(&request->state, tid, &timeout);
         }
+    }
 
-        // Wait indefinitely for the dump to finish or be canceled.
-        // We cannot apply a timeout here because the other thread is accessing state that
-        // is owned by this thread, such as milist.  It should not take very
-        // long to take the dump once started.
-        while (tid_state == STATE_DUMPING) {
- //           ALOGV("Waiting for thread %d to finish dumping the stack...", tid);
-            usleep(1000);
-            tid_state = android_atomic_acquire_load(&g_unwind_signal_state.tid_state);
+    // Try to cancel the dump if it has not started yet.
+    if (tid_state == tid) {
+        int32_t expected = tid;
+        if (__atomic_compare_exchange_n(&request->state, &expected, STATE_CANCEL,
+                false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+//            ALOGV("Canceled thread %d stack dump.", tid);
+            tid_state = STATE_CANCEL;
+        } else {
+            tid_state = expected;
         }
+    }
 
-        if (tid_state == STATE_DONE) {
-            frames = g_unwind_signal_state.returned_frames;
-        }
+    // Wait indefinitely for the dump to finish.
+    // We cannot apply a timeout here because the other thread is accessing state that
+    // is owned by this thread, such as milist.  It should not take very
+    // long to take the dump once started.
+    while (tid_state == STATE_DUMPING) {
+        futex_wait(&request->state, STATE_DUMPING, NULL);
+        tid_state = __atomic_load_n(&request->state, __ATOMIC_ACQUIRE);
+    }
 
-        sigaction(SIGURG, &oact, NULL);
+    ssize_t frames = -1;
+    if (tid_state == STATE_DONE) {
+        frames = request->returned_frames;
     }
+    __atomic_store_n(&request->state, STATE_FREE, __ATOMIC_RELEASE);
 
     release_my_map_info_list(milist);
-    pthread_mutex_unlock(&g_unwind_signal_mutex);
     return frames;
 #else
     return -1;
 #endif
 }
 
+ssize_t unwind_backtrace_signal(siginfo_t *siginfo, void *sigcontext,
+                                const map_info_t *map_info_list, backtrace_frame_t *backtrace,
+                                size_t ignore_depth, size_t max_depth, unwind_mode_t mode) {
+#ifdef CORKSCREW_HAVE_ARCH
+    return unwind_backtrace_signal_arch(siginfo, sigcontext, map_info_list,
+                                        backtrace, ignore_depth, max_depth, mode);
+#else
+    return -1;
+#endif
+}
+
 ssize_t unwind_backtrace_ptrace(pid_t tid, const ptrace_context_t *context,
                                 backtrace_frame_t *backtrace, size_t ignore_depth, size_t max_depth,
                                 bool at_fault) {
 //#ifdef CORKSCREW_HAVE_ARCH
-    return unwind_backtrace_ptrace_arch(tid, context, backtrace, ignore_depth, max_depth, at_fault);
+    return unwind_backtrace_ptrace_arch(tid, context, backtrace, ignore_depth, max_depth, at_fault,
+                                        NULL);
 //#else
 //    return -1;
 //#endif
 }
 
+ssize_t unwind_backtrace_ptrace_folded(pid_t tid, const ptrace_context_t *context,
+                                       backtrace_frame_t *backtrace, size_t max_depth,
+                                       bool at_fault, backtrace_fold_t *fold) {
+    return unwind_backtrace_ptrace_arch(tid, context, backtrace, 0, max_depth, at_fault, fold);
+}
+
 void get_regs_common(const struct ucontext *const uc) {
     get_regs_from_ucontext(uc);
 }
@@ -255,6 +383,17 @@ static void init_backtrace_symbol(backtrace_symbol_t *symbol, uintptr_t pc) {
     symbol->demangled_name = NULL;
 }
 
+/* Names a frame in registered JIT code, which has no symbol table. */
+static void init_jit_symbol(const ptrace_context_t *context, const map_info_t *mi,
+                            uintptr_t pc, backtrace_symbol_t *symbol) {
+    jit_code_t code;
+    if (find_jit_code(context, pc, &code) && code.name[0]) {
+        symbol->relative_symbol_addr = code.start - mi->start;
+        symbol->symbol_name = strdup(code.name);
+        symbol->demangled_name = demangle_symbol_name(symbol->symbol_name);
+    }
+}
+
 void get_backtrace_symbols(const backtrace_frame_t *backtrace, size_t frames,
                            backtrace_symbol_t *backtrace_symbols) {
     map_info_t *milist = acquire_my_map_info_list();
@@ -269,12 +408,13 @@ void get_backtrace_symbols(const backtrace_frame_t *backtrace, size_t frames,
             if (mi->name[0]) {
                 symbol->map_name = strdup(mi->name);
             }
-            Dl_info info;
-            if (dladdr((const void *) frame->absolute_pc, &info) && info.dli_sname) {
-                symbol->relative_symbol_addr = (uintptr_t) info.dli_saddr
-                                               - (uintptr_t) info.dli_fbase;
-                symbol->symbol_name = strdup(info.dli_sname);
+            pc_symbol_t s;
+            if (symbolize_pc(frame->absolute_pc, &s) && s.symbol_name) {
+                symbol->relative_symbol_addr = s.symbol_addr - mi->start;
+                symbol->symbol_name = strdup(s.symbol_name);
                 symbol->demangled_name = demangle_symbol_name(symbol->symbol_name);
+            } else {
+                init_jit_symbol(NULL, mi, frame->absolute_pc, symbol);
             }
         }
     }
@@ -302,6 +442,8 @@ void get_backtrace_symbols_ptrace(const ptrace_context_t *context,
             symbol->relative_symbol_addr = s->start;
             symbol->symbol_name = strdup(s->name);
             symbol->demangled_name = demangle_symbol_name(symbol->symbol_name);
+        } else if (mi) {
+            init_jit_symbol(context, mi, frame->absolute_pc, symbol);
         }
     }
 }
@@ -316,26 +458,27 @@ void free_backtrace_symbols(backtrace_symbol_t *backtrace_symbols, size_t frames
     }
 }
 
-void format_backtrace_line(unsigned frameNumber,
-                           const backtrace_frame_t *frame __attribute__((unused)),
+void format_backtrace_line(unsigned frameNumber, const backtrace_frame_t *frame,
                            const backtrace_symbol_t *symbol, char *buffer, size_t bufferSize) {
     const char *mapName = symbol->map_name ? symbol->map_name : "<unknown>";
     const char *symbolName = symbol->demangled_name ? symbol->demangled_name : symbol->symbol_name;
+    const char *confidence = frame->flags & BACKTRACE_FRAME_SCANNED ? " (scanned)" : "";
     int fieldWidth = (bufferSize - 80) / 2;
+    int pcWidth = (int) (sizeof(uintptr_t) * 2);
     if (symbolName) {
-        uint32_t pc_offset = symbol->relative_pc - symbol->relative_symbol_addr;
+        uintptr_t pc_offset = symbol->relative_pc - symbol->relative_symbol_addr;
         if (pc_offset) {
-            snprintf(buffer, bufferSize, "#%02u  pc %08x  %.*s (%.*s+%u)",
-                     frameNumber, (unsigned int) symbol->relative_pc,
-                     fieldWidth, mapName, fieldWidth, symbolName, pc_offset);
+            snprintf(buffer, bufferSize, "#%02u  pc %0*" PRIxPTR "  %.*s (%.*s+%" PRIuPTR ")%s",
+                     frameNumber, pcWidth, symbol->relative_pc,
+                     fieldWidth, mapName, fieldWidth, symbolName, pc_offset, confidence);
         } else {
-            snprintf(buffer, bufferSize, "#%02u  pc %08x  %.*s (%.*s)",
-                     frameNumber, (unsigned int) symbol->relative_pc,
-                     fieldWidth, mapName, fieldWidth, symbolName);
+            snprintf(buffer, bufferSize, "#%02u  pc %0*" PRIxPTR "  %.*s (%.*s)%s",
+                     frameNumber, pcWidth, symbol->relative_pc,
+                     fieldWidth, mapName, fieldWidth, symbolName, confidence);
         }
     } else {
-        snprintf(buffer, bufferSize, "#%02u  pc %08x  %.*s",
-                 frameNumber, (unsigned int) symbol->relative_pc,
-                 fieldWidth, mapName);
+        snprintf(buffer, bufferSize, "#%02u  pc %0*" PRIxPTR "  %.*s%s",
+                 frameNumber, pcWidth, symbol->relative_pc,
+                 fieldWidth, mapName, confidence);
     }
 }
@@ -23,6 +23,7 @@
 extern "C" {
 #endif
 
+#include <signal.h>
 #include <sys/types.h>
 #include "ptrace.h"
 #include "map_info.h"
@@ -36,8 +37,78 @@ typedef struct {
     uintptr_t absolute_pc;     /* absolute PC offset */
     uintptr_t stack_top;       /* top of stack for this frame */
     size_t stack_size;         /* size of this stack frame */
+    uint32_t flags;            /* BACKTRACE_FRAME_* */
 } backtrace_frame_t;
 
+/* The frame was found by scanning the stack for something that looks like a
+ * return address rather than by unwinding, so it may not be a real caller. */
+#define BACKTRACE_FRAME_SCANNED 0x1
+
+/*
+ * How a signal context or another thread is unwound.
+ */
+typedef enum {
+    /* Unwind tables only.  Slow, but works for code without frame pointers. */
+    UNWIND_MODE_ACCURATE = 0,
+    /* Frame-pointer chain only.  Stops where the chain breaks. */
+    UNWIND_MODE_FAST,
+    /* Frame-pointer chain, falling back to the unwind tables for the
+     * innermost frame and for every frame where the chain breaks. */
+    UNWIND_MODE_HYBRID,
+    /* Unwind tables, then scanning the stack for return addresses once they
+     * run out.  Scanned frames are flagged BACKTRACE_FRAME_SCANNED. */
+    UNWIND_MODE_SCAN,
+} unwind_mode_t;
+
+/* Longest cycle of frames that is folded, e.g. by mutual recursion. */
+#define MAX_BACKTRACE_FOLD_PERIOD 8
+/* Distinct cycles that are folded in one backtrace. */
+#define MAX_BACKTRACE_FOLDS 8
+
+/*
+ * A cycle of frames that repeated.  One copy of it is kept in the backtrace,
+ * at [first, first + period).
+ */
+typedef struct {
+    size_t first;
+    size_t period;
+    size_t repeats;             /* times the cycle ran, at least 2 */
+} backtrace_repeat_t;
+
+/*
+ * Bookkeeping for unwinding stacks that may be too deep to keep, such as
+ * those of a stack overflow.
+ *
+ * Cycles of frames are folded as they are unwound, so runaway recursion
+ * takes no room in the backtrace.  If it fills up anyway, frames are dropped
+ * from just below the top frames, so the bottom of the stack is still seen.
+ * Unwinding stops at the deadline rather than at a fixed depth.
+ */
+typedef struct {
+    /* Set by init_backtrace_fold(). */
+    size_t top_frames;          /* frames that are never dropped */
+    int64_t deadline_ns;        /* CLOCK_MONOTONIC, 0 for none */
+    /* Filled in while unwinding. */
+    backtrace_repeat_t repeats[MAX_BACKTRACE_FOLDS];
+    size_t repeat_count;
+    size_t elided_at;           /* index the frames were dropped at */
+    size_t elided_frames;       /* number of frames dropped there */
+    bool timed_out;
+    uint32_t steps;
+} backtrace_fold_t;
+
+/*
+ * Prepares a fold that keeps at least top_frames from the top of the stack
+ * and gives up unwinding after time_limit_ms, or never if it is 0.
+ */
+void init_backtrace_fold(backtrace_fold_t* fold, size_t top_frames, int time_limit_ms);
+
+/*
+ * Returns the depth in the whole stack of the frame kept at index, counting
+ * the frames that were folded or dropped above it.
+ */
+size_t get_backtrace_fold_depth(const backtrace_fold_t* fold, size_t index);
+
 /*
  * Describes the symbols associated with a backtrace frame.
  */
@@ -58,6 +129,15 @@ typedef struct {
  */
 ssize_t unwind_backtrace(backtrace_frame_t* backtrace, size_t ignore_depth, size_t max_depth);
 
+/*
+ * Same as unwind_backtrace() with the unwinding mode of
+ * unwind_backtrace_signal(), for callers that unwind often and can live with
+ * the frames the frame-pointer walk drops.  Returns -1 where the architecture
+ * has no unwinder of its own.
+ */
+ssize_t unwind_backtrace_mode(backtrace_frame_t* backtrace, size_t ignore_depth,
+        size_t max_depth, unwind_mode_t mode);
+
 /*
  * Unwinds the call stack for a thread within this process.
  * Populates the backtrace array with the program counters from the call stack.
@@ -68,6 +148,24 @@ ssize_t unwind_backtrace(backtrace_frame_t* backtrace, size_t ignore_depth, size
 ssize_t unwind_backtrace_thread(pid_t tid, backtrace_frame_t* backtrace,
         size_t ignore_depth, size_t max_depth);
 
+/*
+ * Same as unwind_backtrace_thread() with UNWIND_MODE_ACCURATE replaced by
+ * mode.  The calling thread itself is always unwound with the unwind tables.
+ */
+ssize_t unwind_backtrace_thread_mode(pid_t tid, backtrace_frame_t* backtrace,
+        size_t ignore_depth, size_t max_depth, unwind_mode_t mode);
+
+/*
+ * Unwinds the thread a signal was delivered to, from the siginfo and context
+ * passed to an SA_SIGINFO handler.  The first frame is where the signal
+ * interrupted the thread.  map_info_list must be acquired before the signal,
+ * e.g. with acquire_my_map_info_list(), which is not async-signal-safe.
+ * Returns the number of frames collected, or -1 if an error occurred.
+ */
+ssize_t unwind_backtrace_signal(siginfo_t* siginfo, void* sigcontext,
+        const map_info_t* map_info_list, backtrace_frame_t* backtrace,
+        size_t ignore_depth, size_t max_depth, unwind_mode_t mode);
+
 /*
  * Unwinds the call stack of a task within a remote process using ptrace().
  * Populates the backtrace array with the program counters from the call stack.
@@ -76,6 +174,14 @@ ssize_t unwind_backtrace_thread(pid_t tid, backtrace_frame_t* backtrace,
 ssize_t unwind_backtrace_ptrace(pid_t tid, const ptrace_context_t* context,
         backtrace_frame_t* backtrace, size_t ignore_depth, size_t max_depth, bool at_fault);
 
+/*
+ * Same as unwind_backtrace_ptrace() for stacks that may be very deep: the
+ * backtrace is folded as described by backtrace_fold_t, and max_depth only
+ * bounds the frames kept, not the depth unwound.
+ */
+ssize_t unwind_backtrace_ptrace_folded(pid_t tid, const ptrace_context_t* context,
+        backtrace_frame_t* backtrace, size_t max_depth, bool at_fault, backtrace_fold_t* fold);
+
 void get_regs_common(const struct ucontext* const uc);
 
 /*
@@ -107,6 +213,7 @@ enum {
 
 /**
  * Formats a line from a backtrace as a zero-terminated string into the specified buffer.
+ * Frames found by scanning the stack are marked "(scanned)".
  */
 void format_backtrace_line(unsigned frameNumber, const backtrace_frame_t* frame,
         const backtrace_symbol_t* symbol, char* buffer, size_t bufferSize);
@@ -19,6 +19,7 @@
 
 #include "demangle.h"
 #include <dlfcn.h>
+#include <stddef.h>
 
 typedef char* (*DemanglerFn)(const char*, char*, size_t*, int*);
 static DemanglerFn gDemanglerFn = NULL;
@@ -28,8 +29,9 @@ extern char *__cxa_demangle (const char *mangled, char *buf, size_t *len,
                              int *status);
 
 char* demangle_symbol_name(const char* name) {
-#if defined(__APPLE__)
+#if defined(__APPLE__) || !defined(__BIONIC__)
     // Mac OS' __cxa_demangle demangles "f" as "float"; last tested on 10.7.
+    // So do those of libstdc++ and libc++ off Android.
     if (name != NULL && name[0] != '_') {
         return NULL;
     }
@@ -39,6 +41,9 @@ char* demangle_symbol_name(const char* name) {
     	if (gDemangler != NULL) {
     		gDemanglerFn = dlsym(gDemangler, "__cxa_demangle");
 //    		gDemanglerFn = reinterpret_cast<DemanglerFn>(sym);
+    	} else {
+    		// Off Android, the C++ runtime the process is linked with has one.
+    		gDemanglerFn = dlsym(RTLD_DEFAULT, "__cxa_demangle");
     	}
     }
     // __cxa_demangle handles NULL by returning NULL
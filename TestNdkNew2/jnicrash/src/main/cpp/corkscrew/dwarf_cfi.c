@@ -0,0 +1,1203 @@
+/*
+ * DWARF call frame information.
+ *
+ * .eh_frame holds a CIE for each group of functions that share settings and
+ * an FDE for each function.  Both carry a small program whose rows describe,
+ * for successive address ranges of the function, how to compute the
+ * canonical frame address (CFA, the caller's stack pointer) and where the
+ * return address and callee-saved registers were saved.  .eh_frame_hdr adds
+ * a table of the FDEs sorted by start address, which we binary search.
+ *
+ * Tables and programs are read through memory_t so that the same code serves
+ * local and ptrace() unwinding.  Locally, a range is read directly once its
+ * ends are known to be mapped rather than checking every word.
+ *
+ * Only rows that restore registers from CFA-relative slots are cached.  Rows
+ * using DWARF expressions, which are mostly found in signal trampolines, are
+ * always computed again.  Rows of another process are cached per traced
+ * thread, which is what makes stepping through deep recursion cheap there.
+ */
+
+#define LOG_TAG "Corkscrew"
+
+#include "dwarf_cfi.h"
+#include "elf_view.h"
+#include "module_table.h"
+
+#include <elf.h>
+#include <link.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef PT_GNU_EH_FRAME
+#define PT_GNU_EH_FRAME 0x6474e550
+#endif
+
+/* Pointer encodings. */
+enum {
+    DW_EH_PE_absptr = 0x00,
+    DW_EH_PE_uleb128 = 0x01,
+    DW_EH_PE_udata2 = 0x02,
+    DW_EH_PE_udata4 = 0x03,
+    DW_EH_PE_udata8 = 0x04,
+    DW_EH_PE_sleb128 = 0x09,
+    DW_EH_PE_sdata2 = 0x0a,
+    DW_EH_PE_sdata4 = 0x0b,
+    DW_EH_PE_sdata8 = 0x0c,
+    DW_EH_PE_pcrel = 0x10,
+    DW_EH_PE_datarel = 0x30,
+    DW_EH_PE_aligned = 0x50,
+    DW_EH_PE_omit = 0xff,
+};
+
+/* Call frame instructions, apart from the three packed into the top two
+ * bits of the opcode (advance_loc, offset and restore). */
+enum {
+    DW_CFA_nop = 0x00,
+    DW_CFA_set_loc = 0x01,
+    DW_CFA_advance_loc1 = 0x02,
+    DW_CFA_advance_loc2 = 0x03,
+    DW_CFA_advance_loc4 = 0x04,
+    DW_CFA_offset_extended = 0x05,
+    DW_CFA_restore_extended = 0x06,
+    DW_CFA_undefined = 0x07,
+    DW_CFA_same_value = 0x08,
+    DW_CFA_register = 0x09,
+    DW_CFA_remember_state = 0x0a,
+    DW_CFA_restore_state = 0x0b,
+    DW_CFA_def_cfa = 0x0c,
+    DW_CFA_def_cfa_register = 0x0d,
+    DW_CFA_def_cfa_offset = 0x0e,
+    DW_CFA_def_cfa_expression = 0x0f,
+    DW_CFA_expression = 0x10,
+    DW_CFA_offset_extended_sf = 0x11,
+    DW_CFA_def_cfa_sf = 0x12,
+    DW_CFA_def_cfa_offset_sf = 0x13,
+    DW_CFA_val_offset = 0x14,
+    DW_CFA_val_offset_sf = 0x15,
+    DW_CFA_val_expression = 0x16,
+    DW_CFA_GNU_window_save = 0x2d,  /* DW_CFA_AARCH64_negate_ra_state on AArch64 */
+    DW_CFA_GNU_args_size = 0x2e,
+    DW_CFA_GNU_negative_offset_extended = 0x2f,
+};
+
+/* DWARF expression operations that can compute an address. */
+enum {
+    DW_OP_addr = 0x03,
+    DW_OP_deref = 0x06,
+    DW_OP_const1u = 0x08,
+    DW_OP_const1s = 0x09,
+    DW_OP_const2u = 0x0a,
+    DW_OP_const2s = 0x0b,
+    DW_OP_const4u = 0x0c,
+    DW_OP_const4s = 0x0d,
+    DW_OP_const8u = 0x0e,
+    DW_OP_const8s = 0x0f,
+    DW_OP_constu = 0x10,
+    DW_OP_consts = 0x11,
+    DW_OP_dup = 0x12,
+    DW_OP_drop = 0x13,
+    DW_OP_over = 0x14,
+    DW_OP_pick = 0x15,
+    DW_OP_swap = 0x16,
+    DW_OP_rot = 0x17,
+    DW_OP_abs = 0x19,
+    DW_OP_and = 0x1a,
+    DW_OP_div = 0x1b,
+    DW_OP_minus = 0x1c,
+    DW_OP_mod = 0x1d,
+    DW_OP_mul = 0x1e,
+    DW_OP_neg = 0x1f,
+    DW_OP_not = 0x20,
+    DW_OP_or = 0x21,
+    DW_OP_plus = 0x22,
+    DW_OP_plus_uconst = 0x23,
+    DW_OP_shl = 0x24,
+    DW_OP_shr = 0x25,
+    DW_OP_shra = 0x26,
+    DW_OP_xor = 0x27,
+    DW_OP_bra = 0x28,
+    DW_OP_eq = 0x29,
+    DW_OP_ge = 0x2a,
+    DW_OP_gt = 0x2b,
+    DW_OP_le = 0x2c,
+    DW_OP_lt = 0x2d,
+    DW_OP_ne = 0x2e,
+    DW_OP_skip = 0x2f,
+    DW_OP_lit0 = 0x30,
+    DW_OP_lit31 = 0x4f,
+    DW_OP_breg0 = 0x70,
+    DW_OP_breg31 = 0x8f,
+    DW_OP_bregx = 0x92,
+    DW_OP_deref_size = 0x94,
+    DW_OP_nop = 0x96,
+};
+
+/* Largest CIE or FDE we believe. */
+#define MAX_ENTRY_SIZE (1024 * 1024)
+/* Depth of DW_CFA_remember_state. */
+#define MAX_REMEMBERED_ROWS 4
+#define MAX_EXPRESSION_STACK 16
+/* Bounds the work done by expressions that branch backwards. */
+#define MAX_EXPRESSION_OPS 256
+/* Cached rows; must be a power of two. */
+#define ROW_CACHE_SIZE 256
+/* Saved registers a row may have and still be cached. */
+#define ROW_CACHE_RULES 16
+
+/* Reads the bytes of a table or program. */
+typedef struct {
+    const memory_t* memory;
+    uintptr_t ptr;
+    bool direct;                /* the bytes can be dereferenced directly */
+    bool failed;                /* a read failed; further reads return 0 */
+    uintptr_t word_ptr;         /* address of the cached word, 1 if none */
+    uint32_t word;
+} cfi_stream_t;
+
+typedef struct {
+    uint64_t code_align;
+    int64_t data_align;
+    uint32_t ra_reg;
+    uint8_t fde_encoding;
+    bool has_augmentation_data;
+    uintptr_t instructions;
+    uintptr_t instructions_end;
+} cie_t;
+
+typedef struct {
+    uintptr_t pc_start;
+    uintptr_t pc_end;
+    uintptr_t instructions;
+    uintptr_t instructions_end;
+} fde_t;
+
+/* How a register of the caller is recovered.  RULE_SAME is also the rule of
+ * registers the CFI says nothing about. */
+enum {
+    RULE_SAME = 0,
+    RULE_UNDEFINED,
+    RULE_OFFSET,                /* saved at CFA + value */
+    RULE_VAL_OFFSET,            /* is CFA + value */
+    RULE_REGISTER,              /* saved in register value */
+    RULE_EXPRESSION,            /* saved at the address computed by the expression at value */
+    RULE_VAL_EXPRESSION,        /* is the value computed by the expression at value */
+};
+
+typedef struct {
+    uint8_t kind;
+    intptr_t value;
+} cfi_rule_t;
+
+typedef struct {
+    bool cfa_is_expression;
+    uint32_t cfa_reg;
+    intptr_t cfa_offset;        /* the address of the expression if cfa_is_expression */
+    cfi_rule_t rules[DWARF_CFI_MAX_REGS];
+} cfi_row_t;
+
+/* A row reduced to CFA-relative slots, guarded by a sequence lock. */
+typedef struct {
+    uint32_t sequence;          /* 0 if empty, odd while being written */
+    pid_t tid;                  /* traced thread, or -1 for this process */
+    uintptr_t pc;
+    uintptr_t eh_frame_hdr;
+    int32_t cfa_offset;
+    uint8_t cfa_reg;
+    uint8_t ra_reg;
+    uint8_t rule_count;
+    uint8_t rule_regs[ROW_CACHE_RULES];
+    uint8_t rule_kinds[ROW_CACHE_RULES];
+    int32_t rule_offsets[ROW_CACHE_RULES];
+} cached_row_t;
+
+static cached_row_t g_row_cache[ROW_CACHE_SIZE];
+
+static void init_stream(cfi_stream_t* stream, const memory_t* memory,
+        uintptr_t ptr, size_t size) {
+    stream->memory = memory;
+    stream->ptr = ptr;
+    stream->failed = false;
+    stream->word_ptr = 1;
+    // The tables are read-only data of a loaded module, so checking the ends
+    // of a range once is enough.
+    stream->direct = memory->tid < 0 && size && ptr + size > ptr
+            && is_readable_map(memory->map_info_list, ptr)
+            && is_readable_map(memory->map_info_list, ptr + size - 1);
+}
+
+static uint8_t read_u8(cfi_stream_t* stream) {
+    if (stream->failed) {
+        return 0;
+    }
+    uintptr_t ptr = stream->ptr++;
+    if (stream->direct) {
+        return *(const uint8_t*) ptr;
+    }
+    uintptr_t word_ptr = ptr & ~(uintptr_t) 3;
+    if (word_ptr != stream->word_ptr) {
+        if (!try_get_word(stream->memory, word_ptr, &stream->word)) {
+            stream->failed = true;
+            return 0;
+        }
+        stream->word_ptr = word_ptr;
+    }
+    return stream->word >> ((ptr & 3) * 8);
+}
+
+/* Reads a little-endian value of up to eight bytes. */
+static uint64_t read_bytes(cfi_stream_t* stream, size_t size) {
+    uint64_t value = 0;
+    if (stream->direct && !stream->failed) {
+        memcpy(&value, (const void*) stream->ptr, size);
+        stream->ptr += size;
+        return value;
+    }
+    for (size_t i = 0; i < size; i++) {
+        value |= (uint64_t) read_u8(stream) << (i * 8);
+    }
+    return value;
+}
+
+static uint64_t read_uleb128(cfi_stream_t* stream) {
+    uint64_t value = 0;
+    unsigned shift = 0;
+    uint8_t byte;
+    do {
+        byte = read_u8(stream);
+        if (shift < 64) {
+            value |= (uint64_t) (byte & 0x7f) << shift;
+        }
+        shift += 7;
+    } while (byte & 0x80);
+    return value;
+}
+
+static int64_t read_sleb128(cfi_stream_t* stream) {
+    uint64_t value = 0;
+    unsigned shift = 0;
+    uint8_t byte;
+    do {
+        byte = read_u8(stream);
+        if (shift < 64) {
+            value |= (uint64_t) (byte & 0x7f) << shift;
+        }
+        shift += 7;
+    } while (byte & 0x80);
+    if (shift < 64 && (byte & 0x40)) {
+        value |= -((uint64_t) 1 << shift);
+    }
+    return (int64_t) value;
+}
+
+/*
+ * Reads a pointer in one of the DW_EH_PE_* encodings.  data_base is the base
+ * of DW_EH_PE_datarel, 0 if there is none.  DW_EH_PE_indirect is only found
+ * in personality pointers, which are never followed, so it is ignored.
+ */
+static bool read_encoded(cfi_stream_t* stream, uint8_t encoding, uintptr_t data_base,
+        uintptr_t* out_value) {
+    *out_value = 0;
+    if (encoding == DW_EH_PE_omit) {
+        return true;
+    }
+    uintptr_t place = stream->ptr;
+    if ((encoding & 0x70) == DW_EH_PE_aligned) {
+        stream->ptr = (place + sizeof(uintptr_t) - 1) & ~(sizeof(uintptr_t) - 1);
+        *out_value = read_bytes(stream, sizeof(uintptr_t));
+        return !stream->failed;
+    }
+
+    uintptr_t value;
+    switch (encoding & 0x0f) {
+        case DW_EH_PE_absptr:
+            value = read_bytes(stream, sizeof(uintptr_t));
+            break;
+        case DW_EH_PE_uleb128:
+            value = read_uleb128(stream);
+            break;
+        case DW_EH_PE_udata2:
+            value = (uint16_t) read_bytes(stream, 2);
+            break;
+        case DW_EH_PE_udata4:
+            value = (uint32_t) read_bytes(stream, 4);
+            break;
+        case DW_EH_PE_udata8:
+            value = read_bytes(stream, 8);
+            break;
+        case DW_EH_PE_sleb128:
+            value = read_sleb128(stream);
+            break;
+        case DW_EH_PE_sdata2:
+            value = (int16_t) read_bytes(stream, 2);
+            break;
+        case DW_EH_PE_sdata4:
+            value = (int32_t) read_bytes(stream, 4);
+            break;
+        case DW_EH_PE_sdata8:
+            value = read_bytes(stream, 8);
+            break;
+        default:
+            return false;
+    }
+
+    switch (encoding & 0x70) {
+        case DW_EH_PE_absptr:
+            break;
+        case DW_EH_PE_pcrel:
+            value += place;
+            break;
+        case DW_EH_PE_datarel:
+            if (!data_base) {
+                return false;
+            }
+            value += data_base;
+            break;
+        default:
+            // DW_EH_PE_textrel and DW_EH_PE_funcrel are not used by the
+            // parts of the tables we read.
+            return false;
+    }
+    *out_value = value;
+    return !stream->failed;
+}
+
+/* Reads the length of a CIE or FDE.  Returns false for the terminator. */
+static bool read_entry_length(cfi_stream_t* stream, uintptr_t* out_end, bool* out_is64) {
+    uint64_t length = read_bytes(stream, 4);
+    *out_is64 = length == 0xffffffff;
+    if (*out_is64) {
+        length = read_bytes(stream, 8);
+    }
+    if (stream->failed || !length || length > MAX_ENTRY_SIZE) {
+        return false;
+    }
+    *out_end = stream->ptr + length;
+    return true;
+}
+
+static bool parse_cie(const memory_t* memory, uintptr_t ptr, cie_t* cie) {
+    cfi_stream_t stream;
+    init_stream(&stream, memory, ptr, 12);
+    uintptr_t end;
+    bool is64;
+    if (!read_entry_length(&stream, &end, &is64)) {
+        return false;
+    }
+    init_stream(&stream, memory, stream.ptr, end - stream.ptr);
+
+    // In .eh_frame the CIE id is 0, unlike in .debug_frame.
+    if (read_bytes(&stream, is64 ? 8 : 4) != 0) {
+        return false;
+    }
+    uint8_t version = read_u8(&stream);
+    if (version != 1 && version != 3 && version != 4) {
+        return false;
+    }
+    char augmentation[8];
+    size_t length = 0;
+    for (;;) {
+        uint8_t c = read_u8(&stream);
+        if (!c) {
+            break;
+        }
+        if (length == sizeof(augmentation) - 1) {
+            return false;
+        }
+        augmentation[length++] = c;
+    }
+    augmentation[length] = '\0';
+    if (version == 4) {
+        uint8_t address_size = read_u8(&stream);
+        uint8_t segment_size = read_u8(&stream);
+        if (address_size != sizeof(uintptr_t) || segment_size) {
+            return false;
+        }
+    }
+    cie->code_align = read_uleb128(&stream);
+    cie->data_align = read_sleb128(&stream);
+    cie->ra_reg = version == 1 ? read_u8(&stream) : read_uleb128(&stream);
+    cie->fde_encoding = DW_EH_PE_absptr;
+    cie->has_augmentation_data = augmentation[0] == 'z';
+
+    if (cie->has_augmentation_data) {
+        uint64_t augmentation_size = read_uleb128(&stream);
+        uintptr_t augmentation_end = stream.ptr + augmentation_size;
+        for (size_t i = 1; augmentation[i]; i++) {
+            if (augmentation[i] == 'L') {
+                read_u8(&stream);
+            } else if (augmentation[i] == 'P') {
+                uint8_t encoding = read_u8(&stream);
+                uintptr_t personality;
+                if (!read_encoded(&stream, encoding, 0, &personality)) {
+                    return false;
+                }
+            } else if (augmentation[i] == 'R') {
+                cie->fde_encoding = read_u8(&stream);
+            } else if (augmentation[i] != 'S' && augmentation[i] != 'B'
+                    && augmentation[i] != 'G') {
+                // The size tells us where the data ends, but not what the
+                // letters we do not know mean for the letters after them.
+                break;
+            }
+        }
+        stream.ptr = augmentation_end;
+    } else if (augmentation[0]) {
+        return false;
+    }
+
+    cie->instructions = stream.ptr;
+    cie->instructions_end = end;
+    return !stream.failed && stream.ptr <= end;
+}
+
+static bool parse_fde(const memory_t* memory, uintptr_t ptr, cie_t* cie, fde_t* fde) {
+    cfi_stream_t stream;
+    init_stream(&stream, memory, ptr, 12);
+    uintptr_t end;
+    bool is64;
+    if (!read_entry_length(&stream, &end, &is64)) {
+        return false;
+    }
+    uintptr_t cie_pointer = stream.ptr;
+    init_stream(&stream, memory, cie_pointer, end - cie_pointer);
+
+    // The CIE pointer is relative to itself; 0 would make this a CIE.
+    uint64_t cie_offset = read_bytes(&stream, is64 ? 8 : 4);
+    if (stream.failed || !cie_offset || !parse_cie(memory, cie_pointer - cie_offset, cie)) {
+        return false;
+    }
+    uintptr_t pc_start;
+    uintptr_t pc_range;
+    if (!read_encoded(&stream, cie->fde_encoding, 0, &pc_start)
+            || !read_encoded(&stream, cie->fde_encoding & 0x0f, 0, &pc_range)) {
+        return false;
+    }
+    if (cie->has_augmentation_data) {
+        uint64_t augmentation_size = read_uleb128(&stream);
+        stream.ptr += augmentation_size;
+    }
+    fde->pc_start = pc_start;
+    fde->pc_end = pc_start + pc_range;
+    fde->instructions = stream.ptr;
+    fde->instructions_end = end;
+    return !stream.failed && stream.ptr <= end;
+}
+
+/* Binary searches the .eh_frame_hdr table for the FDE that may cover pc. */
+static bool find_fde(const memory_t* memory, uintptr_t eh_frame_hdr, uintptr_t pc,
+        uintptr_t* out_fde) {
+    cfi_stream_t stream;
+    init_stream(&stream, memory, eh_frame_hdr, 12);
+    uint8_t version = read_u8(&stream);
+    uint8_t eh_frame_ptr_encoding = read_u8(&stream);
+    uint8_t fde_count_encoding = read_u8(&stream);
+    uint8_t table_encoding = read_u8(&stream);
+    // Linkers always emit 32-bit offsets from the start of the header.
+    if (stream.failed || version != 1
+            || table_encoding != (DW_EH_PE_datarel | DW_EH_PE_sdata4)) {
+        return false;
+    }
+    uintptr_t eh_frame;
+    uintptr_t fde_count;
+    if (!read_encoded(&stream, eh_frame_ptr_encoding, eh_frame_hdr, &eh_frame)
+            || !read_encoded(&stream, fde_count_encoding, eh_frame_hdr, &fde_count)
+            || !fde_count || fde_count > MAX_ENTRY_SIZE) {
+        return false;
+    }
+
+    uintptr_t table = stream.ptr;
+    init_stream(&stream, memory, table, fde_count * 8);
+    size_t low = 0;
+    size_t high = fde_count;
+    while (low + 1 < high) {
+        size_t index = (low + high) / 2;
+        stream.ptr = table + index * 8;
+        uintptr_t entry_pc = eh_frame_hdr + (int32_t) read_bytes(&stream, 4);
+        if (pc < entry_pc) {
+            high = index;
+        } else {
+            low = index;
+        }
+    }
+    stream.ptr = table + low * 8;
+    uintptr_t entry_pc = eh_frame_hdr + (int32_t) read_bytes(&stream, 4);
+    uintptr_t entry_fde = eh_frame_hdr + (int32_t) read_bytes(&stream, 4);
+    if (stream.failed || pc < entry_pc) {
+        return false;
+    }
+    *out_fde = entry_fde;
+    return true;
+}
+
+static void set_rule(cfi_row_t* row, uint64_t reg, uint8_t kind, intptr_t value) {
+    // Registers we do not track, such as the vector registers, are ignored.
+    if (reg < DWARF_CFI_MAX_REGS) {
+        row->rules[reg].kind = kind;
+        row->rules[reg].value = value;
+    }
+}
+
+static void restore_rule(cfi_row_t* row, const cfi_row_t* initial_row, uint64_t reg) {
+    if (reg < DWARF_CFI_MAX_REGS) {
+        if (initial_row) {
+            row->rules[reg] = initial_row->rules[reg];
+        } else {
+            row->rules[reg].kind = RULE_SAME;
+            row->rules[reg].value = 0;
+        }
+    }
+}
+
+/* Skips the length-prefixed expression at the stream and returns its address. */
+static intptr_t skip_expression(cfi_stream_t* stream) {
+    uintptr_t expression = stream->ptr;
+    uint64_t length = read_uleb128(stream);
+    stream->ptr += length;
+    return expression;
+}
+
+/*
+ * Runs the CFA program in [start, end), which begins at address loc, until
+ * it moves past pc.  initial_row is the row the CIE's program produced, used
+ * by the restore instructions; it is NULL while running the CIE's program.
+ */
+static bool run_cfa_program(const memory_t* memory, uintptr_t start, uintptr_t end,
+        const cie_t* cie, uintptr_t pc, uintptr_t loc, const cfi_row_t* initial_row,
+        cfi_row_t* row) {
+    cfi_row_t remembered[MAX_REMEMBERED_ROWS];
+    size_t remembered_count = 0;
+    int64_t data_align = cie->data_align;
+
+    cfi_stream_t stream;
+    init_stream(&stream, memory, start, end - start);
+    while (stream.ptr < end) {
+        uint8_t op = read_u8(&stream);
+        if (stream.failed) {
+            return false;
+        }
+        uint64_t reg;
+        switch (op >> 6) {
+            case 1: // DW_CFA_advance_loc
+                loc += (op & 0x3f) * cie->code_align;
+                if (loc > pc) {
+                    return true;
+                }
+                continue;
+            case 2: // DW_CFA_offset
+                set_rule(row, op & 0x3f, RULE_OFFSET, read_uleb128(&stream) * data_align);
+                continue;
+            case 3: // DW_CFA_restore
+                restore_rule(row, initial_row, op & 0x3f);
+                continue;
+        }
+
+        switch (op) {
+            case DW_CFA_nop:
+            case DW_CFA_GNU_window_save:
+                // On AArch64 this toggles whether the return address is
+                // signed; the arch code strips return addresses anyway.
+                break;
+            case DW_CFA_set_loc:
+                if (!read_encoded(&stream, cie->fde_encoding, 0, &loc)) {
+                    return false;
+                }
+                if (loc > pc) {
+                    return true;
+                }
+                break;
+            case DW_CFA_advance_loc1:
+            case DW_CFA_advance_loc2:
+            case DW_CFA_advance_loc4:
+                // 1, 2 and 4 bytes of delta respectively.
+                loc += read_bytes(&stream, 1 << (op - DW_CFA_advance_loc1)) * cie->code_align;
+                if (!stream.failed && loc > pc) {
+                    return true;
+                }
+                break;
+            case DW_CFA_offset_extended:
+                reg = read_uleb128(&stream);
+                set_rule(row, reg, RULE_OFFSET, read_uleb128(&stream) * data_align);
+                break;
+            case DW_CFA_offset_extended_sf:
+                reg = read_uleb128(&stream);
+                set_rule(row, reg, RULE_OFFSET, read_sleb128(&stream) * data_align);
+                break;
+            case DW_CFA_GNU_negative_offset_extended:
+                reg = read_uleb128(&stream);
+                set_rule(row, reg, RULE_OFFSET, -(int64_t) read_uleb128(&stream) * data_align);
+                break;
+            case DW_CFA_restore_extended:
+                restore_rule(row, initial_row, read_uleb128(&stream));
+                break;
+            case DW_CFA_undefined:
+                set_rule(row, read_uleb128(&stream), RULE_UNDEFINED, 0);
+                break;
+            case DW_CFA_same_value:
+                set_rule(row, read_uleb128(&stream), RULE_SAME, 0);
+                break;
+            case DW_CFA_register:
+                reg = read_uleb128(&stream);
+                set_rule(row, reg, RULE_REGISTER, read_uleb128(&stream));
+                break;
+            case DW_CFA_remember_state:
+                if (remembered_count == MAX_REMEMBERED_ROWS) {
+                    return false;
+                }
+                remembered[remembered_count++] = *row;
+                break;
+            case DW_CFA_restore_state:
+                if (!remembered_count) {
+                    return false;
+                }
+                *row = remembered[--remembered_count];
+                break;
+            case DW_CFA_def_cfa:
+                row->cfa_is_expression = false;
+                row->cfa_reg = read_uleb128(&stream);
+                row->cfa_offset = read_uleb128(&stream);
+                break;
+            case DW_CFA_def_cfa_sf:
+                row->cfa_is_expression = false;
+                row->cfa_reg = read_uleb128(&stream);
+                row->cfa_offset = read_sleb128(&stream) * data_align;
+                break;
+            case DW_CFA_def_cfa_register:
+                row->cfa_is_expression = false;
+                row->cfa_reg = read_uleb128(&stream);
+                break;
+            case DW_CFA_def_cfa_offset:
+                row->cfa_offset = read_uleb128(&stream);
+                break;
+            case DW_CFA_def_cfa_offset_sf:
+                row->cfa_offset = read_sleb128(&stream) * data_align;
+                break;
+            case DW_CFA_def_cfa_expression:
+                row->cfa_is_expression = true;
+                row->cfa_offset = skip_expression(&stream);
+                break;
+            case DW_CFA_expression:
+                reg = read_uleb128(&stream);
+                set_rule(row, reg, RULE_EXPRESSION, skip_expression(&stream));
+                break;
+            case DW_CFA_val_expression:
+                reg = read_uleb128(&stream);
+                set_rule(row, reg, RULE_VAL_EXPRESSION, skip_expression(&stream));
+                break;
+            case DW_CFA_val_offset:
+                reg = read_uleb128(&stream);
+                set_rule(row, reg, RULE_VAL_OFFSET, read_uleb128(&stream) * data_align);
+                break;
+            case DW_CFA_val_offset_sf:
+                reg = read_uleb128(&stream);
+                set_rule(row, reg, RULE_VAL_OFFSET, read_sleb128(&stream) * data_align);
+                break;
+            case DW_CFA_GNU_args_size:
+                read_uleb128(&stream);
+                break;
+            default:
+                return false;
+        }
+    }
+    return !stream.failed;
+}
+
+/*
+ * Evaluates a length-prefixed DWARF expression.  Register rules start with
+ * the CFA on the stack, the CFA rule with an empty stack.
+ */
+static bool evaluate_expression(const memory_t* memory, uintptr_t expression,
+        const uintptr_t* regs, int reg_count, bool push_cfa, uintptr_t cfa,
+        uintptr_t* out_value) {
+    cfi_stream_t stream;
+    init_stream(&stream, memory, expression, 1);
+    uint64_t length = read_uleb128(&stream);
+    if (stream.failed || !length || length > MAX_ENTRY_SIZE) {
+        return false;
+    }
+    uintptr_t start = stream.ptr;
+    uintptr_t end = start + length;
+    init_stream(&stream, memory, start, length);
+
+    uintptr_t stack[MAX_EXPRESSION_STACK];
+    size_t depth = 0;
+    if (push_cfa) {
+        stack[depth++] = cfa;
+    }
+
+#define NEED(n) if (depth < (n)) return false
+#define PUSH(v) do { uintptr_t pushed = (v); \
+        if (depth == MAX_EXPRESSION_STACK) return false; \
+        stack[depth++] = pushed; } while (0)
+
+    for (int ops = 0; stream.ptr < end; ops++) {
+        uint8_t op = read_u8(&stream);
+        if (stream.failed || ops == MAX_EXPRESSION_OPS) {
+            return false;
+        }
+        if (op >= DW_OP_lit0 && op <= DW_OP_lit31) {
+            PUSH(op - DW_OP_lit0);
+            continue;
+        }
+        if (op >= DW_OP_breg0 && op <= DW_OP_breg31) {
+            int reg = op - DW_OP_breg0;
+            int64_t offset = read_sleb128(&stream);
+            if (reg >= reg_count) {
+                return false;
+            }
+            PUSH(regs[reg] + offset);
+            continue;
+        }
+
+        uintptr_t value;
+        int64_t offset;
+        switch (op) {
+            case DW_OP_addr:
+                PUSH(read_bytes(&stream, sizeof(uintptr_t)));
+                break;
+            case DW_OP_deref:
+                NEED(1);
+                if (!try_get_pointer(memory, stack[depth - 1], &stack[depth - 1])) {
+                    return false;
+                }
+                break;
+            case DW_OP_deref_size: {
+                NEED(1);
+                uint8_t size = read_u8(&stream);
+                uintptr_t address = stack[depth - 1];
+                if (size == sizeof(uintptr_t)) {
+                    if (!try_get_pointer(memory, address, &stack[depth - 1])) {
+                        return false;
+                    }
+                } else if (size && size <= 4 && (address & 3) + size <= 4) {
+                    uint32_t word;
+                    if (!try_get_word(memory, address & ~(uintptr_t) 3, &word)) {
+                        return false;
+                    }
+                    word >>= (address & 3) * 8;
+                    stack[depth - 1] = size == 4 ? word : word & ((1u << (size * 8)) - 1);
+                } else {
+                    return false;
+                }
+                break;
+            }
+            case DW_OP_const1u:
+                PUSH((uint8_t) read_bytes(&stream, 1));
+                break;
+            case DW_OP_const1s:
+                PUSH((int8_t) read_bytes(&stream, 1));
+                break;
+            case DW_OP_const2u:
+                PUSH((uint16_t) read_bytes(&stream, 2));
+                break;
+            case DW_OP_const2s:
+                PUSH((int16_t) read_bytes(&stream, 2));
+                break;
+            case DW_OP_const4u:
+                PUSH((uint32_t) read_bytes(&stream, 4));
+                break;
+            case DW_OP_const4s:
+                PUSH((int32_t) read_bytes(&stream, 4));
+                break;
+            case DW_OP_const8u:
+            case DW_OP_const8s:
+                PUSH(read_bytes(&stream, 8));
+                break;
+            case DW_OP_constu:
+                PUSH(read_uleb128(&stream));
+                break;
+            case DW_OP_consts:
+                PUSH(read_sleb128(&stream));
+                break;
+            case DW_OP_dup:
+                NEED(1);
+                PUSH(stack[depth - 1]);
+                break;
+            case DW_OP_drop:
+                NEED(1);
+                depth--;
+                break;
+            case DW_OP_over:
+                NEED(2);
+                PUSH(stack[depth - 2]);
+                break;
+            case DW_OP_pick: {
+                uint8_t index = read_u8(&stream);
+                NEED((size_t) index + 1);
+                PUSH(stack[depth - 1 - index]);
+                break;
+            }
+            case DW_OP_swap:
+                NEED(2);
+                value = stack[depth - 1];
+                stack[depth - 1] = stack[depth - 2];
+                stack[depth - 2] = value;
+                break;
+            case DW_OP_rot:
+                NEED(3);
+                value = stack[depth - 1];
+                stack[depth - 1] = stack[depth - 2];
+                stack[depth - 2] = stack[depth - 3];
+                stack[depth - 3] = value;
+                break;
+            case DW_OP_abs:
+                NEED(1);
+                if ((intptr_t) stack[depth - 1] < 0) {
+                    stack[depth - 1] = -stack[depth - 1];
+                }
+                break;
+            case DW_OP_neg:
+                NEED(1);
+                stack[depth - 1] = -stack[depth - 1];
+                break;
+            case DW_OP_not:
+                NEED(1);
+                stack[depth - 1] = ~stack[depth - 1];
+                break;
+            case DW_OP_plus_uconst:
+                NEED(1);
+                stack[depth - 1] += read_uleb128(&stream);
+                break;
+            case DW_OP_and:
+            case DW_OP_div:
+            case DW_OP_minus:
+            case DW_OP_mod:
+            case DW_OP_mul:
+            case DW_OP_or:
+            case DW_OP_plus:
+            case DW_OP_shl:
+            case DW_OP_shr:
+            case DW_OP_shra:
+            case DW_OP_xor:
+            case DW_OP_eq:
+            case DW_OP_ge:
+            case DW_OP_gt:
+            case DW_OP_le:
+            case DW_OP_lt:
+            case DW_OP_ne: {
+                NEED(2);
+                uintptr_t b = stack[--depth];
+                uintptr_t a = stack[depth - 1];
+                switch (op) {
+                    case DW_OP_and: value = a & b; break;
+                    case DW_OP_div:
+                        if (!b) {
+                            return false;
+                        }
+                        value = (intptr_t) a / (intptr_t) b;
+                        break;
+                    case DW_OP_minus: value = a - b; break;
+                    case DW_OP_mod:
+                        if (!b) {
+                            return false;
+                        }
+                        value = a % b;
+                        break;
+                    case DW_OP_mul: value = a * b; break;
+                    case DW_OP_or: value = a | b; break;
+                    case DW_OP_plus: value = a + b; break;
+                    case DW_OP_shl: value = b < sizeof(uintptr_t) * 8 ? a << b : 0; break;
+                    case DW_OP_shr: value = b < sizeof(uintptr_t) * 8 ? a >> b : 0; break;
+                    case DW_OP_shra:
+                        value = (intptr_t) a >> (b < sizeof(uintptr_t) * 8 ? b : sizeof(uintptr_t) * 8 - 1);
+                        break;
+                    case DW_OP_xor: value = a ^ b; break;
+                    case DW_OP_eq: value = a == b; break;
+                    case DW_OP_ge: value = (intptr_t) a >= (intptr_t) b; break;
+                    case DW_OP_gt: value = (intptr_t) a > (intptr_t) b; break;
+                    case DW_OP_le: value = (intptr_t) a <= (intptr_t) b; break;
+                    case DW_OP_lt: value = (intptr_t) a < (intptr_t) b; break;
+                    default: value = a != b; break;
+                }
+                stack[depth - 1] = value;
+                break;
+            }
+            case DW_OP_bra:
+            case DW_OP_skip:
+                offset = (int16_t) read_bytes(&stream, 2);
+                if (op == DW_OP_bra) {
+                    NEED(1);
+                    if (!stack[--depth]) {
+                        break;
+                    }
+                }
+                if (stream.ptr + offset < start || stream.ptr + offset > end) {
+                    return false;
+                }
+                stream.ptr += offset;
+                break;
+            case DW_OP_bregx: {
+                uint64_t reg = read_uleb128(&stream);
+                offset = read_sleb128(&stream);
+                if (reg >= (uint64_t) reg_count) {
+                    return false;
+                }
+                PUSH(regs[reg] + offset);
+                break;
+            }
+            case DW_OP_nop:
+                break;
+            default:
+                // Register locations and the rest cannot describe a frame.
+                return false;
+        }
+    }
+
+#undef NEED
+#undef PUSH
+
+    if (stream.failed || !depth) {
+        return false;
+    }
+    *out_value = stack[depth - 1];
+    return true;
+}
+
+static bool apply_row(const memory_t* memory, const cfi_row_t* row, uint32_t ra_reg,
+        int sp_reg, uintptr_t* regs, int reg_count, uintptr_t* out_return_address) {
+    uintptr_t cfa;
+    if (row->cfa_is_expression) {
+        if (!evaluate_expression(memory, row->cfa_offset, regs, reg_count, false, 0, &cfa)) {
+            return false;
+        }
+    } else {
+        if (row->cfa_reg >= (uint32_t) reg_count) {
+            return false;
+        }
+        cfa = regs[row->cfa_reg] + row->cfa_offset;
+    }
+    if (ra_reg >= (uint32_t) reg_count) {
+        return false;
+    }
+
+    // The CFA is by definition the caller's stack pointer, unless the CFI
+    // says otherwise, as it does for signal frames.
+    uintptr_t caller_regs[DWARF_CFI_MAX_REGS];
+    memcpy(caller_regs, regs, reg_count * sizeof(uintptr_t));
+    caller_regs[sp_reg] = cfa;
+    bool outermost = false;
+    for (int i = 0; i < reg_count; i++) {
+        const cfi_rule_t* rule = &row->rules[i];
+        uintptr_t address;
+        switch (rule->kind) {
+            case RULE_SAME:
+                break;
+            case RULE_UNDEFINED:
+                if ((uint32_t) i == ra_reg) {
+                    outermost = true;
+                }
+                break;
+            case RULE_OFFSET:
+                if (!try_get_pointer(memory, cfa + rule->value, &caller_regs[i])) {
+                    return false;
+                }
+                break;
+            case RULE_VAL_OFFSET:
+                caller_regs[i] = cfa + rule->value;
+                break;
+            case RULE_REGISTER:
+                if (rule->value < 0 || rule->value >= reg_count) {
+                    return false;
+                }
+                caller_regs[i] = regs[rule->value];
+                break;
+            case RULE_EXPRESSION:
+                if (!evaluate_expression(memory, rule->value, regs, reg_count, true, cfa, &address)
+                        || !try_get_pointer(memory, address, &caller_regs[i])) {
+                    return false;
+                }
+                break;
+            case RULE_VAL_EXPRESSION:
+                if (!evaluate_expression(memory, rule->value, regs, reg_count, true, cfa,
+                        &caller_regs[i])) {
+                    return false;
+                }
+                break;
+        }
+    }
+
+    memcpy(regs, caller_regs, reg_count * sizeof(uintptr_t));
+    *out_return_address = outermost ? 0 : caller_regs[ra_reg];
+    return true;
+}
+
+static uint32_t hash_pc(pid_t tid, uintptr_t pc) {
+    uint32_t h = (uint32_t) (pc ^ ((uint64_t) pc >> 32)) ^ ((uint32_t) tid * 0x9e3779b9);
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    return h;
+}
+
+static bool lookup_cached_row(pid_t tid, uintptr_t pc, uintptr_t eh_frame_hdr,
+        cfi_row_t* row, uint32_t* out_ra_reg) {
+    cached_row_t* entry = &g_row_cache[hash_pc(tid, pc) & (ROW_CACHE_SIZE - 1)];
+    uint32_t sequence = __atomic_load_n(&entry->sequence, __ATOMIC_ACQUIRE);
+    if (!sequence || (sequence & 1)) {
+        return false;
+    }
+    cached_row_t copy;
+    memcpy(&copy, entry, sizeof(copy));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&entry->sequence, __ATOMIC_RELAXED) != sequence
+            || copy.tid != tid || copy.pc != pc || copy.eh_frame_hdr != eh_frame_hdr
+            || copy.rule_count > ROW_CACHE_RULES) {
+        return false;
+    }
+
+    memset(row, 0, sizeof(*row));
+    row->cfa_reg = copy.cfa_reg;
+    row->cfa_offset = copy.cfa_offset;
+    for (size_t i = 0; i < copy.rule_count; i++) {
+        set_rule(row, copy.rule_regs[i], copy.rule_kinds[i], copy.rule_offsets[i]);
+    }
+    *out_ra_reg = copy.ra_reg;
+    return true;
+}
+
+static void store_cached_row(pid_t tid, uintptr_t pc, uintptr_t eh_frame_hdr,
+        const cfi_row_t* row, uint32_t ra_reg) {
+    if (row->cfa_is_expression || row->cfa_reg >= DWARF_CFI_MAX_REGS
+            || ra_reg >= DWARF_CFI_MAX_REGS
+            || row->cfa_offset != (int32_t) row->cfa_offset) {
+        return;
+    }
+    cached_row_t fresh;
+    memset(&fresh, 0, sizeof(fresh));
+    for (int i = 0; i < DWARF_CFI_MAX_REGS; i++) {
+        const cfi_rule_t* rule = &row->rules[i];
+        if (rule->kind == RULE_SAME) {
+            continue;
+        }
+        if ((rule->kind != RULE_OFFSET && rule->kind != RULE_UNDEFINED)
+                || rule->value != (int32_t) rule->value
+                || fresh.rule_count == ROW_CACHE_RULES) {
+            return;
+        }
+        fresh.rule_regs[fresh.rule_count] = i;
+        fresh.rule_kinds[fresh.rule_count] = rule->kind;
+        fresh.rule_offsets[fresh.rule_count] = rule->value;
+        fresh.rule_count++;
+    }
+    fresh.tid = tid;
+    fresh.pc = pc;
+    fresh.eh_frame_hdr = eh_frame_hdr;
+    fresh.cfa_reg = row->cfa_reg;
+    fresh.cfa_offset = row->cfa_offset;
+    fresh.ra_reg = ra_reg;
+
+    cached_row_t* entry = &g_row_cache[hash_pc(tid, pc) & (ROW_CACHE_SIZE - 1)];
+    uint32_t sequence = __atomic_load_n(&entry->sequence, __ATOMIC_RELAXED);
+    // Somebody else is writing the entry; their row is as good as ours.
+    if ((sequence & 1) || !__atomic_compare_exchange_n(&entry->sequence, &sequence,
+            sequence + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return;
+    }
+    fresh.sequence = sequence + 1;
+    memcpy(entry, &fresh, sizeof(fresh));
+    __atomic_store_n(&entry->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+bool step_dwarf_cfi(const memory_t* memory, uintptr_t eh_frame_hdr, uintptr_t pc,
+        int sp_reg, uintptr_t* regs, int reg_count, uintptr_t* out_return_address) {
+    if (!eh_frame_hdr || reg_count > DWARF_CFI_MAX_REGS || sp_reg >= reg_count) {
+        return false;
+    }
+
+    // The code of another process may be anywhere in our address space, so
+    // its rows are only shared by unwinds of the same thread.
+    pid_t tid = memory->tid < 0 ? -1 : memory->tid;
+    cfi_row_t row;
+    uint32_t ra_reg;
+    if (!lookup_cached_row(tid, pc, eh_frame_hdr, &row, &ra_reg)) {
+        uintptr_t fde_ptr;
+        cie_t cie;
+        fde_t fde;
+        if (!find_fde(memory, eh_frame_hdr, pc, &fde_ptr)
+                || !parse_fde(memory, fde_ptr, &cie, &fde)
+                || pc < fde.pc_start || pc >= fde.pc_end) {
+            return false;
+        }
+        memset(&row, 0, sizeof(row));
+        if (!run_cfa_program(memory, cie.instructions, cie.instructions_end, &cie,
+                pc, fde.pc_start, NULL, &row)) {
+            return false;
+        }
+        cfi_row_t initial_row = row;
+        if (!run_cfa_program(memory, fde.instructions, fde.instructions_end, &cie,
+                pc, fde.pc_start, &initial_row, &row)) {
+            return false;
+        }
+        ra_reg = cie.ra_reg;
+        store_cached_row(tid, pc, eh_frame_hdr, &row, ra_reg);
+    }
+    return apply_row(memory, &row, ra_reg, sp_reg, regs, reg_count, out_return_address);
+}
+
+typedef struct {
+    uintptr_t pc;
+    uintptr_t eh_frame_hdr;
+} find_eh_frame_hdr_arg_t;
+
+static int find_eh_frame_hdr_callback(struct dl_phdr_info* info, size_t size, void* data) {
+    find_eh_frame_hdr_arg_t* arg = (find_eh_frame_hdr_arg_t*) data;
+    bool contains_pc = false;
+    uintptr_t eh_frame_hdr = 0;
+    for (size_t i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr)* phdr = &info->dlpi_phdr[i];
+        uintptr_t start = info->dlpi_addr + phdr->p_vaddr;
+        if (phdr->p_type == PT_LOAD) {
+            if (arg->pc >= start && arg->pc < start + phdr->p_memsz) {
+                contains_pc = true;
+            }
+        } else if (phdr->p_type == PT_GNU_EH_FRAME) {
+            eh_frame_hdr = start;
+        }
+    }
+    if (!contains_pc) {
+        return 0;
+    }
+    arg->eh_frame_hdr = eh_frame_hdr;
+    return 1;
+}
+
+uintptr_t find_eh_frame_hdr(uintptr_t pc) {
+    // The module table answers without the dynamic linker's lock, which a
+    // thread that crashed inside dlopen() may hold.
+    const module_table_t* table = module_table_acquire();
+    const module_entry_t* entry = module_table_find(table, pc);
+    uintptr_t eh_frame_hdr = entry ? entry->eh_frame_hdr : 0;
+    module_table_release(table);
+    if (entry) {
+        return eh_frame_hdr;
+    }
+
+    find_eh_frame_hdr_arg_t arg;
+    arg.pc = pc;
+    arg.eh_frame_hdr = 0;
+    module_table_iterate_phdr(find_eh_frame_hdr_callback, &arg);
+    return arg.eh_frame_hdr;
+}
+
+uintptr_t load_eh_frame_hdr_ptrace(const memory_t* memory, const map_info_t* mi) {
+    uint32_t headers[MAX_ELF_HEADERS_SIZE / sizeof(uint32_t)];
+    elf_view_t view;
+    if (!elf_view_init(&view, headers,
+            read_elf_headers(memory, mi->start, headers, sizeof(headers)))) {
+        return 0;
+    }
+
+    // The module is mapped from its first PT_LOAD segment; addresses are
+    // relative to that segment's page, whose size is the target's, not 4 KiB
+    // on every device.
+    uintptr_t page_size = sysconf(_SC_PAGESIZE);
+    elf_segment_t first_load;
+    elf_segment_t eh_frame_hdr;
+    if (!elf_view_find_program_header(&view, PT_LOAD, &first_load)
+            || !elf_view_find_program_header(&view, PT_GNU_EH_FRAME, &eh_frame_hdr)
+            || !eh_frame_hdr.vaddr) {
+        return 0;
+    }
+    return mi->start + eh_frame_hdr.vaddr - (first_load.vaddr & ~(page_size - 1));
+}
@@ -0,0 +1,58 @@
+/* DWARF call frame information unwinding through .eh_frame_hdr. */
+
+#ifndef _CORKSCREW_DWARF_CFI_H
+#define _CORKSCREW_DWARF_CFI_H
+
+#include "map_info.h"
+#include "ptrace.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Registers tracked by the CFI engine, in DWARF numbering.
+ * Enough for AArch64 (x0-x30, sp, pc) and x86-64 (16 core registers, rip). */
+#define DWARF_CFI_MAX_REGS 33
+
+/*
+ * Finds the .eh_frame_hdr section of the module of this process that
+ * contains pc.  Returns 0 if there is no such module or it has no section.
+ */
+uintptr_t find_eh_frame_hdr(uintptr_t pc);
+
+/*
+ * Finds the .eh_frame_hdr section of a module of another process, or of this
+ * one, through memory.  The module's ELF header must be at mi->start.
+ * Returns 0 if the module has no such section.
+ */
+uintptr_t load_eh_frame_hdr_ptrace(const memory_t* memory, const map_info_t* mi);
+
+/*
+ * Unwinds one frame using the CFI of the function containing pc, looked up
+ * in the .eh_frame_hdr binary search table at eh_frame_hdr.  For every frame
+ * but the innermost, pc should point into the call instruction rather than
+ * at the return address.
+ *
+ * regs holds reg_count registers in DWARF numbering and sp_reg is the number
+ * of the stack pointer.  On success, regs is updated to the caller's
+ * registers, the stack pointer being the canonical frame address, and
+ * *out_return_address is set to the return address, or 0 if this is the
+ * outermost frame.  Returns false, leaving regs alone, if the frame has no
+ * CFI or the CFI could not be evaluated.
+ *
+ * Rows computed for code of this process are cached by pc, so unwinding the
+ * same call sites repeatedly does not run the CFA programs again.  The cache
+ * is lock-free and async-signal-safe.
+ */
+bool step_dwarf_cfi(const memory_t* memory, uintptr_t eh_frame_hdr, uintptr_t pc,
+        int sp_reg, uintptr_t* regs, int reg_count, uintptr_t* out_return_address);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _CORKSCREW_DWARF_CFI_H
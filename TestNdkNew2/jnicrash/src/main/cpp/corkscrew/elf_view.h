@@ -0,0 +1,353 @@
+/* Bounds-checked views of ELF images of either class, without copying them. */
+
+#ifndef _CORKSCREW_ELF_VIEW_H
+#define _CORKSCREW_ELF_VIEW_H
+
+#include <elf.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A view is a range of bytes holding an ELF image, all of it or just its
+ * headers, or the contents of one of its sections.  Nothing is read outside
+ * the range, so a view of a truncated or corrupt image fails lookups rather
+ * than faulting, and a view of the first page of a module answers questions
+ * about its program headers but not its sections.
+ *
+ * Headers are decoded, field by field, into the class-independent structures
+ * below; the data they point to is read in place.  The decoders are defined
+ * once per class by DEFINE_ELF_VIEW_CLASS(), each with that class's own
+ * structures, and a view dispatches on the class of the image it views.
+ * Only images in the byte order of the process are viewed.
+ */
+typedef struct {
+    const uint8_t* data;
+    size_t size;
+    uint8_t elf_class;          /* ELFCLASS32 or ELFCLASS64 */
+    /* From the ELF header; zero in views of a section's contents. */
+    uint16_t type;
+    uint16_t machine;
+    uint64_t phoff;
+    uint16_t phentsize;
+    uint16_t phnum;
+    uint64_t shoff;
+    uint16_t shentsize;
+    uint16_t shnum;
+    uint16_t shstrndx;
+} elf_view_t;
+
+typedef struct {
+    uint32_t type;
+    uint32_t flags;
+    uint64_t offset;
+    uint64_t vaddr;
+    uint64_t filesz;
+    uint64_t memsz;
+} elf_segment_t;
+
+typedef struct {
+    uint32_t name;              /* offset in the section name table */
+    uint32_t type;
+    uint64_t flags;
+    uint64_t addr;
+    uint64_t offset;
+    uint64_t size;
+    uint32_t link;
+    uint64_t entsize;
+} elf_section_t;
+
+typedef struct {
+    uint32_t name;              /* offset in the linked string table */
+    uint8_t info;
+    uint16_t shndx;
+    uint64_t value;
+    uint64_t size;
+} elf_symbol_t;
+
+typedef struct {
+    uint32_t type;
+    const char* name;           /* name_size bytes, usually NUL-terminated */
+    uint32_t name_size;
+    const uint8_t* desc;
+    uint32_t desc_size;
+} elf_note_t;
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define ELF_VIEW_DATA ELFDATA2MSB
+#else
+#define ELF_VIEW_DATA ELFDATA2LSB
+#endif
+
+/* Whether [offset, offset + size) is within the view. */
+static inline bool elf_view_contains(const elf_view_t* view, uint64_t offset, uint64_t size) {
+    return offset <= view->size && size <= view->size - offset;
+}
+
+/* Makes a view of the contents of a section or segment of an image of
+ * elf_class that were read or mapped apart from the image. */
+static inline void elf_view_init_contents(elf_view_t* view, const void* data, size_t size,
+        uint8_t elf_class) {
+    memset(view, 0, sizeof(*view));
+    view->data = (const uint8_t*) data;
+    view->size = size;
+    view->elf_class = elf_class;
+}
+
+/* Makes out a view of [offset, offset + size) of view, of the same class.
+ * Returns false if that is not within view. */
+static inline bool elf_view_sub(const elf_view_t* view, uint64_t offset, uint64_t size,
+        elf_view_t* out) {
+    if (!elf_view_contains(view, offset, size)) {
+        return false;
+    }
+    elf_view_init_contents(out, view->data + offset, size, view->elf_class);
+    return true;
+}
+
+/*
+ * The decoders of one class.  Each copies a header out of the view, which
+ * need not be aligned, and widens its fields.
+ */
+#define DEFINE_ELF_VIEW_CLASS(bits) \
+static inline bool elf##bits##_view_init(elf_view_t* view) { \
+    Elf##bits##_Ehdr ehdr; \
+    if (view->size < sizeof(ehdr)) { \
+        return false; \
+    } \
+    memcpy(&ehdr, view->data, sizeof(ehdr)); \
+    view->type = ehdr.e_type; \
+    view->machine = ehdr.e_machine; \
+    view->phoff = ehdr.e_phoff; \
+    view->phentsize = ehdr.e_phentsize; \
+    view->phnum = ehdr.e_phnum; \
+    view->shoff = ehdr.e_shoff; \
+    view->shentsize = ehdr.e_shentsize; \
+    view->shnum = ehdr.e_shnum; \
+    view->shstrndx = ehdr.e_shstrndx; \
+    return (!view->phnum || view->phentsize >= sizeof(Elf##bits##_Phdr)) \
+            && (!view->shnum || view->shentsize >= sizeof(Elf##bits##_Shdr)); \
+} \
+\
+static inline bool elf##bits##_view_program_header(const elf_view_t* view, size_t index, \
+        elf_segment_t* out) { \
+    Elf##bits##_Phdr phdr; \
+    uint64_t offset = view->phoff + (uint64_t) index * view->phentsize; \
+    if (index >= view->phnum || !elf_view_contains(view, offset, sizeof(phdr))) { \
+        return false; \
+    } \
+    memcpy(&phdr, view->data + offset, sizeof(phdr)); \
+    out->type = phdr.p_type; \
+    out->flags = phdr.p_flags; \
+    out->offset = phdr.p_offset; \
+    out->vaddr = phdr.p_vaddr; \
+    out->filesz = phdr.p_filesz; \
+    out->memsz = phdr.p_memsz; \
+    return true; \
+} \
+\
+static inline bool elf##bits##_view_section(const elf_view_t* view, size_t index, \
+        elf_section_t* out) { \
+    Elf##bits##_Shdr shdr; \
+    uint64_t offset = view->shoff + (uint64_t) index * view->shentsize; \
+    if (index >= view->shnum || !elf_view_contains(view, offset, sizeof(shdr))) { \
+        return false; \
+    } \
+    memcpy(&shdr, view->data + offset, sizeof(shdr)); \
+    out->name = shdr.sh_name; \
+    out->type = shdr.sh_type; \
+    out->flags = shdr.sh_flags; \
+    out->addr = shdr.sh_addr; \
+    out->offset = shdr.sh_offset; \
+    out->size = shdr.sh_size; \
+    out->link = shdr.sh_link; \
+    out->entsize = shdr.sh_entsize; \
+    return true; \
+} \
+\
+static inline bool elf##bits##_view_symbol(const elf_view_t* symbols, size_t index, \
+        elf_symbol_t* out) { \
+    Elf##bits##_Sym sym; \
+    if (index >= symbols->size / sizeof(sym)) { \
+        return false; \
+    } \
+    memcpy(&sym, symbols->data + index * sizeof(sym), sizeof(sym)); \
+    out->name = sym.st_name; \
+    out->info = sym.st_info; \
+    out->shndx = sym.st_shndx; \
+    out->value = sym.st_value; \
+    out->size = sym.st_size; \
+    return true; \
+}
+
+DEFINE_ELF_VIEW_CLASS(32)
+DEFINE_ELF_VIEW_CLASS(64)
+
+/*
+ * Makes a view of the ELF image of size bytes at data, which may be just
+ * its first bytes.  Returns false if it does not start with an ELF header
+ * the process can read.
+ */
+static inline bool elf_view_init(elf_view_t* view, const void* data, size_t size) {
+    memset(view, 0, sizeof(*view));
+    view->data = (const uint8_t*) data;
+    view->size = size;
+    if (size < EI_NIDENT || memcmp(data, ELFMAG, SELFMAG)
+            || view->data[EI_DATA] != ELF_VIEW_DATA) {
+        return false;
+    }
+    view->elf_class = view->data[EI_CLASS];
+    switch (view->elf_class) {
+    case ELFCLASS32:
+        return elf32_view_init(view);
+    case ELFCLASS64:
+        return elf64_view_init(view);
+    default:
+        return false;
+    }
+}
+
+static inline bool elf_view_program_header(const elf_view_t* view, size_t index,
+        elf_segment_t* out) {
+    return view->elf_class == ELFCLASS64 ? elf64_view_program_header(view, index, out)
+            : elf32_view_program_header(view, index, out);
+}
+
+static inline bool elf_view_section(const elf_view_t* view, size_t index,
+        elf_section_t* out) {
+    return view->elf_class == ELFCLASS64 ? elf64_view_section(view, index, out)
+            : elf32_view_section(view, index, out);
+}
+
+/* Reads symbol index from a view of the contents of a symbol table. */
+static inline bool elf_view_symbol(const elf_view_t* symbols, size_t index,
+        elf_symbol_t* out) {
+    return symbols->elf_class == ELFCLASS64 ? elf64_view_symbol(symbols, index, out)
+            : elf32_view_symbol(symbols, index, out);
+}
+
+static inline size_t elf_view_symbol_count(const elf_view_t* symbols) {
+    return symbols->size / (symbols->elf_class == ELFCLASS64
+            ? sizeof(Elf64_Sym) : sizeof(Elf32_Sym));
+}
+
+/* The NUL-terminated string at offset in a view of a string table, or NULL. */
+static inline const char* elf_view_string(const elf_view_t* strings, uint64_t offset) {
+    if (offset >= strings->size
+            || !memchr(strings->data + offset, '\0', strings->size - offset)) {
+        return NULL;
+    }
+    return (const char*) strings->data + offset;
+}
+
+/* Makes a view of the contents of section.  Returns false if they are not
+ * in the file or not within the view. */
+static inline bool elf_view_section_data(const elf_view_t* view, const elf_section_t* section,
+        elf_view_t* out) {
+    return section->type != SHT_NOBITS
+            && elf_view_sub(view, section->offset, section->size, out);
+}
+
+/* The name of section, or NULL if the section name table is not in view. */
+static inline const char* elf_view_section_name(const elf_view_t* view,
+        const elf_section_t* section) {
+    elf_section_t names;
+    elf_view_t strings;
+    if (!elf_view_section(view, view->shstrndx, &names)
+            || !elf_view_section_data(view, &names, &strings)) {
+        return NULL;
+    }
+    return elf_view_string(&strings, section->name);
+}
+
+/* Finds the first section with the given name.  Returns its index, 0 if
+ * there is none. */
+static inline size_t elf_view_find_section(const elf_view_t* view, const char* name,
+        elf_section_t* out) {
+    for (size_t i = 1; i < view->shnum; i++) {
+        const char* section_name;
+        if (elf_view_section(view, i, out)
+                && (section_name = elf_view_section_name(view, out))
+                && !strcmp(section_name, name)) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+/* Finds the first section of the given type.  Returns its index, 0 if
+ * there is none. */
+static inline size_t elf_view_find_section_by_type(const elf_view_t* view, uint32_t type,
+        elf_section_t* out) {
+    for (size_t i = 1; i < view->shnum; i++) {
+        if (elf_view_section(view, i, out) && out->type == type) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+/* Finds the first program header of the given type.  Returns false if
+ * there is none. */
+static inline bool elf_view_find_program_header(const elf_view_t* view, uint32_t type,
+        elf_segment_t* out) {
+    for (size_t i = 0; i < view->phnum; i++) {
+        if (elf_view_program_header(view, i, out) && out->type == type) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Reads the note at *offset in a view of notes, a PT_NOTE segment or
+ * SHT_NOTE section, and advances *offset past it.  Notes have the same
+ * layout in both classes.  Returns false at the end or at a bad note.
+ */
+static inline bool elf_view_next_note(const elf_view_t* notes, size_t* offset,
+        elf_note_t* out) {
+    uint32_t header[3];
+    if (!elf_view_contains(notes, *offset, sizeof(header))) {
+        return false;
+    }
+    memcpy(header, notes->data + *offset, sizeof(header));
+    uint64_t name_offset = *offset + sizeof(header);
+    uint64_t desc_offset = name_offset + ((header[0] + 3ull) & ~3ull);
+    uint64_t end = desc_offset + ((header[1] + 3ull) & ~3ull);
+    if (!elf_view_contains(notes, name_offset, header[0])
+            || !elf_view_contains(notes, desc_offset, header[1])) {
+        return false;
+    }
+    out->name_size = header[0];
+    out->desc_size = header[1];
+    out->type = header[2];
+    out->name = (const char*) notes->data + name_offset;
+    out->desc = notes->data + desc_offset;
+    *offset = end < notes->size ? end : notes->size;
+    return true;
+}
+
+/* Finds the note with the given name, including its NUL, and type. */
+static inline bool elf_view_find_note(const elf_view_t* notes, const char* name,
+        uint32_t type, elf_note_t* out) {
+    size_t name_size = strlen(name) + 1;
+    size_t offset = 0;
+    while (elf_view_next_note(notes, &offset, out)) {
+        if (out->type == type && out->name_size == name_size
+                && !memcmp(out->name, name, name_size)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _CORKSCREW_ELF_VIEW_H
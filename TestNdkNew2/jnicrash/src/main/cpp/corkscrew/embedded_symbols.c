@@ -0,0 +1,149 @@
+/*
+ * Embedded function-range tables.
+ *
+ * Release builds are stripped, which leaves a symbol table loaded from the
+ * file with nothing but the exports.  Modules built with a table carry every
+ * function's range and name in a note of their own, mapped with the rest of
+ * their first segment, so it is read from memory like any other data: the
+ * process's own for a local backtrace, through ptrace() or the regions of an
+ * offline context otherwise.  Nothing is read from files at crash time.
+ */
+
+#define LOG_TAG "Corkscrew"
+//#define LOG_NDEBUG 0
+
+#include "embedded_symbols.h"
+#include "elf_view.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The library's own table, when the build reserves one. */
+#ifdef JNICRASH_EMBEDDED_SYMBOLS_SIZE
+DEFINE_EMBEDDED_SYMBOLS(JNICRASH_EMBEDDED_SYMBOLS_SIZE);
+#endif
+
+/* Checks the header of a table in a descriptor of desc_size bytes. */
+static bool is_valid_table(const embedded_symbols_header_t* header, uint32_t desc_size) {
+    if (header->magic != EMBEDDED_SYMBOLS_MAGIC || desc_size < sizeof(*header)) {
+        return false;
+    }
+    size_t max_count = (desc_size - sizeof(*header)) / sizeof(embedded_symbol_t);
+    return header->count <= max_count
+            && header->names_offset >= sizeof(*header)
+                    + header->count * sizeof(embedded_symbol_t)
+            && !(header->names_offset & 3)
+            && header->names_size <= desc_size
+            && header->names_offset <= desc_size - header->names_size;
+}
+
+/* Finds the table among the notes at [start, start + size). */
+static uintptr_t find_table_note(const memory_t* memory, uintptr_t start, size_t size) {
+    size_t offset = 0;
+    while (offset + 3 * sizeof(uint32_t) <= size) {
+        uint32_t header[3];
+        if (!try_get_words(memory, start + offset, header, sizeof(header))) {
+            break;
+        }
+        uint32_t name_size = header[0];
+        uint32_t desc_size = header[1];
+        uint32_t type = header[2];
+        offset += sizeof(header);
+        size_t name_end = offset + ((name_size + 3) & ~3u);
+        size_t desc_end = name_end + ((desc_size + 3) & ~3u);
+        if (name_size > size || desc_size > size || desc_end > size) {
+            break;
+        }
+        char name[12];
+        if (type == EMBEDDED_SYMBOLS_NOTE_TYPE
+                && name_size == sizeof(EMBEDDED_SYMBOLS_NOTE_NAME)
+                && try_get_words(memory, start + offset, name, sizeof(name))
+                && !memcmp(name, EMBEDDED_SYMBOLS_NOTE_NAME, name_size)) {
+            embedded_symbols_header_t table;
+            if (try_get_words(memory, start + name_end, &table, sizeof(table))
+                    && is_valid_table(&table, desc_size)) {
+                return start + name_end;
+            }
+            break;
+        }
+        offset = desc_end;
+    }
+    return 0;
+}
+
+uintptr_t find_embedded_symbols(const memory_t* memory, uintptr_t elf_start,
+        uintptr_t* out_load_bias) {
+    uint32_t headers[MAX_ELF_HEADERS_SIZE / sizeof(uint32_t)];
+    elf_view_t view;
+    elf_segment_t first_load;
+    if (!elf_view_init(&view, headers,
+                    read_elf_headers(memory, elf_start, headers, sizeof(headers)))
+            || !elf_view_find_program_header(&view, PT_LOAD, &first_load)) {
+        return 0;
+    }
+    uintptr_t load_bias = elf_start - (first_load.vaddr - first_load.offset);
+    for (size_t i = 0; i < view.phnum; i++) {
+        elf_segment_t note;
+        if (elf_view_program_header(&view, i, &note) && note.type == PT_NOTE
+                && !(note.vaddr & 3)) {
+            uintptr_t table = find_table_note(memory, load_bias + note.vaddr, note.filesz);
+            if (table) {
+                *out_load_bias = load_bias;
+                return table;
+            }
+        }
+    }
+    return 0;
+}
+
+const char* find_embedded_symbol(uintptr_t table, uintptr_t vaddr, uintptr_t* out_start) {
+    const embedded_symbols_header_t* header = (const embedded_symbols_header_t*) table;
+    const embedded_symbol_t* symbols = (const embedded_symbol_t*) (header + 1);
+    const char* names = (const char*) table + header->names_offset;
+
+    // The last function starting at or below vaddr is the only candidate.
+    size_t low = 0;
+    size_t high = header->count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (symbols[mid].start <= vaddr) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (!low) {
+        return NULL;
+    }
+    const embedded_symbol_t* symbol = &symbols[low - 1];
+    if (vaddr - symbol->start >= symbol->size || symbol->name >= header->names_size) {
+        return NULL;
+    }
+    *out_start = symbol->start;
+    return names + symbol->name;
+}
+
+symbol_table_t* load_embedded_symbol_table(const memory_t* memory, uintptr_t elf_start,
+        uintptr_t base) {
+    uintptr_t load_bias;
+    uintptr_t address = find_embedded_symbols(memory, elf_start, &load_bias);
+    if (!address) {
+        return NULL;
+    }
+    embedded_symbols_header_t header;
+    if (!try_get_words(memory, address, &header, sizeof(header))) {
+        return NULL;
+    }
+
+    // The descriptor is padded to a word, so the table can be read whole.
+    size_t size = (header.names_offset + header.names_size + 3) & ~3u;
+    void* data = malloc(size);
+    symbol_table_t* table = NULL;
+    if (data && try_get_words(memory, address, data, size)) {
+        table = load_symbol_table_from_ranges(data, header.names_offset + header.names_size,
+                load_bias - base);
+    }
+    free(data);
+    return table;
+}
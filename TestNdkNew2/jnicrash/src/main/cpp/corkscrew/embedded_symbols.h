@@ -0,0 +1,91 @@
+/* Function-range tables embedded in stripped modules at build time. */
+
+#ifndef _CORKSCREW_EMBEDDED_SYMBOLS_H
+#define _CORKSCREW_EMBEDDED_SYMBOLS_H
+
+#include "ptrace.h"
+#include "symbol_table.h"
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The table is the descriptor of an ELF note, so the linker gives it a
+ * PT_NOTE segment of its own that strip leaves alone:
+ *
+ *   embedded_symbols_header_t
+ *   embedded_symbol_t[count]     sorted by start, no two alike
+ *   names                        NUL-terminated, at names_offset
+ *
+ * A module reserves it with DEFINE_EMBEDDED_SYMBOLS(); after linking,
+ * cmake/embed_symbols.cmake fills it in from the module's own symbols,
+ * before the module is stripped.  Until then magic is 0.
+ */
+#define EMBEDDED_SYMBOLS_SECTION ".note.jnicrash.symbols"
+#define EMBEDDED_SYMBOLS_NOTE_NAME "JNICRASH"
+#define EMBEDDED_SYMBOLS_NOTE_TYPE 1
+#define EMBEDDED_SYMBOLS_MAGIC 0x4d59534a   /* "JSYM" */
+
+typedef struct {
+    uint32_t magic;
+    uint32_t count;
+    uint32_t names_offset;      /* from the start of the header */
+    uint32_t names_size;
+} embedded_symbols_header_t;
+
+typedef struct {
+    uint32_t start;             /* ELF virtual address, Thumb bit clear */
+    uint32_t size;
+    uint32_t name;              /* offset in names */
+} embedded_symbol_t;
+
+/*
+ * Reserves capacity bytes for the table of the module the expansion is
+ * linked into.  Use it in exactly one file of the module, at file scope.
+ */
+#define DEFINE_EMBEDDED_SYMBOLS(capacity) \
+    __attribute__((section(EMBEDDED_SYMBOLS_SECTION), used, aligned(4))) \
+    static const struct { \
+        uint32_t name_size; \
+        uint32_t desc_size; \
+        uint32_t type; \
+        char name[12]; \
+        uint32_t desc[(capacity) / 4]; \
+    } embedded_symbols_note = { \
+        sizeof(EMBEDDED_SYMBOLS_NOTE_NAME), (capacity) / 4 * 4, \
+        EMBEDDED_SYMBOLS_NOTE_TYPE, EMBEDDED_SYMBOLS_NOTE_NAME, { 0 } \
+    }
+
+/*
+ * Finds the filled-in table of the module whose ELF header is at elf_start.
+ * Sets *out_load_bias to the address of the module's virtual address 0.
+ * Returns the address of the table's header, 0 if the module has none.
+ */
+uintptr_t find_embedded_symbols(const memory_t* memory, uintptr_t elf_start,
+        uintptr_t* out_load_bias);
+
+/*
+ * Looks an ELF virtual address up in a table of this process returned by
+ * find_embedded_symbols().  Returns the name of the function holding it and
+ * sets *out_start to the function's address, or returns NULL.
+ */
+const char* find_embedded_symbol(uintptr_t table, uintptr_t vaddr, uintptr_t* out_start);
+
+/*
+ * Copies the table of the module whose ELF header is at elf_start into a
+ * symbol table whose addresses are relative to base, as find_symbol()
+ * expects them for a map starting at base.  Returns NULL if the module has
+ * no table.
+ */
+symbol_table_t* load_embedded_symbol_table(const memory_t* memory, uintptr_t elf_start,
+        uintptr_t base);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _CORKSCREW_EMBEDDED_SYMBOLS_H
@@ -0,0 +1,298 @@
+/*
+ * JIT code registry.
+ *
+ * Engines that generate machine code into anonymous mappings register each
+ * piece with its name and a simple unwind rule, much like the GDB JIT
+ * interface.  The entries are kept sorted by address in one large anonymous
+ * mapping made on first use, behind a sequence lock: writers hold a mutex
+ * and make the sequence odd while they move entries around, readers search
+ * without locking and retry if the sequence changed under them.
+ *
+ * The unwinders of this process read the table directly.  The ptrace()
+ * unwinder reads it out of the traced process once, when its context is
+ * loaded, and searches the copy.
+ */
+
+#define LOG_TAG "Corkscrew"
+//#define LOG_NDEBUG 0
+
+#include "jit_code.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0x4000
+#endif
+
+/* Readers that keep losing races with writers give up. */
+#define JIT_CODE_READ_ATTEMPTS 4
+
+typedef struct {
+    uint32_t sequence;          /* odd while being written */
+    uint32_t count;
+    jit_code_t entries[JIT_CODE_MAX];
+} jit_table_t;
+
+static jit_table_t* g_jit_table;
+static pthread_mutex_t g_jit_table_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Index of the first entry ending above addr. */
+static size_t lower_bound(const jit_code_t* entries, size_t count, uintptr_t addr) {
+    size_t low = 0;
+    size_t high = count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (entries[mid].end <= addr) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+static jit_table_t* get_table_locked() {
+    if (g_jit_table) {
+        return g_jit_table;
+    }
+    void* mapping = mmap(NULL, sizeof(jit_table_t), PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mapping == MAP_FAILED) {
+        return NULL;
+    }
+    __atomic_store_n(&g_jit_table, (jit_table_t*) mapping, __ATOMIC_RELEASE);
+    return g_jit_table;
+}
+
+static void begin_write(jit_table_t* table) {
+    __atomic_store_n(&table->sequence, table->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void end_write(jit_table_t* table) {
+    __atomic_store_n(&table->sequence, table->sequence + 1, __ATOMIC_RELEASE);
+}
+
+bool jit_code_register(uintptr_t start, size_t size, const char* name,
+        const jit_unwind_rule_t* rule) {
+    if (!size || start + size < start) {
+        return false;
+    }
+    jit_code_t code;
+    memset(&code, 0, sizeof(code));
+    code.start = start;
+    code.end = start + size;
+    if (rule) {
+        code.rule = *rule;
+    }
+    if (name) {
+        strncpy(code.name, name, sizeof(code.name) - 1);
+    }
+
+    pthread_mutex_lock(&g_jit_table_mutex);
+    jit_table_t* table = get_table_locked();
+    bool registered = false;
+    if (table) {
+        size_t first = lower_bound(table->entries, table->count, code.start);
+        size_t last = first;
+        while (last < table->count && table->entries[last].start < code.end) {
+            last++;
+        }
+        if (table->count - (last - first) < JIT_CODE_MAX) {
+            begin_write(table);
+            // Drop the overlapped entries [first, last) and open a gap for ours.
+            memmove(&table->entries[first + 1], &table->entries[last],
+                    (table->count - last) * sizeof(jit_code_t));
+            table->entries[first] = code;
+            table->count = table->count - (last - first) + 1;
+            end_write(table);
+            registered = true;
+        }
+    }
+    pthread_mutex_unlock(&g_jit_table_mutex);
+    return registered;
+}
+
+bool jit_code_unregister(uintptr_t start) {
+    pthread_mutex_lock(&g_jit_table_mutex);
+    jit_table_t* table = g_jit_table;
+    bool unregistered = false;
+    if (table) {
+        size_t i = lower_bound(table->entries, table->count, start);
+        if (i < table->count && table->entries[i].start == start) {
+            begin_write(table);
+            memmove(&table->entries[i], &table->entries[i + 1],
+                    (table->count - i - 1) * sizeof(jit_code_t));
+            table->count--;
+            end_write(table);
+            unregistered = true;
+        }
+    }
+    pthread_mutex_unlock(&g_jit_table_mutex);
+    return unregistered;
+}
+
+static bool find_local_jit_code(uintptr_t pc, jit_code_t* out_code) {
+    const jit_table_t* table = __atomic_load_n(&g_jit_table, __ATOMIC_ACQUIRE);
+    if (!table) {
+        return false;
+    }
+    for (int attempt = 0; attempt < JIT_CODE_READ_ATTEMPTS; attempt++) {
+        uint32_t sequence = __atomic_load_n(&table->sequence, __ATOMIC_ACQUIRE);
+        if (sequence & 1) {
+            // A signal handler may have interrupted the writer, which would
+            // then never finish while we wait.
+            continue;
+        }
+        size_t count = __atomic_load_n(&table->count, __ATOMIC_RELAXED);
+        if (count > JIT_CODE_MAX) {
+            continue;
+        }
+        size_t i = lower_bound(table->entries, count, pc);
+        bool found = i < count;
+        if (found) {
+            memcpy(out_code, &table->entries[i], sizeof(jit_code_t));
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&table->sequence, __ATOMIC_RELAXED) == sequence) {
+            return found && pc >= out_code->start;
+        }
+    }
+    return false;
+}
+
+bool find_jit_code(const ptrace_context_t* context, uintptr_t pc, jit_code_t* out_code) {
+    if (!context) {
+        return find_local_jit_code(pc, out_code);
+    }
+    size_t i = lower_bound(context->jit_code, context->jit_code_count, pc);
+    if (i < context->jit_code_count && pc >= context->jit_code[i].start) {
+        *out_code = context->jit_code[i];
+        return true;
+    }
+    return false;
+}
+
+/* Reads a block of words of the traced process. */
+static bool read_words(const memory_t* memory, uintptr_t ptr, void* out, size_t size) {
+    uint8_t* bytes = (uint8_t*) out;
+    for (size_t offset = 0; offset < size; offset += sizeof(uint32_t)) {
+        uint32_t word;
+        if (!try_get_word(memory, ptr + offset, &word)) {
+            return false;
+        }
+        memcpy(bytes + offset, &word, sizeof(word));
+    }
+    return true;
+}
+
+/* Reads where the table of the traced process is and what it holds.
+ * Returns false if there is none or it is being written. */
+static bool read_jit_table_header(const memory_t* memory, uintptr_t* out_table,
+        uint32_t* out_sequence, uint32_t* out_count) {
+    // Our own copy of the pointer may predate the table.
+    return try_get_pointer(memory, (uintptr_t) &g_jit_table, out_table) && *out_table
+            && try_get_word(memory, *out_table + offsetof(jit_table_t, sequence), out_sequence)
+            && !(*out_sequence & 1)
+            && try_get_word(memory, *out_table + offsetof(jit_table_t, count), out_count)
+            && *out_count && *out_count <= JIT_CODE_MAX;
+}
+
+/* Copies the entries of the traced process's table.  Returns false if they
+ * could not be read or the table changed meanwhile. */
+static bool read_jit_table_entries(const memory_t* memory, uintptr_t table,
+        uint32_t sequence, jit_code_t* entries, uint32_t count) {
+    // The threads are stopped, so the sequence can only have moved on if a
+    // thread was let go while we were reading.
+    uint32_t sequence_after;
+    if (!read_words(memory, table + offsetof(jit_table_t, entries), entries,
+                    count * sizeof(jit_code_t))
+            || !try_get_word(memory, table + offsetof(jit_table_t, sequence), &sequence_after)
+            || sequence_after != sequence) {
+        return false;
+    }
+    for (size_t i = 0; i < count; i++) {
+        entries[i].name[JIT_CODE_NAME_LENGTH - 1] = '\0';
+    }
+    return true;
+}
+
+jit_code_t* load_jit_code_ptrace(pid_t pid, size_t* out_count) {
+    *out_count = 0;
+    memory_t memory;
+    init_memory_ptrace(&memory, pid);
+
+    uintptr_t table;
+    uint32_t sequence, count;
+    if (!read_jit_table_header(&memory, &table, &sequence, &count)) {
+        return NULL;
+    }
+    jit_code_t* entries = (jit_code_t*) malloc(count * sizeof(jit_code_t));
+    if (!entries) {
+        return NULL;
+    }
+    if (!read_jit_table_entries(&memory, table, sequence, entries, count)) {
+        free(entries);
+        return NULL;
+    }
+    *out_count = count;
+    return entries;
+}
+
+bool copy_jit_code_ptrace(pid_t pid, jit_code_t* entries, size_t max_count,
+        size_t* out_count) {
+    *out_count = 0;
+    memory_t memory;
+    init_memory_ptrace(&memory, pid);
+
+    uintptr_t table;
+    uint32_t sequence, count;
+    if (!read_jit_table_header(&memory, &table, &sequence, &count) || count > max_count
+            || !read_jit_table_entries(&memory, table, sequence, entries, count)) {
+        return false;
+    }
+    *out_count = count;
+    return true;
+}
+
+bool step_jit_code(const memory_t* memory, const jit_code_t* code,
+        uintptr_t* sp, uintptr_t* fp, uintptr_t lr, uintptr_t* out_return_address) {
+    const jit_unwind_rule_t* rule = &code->rule;
+    uintptr_t cfa;
+    switch (rule->cfa_base) {
+    case JIT_CFA_SP:
+        cfa = *sp + rule->cfa_offset;
+        break;
+    case JIT_CFA_FP:
+        cfa = *fp + rule->cfa_offset;
+        break;
+    default:
+        return false;
+    }
+    // The stack grows down, so the caller's frame cannot be below ours.
+    if (cfa < *sp) {
+        return false;
+    }
+
+    uintptr_t return_address = lr;
+    if (rule->ra_offset != JIT_IN_REGISTER
+            && !try_get_pointer(memory, cfa + rule->ra_offset, &return_address)) {
+        return false;
+    }
+    uintptr_t caller_fp = *fp;
+    if (rule->fp_offset != JIT_IN_REGISTER
+            && !try_get_pointer(memory, cfa + rule->fp_offset, &caller_fp)) {
+        return false;
+    }
+    if (!return_address) {
+        return false;
+    }
+    *sp = cfa;
+    *fp = caller_fp;
+    *out_return_address = return_address;
+    return true;
+}
@@ -0,0 +1,109 @@
+/* Registry of dynamically generated code, for unwinding and symbolizing it. */
+
+#ifndef _CORKSCREW_JIT_CODE_H
+#define _CORKSCREW_JIT_CODE_H
+
+#include "ptrace.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* What the canonical frame address (the caller's stack pointer) is relative to. */
+enum {
+    JIT_CFA_NONE = 0,           /* no unwind rule, the code is only named */
+    JIT_CFA_SP = 1,
+    JIT_CFA_FP = 2,
+};
+
+/* For ra_offset and fp_offset: the value was not saved on the stack. */
+#define JIT_IN_REGISTER INT32_MIN
+
+/*
+ * How to find the caller of any frame of a piece of JIT code.  Offsets are
+ * in bytes.  The frame pointer is x29 on AArch64, rbp on x86-64, and r7 in
+ * Thumb or r11 in ARM code.
+ */
+typedef struct {
+    int32_t cfa_base;           /* JIT_CFA_* */
+    int32_t cfa_offset;         /* CFA = cfa_base register + cfa_offset */
+    int32_t ra_offset;          /* return address at CFA + ra_offset, or still in lr */
+    int32_t fp_offset;          /* caller's frame pointer at CFA + fp_offset, or unchanged */
+} jit_unwind_rule_t;
+
+/* Rule for code that keeps a {frame pointer, return address} record at fp. */
+#define JIT_UNWIND_RULE_FRAME_RECORD { JIT_CFA_FP, 2 * (int32_t) sizeof(void*), \
+        -(int32_t) sizeof(void*), -2 * (int32_t) sizeof(void*) }
+
+/* Names are truncated to fit, including the terminator. */
+#define JIT_CODE_NAME_LENGTH 48
+
+/* Most pieces of code the table holds; its pages are only committed as it
+ * fills up. */
+#define JIT_CODE_MAX 16384
+
+/* A registered piece of code. */
+typedef struct jit_code {
+    uintptr_t start;
+    uintptr_t end;
+    jit_unwind_rule_t rule;
+    char name[JIT_CODE_NAME_LENGTH];
+} jit_code_t;
+
+/*
+ * Registers the code at [start, start + size), replacing any registered code
+ * it overlaps, which is evidently gone.  rule may be NULL if the code can
+ * only be named.  Registration is serialized, but it is a binary search and,
+ * for code allocated at increasing addresses, an append, so it is cheap
+ * enough to do for every compiled function.  Returns false if the table is
+ * full or could not be mapped.
+ */
+bool jit_code_register(uintptr_t start, size_t size, const char* name,
+        const jit_unwind_rule_t* rule);
+
+/* Unregisters the code starting at start.  Returns false if there was none. */
+bool jit_code_unregister(uintptr_t start);
+
+/*
+ * Looks up the code containing pc.  If context is NULL the table of this
+ * process is searched; lookups are lock-free and async-signal-safe, and give
+ * up rather than wait if they interrupted a registration.  Otherwise the
+ * snapshot of the traced process's table taken by load_ptrace_context() is.
+ */
+bool find_jit_code(const ptrace_context_t* context, uintptr_t pc, jit_code_t* out_code);
+
+/*
+ * Copies the table of a process this one traces, which must be this process
+ * or a fork of it so the table is at the same address.  Sets *out_count and
+ * returns a sorted array to be freed with free(), or NULL if there is none.
+ */
+jit_code_t* load_jit_code_ptrace(pid_t pid, size_t* out_count);
+
+/*
+ * Like load_jit_code_ptrace(), into entries, which holds max_count entries,
+ * without allocating, so it can be used where malloc() cannot.  Returns
+ * false, with *out_count 0, if there is no table, it does not fit or it was
+ * being changed; the contents of entries are then undefined.
+ */
+bool copy_jit_code_ptrace(pid_t pid, jit_code_t* entries, size_t max_count,
+        size_t* out_count);
+
+/*
+ * Unwinds one frame of JIT code with its rule.  sp and fp are the frame's
+ * stack and frame pointers and lr its link register, 0 if there is none.
+ * On success sp and fp are updated to the caller's and *out_return_address
+ * is set.  Returns false, leaving sp and fp alone, if the code has no rule
+ * or the saved values could not be read.
+ */
+bool step_jit_code(const memory_t* memory, const jit_code_t* code,
+        uintptr_t* sp, uintptr_t* fp, uintptr_t lr, uintptr_t* out_return_address);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _CORKSCREW_JIT_CODE_H
@@ -18,8 +18,11 @@
 //#define LOG_NDEBUG 0
 
 #include "map_info.h"
+#include "module_table.h"
 
 #include <ctype.h>
+#include <fcntl.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -27,10 +30,11 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <sys/time.h>
-#include <android/log.h>
 
 #if defined(__APPLE__)
 
+#include <android/log.h>
+
 // Mac OS vmmap(1) output:
 // __TEXT                 0009f000-000a1000 [    8K     8K] r-x/rwx SM=COW  /Volumes/android/dalvik-dev/out/host/darwin-x86/bin/libcorkscrew_test\n
 // 012345678901234567890123456789012345678901234567890123456789
@@ -97,10 +101,11 @@ static map_info_t* parse_maps_line(const char* line)
 {
     unsigned long int start;
     unsigned long int end;
+    unsigned long int offset;
     char permissions[5];
     int name_pos;
-    if (sscanf(line, "%lx-%lx %4s %*x %*x:%*x %*d%n", &start, &end,
-            permissions, &name_pos) != 3) {
+    if (sscanf(line, "%lx-%lx %4s %lx %*x:%*x %*d%n", &start, &end,
+            permissions, &offset, &name_pos) != 4) {
         return NULL;
     }
 
@@ -117,6 +122,7 @@ static map_info_t* parse_maps_line(const char* line)
     if (mi) {
         mi->start = start;
         mi->end = end;
+        mi->offset = offset;
         mi->is_readable = strlen(permissions) == 4 && permissions[0] == 'r';
         mi->is_writable = strlen(permissions) == 4 && permissions[1] == 'w';
         mi->is_executable = strlen(permissions) == 4 && permissions[2] == 'x';
@@ -185,14 +191,32 @@ bool is_executable_map(const map_info_t* milist, uintptr_t addr) {
     return mi && mi->is_executable;
 }
 
+/*
+ * The cached list is published through g_my_map_info_list and reference
+ * counted, so acquiring and releasing it takes no lock.  A reader announces
+ * itself on g_acquiring while it goes from loading the pointer to holding a
+ * reference; a writer that replaces the list waits for that to drain before
+ * dropping the cache's own reference.  Only the writers share a mutex.
+ *
+ * The list is replaced when the module table changes, which dlopen() through
+ * module_table_dlopen() makes happen at once, and otherwise only when the
+ * maps are found to have changed: every MAX_CACHE_AGE one reader checksums
+ * them and the others keep using the list meanwhile.
+ */
 static pthread_mutex_t g_my_map_info_list_mutex = PTHREAD_MUTEX_INITIALIZER;
 static map_info_t* g_my_map_info_list = NULL;
+static uint32_t g_acquiring;
 
 static const int64_t MAX_CACHE_AGE = 5 * 1000 * 1000000LL;
 
+/* How long a writer waits for readers to take their references. */
+#define MAX_GRACE_PERIOD_YIELDS 10000
+
 typedef struct {
     uint32_t refs;
-    int64_t timestamp;
+    int64_t timestamp; // when the maps were last found to match the list
+    uint32_t module_generation;
+    uint32_t checksum; // of the maps the list was loaded from
 } my_map_info_data_t;
 
 static int64_t now_ns() {
@@ -209,71 +233,137 @@ static int64_t now_ns() {
 }
 
 static void dec_ref(map_info_t* milist, my_map_info_data_t* data) {
-    if (!--data->refs) {
+    if (!__atomic_sub_fetch(&data->refs, 1, __ATOMIC_ACQ_REL)) {
 //        ALOGV("Freed my_map_info_list %p.", milist);
         free(data);
         free_map_info_list(milist);
     }
 }
 
-map_info_t* acquire_my_map_info_list() {
-    pthread_mutex_lock(&g_my_map_info_list_mutex);
+/* Takes a reference to the published list, if any. */
+static map_info_t* get_my_map_info_list() {
+    __atomic_add_fetch(&g_acquiring, 1, __ATOMIC_SEQ_CST);
+    map_info_t* milist = __atomic_load_n(&g_my_map_info_list, __ATOMIC_SEQ_CST);
+    if (milist) {
+        my_map_info_data_t* data = (my_map_info_data_t*)milist->data;
+        __atomic_add_fetch(&data->refs, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_sub_fetch(&g_acquiring, 1, __ATOMIC_SEQ_CST);
+    return milist;
+}
 
-    int64_t time = now_ns();
-    if (g_my_map_info_list != NULL) {
-        my_map_info_data_t* data = (my_map_info_data_t*)g_my_map_info_list->data;
-        int64_t age = time - data->timestamp;
-        if (age >= MAX_CACHE_AGE) {
-//            ALOGV("Invalidated my_map_info_list %p, age=%lld.", g_my_map_info_list, age);
-            dec_ref(g_my_map_info_list, data);
-            g_my_map_info_list = NULL;
-        } else {
-//            ALOGV("Reusing my_map_info_list %p, age=%lld.", g_my_map_info_list, age);
+/* Publishes milist and drops the cache's reference to the list it replaces.
+ * A reader that never finishes acquiring, such as a signal handler that
+ * crashed itself, only makes the old list leak. */
+static void set_my_map_info_list(map_info_t* milist) {
+    map_info_t* old = __atomic_exchange_n(&g_my_map_info_list, milist, __ATOMIC_SEQ_CST);
+    if (old == NULL) {
+        return;
+    }
+    for (int i = 0; i < MAX_GRACE_PERIOD_YIELDS; i++) {
+        if (!__atomic_load_n(&g_acquiring, __ATOMIC_SEQ_CST)) {
+//            ALOGV("Replaced my_map_info_list %p.", old);
+            dec_ref(old, (my_map_info_data_t*)old->data);
+            return;
         }
+        sched_yield();
     }
+}
 
-    if (g_my_map_info_list == NULL) {
-        my_map_info_data_t* data = (my_map_info_data_t*)malloc(sizeof(my_map_info_data_t));
-        g_my_map_info_list = load_map_info_list(getpid());
-        if (g_my_map_info_list != NULL) {
-//            ALOGV("Loaded my_map_info_list %p.", g_my_map_info_list);
-            g_my_map_info_list->data = data;
-            data->refs = 1;
-            data->timestamp = time;
-        } else {
-            free(data);
+static bool is_stale(const map_info_t* milist, int64_t time) {
+    const my_map_info_data_t* data = (const my_map_info_data_t*)milist->data;
+    return data->module_generation != module_table_generation()
+            || time - __atomic_load_n(&data->timestamp, __ATOMIC_RELAXED) >= MAX_CACHE_AGE;
+}
+
+/* FNV-1a of the maps as the kernel prints them, without parsing or
+ * allocating; far cheaper than loading them.  Returns false if they cannot
+ * be read. */
+static bool checksum_maps(uint32_t* checksum) {
+    int fd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    uint32_t hash = 2166136261u;
+    char buffer[4096];
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+        for (ssize_t i = 0; i < n; i++) {
+            hash = (hash ^ (uint8_t)buffer[i]) * 16777619u;
         }
     }
+    close(fd);
+    *checksum = hash;
+    return n == 0;
+}
 
+/* Replaces the published list if it is stale and the maps have changed.
+ * Called with g_my_map_info_list_mutex held. */
+static void refresh_my_map_info_list() {
+    int64_t time = now_ns();
     map_info_t* milist = g_my_map_info_list;
-    if (milist) {
-        my_map_info_data_t* data = (my_map_info_data_t*)g_my_map_info_list->data;
-        data->refs += 1;
+    if (milist != NULL && !is_stale(milist, time)) {
+        return; // refreshed by another thread meanwhile
     }
 
-    pthread_mutex_unlock(&g_my_map_info_list_mutex);
-    return milist;
+    // Loads the module table has not been told about are found here.
+    module_table_update();
+    uint32_t module_generation = module_table_generation();
+    uint32_t checksum = 0;
+    bool have_checksum = checksum_maps(&checksum);
+
+    if (milist != NULL) {
+        my_map_info_data_t* data = (my_map_info_data_t*)milist->data;
+        if (data->module_generation == module_generation && have_checksum
+                && data->checksum == checksum) {
+//            ALOGV("Reusing my_map_info_list %p.", milist);
+            __atomic_store_n(&data->timestamp, time, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+
+    my_map_info_data_t* data = (my_map_info_data_t*)malloc(sizeof(my_map_info_data_t));
+    map_info_t* fresh = data ? load_map_info_list(getpid()) : NULL;
+    if (fresh == NULL) {
+        free(data); // keep the stale list rather than none
+        return;
+    }
+//    ALOGV("Loaded my_map_info_list %p.", fresh);
+    data->refs = 1; // the cache's
+    data->timestamp = time;
+    data->module_generation = module_generation;
+    data->checksum = checksum;
+    fresh->data = data;
+    set_my_map_info_list(fresh);
 }
 
-void release_my_map_info_list(map_info_t* milist) {
-    if (milist) {
+map_info_t* acquire_my_map_info_list() {
+    map_info_t* milist = get_my_map_info_list();
+    if (milist != NULL && !is_stale(milist, now_ns())) {
+        return milist;
+    }
+
+    // One thread refreshes a stale list while the others go on using it.
+    if (milist == NULL) {
         pthread_mutex_lock(&g_my_map_info_list_mutex);
+    } else if (pthread_mutex_trylock(&g_my_map_info_list_mutex)) {
+        return milist;
+    }
+    refresh_my_map_info_list();
+    pthread_mutex_unlock(&g_my_map_info_list_mutex);
 
-        my_map_info_data_t* data = (my_map_info_data_t*)milist->data;
-        dec_ref(milist, data);
+    release_my_map_info_list(milist);
+    return get_my_map_info_list();
+}
 
-        pthread_mutex_unlock(&g_my_map_info_list_mutex);
+void release_my_map_info_list(map_info_t* milist) {
+    if (milist) {
+        dec_ref(milist, (my_map_info_data_t*)milist->data);
     }
 }
 
 void flush_my_map_info_list() {
     pthread_mutex_lock(&g_my_map_info_list_mutex);
-
-    if (g_my_map_info_list != NULL) {
-        my_map_info_data_t* data = (my_map_info_data_t*) g_my_map_info_list->data;
-        dec_ref(g_my_map_info_list, data);
-        g_my_map_info_list = NULL;
-    }
-
+    set_my_map_info_list(NULL);
     pthread_mutex_unlock(&g_my_map_info_list_mutex);
 }
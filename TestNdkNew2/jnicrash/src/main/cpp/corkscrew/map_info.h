@@ -31,6 +31,7 @@ typedef struct map_info {
     struct map_info* next;
     uintptr_t start;
     uintptr_t end;
+    uintptr_t offset; // of the map in its file
     bool is_readable;
     bool is_writable;
     bool is_executable;
@@ -55,7 +56,8 @@ bool is_writable_map(const map_info_t* milist, uintptr_t addr);
 bool is_executable_map(const map_info_t* milist, uintptr_t addr);
 
 /* Acquires a reference to the memory map for this process.
- * The result is cached and refreshed automatically.
+ * The result is cached and refreshed automatically when modules are loaded
+ * or unloaded or the maps change; a cached map is acquired without locking.
  * Make sure to release the map info when done. */
 map_info_t* acquire_my_map_info_list();
 
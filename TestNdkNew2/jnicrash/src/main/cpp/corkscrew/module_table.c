@@ -0,0 +1,357 @@
+/*
+ * Module table.
+ *
+ * Nothing the crash path needs to know about a module changes between its
+ * load and its unload, yet it was found again from /proc/self/maps and the
+ * module's headers at every crash, and the local unwinders asked the dynamic
+ * linker for it at every frame, under a lock that a thread crashing inside
+ * dlopen() holds.  The table is built in a normal context instead, when the
+ * library starts and whenever the set of modules changes, and published as
+ * an immutable snapshot that signal handlers read without locking.
+ *
+ * Readers announce themselves on a counter.  A writer that replaces the
+ * snapshot waits for the counter to drain before freeing the old one; a
+ * reader that never finishes, such as a handler that crashed itself, only
+ * makes it give up and leak the old snapshot.
+ */
+
+#define LOG_TAG "Corkscrew"
+//#define LOG_NDEBUG 0
+
+#include "module_table.h"
+#include "elf_view.h"
+#include "embedded_symbols.h"
+#include "map_info.h"
+
+#include <dlfcn.h>
+#include <link.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef PT_GNU_EH_FRAME
+#define PT_GNU_EH_FRAME 0x6474e550
+#endif
+
+#ifndef PT_ARM_EXIDX
+#define PT_ARM_EXIDX 0x70000001
+#endif
+
+#ifndef NT_GNU_BUILD_ID
+#define NT_GNU_BUILD_ID 3
+#endif
+
+#if __LP64__
+#define ELF_CLASS ELFCLASS64
+#else
+#define ELF_CLASS ELFCLASS32
+#endif
+
+/* How long a writer waits for the readers of a snapshot it replaced. */
+#define MAX_GRACE_PERIOD_MS 100
+
+static pthread_mutex_t g_module_table_mutex = PTHREAD_MUTEX_INITIALIZER;
+static module_table_t* g_module_table;
+static uint32_t g_readers;
+static uint32_t g_generation;
+/* Identifies the modules the current snapshot was built from. */
+static uintptr_t g_signature;
+
+typedef struct {
+    module_entry_t* entries;
+    size_t count;
+    size_t capacity;
+    long page_size;
+} table_builder_t;
+
+static int signature_callback(struct dl_phdr_info* info, size_t size, void* data) {
+    uintptr_t* signature = (uintptr_t*) data;
+    *signature = *signature * 31 + info->dlpi_addr + (uintptr_t) info->dlpi_phdr;
+    return 0;
+}
+
+#if defined(__arm__)
+typedef int (*dl_iterate_phdr_fn)(module_table_phdr_callback_t callback, void* data);
+
+/*
+ * Calls callback for each ELF module mapped from the start of its header,
+ * as dl_iterate_phdr() would: the first loadable segment maps the header.
+ */
+static int iterate_phdr_from_maps(module_table_phdr_callback_t callback, void* data) {
+    map_info_t* milist = load_map_info_list(getpid());
+    int result = 0;
+    for (const map_info_t* mi = milist; mi && !result; mi = mi->next) {
+        const ElfW(Ehdr)* ehdr = (const ElfW(Ehdr)*) mi->start;
+        if (!mi->is_readable || mi->name[0] != '/'
+                || mi->end - mi->start < sizeof(ElfW(Ehdr))
+                || memcmp(ehdr->e_ident, ELFMAG, SELFMAG)
+                || ehdr->e_ident[EI_CLASS] != ELF_CLASS
+                || ehdr->e_phoff + ehdr->e_phnum * sizeof(ElfW(Phdr)) > mi->end - mi->start) {
+            continue;
+        }
+        const ElfW(Phdr)* phdrs = (const ElfW(Phdr)*) (mi->start + ehdr->e_phoff);
+        for (size_t i = 0; i < ehdr->e_phnum; i++) {
+            if (phdrs[i].p_type == PT_LOAD) {
+                struct dl_phdr_info info;
+                memset(&info, 0, sizeof(info));
+                info.dlpi_addr = mi->start - (phdrs[i].p_vaddr - phdrs[i].p_offset);
+                info.dlpi_name = mi->name;
+                info.dlpi_phdr = phdrs;
+                info.dlpi_phnum = ehdr->e_phnum;
+                result = callback(&info, sizeof(info), data);
+                break;
+            }
+        }
+    }
+    free_map_info_list(milist);
+    return result;
+}
+#endif
+
+int module_table_iterate_phdr(module_table_phdr_callback_t callback, void* data) {
+#if defined(__arm__)
+    // Declared for every API level, but only linkable from API 21.
+    dl_iterate_phdr_fn iterate = (dl_iterate_phdr_fn) dlsym(RTLD_DEFAULT, "dl_iterate_phdr");
+    return iterate ? iterate(callback, data) : iterate_phdr_from_maps(callback, data);
+#else
+    return dl_iterate_phdr(callback, data);
+#endif
+}
+
+/* Identifies the modules loaded now, in the order the linker has them. */
+static uintptr_t get_signature() {
+    uintptr_t signature = 0;
+    module_table_iterate_phdr(signature_callback, &signature);
+    return signature;
+}
+
+/* Whether [vaddr, vaddr + size) is in a loadable segment, so it is mapped. */
+static bool is_loaded(const struct dl_phdr_info* info, uintptr_t vaddr, size_t size) {
+    for (size_t i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr)* phdr = &info->dlpi_phdr[i];
+        if (phdr->p_type == PT_LOAD && vaddr >= phdr->p_vaddr
+                && vaddr + size <= phdr->p_vaddr + phdr->p_filesz) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Finds the build ID and the embedded symbol table among a module's notes. */
+static void load_notes(const struct dl_phdr_info* info, const ElfW(Phdr)* phdr,
+        module_entry_t* entry) {
+    if (!is_loaded(info, phdr->p_vaddr, phdr->p_filesz)) {
+        return;
+    }
+    elf_view_t notes;
+    elf_note_t note;
+    elf_view_init_contents(&notes, (const void*) (info->dlpi_addr + phdr->p_vaddr),
+            phdr->p_filesz, ELF_CLASS);
+    offline_module_t* module = &entry->module;
+    if (!module->build_id_size && elf_view_find_note(&notes, "GNU", NT_GNU_BUILD_ID, &note)) {
+        uint32_t size = note.desc_size < sizeof(module->build_id)
+                ? note.desc_size : sizeof(module->build_id);
+        memcpy(module->build_id, note.desc, size);
+        module->build_id_size = size;
+    }
+    // Until the build fills the table in, its magic is 0.
+    if (!entry->embedded_symbols && elf_view_find_note(&notes, EMBEDDED_SYMBOLS_NOTE_NAME,
+                    EMBEDDED_SYMBOLS_NOTE_TYPE, &note)
+            && note.desc_size >= sizeof(embedded_symbols_header_t)
+            && ((const embedded_symbols_header_t*) note.desc)->magic
+                    == EMBEDDED_SYMBOLS_MAGIC) {
+        entry->embedded_symbols = (uintptr_t) note.desc;
+        entry->embedded_symbols_size = note.desc_size;
+    }
+}
+
+static int add_entry_callback(struct dl_phdr_info* info, size_t size, void* data) {
+    table_builder_t* builder = (table_builder_t*) data;
+    module_entry_t entry;
+    memset(&entry, 0, sizeof(entry));
+    offline_module_t* module = &entry.module;
+    bool have_first_load = false;
+    for (size_t i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr)* phdr = &info->dlpi_phdr[i];
+        uintptr_t start = info->dlpi_addr + phdr->p_vaddr;
+        switch (phdr->p_type) {
+        case PT_LOAD:
+            // The first segment maps the ELF header if it starts in its page.
+            if (!have_first_load) {
+                have_first_load = true;
+                if (phdr->p_offset < (uintptr_t) builder->page_size) {
+                    entry.elf_start = start - phdr->p_offset;
+                }
+            }
+            if (phdr->p_flags & PF_X) {
+                if (!module->end || start < module->start) {
+                    module->start = start;
+                }
+                if (start + phdr->p_memsz > module->end) {
+                    module->end = start + phdr->p_memsz;
+                }
+            }
+            break;
+        case PT_GNU_EH_FRAME:
+            entry.eh_frame_hdr = start;
+            break;
+        case PT_ARM_EXIDX:
+            // Unwinders read the index directly, so it must be mapped.
+            if (is_loaded(info, phdr->p_vaddr, phdr->p_memsz)) {
+                entry.exidx_start = start;
+                entry.exidx_count = phdr->p_memsz / 8;
+            }
+            break;
+        case PT_DYNAMIC:
+            entry.dynamic = start;
+            break;
+        case PT_NOTE:
+            load_notes(info, phdr, &entry);
+            break;
+        }
+    }
+    if (!module->end) {
+        return 0;
+    }
+    module->load_bias = info->dlpi_addr;
+    if (info->dlpi_name) {
+        strncpy(module->name, info->dlpi_name, sizeof(module->name) - 1);
+    }
+
+    if (builder->count == builder->capacity) {
+        size_t capacity = builder->capacity ? builder->capacity * 2 : 256;
+        module_entry_t* entries = (module_entry_t*) realloc(builder->entries,
+                capacity * sizeof(module_entry_t));
+        if (!entries) {
+            return 1;
+        }
+        builder->entries = entries;
+        builder->capacity = capacity;
+    }
+    builder->entries[builder->count++] = entry;
+    return 0;
+}
+
+static int compare_entries(const void* a, const void* b) {
+    uintptr_t a_start = ((const module_entry_t*) a)->module.start;
+    uintptr_t b_start = ((const module_entry_t*) b)->module.start;
+    return a_start < b_start ? -1 : a_start > b_start;
+}
+
+static module_table_t* build_table() {
+    table_builder_t builder;
+    memset(&builder, 0, sizeof(builder));
+    builder.page_size = sysconf(_SC_PAGESIZE);
+    if (module_table_iterate_phdr(add_entry_callback, &builder)) {
+        free(builder.entries);
+        return NULL;
+    }
+
+    // The linker's names are what was asked for; the maps name the file,
+    // which for a library in an APK is the APK, with the library's offset.
+    map_info_t* milist = load_map_info_list(getpid());
+    for (size_t i = 0; i < builder.count; i++) {
+        offline_module_t* module = &builder.entries[i].module;
+        const map_info_t* mi = builder.entries[i].elf_start
+                ? find_map_info(milist, builder.entries[i].elf_start) : NULL;
+        if (mi && mi->name[0]) {
+            strncpy(module->name, mi->name, sizeof(module->name) - 1);
+            module->file_offset = mi->offset + (builder.entries[i].elf_start - mi->start);
+        }
+    }
+    free_map_info_list(milist);
+
+    qsort(builder.entries, builder.count, sizeof(module_entry_t), compare_entries);
+    module_table_t* table = (module_table_t*) malloc(sizeof(module_table_t)
+            + builder.count * sizeof(module_entry_t));
+    if (table) {
+        table->count = builder.count;
+        memcpy(table->entries, builder.entries, builder.count * sizeof(module_entry_t));
+    }
+    free(builder.entries);
+    return table;
+}
+
+static bool wait_for_readers() {
+    for (int waited_ms = 0; waited_ms < MAX_GRACE_PERIOD_MS; waited_ms++) {
+        if (!__atomic_load_n(&g_readers, __ATOMIC_SEQ_CST)) {
+            return true;
+        }
+        usleep(1000);
+    }
+    return false;
+}
+
+bool module_table_update(void) {
+    pthread_mutex_lock(&g_module_table_mutex);
+    uintptr_t signature = get_signature();
+    bool ok = true;
+    if (!g_module_table || signature != g_signature) {
+        module_table_t* table = build_table();
+        if (table) {
+            // The generation changes after the snapshot, so a cache keyed on
+            // it is never newer than the table it was built from.
+            table->generation = g_generation + 1;
+            module_table_t* old = __atomic_exchange_n(&g_module_table, table,
+                    __ATOMIC_SEQ_CST);
+            __atomic_store_n(&g_generation, table->generation, __ATOMIC_RELEASE);
+            g_signature = signature;
+            if (old && wait_for_readers()) {
+                free(old);
+            }
+        } else {
+            ok = false;
+        }
+    }
+    pthread_mutex_unlock(&g_module_table_mutex);
+    return ok;
+}
+
+void* module_table_dlopen(const char* filename, int flags) {
+    void* handle = dlopen(filename, flags);
+    if (handle) {
+        module_table_update();
+    }
+    return handle;
+}
+
+int module_table_dlclose(void* handle) {
+    int result = dlclose(handle);
+    module_table_update();
+    return result;
+}
+
+const module_table_t* module_table_acquire(void) {
+    __atomic_add_fetch(&g_readers, 1, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&g_module_table, __ATOMIC_SEQ_CST);
+}
+
+void module_table_release(const module_table_t* table) {
+    __atomic_sub_fetch(&g_readers, 1, __ATOMIC_SEQ_CST);
+}
+
+uint32_t module_table_generation(void) {
+    return __atomic_load_n(&g_generation, __ATOMIC_ACQUIRE);
+}
+
+const module_entry_t* module_table_find(const module_table_t* table, uintptr_t pc) {
+    if (!table) {
+        return NULL;
+    }
+    // The last module starting at or below pc is the only candidate.
+    size_t low = 0;
+    size_t high = table->count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (table->entries[mid].module.start <= pc) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (!low || pc >= table->entries[low - 1].module.end) {
+        return NULL;
+    }
+    return &table->entries[low - 1];
+}
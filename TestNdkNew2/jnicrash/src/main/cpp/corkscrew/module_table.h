@@ -0,0 +1,96 @@
+/* The modules loaded in this process, kept current from the dynamic linker. */
+
+#ifndef _CORKSCREW_MODULE_TABLE_H
+#define _CORKSCREW_MODULE_TABLE_H
+
+#include "offline.h"
+
+#include <link.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * What the unwinders and the crash path want to know about a module, found
+ * once when it is loaded rather than from /proc/self/maps and its headers
+ * each time.  module.start and module.end are the range of its executable
+ * segments; module.name and module.file_offset are those of the file the
+ * ELF header is mapped from, which for a library in an APK is the APK.
+ */
+typedef struct {
+    offline_module_t module;
+    uintptr_t elf_start;        /* where the ELF header is mapped, or 0 */
+    uintptr_t exidx_start;      /* ARM EHABI index, or 0 */
+    size_t exidx_count;
+    uintptr_t eh_frame_hdr;     /* or 0 */
+    uintptr_t dynamic;          /* PT_DYNAMIC, or 0 */
+    uintptr_t embedded_symbols; /* table of embedded_symbols.h, or 0 */
+    size_t embedded_symbols_size;
+} module_entry_t;
+
+/*
+ * A snapshot of the table.  It is never modified once published: a change
+ * publishes a new one, and the old one is freed once no reader holds it.
+ */
+typedef struct {
+    uint32_t generation;
+    size_t count;
+    module_entry_t entries[];   /* sorted by module.start */
+} module_table_t;
+
+/*
+ * Builds the table from the modules loaded now if it has not been built, or
+ * rebuilds it if modules have been loaded or unloaded since.  Loads that go
+ * through module_table_dlopen() are seen at once; this catches the rest,
+ * such as System.loadLibrary(), the next time it runs.  Takes the dynamic
+ * linker's lock and allocates, so it must not be called from a signal
+ * handler.  Returns false if the table could not be built.
+ */
+bool module_table_update(void);
+
+/*
+ * dlopen() and dlclose() that keep the table current.  Code that loads
+ * libraries of its own should call these instead: a library that is itself
+ * loaded with dlopen() cannot interpose on the linker's own functions.
+ */
+void* module_table_dlopen(const char* filename, int flags);
+int module_table_dlclose(void* handle);
+
+/*
+ * Gets the current snapshot, or NULL if the table has not been built.
+ * Lock-free and async-signal-safe.  Must be released with
+ * module_table_release(), also when NULL.
+ */
+const module_table_t* module_table_acquire(void);
+
+/* Releases a snapshot returned by module_table_acquire(). */
+void module_table_release(const module_table_t* table);
+
+/*
+ * Counts changes to the table; a cache of anything derived from the modules
+ * is stale once it differs.  Async-signal-safe.
+ */
+uint32_t module_table_generation(void);
+
+/* Finds the module whose executable segments hold pc.  Async-signal-safe. */
+const module_entry_t* module_table_find(const module_table_t* table, uintptr_t pc);
+
+typedef int (*module_table_phdr_callback_t)(struct dl_phdr_info* info, size_t size, void* data);
+
+/*
+ * dl_iterate_phdr(), which the linker only has on 32-bit ARM from API 21.
+ * There it is looked up at run time, and if it is missing the modules are
+ * found from /proc/self/maps and their mapped ELF headers instead, which
+ * allocates and so must not happen in a signal handler.
+ */
+int module_table_iterate_phdr(module_table_phdr_callback_t callback, void* data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _CORKSCREW_MODULE_TABLE_H
@@ -0,0 +1,313 @@
+/*
+ * Offline unwinding.
+ *
+ * A process that crashed can record just its registers, a copy of its stack
+ * and a list of its modules, and leave the unwinding to a later process.
+ * That process rebuilds the address space of the dead one well enough for
+ * the unwinders: the stack comes from the copy, and the code, unwind tables
+ * and read-only data of each module come from its file, mapped at the
+ * addresses the dead process had it.  Reads go through memory_t as for
+ * ptrace(), so nothing else needs to know the process is gone.
+ *
+ * Writable data is not recovered, which the unwinders never need.
+ */
+
+#define LOG_TAG "Corkscrew"
+//#define LOG_NDEBUG 0
+
+#include "offline.h"
+#include "elf_view.h"
+#include "ptrace-arch.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifndef PT_GNU_EH_FRAME
+#define PT_GNU_EH_FRAME 0x6474e550
+#endif
+
+#ifndef PT_ARM_EXIDX
+#define PT_ARM_EXIDX 0x70000001
+#endif
+
+#ifndef NT_GNU_BUILD_ID
+#define NT_GNU_BUILD_ID 3
+#endif
+
+/* Bounds what is read of a module's notes. */
+#define MAX_NOTES_SIZE 4096
+
+/* Finds the GNU build ID among notes.  Returns its size, 0 if there is none. */
+static uint32_t find_build_id(const elf_view_t* notes, uint8_t* build_id, size_t build_id_size) {
+    elf_note_t note;
+    if (!elf_view_find_note(notes, "GNU", NT_GNU_BUILD_ID, &note)) {
+        return 0;
+    }
+    uint32_t size = note.desc_size < build_id_size ? note.desc_size : build_id_size;
+    memcpy(build_id, note.desc, size);
+    return size;
+}
+
+bool init_offline_module(offline_module_t* module, uintptr_t elf_start) {
+    // The headers are in the first page, which the caller found mapped.
+    elf_view_t view;
+    elf_segment_t first_load;
+    if (!elf_view_init(&view, (const void*) elf_start, sysconf(_SC_PAGESIZE))
+            || !elf_view_find_program_header(&view, PT_LOAD, &first_load)) {
+        return false;
+    }
+    // The first segment maps the file from offset 0 at elf_start.
+    module->load_bias = elf_start - (first_load.vaddr - first_load.offset);
+    module->build_id_size = 0;
+    // The build ID need not be in the first note segment, and only notes in
+    // the first loadable segment are known to be mapped.
+    for (size_t i = 0; i < view.phnum && !module->build_id_size; i++) {
+        elf_segment_t note;
+        if (elf_view_program_header(&view, i, &note) && note.type == PT_NOTE
+                && note.vaddr >= first_load.vaddr
+                && note.vaddr + note.filesz <= first_load.vaddr + first_load.filesz) {
+            elf_view_t notes;
+            elf_view_init_contents(&notes, (const void*) (module->load_bias + note.vaddr),
+                    note.filesz, view.elf_class);
+            module->build_id_size = find_build_id(&notes,
+                    module->build_id, sizeof(module->build_id));
+        }
+    }
+    return true;
+}
+
+typedef struct {
+    memory_region_t* regions;
+    size_t count;
+    size_t capacity;
+} region_list_t;
+
+static memory_region_t* add_region(region_list_t* list) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 64;
+        memory_region_t* regions = (memory_region_t*) realloc(list->regions,
+                capacity * sizeof(memory_region_t));
+        if (!regions) {
+            return NULL;
+        }
+        list->regions = regions;
+        list->capacity = capacity;
+    }
+    return &list->regions[list->count++];
+}
+
+static bool read_fully(int fd, void* buffer, size_t size, off_t offset) {
+    return pread(fd, buffer, size, offset) == (ssize_t) size;
+}
+
+/* Reads the headers of the module at file_offset in fd into headers, which
+ * holds MAX_ELF_HEADERS_SIZE bytes, and makes a view of them. */
+static bool read_headers(int fd, uintptr_t file_offset, void* headers, elf_view_t* view) {
+    ssize_t size = pread(fd, headers, MAX_ELF_HEADERS_SIZE, file_offset);
+    return size > 0 && elf_view_init(view, headers, size) && view->phnum;
+}
+
+static uint32_t read_build_id_fd(int fd, uintptr_t file_offset, const elf_view_t* view,
+        uint8_t* build_id, size_t build_id_size) {
+    for (size_t i = 0; i < view->phnum; i++) {
+        elf_segment_t phdr;
+        if (elf_view_program_header(view, i, &phdr) && phdr.type == PT_NOTE
+                && phdr.filesz <= MAX_NOTES_SIZE) {
+            uint8_t data[MAX_NOTES_SIZE];
+            if (read_fully(fd, data, phdr.filesz, file_offset + phdr.offset)) {
+                elf_view_t notes;
+                elf_view_init_contents(&notes, data, phdr.filesz, view->elf_class);
+                uint32_t size = find_build_id(&notes, build_id, build_id_size);
+                if (size) {
+                    return size;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+uint32_t read_build_id(const char* path, uintptr_t file_offset,
+        uint8_t* build_id, size_t build_id_size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    uint32_t headers[MAX_ELF_HEADERS_SIZE / sizeof(uint32_t)];
+    elf_view_t view;
+    uint32_t size = 0;
+    if (read_headers(fd, file_offset, headers, &view)) {
+        size = read_build_id_fd(fd, file_offset, &view, build_id, build_id_size);
+    }
+    close(fd);
+    return size;
+}
+
+/* Maps the loadable segments of a module from its file and finds its unwind
+ * tables.  Leaves data empty if the file is not the one the process had. */
+static void load_offline_module(const offline_module_t* module, map_info_data_t* data,
+        region_list_t* regions) {
+    if (module->name[0] != '/') {
+        return;
+    }
+    int fd = open(module->name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    uint32_t headers[MAX_ELF_HEADERS_SIZE / sizeof(uint32_t)];
+    elf_view_t view;
+    if (!read_headers(fd, module->file_offset, headers, &view)) {
+        close(fd);
+        return;
+    }
+
+    uint8_t build_id[OFFLINE_BUILD_ID_SIZE];
+    uint32_t build_id_size = read_build_id_fd(fd, module->file_offset, &view,
+            build_id, sizeof(build_id));
+    // The library was updated or replaced since: its tables would mislead.
+    if (build_id_size != module->build_id_size
+            || memcmp(build_id, module->build_id, build_id_size)) {
+        close(fd);
+        return;
+    }
+
+    long page_size = sysconf(_SC_PAGESIZE);
+    for (size_t i = 0; i < view.phnum; i++) {
+        elf_segment_t phdr;
+        if (!elf_view_program_header(&view, i, &phdr)) {
+            break;
+        }
+        if (phdr.type == PT_LOAD && phdr.filesz) {
+            off_t file_start = module->file_offset + phdr.offset;
+            off_t map_start = file_start & ~((off_t) page_size - 1);
+            size_t map_size = phdr.filesz + (file_start - map_start);
+            void* mapping = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, map_start);
+            if (mapping == MAP_FAILED) {
+                continue;
+            }
+            memory_region_t* region = add_region(regions);
+            if (!region) {
+                munmap(mapping, map_size);
+                continue;
+            }
+            region->start = module->load_bias + phdr.vaddr;
+            region->end = region->start + phdr.filesz;
+            region->data = (const uint8_t*) mapping + (file_start - map_start);
+            region->mapping = mapping;
+            region->mapping_size = map_size;
+#ifdef __arm__
+        } else if (phdr.type == PT_ARM_EXIDX) {
+            data->exidx_start = module->load_bias + phdr.vaddr;
+            data->exidx_size = phdr.filesz / 8;
+#else
+        } else if (phdr.type == PT_GNU_EH_FRAME) {
+            data->eh_frame_hdr = module->load_bias + phdr.vaddr;
+#endif
+        }
+    }
+    close(fd);
+
+    // Libraries mapped straight from an APK have no symbol table we can load;
+    // a table embedded at build time is found in the regions all the same.
+    data->symbols_in_file = !module->file_offset;
+}
+
+static map_info_t* new_map_info(uintptr_t start, uintptr_t end, const char* name) {
+    size_t name_len = strlen(name);
+    map_info_t* mi = calloc(1, sizeof(map_info_t) + name_len + 1);
+    if (mi) {
+        mi->start = start;
+        mi->end = end;
+        mi->is_readable = true;
+        memcpy(mi->name, name, name_len + 1);
+    }
+    return mi;
+}
+
+static int compare_map_info_descending(const void* a, const void* b) {
+    uintptr_t start_a = (*(const map_info_t* const*) a)->start;
+    uintptr_t start_b = (*(const map_info_t* const*) b)->start;
+    return start_a < start_b ? 1 : start_a > start_b ? -1 : 0;
+}
+
+static int compare_regions(const void* a, const void* b) {
+    uintptr_t start_a = ((const memory_region_t*) a)->start;
+    uintptr_t start_b = ((const memory_region_t*) b)->start;
+    return start_a < start_b ? -1 : start_a > start_b ? 1 : 0;
+}
+
+ptrace_context_t* load_offline_context(const offline_module_t* modules, size_t count,
+        uintptr_t stack_start, size_t stack_size) {
+    ptrace_context_t* context = (ptrace_context_t*) calloc(1, sizeof(ptrace_context_t));
+    map_info_t** maps = (map_info_t**) calloc(count + 1, sizeof(map_info_t*));
+    if (!context || !maps) {
+        free(context);
+        free(maps);
+        return NULL;
+    }
+
+    region_list_t regions = { NULL, 0, 0 };
+    size_t map_count = 0;
+    for (size_t i = 0; i < count; i++) {
+        char name[OFFLINE_MODULE_NAME_SIZE];
+        memcpy(name, modules[i].name, sizeof(name));
+        name[sizeof(name) - 1] = '\0';
+        // The map starts at the load bias so that frame and symbol offsets
+        // within it are ELF virtual addresses, whatever the segment layout.
+        uintptr_t start = modules[i].load_bias && modules[i].load_bias <= modules[i].start
+                ? modules[i].load_bias : modules[i].start;
+        map_info_t* mi = new_map_info(start, modules[i].end, name);
+        if (!mi) {
+            continue;
+        }
+        mi->is_executable = true;
+        map_info_data_t* data = (map_info_data_t*) calloc(1, sizeof(map_info_data_t));
+        if (data) {
+            data->load_base = start;
+            data->build_id_loaded = true;
+            if (modules[i].build_id_size <= sizeof(data->build_id)) {
+                data->build_id_size = modules[i].build_id_size;
+                memcpy(data->build_id, modules[i].build_id, data->build_id_size);
+            }
+            load_offline_module(&modules[i], data, &regions);
+            mi->data = data;
+        }
+        maps[map_count++] = mi;
+    }
+    // The stack map bounds stack scanning and frame-pointer walks.
+    if (stack_size) {
+        map_info_t* mi = new_map_info(stack_start, stack_start + stack_size, "[stack]");
+        if (mi) {
+            mi->is_writable = true;
+            maps[map_count++] = mi;
+        }
+    }
+
+    // Map lists run from high addresses to low.
+    qsort(maps, map_count, sizeof(map_info_t*), compare_map_info_descending);
+    for (size_t i = map_count; i > 0; i--) {
+        maps[i - 1]->next = context->map_info_list;
+        context->map_info_list = maps[i - 1];
+    }
+    free(maps);
+
+    qsort(regions.regions, regions.count, sizeof(memory_region_t), compare_regions);
+    context->regions = regions.regions;
+    context->region_count = regions.count;
+    return context;
+}
+
+void init_memory_offline(memory_t* memory, const ptrace_context_t* context, pid_t tid,
+        uintptr_t stack_start, const uint8_t* stack_data, size_t stack_size) {
+    // A thread ID makes the unwinders use the context's map data, as they
+    // do for ptrace(), rather than look this process's modules up.
+    memory->tid = tid;
+    memory->map_info_list = context->map_info_list;
+    memory->stack_start = stack_start;
+    memory->stack_size = stack_size;
+    memory->stack_data = stack_data;
+    memory->offline_context = context;
+}
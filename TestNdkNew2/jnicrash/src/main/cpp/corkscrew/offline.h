@@ -0,0 +1,69 @@
+/* Unwinding and symbolizing a process that is gone, from what it recorded. */
+
+#ifndef _CORKSCREW_OFFLINE_H
+#define _CORKSCREW_OFFLINE_H
+
+#include "ptrace.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Longest build ID kept; GNU build IDs are 20 bytes. */
+#define OFFLINE_BUILD_ID_SIZE 32
+/* Module paths are truncated to fit, including the terminator. */
+#define OFFLINE_MODULE_NAME_SIZE 256
+
+/* An executable map of the process, as it was. */
+typedef struct {
+    uintptr_t start;
+    uintptr_t end;
+    uintptr_t load_bias;        /* address of ELF virtual address 0 */
+    uintptr_t file_offset;      /* of the ELF header, non-zero for libraries in APKs */
+    uint32_t build_id_size;     /* 0 if the map is not an ELF module or has no build ID */
+    uint8_t build_id[OFFLINE_BUILD_ID_SIZE];
+    char name[OFFLINE_MODULE_NAME_SIZE];
+} offline_module_t;
+
+/*
+ * Fills in the load bias and build ID of a module of this process whose ELF
+ * header is mapped at elf_start.  Only reads memory, so it may be called
+ * from a signal handler.  Returns false if there is no ELF header there.
+ */
+bool init_offline_module(offline_module_t* module, uintptr_t elf_start);
+
+/*
+ * Reads the GNU build ID of the module whose ELF header is at file_offset in
+ * the file at path.  Returns its size, 0 if it has none or cannot be read.
+ */
+uint32_t read_build_id(const char* path, uintptr_t file_offset,
+        uint8_t* build_id, size_t build_id_size);
+
+/*
+ * Builds a context for a process that is gone from its modules and a copy of
+ * the stack of one of its threads, which must outlive the context.
+ *
+ * The loadable segments of each module are mapped from its file, at the
+ * addresses the process had them, if the file is still there and its build
+ * ID matches; modules that have changed or vanished keep their name but
+ * cannot be unwound through.  The result is freed with free_ptrace_context().
+ */
+ptrace_context_t* load_offline_context(const offline_module_t* modules, size_t count,
+        uintptr_t stack_start, size_t stack_size);
+
+/*
+ * Initializes a memory structure for reading the memory of a process that
+ * is gone.  tid is the thread the stack copy belongs to.
+ */
+void init_memory_offline(memory_t* memory, const ptrace_context_t* context, pid_t tid,
+        uintptr_t stack_start, const uint8_t* stack_data, size_t stack_size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _CORKSCREW_OFFLINE_H
@@ -21,25 +21,47 @@
 
 #include "ptrace.h"
 #include "map_info.h"
+#include "module_table.h"
 #include "symbol_table.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* Longest build ID kept; GNU build IDs are 20 bytes. */
+#define MAX_BUILD_ID_SIZE 32
+
 /* Custom extra data we stuff into map_info_t structures as part
  * of our ptrace_context_t. */
 typedef struct {
 #ifdef __arm__
     uintptr_t exidx_start;
     size_t exidx_size;
-#elif __i386__
+#elif defined(__i386__) || defined(__x86_64__) || defined(__aarch64__)
     uintptr_t eh_frame_hdr;
 #endif
     symbol_table_t* symbol_table;
+    bool symbols_loaded;        /* symbol_table is loaded on first use */
+    bool symbols_in_file;       /* the module's file may be read for them */
+    uintptr_t load_base;        /* start of the map holding the module's ELF header */
+    bool build_id_loaded;       /* build_id is read on first use, see get_map_build_id() */
+    uint32_t build_id_size;     /* 0 if the module has no build ID or it is unknown */
+    uint8_t build_id[MAX_BUILD_ID_SIZE];
 } map_info_data_t;
 
-void load_ptrace_map_info_data_arch(pid_t pid, map_info_t* mi, map_info_data_t* data);
+/*
+ * Gets the build ID of the module mapped at mi, reading it from the module's
+ * file the first time: most modules of a process never appear in a
+ * backtrace.  Returns its size, 0 if it is unknown.  Like symbols, build IDs
+ * may only be looked up by one thread per context.
+ */
+uint32_t get_map_build_id(const map_info_t* mi, const uint8_t** out_build_id);
+
+/* Reads the unwind tables of the module whose ELF header is mapped at mi. */
+void load_ptrace_map_info_data_arch(const memory_t* memory, const map_info_t* mi,
+        map_info_data_t* data);
+/* Takes the unwind tables of a module from its module table entry instead. */
+void load_module_map_info_data_arch(const module_entry_t* entry, map_info_data_t* data);
 void free_ptrace_map_info_data_arch(map_info_t* mi, map_info_data_t* data);
 
 #ifdef __cplusplus
@@ -19,29 +19,74 @@
 
 #include "ptrace-arch.h"
 #include "ptrace.h"
+#include "elf_view.h"
+#include "embedded_symbols.h"
+#include "jit_code.h"
+#include "module_table.h"
+#include "offline.h"
 
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/ptrace.h>
+#include <unistd.h>
 
 static const uint32_t ELF_MAGIC = 0x464C457f; // "ELF\0177"
 
-#ifndef PAGE_SIZE
-#define PAGE_SIZE 4096
-#endif
-
-#ifndef PAGE_MASK
-#define PAGE_MASK (~(PAGE_SIZE - 1))
-#endif
-
 void init_memory(memory_t* memory, const map_info_t* map_info_list) {
     memory->tid = -1;
     memory->map_info_list = map_info_list;
+    memory->stack_start = 0;
+    memory->stack_size = 0;
+    memory->stack_data = NULL;
+    memory->offline_context = NULL;
 }
 
 void init_memory_ptrace(memory_t* memory, pid_t tid) {
     memory->tid = tid;
     memory->map_info_list = NULL;
+    memory->stack_start = 0;
+    memory->stack_size = 0;
+    memory->stack_data = NULL;
+    memory->offline_context = NULL;
+}
+
+void init_memory_snapshot(memory_t* memory, const map_info_t* map_info_list,
+        uintptr_t stack_start, const uint8_t* stack_data, size_t stack_size) {
+    init_memory(memory, map_info_list);
+    memory->stack_start = stack_start;
+    memory->stack_size = stack_size;
+    memory->stack_data = stack_data;
+}
+
+/* Reads a word of a process that is gone. */
+static bool try_get_offline_word(const memory_t* memory, uintptr_t ptr, uint32_t* out_value) {
+    if (ptr >= memory->stack_start
+            && ptr - memory->stack_start + sizeof(uint32_t) <= memory->stack_size) {
+        memcpy(out_value, memory->stack_data + (ptr - memory->stack_start), sizeof(uint32_t));
+        return true;
+    }
+    const ptrace_context_t* context = memory->offline_context;
+    size_t low = 0;
+    size_t high = context->region_count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (context->regions[mid].end <= ptr) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low < context->region_count) {
+        const memory_region_t* region = &context->regions[low];
+        if (ptr >= region->start && ptr + sizeof(uint32_t) <= region->end) {
+            memcpy(out_value, region->data + (ptr - region->start), sizeof(uint32_t));
+            return true;
+        }
+    }
+    *out_value = 0xffffffffL;
+    return false;
 }
 
 bool try_get_word(const memory_t* memory, uintptr_t ptr, uint32_t* out_value) {
@@ -51,8 +96,18 @@ bool try_get_word(const memory_t* memory, uintptr_t ptr, uint32_t* out_value) {
         *out_value = 0xffffffffL;
         return false;
     }
+    if (memory->offline_context) {
+        return try_get_offline_word(memory, ptr, out_value);
+    }
     if (memory->tid < 0) {
-        if (!is_readable_map(memory->map_info_list, ptr)) {
+        if (ptr >= memory->stack_start
+                && ptr - memory->stack_start + sizeof(uint32_t) <= memory->stack_size) {
+            memcpy(out_value, memory->stack_data + (ptr - memory->stack_start),
+                    sizeof(uint32_t));
+            return true;
+        }
+        const map_info_t* mi = find_map_info(memory->map_info_list, ptr);
+        if (!mi || !mi->is_readable || (memory->stack_data && mi->is_writable)) {
 //            ALOGV("try_get_word: pointer %p not in a readable map", (void*) ptr);
             *out_value = 0xffffffffL;
             return false;
@@ -78,42 +133,175 @@ bool try_get_word(const memory_t* memory, uintptr_t ptr, uint32_t* out_value) {
     }
 }
 
+bool try_get_pointer(const memory_t* memory, uintptr_t ptr, uintptr_t* out_value) {
+#if __LP64__
+    uint32_t low, high;
+    if ((ptr & 7) || !try_get_word(memory, ptr, &low) || !try_get_word(memory, ptr + 4, &high)) {
+        *out_value = UINTPTR_MAX;
+        return false;
+    }
+    *out_value = ((uintptr_t) high << 32) | low;
+    return true;
+#else
+    uint32_t value;
+    bool result = try_get_word(memory, ptr, &value);
+    *out_value = value;
+    return result;
+#endif
+}
+
+bool try_get_words(const memory_t* memory, uintptr_t ptr, void* buffer, size_t size) {
+    uint32_t* words = (uint32_t*) buffer;
+    for (size_t i = 0; i < size / sizeof(uint32_t); i++) {
+        if (!try_get_word(memory, ptr + i * sizeof(uint32_t), &words[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+size_t read_elf_headers(const memory_t* memory, uintptr_t elf_start,
+        void* buffer, size_t buffer_size) {
+    // Enough for the ELF header of either class; the page it is in is mapped.
+    size_t size = sizeof(Elf64_Ehdr);
+    elf_view_t view;
+    if (buffer_size < size || !try_get_words(memory, elf_start, buffer, size)
+            || !elf_view_init(&view, buffer, size)) {
+        return 0;
+    }
+    uint64_t end = (view.phoff + (uint64_t) view.phnum * view.phentsize + 3) & ~3ull;
+    if (end > buffer_size) {
+        return 0;
+    }
+    if (end > size) {
+        if (!try_get_words(memory, elf_start + size, (uint8_t*) buffer + size, end - size)) {
+            return 0;
+        }
+        size = end;
+    }
+    return size;
+}
+
 bool try_get_word_ptrace(pid_t tid, uintptr_t ptr, uint32_t* out_value) {
     memory_t memory;
     init_memory_ptrace(&memory, tid);
     return try_get_word(&memory, ptr, out_value);
 }
 
-static void load_ptrace_map_info_data(pid_t pid, map_info_t* mi) {
-    if (mi->is_executable && mi->is_readable) {
+/* Finds the map holding the ELF header of the module mapped at mi.  Linkers
+ * that give read-only data a segment of its own map the header below the
+ * code; the list is backward, so that map comes after mi. */
+static map_info_t* find_elf_map(const memory_t* memory, map_info_t* mi) {
+    for (map_info_t* m = mi; m; m = m->next) {
+        if (m != mi && (!mi->name[0] || strcmp(m->name, mi->name))) {
+            break;
+        }
         uint32_t elf_magic;
-        if (try_get_word_ptrace(pid, mi->start, &elf_magic) && elf_magic == ELF_MAGIC) {
+        if (m->is_readable && try_get_word(memory, m->start, &elf_magic)
+                && elf_magic == ELF_MAGIC) {
+            return m;
+        }
+    }
+    return NULL;
+}
+
+/* Finds the entry of table for the module mapped at mi, if table is given
+ * and knows it. */
+static const module_entry_t* find_module_entry(const module_table_t* table,
+        const map_info_t* mi) {
+    const module_entry_t* entry = table ? module_table_find(table, mi->start) : NULL;
+    if (!entry || !entry->elf_start
+            || (mi->name[0] && strcmp(entry->module.name, mi->name))) {
+        return NULL;
+    }
+    return entry;
+}
+
+static void load_ptrace_map_info_data(const memory_t* memory, map_info_t* mi,
+        const module_table_t* table) {
+    if (mi->is_executable && mi->is_readable) {
+        const module_entry_t* entry = find_module_entry(table, mi);
+        map_info_t* elf_mi = entry ? NULL : find_elf_map(memory, mi);
+        if (entry || elf_mi) {
             map_info_data_t* data = (map_info_data_t*)calloc(1, sizeof(map_info_data_t));
             if (data) {
                 mi->data = data;
-                if (mi->name[0]) {
-                    data->symbol_table = load_symbol_table(mi->name);
+                data->symbols_in_file = mi->name[0] != '\0';
+                if (entry) {
+                    data->load_base = entry->elf_start;
+                    data->build_id_loaded = true;
+                    if (entry->module.build_id_size <= sizeof(data->build_id)) {
+                        data->build_id_size = entry->module.build_id_size;
+                        memcpy(data->build_id, entry->module.build_id, data->build_id_size);
+                    }
+                    load_module_map_info_data_arch(entry, data);
+                    return;
                 }
+                data->load_base = elf_mi->start;
 //#ifdef CORKSCREW_HAVE_ARCH
-                load_ptrace_map_info_data_arch(pid, mi, data);
+                load_ptrace_map_info_data_arch(memory, elf_mi, data);
 //#endif
             }
         }
     }
 }
 
-ptrace_context_t* load_ptrace_context(pid_t pid) {
+/* Reads the memory of pid, which is read directly if it is this process. */
+static void init_memory_for_pid(memory_t* memory, pid_t pid, const map_info_t* map_info_list) {
+    if (pid == getpid()) {
+        init_memory(memory, map_info_list);
+    } else {
+        init_memory_ptrace(memory, pid);
+    }
+}
+
+static ptrace_context_t* load_context(pid_t pid, const module_table_t* table,
+        bool load_jit_code) {
     ptrace_context_t* context =
             (ptrace_context_t*)calloc(1, sizeof(ptrace_context_t));
     if (context) {
+        context->pid = pid;
         context->map_info_list = load_map_info_list(pid);
+        memory_t memory;
+        init_memory_for_pid(&memory, pid, context->map_info_list);
         for (map_info_t* mi = context->map_info_list; mi; mi = mi->next) {
-            load_ptrace_map_info_data(pid, mi);
+            load_ptrace_map_info_data(&memory, mi, table);
+        }
+        if (load_jit_code && pid != getpid()) {
+            context->jit_code = load_jit_code_ptrace(pid, &context->jit_code_count);
         }
     }
     return context;
 }
 
+ptrace_context_t* load_ptrace_context(pid_t pid, bool load_jit_code) {
+    return load_context(pid, NULL, load_jit_code);
+}
+
+ptrace_context_t* load_ptrace_context_from_module_table(pid_t pid, bool load_jit_code) {
+    const module_table_t* table = module_table_acquire();
+    ptrace_context_t* context = load_context(pid, table, load_jit_code);
+    module_table_release(table);
+    return context;
+}
+
+uint32_t get_map_build_id(const map_info_t* mi, const uint8_t** out_build_id) {
+    map_info_data_t* data = (map_info_data_t*)mi->data;
+    *out_build_id = NULL;
+    if (!data) {
+        return 0;
+    }
+    if (!data->build_id_loaded) {
+        data->build_id_loaded = true;
+        if (mi->name[0] == '/') {
+            data->build_id_size = read_build_id(mi->name, 0,
+                    data->build_id, sizeof(data->build_id));
+        }
+    }
+    *out_build_id = data->build_id;
+    return data->build_id_size;
+}
+
 static void free_ptrace_map_info_data(map_info_t* mi) {
     map_info_data_t* data = (map_info_data_t*)mi->data;
     if (data) {
@@ -133,15 +321,81 @@ void free_ptrace_context(ptrace_context_t* context) {
         free_ptrace_map_info_data(mi);
     }
     free_map_info_list(context->map_info_list);
+    free(context->jit_code);
+    for (size_t i = 0; i < context->region_count; i++) {
+        if (context->regions[i].mapping) {
+            munmap(context->regions[i].mapping, context->regions[i].mapping_size);
+        }
+    }
+    free(context->regions);
     free(context);
 }
 
+/* Moves the symbols of a table read from a module's file, which are ELF
+ * addresses, to be relative to the start of the executable map, like those
+ * of an embedded table.  The two differ once the code is not in the first
+ * map of the module, as with separate code segments; symbols before the map
+ * are dropped. */
+static void rebase_file_symbols(const memory_t* memory, uintptr_t elf_start,
+        uintptr_t map_start, symbol_table_t* table) {
+    uint32_t headers[MAX_ELF_HEADERS_SIZE / sizeof(uint32_t)];
+    elf_view_t view;
+    elf_segment_t first_load;
+    if (!elf_view_init(&view, headers,
+                    read_elf_headers(memory, elf_start, headers, sizeof(headers)))
+            || !elf_view_find_program_header(&view, PT_LOAD, &first_load)) {
+        return;
+    }
+    uintptr_t load_bias = elf_start - (first_load.vaddr - first_load.offset);
+    if (load_bias == map_start) {
+        return;
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < table->num_symbols; i++) {
+        symbol_t* symbol = &table->symbols[i];
+        if (load_bias + symbol->start < map_start) {
+            free(symbol->name);
+            continue;
+        }
+        symbol->start += load_bias - map_start;
+        symbol->end += load_bias - map_start;
+        table->symbols[count++] = *symbol;
+    }
+    table->num_symbols = count;
+}
+
+/* Loads the symbols of a module the first time they are needed, which for
+ * most modules of a process is never; inflating compressed ones is not
+ * cheap. */
+static void load_symbols(const ptrace_context_t* context, const map_info_t* mi,
+        map_info_data_t* data) {
+    data->symbols_loaded = true;
+    // A table embedded at build time covers every function; the file of a
+    // stripped module only has its exports.
+    memory_t memory;
+    if (context->pid) {
+        init_memory_for_pid(&memory, context->pid, context->map_info_list);
+    } else {
+        init_memory_offline(&memory, context, 0, 0, NULL, 0);
+    }
+    data->symbol_table = load_embedded_symbol_table(&memory, data->load_base, mi->start);
+    if (!data->symbol_table && data->symbols_in_file) {
+        data->symbol_table = load_symbol_table(mi->name);
+        if (data->symbol_table) {
+            rebase_file_symbols(&memory, data->load_base, mi->start, data->symbol_table);
+        }
+    }
+}
+
 void find_symbol_ptrace(const ptrace_context_t* context,
         uintptr_t addr, const map_info_t** out_map_info, const symbol_t** out_symbol) {
     const map_info_t* mi = find_map_info(context->map_info_list, addr);
     const symbol_t* symbol = NULL;
     if (mi) {
-        const map_info_data_t* data = (const map_info_data_t*)mi->data;
+        map_info_data_t* data = (map_info_data_t*)mi->data;
+        if (data && !data->symbols_loaded) {
+            load_symbols(context, mi, data);
+        }
         if (data && data->symbol_table) {
             symbol = find_symbol(data->symbol_table, addr - mi->start);
         }
@@ -30,16 +30,45 @@
 extern "C" {
 #endif
 
+struct jit_code;
+
+/* Contents of a range of a process that is gone, such as a segment of one of
+ * its modules mapped from the module's file. */
+typedef struct {
+    uintptr_t start;
+    uintptr_t end;
+    const uint8_t* data;
+    void* mapping;              /* to be unmapped with the context, or NULL */
+    size_t mapping_size;
+} memory_region_t;
+
 /* Stores information about a process that is used for several different
  * ptrace() based operations. */
 typedef struct {
+    pid_t pid;                  /* 0 for a process that is gone */
     map_info_t* map_info_list;
+    /* Copy of the process's JIT code table, sorted by address. */
+    struct jit_code* jit_code;
+    size_t jit_code_count;
+    /* For a process that is gone, what is left of its memory, sorted by
+     * address.  See load_offline_context(). */
+    memory_region_t* regions;
+    size_t region_count;
 } ptrace_context_t;
 
 /* Describes how to access memory from a process. */
 typedef struct {
     pid_t tid;
     const map_info_t* map_info_list;
+    /* Copy of the stack taken when a thread was sampled.  Local reads of
+     * [stack_start, stack_start + stack_size) are served from stack_data,
+     * other reads only from mappings that cannot have changed since. */
+    uintptr_t stack_start;
+    size_t stack_size;
+    const uint8_t* stack_data;
+    /* Set for a process that is gone.  Reads outside the stack copy are
+     * served from the context's regions. */
+    const ptrace_context_t* offline_context;
 } memory_t;
 
 #if __i386__
@@ -89,6 +118,17 @@ void init_memory(memory_t* memory, const map_info_t* map_info_list);
  */
 void init_memory_ptrace(memory_t* memory, pid_t tid);
 
+/*
+ * Initializes a memory structure for accessing memory from this process
+ * where the stack of the unwound thread has been copied at stack_data.
+ * The copy must stay valid for as long as the memory structure is used.
+ * Outside it only read-only mappings, such as code and unwind tables, are
+ * read: writable memory has moved on from the registers of the snapshot,
+ * and reading it would unwind the current stack as if it were the old one.
+ */
+void init_memory_snapshot(memory_t* memory, const map_info_t* map_info_list,
+        uintptr_t stack_start, const uint8_t* stack_data, size_t stack_size);
+
 /*
  * Reads a word of memory safely.
  * If the memory is local, ensures that the address is readable before dereferencing it.
@@ -96,6 +136,31 @@ void init_memory_ptrace(memory_t* memory, pid_t tid);
  */
 bool try_get_word(const memory_t* memory, uintptr_t ptr, uint32_t* out_value);
 
+/*
+ * Reads a pointer-sized value safely; on 64-bit targets that is two words.
+ * The pointer must be aligned to the size of a pointer.
+ * Returns false and a value of all ones if the value could not be read.
+ */
+bool try_get_pointer(const memory_t* memory, uintptr_t ptr, uintptr_t* out_value);
+
+/*
+ * Reads size bytes, a multiple of the word size, from a word-aligned ptr.
+ * Returns false if any word could not be read.
+ */
+bool try_get_words(const memory_t* memory, uintptr_t ptr, void* buffer, size_t size);
+
+/* Bounds what is read of a module's headers by read_elf_headers(). */
+#define MAX_ELF_HEADERS_SIZE 4096
+
+/*
+ * Copies the ELF header and program headers of the module whose ELF header
+ * is at elf_start, and whatever lies between them, into buffer, which must be
+ * word-aligned.  Returns the number of bytes copied, to make an elf_view_t
+ * of, or 0 if there is no ELF header or the headers do not fit.
+ */
+size_t read_elf_headers(const memory_t* memory, uintptr_t elf_start,
+        void* buffer, size_t buffer_size);
+
 /*
  * Reads a word of memory safely using ptrace().
  * Returns false and a value of 0xffffffff if the word could not be read.
@@ -111,8 +176,24 @@ bool try_get_word_ptrace(pid_t tid, uintptr_t ptr, uint32_t* out_value);
  * assuming ptrace() is attached to them before performing the actual
  * unwinding.  The context can continue to be used to decode backtraces
  * even after ptrace() has been detached from the process.
+ *
+ * The JIT code table is found at its address in this process, so
+ * load_jit_code must only be set when the process is this one or a fork of
+ * it; a tracer of unrelated processes would read an arbitrary word.
+ */
+ptrace_context_t* load_ptrace_context(pid_t pid, bool load_jit_code);
+
+/*
+ * Like load_ptrace_context(), for a process whose modules are those of this
+ * one: a copy of it made by fork() or clone(), such as the process that
+ * cloned a crash dumper, or this process itself.  The load base, unwind
+ * tables and build ID of each module the module table knows are taken from
+ * its current snapshot; only the ELF headers of the rest, such as files
+ * mapped without the dynamic linker, are read.  The maps are still read
+ * from /proc.  The memory of this process is read directly, and its JIT
+ * code table is not copied whatever load_jit_code says.
  */
-ptrace_context_t* load_ptrace_context(pid_t pid);
+ptrace_context_t* load_ptrace_context_from_module_table(pid_t pid, bool load_jit_code);
 
 /*
  * Frees a ptrace context.
@@ -123,6 +204,8 @@ void free_ptrace_context(ptrace_context_t* context);
  * Finds a symbol using ptrace.
  * Returns the containing map and information about the symbol, or
  * NULL if one or the other is not available.
+ * A module's symbols are loaded the first time one of its addresses is
+ * looked up, so only one thread may look symbols up in a context.
  */
 void find_symbol_ptrace(const ptrace_context_t* context,
         uintptr_t addr, const map_info_t** out_map_info, const symbol_t** out_symbol);
@@ -0,0 +1,278 @@
+/*
+ * Stack depot.
+ *
+ * Stacks are kept in chained hash buckets at the start of one large
+ * anonymous mapping; the rest of the mapping is an append-only arena the
+ * stack records are bump-allocated from.  A handle is the record's offset in
+ * the arena in words, so looking one up is an addition.
+ *
+ * Insertion prepends a new record to its bucket with compare-and-swap.  If
+ * another thread got there first, the records it added are checked for the
+ * same stack before retrying; a record that lost such a race is simply left
+ * unreachable in the arena.
+ */
+
+#define LOG_TAG "Corkscrew"
+
+#include "stack_depot.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0x4000
+#endif
+
+/* Hash buckets; must be a power of two. */
+#define DEPOT_BUCKETS 65536
+/* Pages are only committed as the arena fills up. */
+#define DEPOT_SIZE (16 * 1024 * 1024)
+
+typedef struct stack_record {
+    struct stack_record* next;
+    uint32_t hash;
+    uint32_t frames;
+    uintptr_t pcs[];
+} stack_record_t;
+
+typedef struct {
+    stack_record_t* buckets[DEPOT_BUCKETS];
+    size_t used;                /* bytes of the arena handed out */
+    uint8_t arena[];
+} stack_depot_t;
+
+static const size_t ARENA_SIZE = DEPOT_SIZE - sizeof(stack_depot_t);
+
+static stack_depot_t* g_depot;
+
+static stack_depot_t* get_depot() {
+    stack_depot_t* depot = __atomic_load_n(&g_depot, __ATOMIC_ACQUIRE);
+    if (depot) {
+        return depot;
+    }
+    void* mapping = mmap(NULL, DEPOT_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mapping == MAP_FAILED) {
+        return NULL;
+    }
+    stack_depot_t* expected = NULL;
+    if (!__atomic_compare_exchange_n(&g_depot, &expected, (stack_depot_t*) mapping,
+            false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        // Another thread mapped the depot first.
+        munmap(mapping, DEPOT_SIZE);
+        return expected;
+    }
+    return (stack_depot_t*) mapping;
+}
+
+static uint32_t hash_stack(const uintptr_t* pcs, size_t frames) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < frames; i++) {
+        hash = (hash ^ (uint32_t) pcs[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static stack_id_t record_id(const stack_depot_t* depot, const stack_record_t* record) {
+    return ((const uint8_t*) record - depot->arena) / sizeof(uint32_t) + 1;
+}
+
+/* Searches the records from first up to, but not including, last. */
+static const stack_record_t* find_record(const stack_record_t* first,
+        const stack_record_t* last, uint32_t hash, const uintptr_t* pcs, size_t frames) {
+    for (const stack_record_t* record = first; record != last; record = record->next) {
+        if (record->hash == hash && record->frames == frames
+                && !memcmp(record->pcs, pcs, frames * sizeof(uintptr_t))) {
+            return record;
+        }
+    }
+    return NULL;
+}
+
+stack_id_t stack_depot_put(const uintptr_t* pcs, size_t frames) {
+    stack_depot_t* depot = get_depot();
+    if (!depot) {
+        return 0;
+    }
+    uint32_t hash = hash_stack(pcs, frames);
+    stack_record_t** bucket = &depot->buckets[hash & (DEPOT_BUCKETS - 1)];
+
+    stack_record_t* head = __atomic_load_n(bucket, __ATOMIC_ACQUIRE);
+    const stack_record_t* found = find_record(head, NULL, hash, pcs, frames);
+    if (found) {
+        return record_id(depot, found);
+    }
+
+    size_t size = (sizeof(stack_record_t) + frames * sizeof(uintptr_t)
+            + sizeof(uintptr_t) - 1) & ~(sizeof(uintptr_t) - 1);
+    size_t offset = __atomic_fetch_add(&depot->used, size, __ATOMIC_RELAXED);
+    if (offset + size > ARENA_SIZE) {
+        return 0;
+    }
+    stack_record_t* record = (stack_record_t*) (depot->arena + offset);
+    record->hash = hash;
+    record->frames = frames;
+    memcpy(record->pcs, pcs, frames * sizeof(uintptr_t));
+
+    for (;;) {
+        record->next = head;
+        stack_record_t* expected = head;
+        if (__atomic_compare_exchange_n(bucket, &expected, record,
+                false, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+            return record_id(depot, record);
+        }
+        // Only the records prepended since we last looked can be new.
+        found = find_record(expected, head, hash, pcs, frames);
+        if (found) {
+            return record_id(depot, found);
+        }
+        head = expected;
+    }
+}
+
+stack_id_t stack_depot_put_backtrace(const backtrace_frame_t* backtrace, size_t frames) {
+    uintptr_t pcs[frames ? frames : 1];
+    for (size_t i = 0; i < frames; i++) {
+        pcs[i] = backtrace[i].absolute_pc;
+    }
+    return stack_depot_put(pcs, frames);
+}
+
+size_t stack_depot_get(stack_id_t id, const uintptr_t** out_pcs) {
+    stack_depot_t* depot = __atomic_load_n(&g_depot, __ATOMIC_ACQUIRE);
+    if (!depot || !id || (size_t) (id - 1) * sizeof(uint32_t) >= ARENA_SIZE) {
+        return 0;
+    }
+    const stack_record_t* record = (const stack_record_t*)
+            (depot->arena + (size_t) (id - 1) * sizeof(uint32_t));
+    *out_pcs = record->pcs;
+    return record->frames;
+}
+
+/* A PC and the index of its symbol, in an open addressing table. */
+typedef struct {
+    uintptr_t pc;
+    size_t symbol;
+} pc_slot_t;
+
+struct stack_depot_symbols {
+    pc_slot_t* slots;
+    size_t capacity;
+    backtrace_symbol_t* symbols;
+    size_t count;
+};
+
+static uint32_t hash_pc(uintptr_t pc) {
+    uint32_t h = (uint32_t) pc;
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    return h;
+}
+
+static pc_slot_t* find_pc_slot(const pc_slot_t* slots, size_t capacity, uintptr_t pc) {
+    size_t mask = capacity - 1;
+    for (size_t i = hash_pc(pc) & mask;; i = (i + 1) & mask) {
+        if (slots[i].symbol == (size_t) -1 || slots[i].pc == pc) {
+            return (pc_slot_t*) &slots[i];
+        }
+    }
+}
+
+stack_depot_symbols_t* stack_depot_symbolize_all() {
+    stack_depot_symbols_t* result = calloc(1, sizeof(stack_depot_symbols_t));
+    if (!result) {
+        return NULL;
+    }
+    stack_depot_t* depot = __atomic_load_n(&g_depot, __ATOMIC_ACQUIRE);
+    if (!depot) {
+        return result;
+    }
+
+    // Count the frames first to size the table; later stacks are ignored.
+    stack_record_t** heads = malloc(DEPOT_BUCKETS * sizeof(stack_record_t*));
+    if (!heads) {
+        free(result);
+        return NULL;
+    }
+    size_t total_frames = 0;
+    for (size_t i = 0; i < DEPOT_BUCKETS; i++) {
+        heads[i] = __atomic_load_n(&depot->buckets[i], __ATOMIC_ACQUIRE);
+        for (const stack_record_t* record = heads[i]; record; record = record->next) {
+            total_frames += record->frames;
+        }
+    }
+
+    // Collect the distinct PCs, keeping the table at most half full.
+    size_t capacity = 64;
+    while (capacity < total_frames * 2) {
+        capacity *= 2;
+    }
+    pc_slot_t* slots = malloc(capacity * sizeof(pc_slot_t));
+    backtrace_frame_t* unique = malloc((total_frames ? total_frames : 1)
+            * sizeof(backtrace_frame_t));
+    if (!slots || !unique) {
+        free(slots);
+        free(unique);
+        free(heads);
+        free(result);
+        return NULL;
+    }
+    memset(slots, 0xff, capacity * sizeof(pc_slot_t));
+    size_t unique_count = 0;
+    for (size_t i = 0; i < DEPOT_BUCKETS; i++) {
+        for (const stack_record_t* record = heads[i]; record; record = record->next) {
+            for (size_t j = 0; j < record->frames; j++) {
+                pc_slot_t* slot = find_pc_slot(slots, capacity, record->pcs[j]);
+                if (slot->symbol == (size_t) -1) {
+                    slot->pc = record->pcs[j];
+                    slot->symbol = unique_count;
+                    unique[unique_count].absolute_pc = record->pcs[j];
+                    unique[unique_count].stack_top = 0;
+                    unique[unique_count].stack_size = 0;
+                    unique[unique_count].flags = 0;
+                    unique_count++;
+                }
+            }
+        }
+    }
+    free(heads);
+
+    backtrace_symbol_t* symbols = malloc((unique_count ? unique_count : 1)
+            * sizeof(backtrace_symbol_t));
+    if (!symbols) {
+        free(slots);
+        free(unique);
+        free(result);
+        return NULL;
+    }
+    get_backtrace_symbols(unique, unique_count, symbols);
+    free(unique);
+
+    result->slots = slots;
+    result->capacity = capacity;
+    result->symbols = symbols;
+    result->count = unique_count;
+    return result;
+}
+
+const backtrace_symbol_t* stack_depot_find_symbol(const stack_depot_symbols_t* symbols,
+        uintptr_t pc) {
+    if (!symbols->capacity) {
+        return NULL;
+    }
+    const pc_slot_t* slot = find_pc_slot(symbols->slots, symbols->capacity, pc);
+    return slot->symbol != (size_t) -1 ? &symbols->symbols[slot->symbol] : NULL;
+}
+
+void stack_depot_free_symbols(stack_depot_symbols_t* symbols) {
+    if (!symbols) {
+        return;
+    }
+    free_backtrace_symbols(symbols->symbols, symbols->count);
+    free(symbols->symbols);
+    free(symbols->slots);
+    free(symbols);
+}
@@ -0,0 +1,66 @@
+/* Interned storage for backtraces. */
+
+#ifndef _CORKSCREW_STACK_DEPOT_H
+#define _CORKSCREW_STACK_DEPOT_H
+
+#include "backtrace.h"
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Handle of a stack in the depot.  0 is never a valid handle.
+ */
+typedef uint32_t stack_id_t;
+
+/*
+ * Stores a stack of absolute PCs, innermost frame first, unless an identical
+ * stack is already stored, and returns its handle.  Stacks are never removed,
+ * so a handle stays valid for the life of the process.
+ *
+ * Lock-free and async-signal-safe: the depot lives in a single mapping made
+ * on first use.  Returns 0 if the depot is full or could not be mapped.
+ */
+stack_id_t stack_depot_put(const uintptr_t* pcs, size_t frames);
+
+/*
+ * Same as stack_depot_put() for the absolute PCs of a backtrace.
+ */
+stack_id_t stack_depot_put_backtrace(const backtrace_frame_t* backtrace, size_t frames);
+
+/*
+ * Looks up a stack.  Sets *out_pcs to the stored PCs and returns the number
+ * of frames, or returns 0 for an invalid handle.
+ */
+size_t stack_depot_get(stack_id_t id, const uintptr_t** out_pcs);
+
+/*
+ * The symbols of every distinct PC of the stacks in the depot at one time.
+ */
+typedef struct stack_depot_symbols stack_depot_symbols_t;
+
+/*
+ * Symbolizes every distinct PC of every stored stack once.  Stacks added
+ * concurrently may or may not be included.  Returns NULL if memory for the
+ * symbols could not be allocated.
+ */
+stack_depot_symbols_t* stack_depot_symbolize_all();
+
+/*
+ * Returns the symbol of a PC of an included stack, or NULL for any other PC.
+ * The symbol belongs to symbols.
+ */
+const backtrace_symbol_t* stack_depot_find_symbol(const stack_depot_symbols_t* symbols,
+        uintptr_t pc);
+
+void stack_depot_free_symbols(stack_depot_symbols_t* symbols);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _CORKSCREW_STACK_DEPOT_H
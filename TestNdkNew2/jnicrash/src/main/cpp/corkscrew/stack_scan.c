@@ -0,0 +1,174 @@
+/*
+ * Stack scanning.
+ *
+ * When the unwind tables run out, for example in stripped or JIT-compiled
+ * code or because the link register was clobbered, the callers of the last
+ * frame can still be guessed at: their return addresses are somewhere above
+ * it on the stack.  Every stack word is checked against an index of the
+ * executable maps, and the few that point at code are checked against the
+ * instruction before them, which must be a call.
+ *
+ * The index is built once per scan from the map list.  Building it costs one
+ * pass over the list, after which each word costs a binary search rather
+ * than a walk of the list, so scanning a few KB of stack stays cheap.
+ */
+
+#define LOG_TAG "Corkscrew"
+//#define LOG_NDEBUG 0
+
+#include "stack_scan.h"
+#include "backtrace-arch.h"
+#include "backtrace-helper.h"
+
+#include <stdbool.h>
+#include <sys/mman.h>
+
+bool init_exec_range_index(exec_range_index_t* index, const map_info_t* milist) {
+    index->bounds = NULL;
+    index->count = 0;
+    index->mapping_size = 0;
+
+    size_t count = 0;
+    for (const map_info_t* mi = milist; mi; mi = mi->next) {
+        if (mi->is_executable) {
+            count++;
+        }
+    }
+    if (!count) {
+        return true;
+    }
+
+    size_t size = count * 2 * sizeof(uintptr_t);
+    void* mapping = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+    uintptr_t* bounds = (uintptr_t*) mapping;
+
+    // The list is in descending order, so filling from the back usually
+    // leaves nothing for the insertion sort to do.
+    size_t i = count;
+    for (const map_info_t* mi = milist; mi; mi = mi->next) {
+        if (mi->is_executable) {
+            i--;
+            bounds[i * 2] = mi->start;
+            bounds[i * 2 + 1] = mi->end;
+        }
+    }
+    for (i = 1; i < count; i++) {
+        uintptr_t start = bounds[i * 2];
+        uintptr_t end = bounds[i * 2 + 1];
+        size_t j = i;
+        for (; j > 0 && bounds[(j - 1) * 2] > start; j--) {
+            bounds[j * 2] = bounds[(j - 1) * 2];
+            bounds[j * 2 + 1] = bounds[(j - 1) * 2 + 1];
+        }
+        bounds[j * 2] = start;
+        bounds[j * 2 + 1] = end;
+    }
+
+    // Merge adjacent and overlapping ranges.
+    size_t merged = 0;
+    for (i = 0; i < count; i++) {
+        uintptr_t start = bounds[i * 2];
+        uintptr_t end = bounds[i * 2 + 1];
+        if (merged && start <= bounds[(merged - 1) * 2 + 1]) {
+            if (end > bounds[(merged - 1) * 2 + 1]) {
+                bounds[(merged - 1) * 2 + 1] = end;
+            }
+        } else {
+            bounds[merged * 2] = start;
+            bounds[merged * 2 + 1] = end;
+            merged++;
+        }
+    }
+
+    index->bounds = bounds;
+    index->count = merged;
+    index->mapping_size = size;
+    return true;
+}
+
+void free_exec_range_index(exec_range_index_t* index) {
+    if (index->bounds) {
+        munmap(index->bounds, index->mapping_size);
+        index->bounds = NULL;
+    }
+    index->count = 0;
+    index->mapping_size = 0;
+}
+
+bool is_in_exec_range(const exec_range_index_t* index, uintptr_t addr) {
+    // Find the last range starting at or below addr.
+    size_t low = 0;
+    size_t high = index->count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (index->bounds[mid * 2] <= addr) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low && addr < index->bounds[(low - 1) * 2 + 1];
+}
+
+static bool read_stack_slot(const memory_t* memory, bool direct,
+        uintptr_t ptr, uintptr_t* out_value) {
+    if (direct) {
+        *out_value = *(const uintptr_t*) ptr;
+        return true;
+    }
+    return try_get_pointer(memory, ptr, out_value);
+}
+
+void scan_stack_for_frames(const memory_t* memory, const map_info_t* map_info_list,
+        uintptr_t sp, backtrace_frame_t* backtrace, size_t ignore_depth, size_t max_depth,
+        size_t* ignored_frames, size_t* returned_frames) {
+    if (*returned_frames >= max_depth) {
+        return;
+    }
+    const map_info_t* stack_map = find_map_info(map_info_list, sp);
+    if (!stack_map || !stack_map->is_readable) {
+        return;
+    }
+    exec_range_index_t exec_ranges;
+    if (!init_exec_range_index(&exec_ranges, map_info_list)) {
+        return;
+    }
+
+    uintptr_t slot = (sp + sizeof(uintptr_t) - 1) & ~(sizeof(uintptr_t) - 1);
+    uintptr_t end = stack_map->end;
+    if (end - slot > STACK_SCAN_MAX_BYTES) {
+        end = slot + STACK_SCAN_MAX_BYTES;
+    }
+    // Everything between sp and the end of its map is mapped.
+    bool direct = memory->tid < 0 && !memory->stack_size;
+
+    for (; slot + sizeof(uintptr_t) <= end && *returned_frames < max_depth;
+            slot += sizeof(uintptr_t)) {
+        uintptr_t value;
+        if (!read_stack_slot(memory, direct, slot, &value)) {
+            break;
+        }
+        uintptr_t return_address = check_return_address_arch(memory, &exec_ranges, value);
+        if (!return_address) {
+            continue;
+        }
+        // The return address of the last frame unwound is often still on the
+        // stack just above where the unwind stopped.
+        uintptr_t pc = rewind_pc_arch(memory, return_address);
+        if (*returned_frames && backtrace[*returned_frames - 1].absolute_pc == pc) {
+            continue;
+        }
+        backtrace_frame_t* frame = add_backtrace_entry(pc,
+                backtrace, ignore_depth, max_depth, ignored_frames, returned_frames);
+        if (frame) {
+            // The caller's frame starts just above the slot, as far as we know.
+            frame->stack_top = slot + sizeof(uintptr_t);
+            frame->flags |= BACKTRACE_FRAME_SCANNED;
+        }
+    }
+    free_exec_range_index(&exec_ranges);
+}
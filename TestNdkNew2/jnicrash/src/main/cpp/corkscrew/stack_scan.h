@@ -0,0 +1,62 @@
+/* Stack-scanning fallback for frames the unwind tables cannot describe. */
+
+#ifndef _CORKSCREW_STACK_SCAN_H
+#define _CORKSCREW_STACK_SCAN_H
+
+#include "backtrace.h"
+#include "map_info.h"
+#include "ptrace.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Bytes of stack examined by one scan. */
+#define STACK_SCAN_MAX_BYTES 8192
+
+/*
+ * Executable ranges of a map list, merged and sorted by address so an
+ * address can be checked with a binary search instead of a walk of the list.
+ */
+typedef struct {
+    uintptr_t* bounds;          /* start and end of each range, ascending */
+    size_t count;               /* number of ranges */
+    size_t mapping_size;        /* size of the mapping holding bounds */
+} exec_range_index_t;
+
+/*
+ * Builds the index of the executable maps of a map list.  The index is
+ * allocated with mmap() so this may be called from a signal handler.
+ * Returns false if the index could not be allocated.
+ */
+bool init_exec_range_index(exec_range_index_t* index, const map_info_t* milist);
+
+/* Frees an index built by init_exec_range_index(). */
+void free_exec_range_index(exec_range_index_t* index);
+
+/* Returns true if addr is in one of the executable ranges. */
+bool is_in_exec_range(const exec_range_index_t* index, uintptr_t addr);
+
+/*
+ * Scans the stack upwards from sp for words that look like return addresses:
+ * the word must point into an executable map, just past a call instruction.
+ * Each one found is added to the backtrace, rewound to its call site and
+ * flagged BACKTRACE_FRAME_SCANNED, until the backtrace is full, the end of
+ * the stack map is reached or STACK_SCAN_MAX_BYTES have been scanned.
+ *
+ * A stale return address left behind by a call that already returned passes
+ * the same checks as a live one, so scanned frames are only a best guess.
+ */
+void scan_stack_for_frames(const memory_t* memory, const map_info_t* map_info_list,
+        uintptr_t sp, backtrace_frame_t* backtrace, size_t ignore_depth, size_t max_depth,
+        size_t* ignored_frames, size_t* returned_frames);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _CORKSCREW_STACK_SCAN_H
@@ -18,6 +18,7 @@
 //#define LOG_NDEBUG 0
 
 #include "symbol_table.h"
+#include "embedded_symbols.h"
 
 #include <stdbool.h>
 #include <stdlib.h>
@@ -25,17 +26,176 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <zlib.h>
 
 #if defined(__APPLE__)
 #else
 
-#include <elf.h>
+#include "elf_view.h"
 
-static bool is_elf(Elf32_Ehdr* e) {
-    return (e->e_ident[EI_MAG0] == ELFMAG0 &&
-            e->e_ident[EI_MAG1] == ELFMAG1 &&
-            e->e_ident[EI_MAG2] == ELFMAG2 &&
-            e->e_ident[EI_MAG3] == ELFMAG3);
+/* Compressed sections start with one of these, by class; older <elf.h> lack
+ * them. */
+typedef struct {
+    uint32_t ch_type;
+    uint32_t ch_size;
+    uint32_t ch_addralign;
+} elf32_chdr_t;
+
+typedef struct {
+    uint32_t ch_type;
+    uint32_t ch_reserved;
+    uint64_t ch_size;
+    uint64_t ch_addralign;
+} elf64_chdr_t;
+
+#ifndef SHF_COMPRESSED
+#define SHF_COMPRESSED (1 << 11)
+#endif
+#ifndef ELFCOMPRESS_ZLIB
+#define ELFCOMPRESS_ZLIB 1
+#endif
+
+/* The function-range table of a stripped module, gzipped, outside its
+ * loadable segments (see cmake/embed_symbols.cmake). */
+#define SYMBOLS_BLOB_SECTION ".jnicrash.symbols.gz"
+
+/* Inflates a zlib or gzip stream of in_size bytes that expands to exactly
+ * out_size bytes.  Returns a buffer to free, or NULL. */
+static uint8_t* inflate_exactly(const uint8_t* in, size_t in_size, size_t out_size) {
+    if (!out_size || in_size > UINT32_MAX || out_size > UINT32_MAX) {
+        return NULL;
+    }
+    uint8_t* out = malloc(out_size);
+    if (!out) {
+        return NULL;
+    }
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    // 32 makes zlib tell the two headers apart.
+    if (inflateInit2(&stream, 32 + MAX_WBITS) != Z_OK) {
+        free(out);
+        return NULL;
+    }
+    stream.next_in = (Bytef*) in;
+    stream.avail_in = in_size;
+    stream.next_out = out;
+    stream.avail_out = out_size;
+    int result = inflate(&stream, Z_FINISH);
+    inflateEnd(&stream);
+    if (result != Z_STREAM_END || stream.avail_out) {
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+
+/* Finds the contents of a section, inflating them if they are compressed,
+ * either as ELF allows (SHF_COMPRESSED) or as GNU tools did before (".zdebug"
+ * and a "ZLIB" header).  Sets *out_allocated when the contents are a buffer
+ * to free.  Returns NULL if they cannot be read. */
+static const uint8_t* get_section_contents(const elf_view_t* view,
+        const elf_section_t* section, size_t* out_size, bool* out_allocated) {
+    *out_allocated = false;
+    elf_view_t contents;
+    if (!elf_view_section_data(view, section, &contents)) {
+        return NULL;
+    }
+    const uint8_t* data = contents.data;
+    size_t size = contents.size;
+    const char* name = elf_view_section_name(view, section);
+    if (section->flags & SHF_COMPRESSED) {
+        uint32_t type;
+        uint64_t uncompressed_size;
+        size_t header_size;
+        if (view->elf_class == ELFCLASS64) {
+            elf64_chdr_t chdr;
+            header_size = sizeof(chdr);
+            if (size < header_size) {
+                return NULL;
+            }
+            memcpy(&chdr, data, sizeof(chdr));
+            type = chdr.ch_type;
+            uncompressed_size = chdr.ch_size;
+        } else {
+            elf32_chdr_t chdr;
+            header_size = sizeof(chdr);
+            if (size < header_size) {
+                return NULL;
+            }
+            memcpy(&chdr, data, sizeof(chdr));
+            type = chdr.ch_type;
+            uncompressed_size = chdr.ch_size;
+        }
+        if (type != ELFCOMPRESS_ZLIB || uncompressed_size > SIZE_MAX) {
+            return NULL;
+        }
+        data = inflate_exactly(data + header_size, size - header_size, uncompressed_size);
+        size = uncompressed_size;
+        *out_allocated = data != NULL;
+    } else if (name && name[0] == '.' && name[1] == 'z'
+            && size >= 12 && !memcmp(data, "ZLIB", 4)) {
+        uint64_t uncompressed_size = 0;
+        for (int i = 4; i < 12; i++) {
+            uncompressed_size = (uncompressed_size << 8) | data[i];
+        }
+        if (uncompressed_size > SIZE_MAX) {
+            return NULL;
+        }
+        data = inflate_exactly(data + 12, size - 12, uncompressed_size);
+        size = uncompressed_size;
+        *out_allocated = data != NULL;
+    }
+    *out_size = size;
+    return data;
+}
+
+/* Inflates a gzipped function-range table, whose trailer ends with its size. */
+static symbol_table_t* load_symbols_blob(const elf_view_t* view, const elf_section_t* section) {
+    bool allocated;
+    size_t size;
+    const uint8_t* data = get_section_contents(view, section, &size, &allocated);
+    if (!data || size < 4) {
+        return NULL;
+    }
+    uint32_t table_size = data[size - 4] | (data[size - 3] << 8) | (data[size - 2] << 16)
+            | ((uint32_t) data[size - 1] << 24);
+    uint8_t* table_data = inflate_exactly(data, size, table_size);
+    if (allocated) {
+        free((void*) data);
+    }
+    symbol_table_t* table = NULL;
+    if (table_data) {
+        table = load_symbol_table_from_ranges(table_data, table_size, 0);
+        free(table_data);
+    }
+    return table;
+}
+
+/* Counts the symbols of a symbol table worth loading, and copies them to out
+ * unless it is NULL.  Undefined symbols are left out and, from the full
+ * table, those without a name, an address or a size. */
+static size_t copy_symbols(const elf_view_t* symbols, const elf_view_t* strings,
+        bool dynamic, symbol_t* out) {
+    size_t count = 0;
+    size_t num_symbols = elf_view_symbol_count(symbols);
+    for (size_t i = 0; i < num_symbols; i++) {
+        elf_symbol_t sym;
+        const char* name;
+        if (!elf_view_symbol(symbols, i, &sym) || sym.shndx == SHN_UNDEF
+                || !(name = elf_view_string(strings, sym.name))
+                || (!dynamic && (!name[0] || !sym.value || !sym.size))) {
+            continue;
+        }
+        if (out) {
+            out[count].name = strdup(name);
+            out[count].start = sym.value;
+            out[count].end = sym.value + sym.size;
+//            ALOGV("  [%d] '%s' 0x%08x-0x%08x%s", count, out[count].name,
+//                    out[count].start, out[count].end, dynamic ? " (DYNAMIC)" : "");
+        }
+        count++;
+    }
+    return count;
 }
 
 #endif
@@ -79,25 +239,61 @@ symbol_table_t* load_symbol_table(const char *filename) {
         goto out_close;
     }
 
-    // Parse the file header
-    Elf32_Ehdr *hdr = (Elf32_Ehdr*)base;
-    if (!is_elf(hdr)) {
-        goto out_close;
+    bool syms_allocated = false;
+    bool str_allocated = false;
+    const uint8_t *syms_data = NULL;
+    const uint8_t *str_data = NULL;
+
+    // Parse the file header; modules of either class are read.
+    elf_view_t view;
+    if (!elf_view_init(&view, base, length)) {
+        goto out_unmap;
     }
-    Elf32_Shdr *shdr = (Elf32_Shdr*)(base + hdr->e_shoff);
 
-    // Search for the dynamic symbols section
-    int sym_idx = -1;
-    int dynsym_idx = -1;
-    for (Elf32_Half i = 0; i < hdr->e_shnum; i++) {
-        if (shdr[i].sh_type == SHT_SYMTAB) {
-            sym_idx = i;
+    // Search for the symbol sections
+    elf_section_t symtab_section = { 0 };
+    elf_section_t dynsym_section = { 0 };
+    elf_section_t blob_section = { 0 };
+    bool have_syms = elf_view_find_section_by_type(&view, SHT_SYMTAB, &symtab_section);
+    bool have_dynsyms = elf_view_find_section_by_type(&view, SHT_DYNSYM, &dynsym_section);
+    bool have_blob = elf_view_find_section(&view, SYMBOLS_BLOB_SECTION, &blob_section);
+
+    // A stripped module may still carry its full table, compressed.
+    if (!have_syms && have_blob) {
+        table = load_symbols_blob(&view, &blob_section);
+        if (table) {
+            goto out_unmap;
         }
-        if (shdr[i].sh_type == SHT_DYNSYM) {
-            dynsym_idx = i;
+    }
+
+    // The full symbol table and its strings may be compressed; the dynamic
+    // ones are loaded, which they cannot be.
+    elf_view_t syms;
+    elf_view_t str;
+    if (have_syms) {
+        elf_section_t strtab_section;
+        size_t syms_size;
+        size_t str_size;
+        syms_data = get_section_contents(&view, &symtab_section, &syms_size, &syms_allocated);
+        str_data = elf_view_section(&view, symtab_section.link, &strtab_section)
+                ? get_section_contents(&view, &strtab_section, &str_size, &str_allocated)
+                : NULL;
+        if (syms_data && str_data) {
+            elf_view_init_contents(&syms, syms_data, syms_size, view.elf_class);
+            elf_view_init_contents(&str, str_data, str_size, view.elf_class);
+        } else {
+            have_syms = false;
         }
     }
-    if (dynsym_idx == -1 && sym_idx == -1) {
+    elf_view_t dynsyms;
+    elf_view_t dynstr;
+    if (have_dynsyms) {
+        elf_section_t dynstr_section;
+        have_dynsyms = elf_view_section_data(&view, &dynsym_section, &dynsyms)
+                && elf_view_section(&view, dynsym_section.link, &dynstr_section)
+                && elf_view_section_data(&view, &dynstr_section, &dynstr);
+    }
+    if (!have_dynsyms && !have_syms) {
         goto out_unmap;
     }
 
@@ -105,100 +301,36 @@ symbol_table_t* load_symbol_table(const char *filename) {
     if(!table) {
         goto out_unmap;
     }
-    table->num_symbols = 0;
-
-    Elf32_Sym *dynsyms = NULL;
-    int dynnumsyms = 0;
-    char *dynstr = NULL;
-    if (dynsym_idx != -1) {
-        dynsyms = (Elf32_Sym*)(base + shdr[dynsym_idx].sh_offset);
-        dynnumsyms = shdr[dynsym_idx].sh_size / shdr[dynsym_idx].sh_entsize;
-        int dynstr_idx = shdr[dynsym_idx].sh_link;
-        dynstr = base + shdr[dynstr_idx].sh_offset;
-    }
-
-    Elf32_Sym *syms = NULL;
-    int numsyms = 0;
-    char *str = NULL;
-    if (sym_idx != -1) {
-        syms = (Elf32_Sym*)(base + shdr[sym_idx].sh_offset);
-        numsyms = shdr[sym_idx].sh_size / shdr[sym_idx].sh_entsize;
-        int str_idx = shdr[sym_idx].sh_link;
-        str = base + shdr[str_idx].sh_offset;
-    }
-
-    int dynsymbol_count = 0;
-    if (dynsym_idx != -1) {
-        // Iterate through the dynamic symbol table, and count how many symbols
-        // are actually defined
-        for (int i = 0; i < dynnumsyms; i++) {
-            if (dynsyms[i].st_shndx != SHN_UNDEF) {
-                dynsymbol_count++;
-            }
-        }
-    }
 
-    size_t symbol_count = 0;
-    if (sym_idx != -1) {
-        // Iterate through the symbol table, and count how many symbols
-        // are actually defined
-        for (int i = 0; i < numsyms; i++) {
-            if (syms[i].st_shndx != SHN_UNDEF
-                    && str[syms[i].st_name]
-                    && syms[i].st_value
-                    && syms[i].st_size) {
-                symbol_count++;
-            }
-        }
-    }
+    // Count how many symbols are actually defined...
+    size_t dynsymbol_count = have_dynsyms ? copy_symbols(&dynsyms, &dynstr, true, NULL) : 0;
+    size_t symbol_count = have_syms ? copy_symbols(&syms, &str, false, NULL) : 0;
 
-    // Now, create an entry in our symbol table structure for each symbol...
-    table->num_symbols += symbol_count + dynsymbol_count;
+    // ...and create an entry in our symbol table structure for each symbol.
+    table->num_symbols = symbol_count + dynsymbol_count;
     table->symbols = malloc(table->num_symbols * sizeof(symbol_t));
     if (!table->symbols) {
         free(table);
         table = NULL;
         goto out_unmap;
     }
-
-    size_t symbol_index = 0;
-    if (dynsym_idx != -1) {
-        // ...and populate them
-        for (int i = 0; i < dynnumsyms; i++) {
-            if (dynsyms[i].st_shndx != SHN_UNDEF) {
-                table->symbols[symbol_index].name = strdup(dynstr + dynsyms[i].st_name);
-                table->symbols[symbol_index].start = dynsyms[i].st_value;
-                table->symbols[symbol_index].end = dynsyms[i].st_value + dynsyms[i].st_size;
-//                ALOGV("  [%d] '%s' 0x%08x-0x%08x (DYNAMIC)",
-//                        symbol_index, table->symbols[symbol_index].name,
-//                        table->symbols[symbol_index].start, table->symbols[symbol_index].end);
-                symbol_index += 1;
-            }
-        }
+    if (have_dynsyms) {
+        copy_symbols(&dynsyms, &dynstr, true, table->symbols);
     }
-
-    if (sym_idx != -1) {
-        // ...and populate them
-        for (int i = 0; i < numsyms; i++) {
-            if (syms[i].st_shndx != SHN_UNDEF
-                    && str[syms[i].st_name]
-                    && syms[i].st_value
-                    && syms[i].st_size) {
-                table->symbols[symbol_index].name = strdup(str + syms[i].st_name);
-                table->symbols[symbol_index].start = syms[i].st_value;
-                table->symbols[symbol_index].end = syms[i].st_value + syms[i].st_size;
-//                ALOGV("  [%d] '%s' 0x%08x-0x%08x",
-//                        symbol_index, table->symbols[symbol_index].name,
-//                        table->symbols[symbol_index].start, table->symbols[symbol_index].end);
-                symbol_index += 1;
-            }
-        }
+    if (have_syms) {
+        copy_symbols(&syms, &str, false, table->symbols + dynsymbol_count);
     }
 
     // Sort the symbol table entries, so they can be bsearched later
     qsort(table->symbols, table->num_symbols, sizeof(symbol_t), qcompar);
 
 out_unmap:
+    if (syms_allocated) {
+        free((void*)syms_data);
+    }
+    if (str_allocated) {
+        free((void*)str_data);
+    }
     munmap(base, length);
 
 out_close:
@@ -209,6 +341,46 @@ out:
     return table;
 }
 
+symbol_table_t* load_symbol_table_from_ranges(const void* data, size_t size, uintptr_t bias) {
+    const embedded_symbols_header_t* header = (const embedded_symbols_header_t*)data;
+    if (size < sizeof(*header) || header->magic != EMBEDDED_SYMBOLS_MAGIC || !header->count
+            || header->count > (size - sizeof(*header)) / sizeof(embedded_symbol_t)
+            || header->names_offset < sizeof(*header)
+                    + header->count * sizeof(embedded_symbol_t)
+            || header->names_offset > size || header->names_size > size - header->names_offset) {
+        return NULL;
+    }
+    const embedded_symbol_t* ranges = (const embedded_symbol_t*)(header + 1);
+    const char* names = (const char*)data + header->names_offset;
+
+    symbol_table_t* table = calloc(1, sizeof(symbol_table_t));
+    if (!table) {
+        return NULL;
+    }
+    table->symbols = calloc(header->count, sizeof(symbol_t));
+    if (!table->symbols) {
+        free(table);
+        return NULL;
+    }
+    for (uint32_t i = 0; i < header->count; i++) {
+        const embedded_symbol_t* range = &ranges[i];
+        if (range->name >= header->names_size
+                || !memchr(names + range->name, '\0', header->names_size - range->name)) {
+            continue;
+        }
+        symbol_t* symbol = &table->symbols[table->num_symbols];
+        symbol->start = bias + range->start;
+        symbol->end = symbol->start + range->size;
+        symbol->name = strdup(names + range->name);
+        if (!symbol->name) {
+            free_symbol_table(table);
+            return NULL;
+        }
+        table->num_symbols++;
+    }
+    return table;
+}
+
 void free_symbol_table(symbol_table_t* table) {
     if (table) {
         for (size_t i = 0; i < table->num_symbols; i++) {
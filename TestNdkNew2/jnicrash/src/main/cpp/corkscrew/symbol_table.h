@@ -36,11 +36,20 @@ typedef struct {
 } symbol_table_t;
 
 /*
- * Loads a symbol table from a given file.
+ * Loads a symbol table from a given file.  The full symbol table and its
+ * strings may be zlib-compressed; a stripped file may carry a gzipped
+ * function-range table instead.
  * Returns NULL on error.
  */
 symbol_table_t* load_symbol_table(const char* filename);
 
+/*
+ * Builds a symbol table from a function-range table (see embedded_symbols.h)
+ * of size bytes at data, adding bias to its addresses.
+ * Returns NULL if the table is not valid.
+ */
+symbol_table_t* load_symbol_table_from_ranges(const void* data, size_t size, uintptr_t bias);
+
 /*
  * Frees a symbol table.
  */
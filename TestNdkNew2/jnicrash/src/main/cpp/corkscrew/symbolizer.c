@@ -0,0 +1,388 @@
+/*
+ * In-process symbolizer.
+ *
+ * dladdr() takes the dynamic linker's lock, only sees exports and leaves its
+ * caller to copy the names it returns.  Here a module found in the module
+ * table has its symbols loaded once into a compact table of ranges, laid
+ * out like an embedded table, with one block for the names.  Tables are
+ * keyed by file and build ID rather than address, so a library unloaded and
+ * loaded again reuses its table, and are never freed, which is what lets a
+ * lookup return views of the names.
+ *
+ * Lookups are cached by address in slots spread over shards on cache lines
+ * of their own.  Each slot has a sequence number that is odd while the slot
+ * is written: a reader copies the slot and checks that the number did not
+ * change meanwhile, so a hit takes no lock and writes nothing, and a writer
+ * that finds a slot being written just leaves it.  A cached lookup is only
+ * valid for the generation of the module table it was made in.
+ */
+
+#define LOG_TAG "Corkscrew"
+//#define LOG_NDEBUG 0
+
+#include "symbolizer.h"
+#include "embedded_symbols.h"
+#include "module_table.h"
+#include "symbol_table.h"
+
+#include <link.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef DT_GNU_HASH
+#define DT_GNU_HASH 0x6ffffef5
+#endif
+
+/* Symbol tables kept; each distinct file and build ID takes one. */
+#define MAX_SYMBOL_MODULES 1024
+
+/* Both must be powers of two. */
+#define CACHE_SHARDS 16
+#define CACHE_SLOTS_PER_SHARD 1024
+
+/* The symbols of a module, with addresses relative to its load bias. */
+typedef struct {
+    uintptr_t file_offset;
+    uint32_t build_id_size;
+    uint8_t build_id[OFFLINE_BUILD_ID_SIZE];
+    uint32_t count;
+    const embedded_symbol_t* symbols;   /* sorted by start, no two alike */
+    const char* names;
+    char name[];
+} symbol_module_t;
+
+typedef struct {
+    uint32_t sequence;          /* odd while the slot is written, 0 if never */
+    uint32_t generation;        /* of the module table */
+    uintptr_t pc;
+    uintptr_t load_bias;
+    uintptr_t symbol_addr;
+    const char* module_name;
+    const char* symbol_name;
+} cache_slot_t;
+
+typedef struct {
+    cache_slot_t slots[CACHE_SLOTS_PER_SHARD];
+} __attribute__((aligned(64))) cache_shard_t;
+
+static pthread_mutex_t g_load_mutex = PTHREAD_MUTEX_INITIALIZER;
+static symbol_module_t* g_modules[MAX_SYMBOL_MODULES];
+static size_t g_module_count;
+
+static cache_shard_t g_cache[CACHE_SHARDS];
+
+static cache_slot_t* get_slot(uintptr_t pc) {
+    uint64_t hash = (uint64_t) pc * 0x9e3779b97f4a7c15ull;
+    cache_shard_t* shard = &g_cache[(hash >> 48) & (CACHE_SHARDS - 1)];
+    return &shard->slots[(hash >> 32) & (CACHE_SLOTS_PER_SHARD - 1)];
+}
+
+static bool read_slot(const cache_slot_t* slot, uintptr_t pc, uint32_t generation,
+        pc_symbol_t* out) {
+    uint32_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+    if (!sequence || (sequence & 1)
+            || __atomic_load_n(&slot->pc, __ATOMIC_RELAXED) != pc
+            || __atomic_load_n(&slot->generation, __ATOMIC_RELAXED) != generation) {
+        return false;
+    }
+    out->module_name = __atomic_load_n(&slot->module_name, __ATOMIC_RELAXED);
+    out->load_bias = __atomic_load_n(&slot->load_bias, __ATOMIC_RELAXED);
+    out->symbol_name = __atomic_load_n(&slot->symbol_name, __ATOMIC_RELAXED);
+    out->symbol_addr = __atomic_load_n(&slot->symbol_addr, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) == sequence;
+}
+
+static void write_slot(cache_slot_t* slot, uintptr_t pc, uint32_t generation,
+        const pc_symbol_t* symbol) {
+    uint32_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED);
+    if ((sequence & 1) || !__atomic_compare_exchange_n(&slot->sequence, &sequence,
+            sequence + 1, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        return; // another thread is writing it
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&slot->pc, pc, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->generation, generation, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->module_name, symbol->module_name, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->load_bias, symbol->load_bias, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->symbol_name, symbol->symbol_name, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->symbol_addr, symbol->symbol_addr, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+static bool is_symbol_module(const symbol_module_t* module, const offline_module_t* key) {
+    return module->file_offset == key->file_offset
+            && module->build_id_size == key->build_id_size
+            && !memcmp(module->build_id, key->build_id, key->build_id_size)
+            && !strcmp(module->name, key->name);
+}
+
+static const symbol_module_t* find_symbol_module(const offline_module_t* key) {
+    size_t count = __atomic_load_n(&g_module_count, __ATOMIC_ACQUIRE);
+    for (size_t i = 0; i < count; i++) {
+        if (is_symbol_module(g_modules[i], key)) {
+            return g_modules[i];
+        }
+    }
+    return NULL;
+}
+
+/* The address a dynamic entry points to.  glibc relocates the entries in
+ * place and bionic does not, but a library's virtual addresses are far below
+ * where it is loaded either way. */
+static uintptr_t get_dynamic_address(const module_entry_t* entry, uintptr_t value) {
+    return value < entry->module.load_bias ? entry->module.load_bias + value : value;
+}
+
+/* Counts the dynamic symbols, which only the hash tables record. */
+static size_t count_dynamic_symbols(const uint32_t* hash, const uint32_t* gnu_hash) {
+    if (hash) {
+        return hash[1]; // nchain
+    }
+    if (!gnu_hash) {
+        return 0;
+    }
+    // The chains end at the highest symbol any bucket leads to.
+    uint32_t bucket_count = gnu_hash[0];
+    uint32_t symbol_offset = gnu_hash[1];
+    uint32_t bloom_size = gnu_hash[2];
+    const uint32_t* buckets = gnu_hash + 4 + bloom_size * (sizeof(ElfW(Addr)) / 4);
+    const uint32_t* chains = buckets + bucket_count;
+    uint32_t last = 0;
+    for (uint32_t i = 0; i < bucket_count; i++) {
+        if (buckets[i] > last) {
+            last = buckets[i];
+        }
+    }
+    if (last < symbol_offset) {
+        return symbol_offset;
+    }
+    while (!(chains[last - symbol_offset] & 1)) {
+        last++;
+    }
+    return last + 1;
+}
+
+/* Loads the exports of a module from its dynamic section, as dladdr() sees
+ * them, for modules whose file cannot be read on its own. */
+static symbol_table_t* load_dynamic_symbols(const module_entry_t* entry) {
+    const ElfW(Sym)* symbols = NULL;
+    const char* strings = NULL;
+    size_t strings_size = 0;
+    const uint32_t* hash = NULL;
+    const uint32_t* gnu_hash = NULL;
+    for (const ElfW(Dyn)* dyn = (const ElfW(Dyn)*) entry->dynamic; dyn->d_tag != DT_NULL;
+            dyn++) {
+        switch (dyn->d_tag) {
+        case DT_SYMTAB:
+            symbols = (const ElfW(Sym)*) get_dynamic_address(entry, dyn->d_un.d_ptr);
+            break;
+        case DT_STRTAB:
+            strings = (const char*) get_dynamic_address(entry, dyn->d_un.d_ptr);
+            break;
+        case DT_STRSZ:
+            strings_size = dyn->d_un.d_val;
+            break;
+        case DT_HASH:
+            hash = (const uint32_t*) get_dynamic_address(entry, dyn->d_un.d_ptr);
+            break;
+        case DT_GNU_HASH:
+            gnu_hash = (const uint32_t*) get_dynamic_address(entry, dyn->d_un.d_ptr);
+            break;
+        }
+    }
+    size_t count = symbols && strings ? count_dynamic_symbols(hash, gnu_hash) : 0;
+    if (!count) {
+        return NULL;
+    }
+
+    symbol_table_t* table = (symbol_table_t*) calloc(1, sizeof(symbol_table_t));
+    if (!table) {
+        return NULL;
+    }
+    table->symbols = (symbol_t*) calloc(count, sizeof(symbol_t));
+    if (!table->symbols) {
+        free(table);
+        return NULL;
+    }
+    for (size_t i = 0; i < count; i++) {
+        const ElfW(Sym)* sym = &symbols[i];
+        if (sym->st_shndx == SHN_UNDEF || !sym->st_size || sym->st_name >= strings_size) {
+            continue;
+        }
+        symbol_t* symbol = &table->symbols[table->num_symbols];
+        symbol->name = strndup(strings + sym->st_name, strings_size - sym->st_name);
+        if (!symbol->name) {
+            free_symbol_table(table);
+            return NULL;
+        }
+        symbol->start = sym->st_value;
+        symbol->end = sym->st_value + sym->st_size;
+        table->num_symbols++;
+    }
+    return table;
+}
+
+static int compare_symbols(const void* a, const void* b) {
+    uintptr_t a_start = ((const symbol_t*) a)->start;
+    uintptr_t b_start = ((const symbol_t*) b)->start;
+    return a_start < b_start ? -1 : a_start > b_start;
+}
+
+/* Whether a symbol goes into the compact table: it must have a size and fit
+ * its 32-bit fields, and only the first of those starting at an address is
+ * kept. */
+static bool is_compact_symbol(const symbol_t* symbols, size_t index) {
+    const symbol_t* symbol = &symbols[index];
+    return symbol->end > symbol->start && symbol->end - 1 <= UINT32_MAX
+            && (!index || symbols[index - 1].start != symbol->start);
+}
+
+/* Copies table, which may be NULL, into a new compact one. */
+static symbol_module_t* new_symbol_module(const offline_module_t* key, symbol_table_t* table) {
+    size_t count = 0;
+    size_t names_size = 0;
+    if (table) {
+        for (size_t i = 0; i < table->num_symbols; i++) {
+#if defined(__arm__)
+            table->symbols[i].start &= ~(uintptr_t) 1; // the Thumb bit
+            table->symbols[i].end &= ~(uintptr_t) 1;
+#endif
+        }
+        qsort(table->symbols, table->num_symbols, sizeof(symbol_t), compare_symbols);
+        for (size_t i = 0; i < table->num_symbols; i++) {
+            if (is_compact_symbol(table->symbols, i)) {
+                count++;
+                names_size += strlen(table->symbols[i].name) + 1;
+            }
+        }
+    }
+
+    size_t name_size = strlen(key->name) + 1;
+    size_t symbols_offset = (sizeof(symbol_module_t) + name_size + 3) & ~(size_t) 3;
+    size_t names_offset = symbols_offset + count * sizeof(embedded_symbol_t);
+    symbol_module_t* module = (symbol_module_t*) malloc(names_offset + names_size);
+    if (!module) {
+        return NULL;
+    }
+    module->file_offset = key->file_offset;
+    module->build_id_size = key->build_id_size;
+    memcpy(module->build_id, key->build_id, sizeof(module->build_id));
+    memcpy(module->name, key->name, name_size);
+    embedded_symbol_t* symbols = (embedded_symbol_t*) ((char*) module + symbols_offset);
+    char* names = (char*) module + names_offset;
+    module->count = count;
+    module->symbols = symbols;
+    module->names = names;
+
+    size_t name = 0;
+    for (size_t i = 0, j = 0; j < count; i++) {
+        const symbol_t* symbol = &table->symbols[i];
+        if (is_compact_symbol(table->symbols, i)) {
+            size_t length = strlen(symbol->name) + 1;
+            symbols[j].start = symbol->start;
+            symbols[j].size = symbol->end - symbol->start;
+            symbols[j].name = name;
+            memcpy(names + name, symbol->name, length);
+            name += length;
+            j++;
+        }
+    }
+    return module;
+}
+
+/* Loads the symbols of a module; called with g_load_mutex held.  A table
+ * embedded at build time covers every function, the file's symbol table
+ * may, and the exports in memory are what a module in an APK is left with. */
+static const symbol_module_t* load_symbol_module(const module_entry_t* entry) {
+    if (g_module_count == MAX_SYMBOL_MODULES) {
+        return NULL;
+    }
+    const offline_module_t* key = &entry->module;
+    symbol_table_t* table = NULL;
+    if (entry->embedded_symbols) {
+        table = load_symbol_table_from_ranges((const void*) entry->embedded_symbols,
+                entry->embedded_symbols_size, 0);
+    }
+    if (!table && key->name[0] == '/' && !key->file_offset) {
+        table = load_symbol_table(key->name);
+    }
+    if (!table && entry->dynamic) {
+        table = load_dynamic_symbols(entry);
+    }
+    symbol_module_t* module = new_symbol_module(key, table);
+    free_symbol_table(table);
+    if (module) {
+        g_modules[g_module_count] = module;
+        __atomic_store_n(&g_module_count, g_module_count + 1, __ATOMIC_RELEASE);
+    }
+    return module;
+}
+
+/* Finds the symbol holding vaddr, an address relative to the load bias. */
+static const embedded_symbol_t* find_module_symbol(const symbol_module_t* module,
+        uintptr_t vaddr) {
+    // The last symbol starting at or below vaddr is the only candidate.
+    size_t low = 0;
+    size_t high = module->count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (module->symbols[mid].start <= vaddr) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (!low || vaddr - module->symbols[low - 1].start >= module->symbols[low - 1].size) {
+        return NULL;
+    }
+    return &module->symbols[low - 1];
+}
+
+bool symbolize_pc(uintptr_t pc, pc_symbol_t* out) {
+    cache_slot_t* slot = get_slot(pc);
+    if (read_slot(slot, pc, module_table_generation(), out)) {
+        return true;
+    }
+
+    const module_table_t* table = module_table_acquire();
+    if (!table) {
+        module_table_release(table);
+        module_table_update();
+        table = module_table_acquire();
+    }
+    // The entry is copied so the table is not held while symbols load.
+    const module_entry_t* found = module_table_find(table, pc);
+    module_entry_t entry;
+    uint32_t generation = 0;
+    if (found) {
+        entry = *found;
+        generation = table->generation;
+    }
+    module_table_release(table);
+    if (!found) {
+        return false;
+    }
+
+    const symbol_module_t* module = find_symbol_module(&entry.module);
+    if (!module) {
+        pthread_mutex_lock(&g_load_mutex);
+        module = find_symbol_module(&entry.module);
+        if (!module) {
+            module = load_symbol_module(&entry);
+        }
+        pthread_mutex_unlock(&g_load_mutex);
+        if (!module) {
+            return false;
+        }
+    }
+
+    const embedded_symbol_t* symbol = find_module_symbol(module, pc - entry.module.load_bias);
+    out->module_name = module->name;
+    out->load_bias = entry.module.load_bias;
+    out->symbol_name = symbol ? module->names + symbol->name : NULL;
+    out->symbol_addr = symbol ? entry.module.load_bias + symbol->start : 0;
+    write_slot(slot, pc, generation, out);
+    return true;
+}
@@ -0,0 +1,44 @@
+/* Symbolizes addresses of this process without the dynamic linker. */
+
+#ifndef _CORKSCREW_SYMBOLIZER_H
+#define _CORKSCREW_SYMBOLIZER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The module and function holding an address.  The names are views into
+ * storage the symbolizer never frees or changes: they stay valid for the
+ * life of the process, also after the module is unloaded, and must not be
+ * freed.
+ */
+typedef struct {
+    const char* module_name;    /* file the module was loaded from */
+    uintptr_t load_bias;        /* address of the module's ELF virtual address 0 */
+    const char* symbol_name;    /* mangled, or NULL if no symbol holds the address */
+    uintptr_t symbol_addr;      /* absolute, or 0 if no symbol holds the address */
+} pc_symbol_t;
+
+/*
+ * Finds the module and function holding pc.  Returns false if no module
+ * holds it, e.g. for JIT code.
+ *
+ * Modules are found in the module table and their symbols loaded the first
+ * time one of their addresses is looked up: from the table embedded at
+ * build time, else from the file, else the exports from memory.  Results
+ * are cached by address, so looking an address up again is lock-free,
+ * allocates nothing and does not write shared memory.  A miss may take the
+ * symbolizer's own lock and allocate, so it must not be called from a signal
+ * handler.
+ */
+bool symbolize_pc(uintptr_t pc, pc_symbol_t* out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _CORKSCREW_SYMBOLIZER_H
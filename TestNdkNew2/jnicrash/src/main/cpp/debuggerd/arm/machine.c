@@ -190,3 +190,15 @@ void dump_registers(const ptrace_context_t* context __attribute((unused)),
     _LOG(log, scopeFlags, "    scr %08lx\n", vfp_regs.fpscr);
 #endif
 }
+
+void dump_snapshot_registers(log_t *log, const uintptr_t *regs)
+{
+    _LOG(log, SCOPE_AT_FAULT, "    r0 %08x  r1 %08x  r2 %08x  r3 %08x\n",
+            regs[0], regs[1], regs[2], regs[3]);
+    _LOG(log, SCOPE_AT_FAULT, "    r4 %08x  r5 %08x  r6 %08x  r7 %08x\n",
+            regs[4], regs[5], regs[6], regs[7]);
+    _LOG(log, SCOPE_AT_FAULT, "    r8 %08x  r9 %08x  sl %08x  fp %08x\n",
+            regs[8], regs[9], regs[10], regs[11]);
+    _LOG(log, SCOPE_AT_FAULT, "    ip %08x  sp %08x  lr %08x  pc %08x\n",
+            regs[12], regs[13], regs[14], regs[15]);
+}
@@ -0,0 +1,153 @@
+/* Register and memory dumps for AArch64 tombstones. */
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <elf.h>
+#include <sys/types.h>
+#include <sys/ptrace.h>
+#include <sys/uio.h>
+
+#include "../../corkscrew/ptrace.h"
+
+#include "../utility.h"
+#include "../machine.h"
+
+#ifndef PTRACE_GETREGSET
+#define PTRACE_GETREGSET 0x4204
+#endif
+
+#ifndef NT_PRSTATUS
+#define NT_PRSTATUS 1
+#endif
+
+/* enable to dump memory pointed to by every register */
+#define DUMP_MEMORY_FOR_ALL_REGISTERS 1
+
+extern struct user_pt_regs crash_regs;
+
+static bool get_regs(pid_t tid, bool at_fault, struct user_pt_regs* regs) {
+    if (at_fault) {
+        *regs = crash_regs;
+        return true;
+    }
+    struct iovec iov;
+    iov.iov_base = regs;
+    iov.iov_len = sizeof(*regs);
+    return ptrace(PTRACE_GETREGSET, tid, (void*) NT_PRSTATUS, &iov) == 0;
+}
+
+static void dump_memory(log_t* log, pid_t tid, uintptr_t addr, int scopeFlags) {
+    uintptr_t p, end;
+
+    p = addr & ~7;
+    p -= 32;
+    if (p > addr) {
+        /* catch underflow */
+        p = 0;
+    }
+    end = p + 256;
+    /* catch overflow; 'end - p' has to be multiples of 16 */
+    while (end < p)
+        end -= 16;
+
+    /* Dump the memory as:
+     *  addr             contents
+     *  0000007f8a3c4d30 f9400bf3a9be7bfd 910003fdaa0003f3
+     */
+    while (p < end) {
+        char code_buffer[64];
+
+        sprintf(code_buffer, "%016lx ", (unsigned long) p);
+        for (int i = 0; i < 2; i++) {
+            /* A failed read gives -1, which is as good as anything here. */
+            long data = ptrace(PTRACE_PEEKTEXT, tid, (void*)p, NULL);
+            sprintf(code_buffer + strlen(code_buffer), "%016lx ", data);
+            p += 8;
+        }
+        _LOG(log, scopeFlags, "    %s\n", code_buffer);
+    }
+}
+
+/*
+ * If configured to do so, dump memory around *all* registers
+ * for the crashing thread.
+ */
+void dump_memory_and_code(const ptrace_context_t* context __attribute((unused)),
+        log_t* log, pid_t tid, bool at_fault) {
+    struct user_pt_regs regs;
+    if (!get_regs(tid, at_fault, &regs)) {
+        return;
+    }
+
+    int scopeFlags = at_fault ? SCOPE_AT_FAULT : 0;
+
+    if (at_fault && DUMP_MEMORY_FOR_ALL_REGISTERS) {
+        for (int reg = 0; reg < 32; reg++) {
+            uintptr_t addr = reg == 31 ? regs.sp : regs.regs[reg];
+
+            /*
+             * Don't bother if it looks like a small int or ~= null, or if
+             * it's in the kernel area.
+             */
+            if (addr < 4096 || addr >= (1UL << 48)) {
+                continue;
+            }
+
+            if (reg == 31) {
+                _LOG(log, scopeFlags | SCOPE_SENSITIVE, "\nmemory near sp:\n");
+            } else {
+                _LOG(log, scopeFlags | SCOPE_SENSITIVE, "\nmemory near x%d:\n", reg);
+            }
+            dump_memory(log, tid, addr, scopeFlags | SCOPE_SENSITIVE);
+        }
+    }
+
+    /* explicitly allow upload of code dump logging */
+    _LOG(log, scopeFlags, "\ncode around pc:\n");
+    dump_memory(log, tid, (uintptr_t)regs.pc, scopeFlags);
+
+    if (regs.pc != regs.regs[30]) {
+        _LOG(log, scopeFlags, "\ncode around lr:\n");
+        dump_memory(log, tid, (uintptr_t)regs.regs[30], scopeFlags);
+    }
+}
+
+void dump_registers(const ptrace_context_t* context __attribute((unused)),
+        log_t* log, pid_t tid, bool at_fault)
+{
+    struct user_pt_regs r;
+    int scopeFlags = at_fault ? SCOPE_AT_FAULT : 0;
+
+    if (!get_regs(tid, at_fault, &r)) {
+        _LOG(log, scopeFlags, "cannot get registers: %s\n", strerror(errno));
+        return;
+    }
+    for (int i = 0; i < 28; i += 4) {
+        _LOG(log, scopeFlags, "    x%-2d  %016llx  x%-2d  %016llx  x%-2d  %016llx  x%-2d  %016llx\n",
+                i, (unsigned long long) r.regs[i], i + 1, (unsigned long long) r.regs[i + 1],
+                i + 2, (unsigned long long) r.regs[i + 2], i + 3, (unsigned long long) r.regs[i + 3]);
+    }
+    _LOG(log, scopeFlags, "    x28  %016llx  x29  %016llx  x30  %016llx\n",
+            (unsigned long long) r.regs[28], (unsigned long long) r.regs[29],
+            (unsigned long long) r.regs[30]);
+    _LOG(log, scopeFlags, "    sp   %016llx  pc   %016llx  pstate %016llx\n",
+            (unsigned long long) r.sp, (unsigned long long) r.pc,
+            (unsigned long long) r.pstate);
+}
+
+void dump_snapshot_registers(log_t* log, const uintptr_t* regs)
+{
+    for (int i = 0; i < 28; i += 4) {
+        _LOG(log, SCOPE_AT_FAULT, "    x%-2d  %016lx  x%-2d  %016lx  x%-2d  %016lx  x%-2d  %016lx\n",
+                i, (unsigned long) regs[i], i + 1, (unsigned long) regs[i + 1],
+                i + 2, (unsigned long) regs[i + 2], i + 3, (unsigned long) regs[i + 3]);
+    }
+    _LOG(log, SCOPE_AT_FAULT, "    x28  %016lx  x29  %016lx  x30  %016lx\n",
+            (unsigned long) regs[28], (unsigned long) regs[29], (unsigned long) regs[30]);
+    _LOG(log, SCOPE_AT_FAULT, "    sp   %016lx  pc   %016lx\n",
+            (unsigned long) regs[31], (unsigned long) regs[32]);
+}
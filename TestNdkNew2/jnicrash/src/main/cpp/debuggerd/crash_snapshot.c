@@ -0,0 +1,427 @@
+/*
+ * Crash snapshots.
+ *
+ * Unwinding, loading symbols, demangling and formatting a tombstone while
+ * the process is dying is slow, and every step of it can fail in new ways
+ * in a process that is already broken.  A snapshot records only what the
+ * report cannot be rebuilt without: the registers and a copy of the stack of
+ * the crashing thread, the abort message, and the executable maps with the
+ * load bias and build ID of each module.  It is written into a file that was
+ * created, allocated and mapped at start-up, so capturing it takes a few
+ * copies and one pass over /proc/self/maps, with no allocation.  What the
+ * module table already knows of a module is copied from it rather than read
+ * again from the module's headers.
+ *
+ * The next run maps the file and rebuilds the tombstone from it with the
+ * offline unwinder; see engrave_tombstone_snapshot().
+ */
+
+#include "crash_snapshot.h"
+#include "../corkscrew/module_table.h"
+
+#include <dlfcn.h>
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+/* Where the stack pointer is among the registers, how far below it the
+ * thread may keep data, and what the snapshot was built for. */
+#if defined(__arm__)
+#define SNAPSHOT_REG_SP 13
+#define SNAPSHOT_RED_ZONE 0
+#define SNAPSHOT_MACHINE EM_ARM
+#elif defined(__aarch64__)
+#define SNAPSHOT_REG_SP 31
+#define SNAPSHOT_RED_ZONE 0
+#define SNAPSHOT_MACHINE EM_AARCH64
+#elif defined(__x86_64__)
+#define SNAPSHOT_REG_SP 7
+#define SNAPSHOT_RED_ZONE 128
+#define SNAPSHOT_MACHINE EM_X86_64
+#endif
+
+/* A stack pointer this far below the stack, in its guard region after an
+ * overflow, still finds the stack. */
+#define STACK_GUARD_SLACK (64 * 1024)
+
+static crash_snapshot_t* g_snapshot;
+static int32_t g_armed;
+
+#ifdef SNAPSHOT_MACHINE
+
+typedef int (*posix_fallocate_fn)(int, off_t, off_t);
+
+/*
+ * Allocates the blocks of the first size bytes of fd.  posix_fallocate() is
+ * only in bionic from API 21 and 32-bit builds target older releases, so it
+ * is looked up rather than linked.  Where it is missing, or the filesystem
+ * cannot allocate ahead, the file is only extended, which may leave it
+ * sparse.  Returns 0 or an errno value, like posix_fallocate().
+ */
+static int allocate_file(int fd, off_t size) {
+    posix_fallocate_fn allocate = (posix_fallocate_fn) dlsym(RTLD_DEFAULT, "posix_fallocate");
+    int result = allocate ? allocate(fd, 0, size) : ENOSYS;
+    if (result == EOPNOTSUPP || result == ENOSYS) {
+        result = ftruncate(fd, size) ? errno : 0;
+    }
+    return result;
+}
+
+#endif // SNAPSHOT_MACHINE
+
+bool crash_snapshot_prepare(const char* path) {
+#ifdef SNAPSHOT_MACHINE
+    __atomic_store_n(&g_armed, 0, __ATOMIC_RELEASE);
+    if (g_snapshot) {
+        munmap(g_snapshot, sizeof(crash_snapshot_t));
+        g_snapshot = NULL;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return false;
+    }
+    // Allocate the blocks now: a full disk must not lose the crash.
+    if (allocate_file(fd, sizeof(crash_snapshot_t))) {
+        close(fd);
+        return false;
+    }
+    void* mapping = mmap(NULL, sizeof(crash_snapshot_t), PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+
+    // Pre-fault the pages so capture does not depend on memory being free.
+    crash_snapshot_t* snapshot = (crash_snapshot_t*) mapping;
+    memset(snapshot, 0, sizeof(*snapshot));
+    snapshot->magic = CRASH_SNAPSHOT_MAGIC;
+    snapshot->version = CRASH_SNAPSHOT_VERSION;
+    snapshot->machine = SNAPSHOT_MACHINE;
+    snapshot->state = CRASH_SNAPSHOT_EMPTY;
+    snapshot->pid = getpid();
+    int cmdline = open("/proc/self/cmdline", O_RDONLY | O_CLOEXEC);
+    if (cmdline >= 0) {
+        ssize_t n = read(cmdline, snapshot->process_name, sizeof(snapshot->process_name) - 1);
+        if (n < 0) {
+            snapshot->process_name[0] = '\0';
+        }
+        close(cmdline);
+    }
+
+    g_snapshot = snapshot;
+    __atomic_store_n(&g_armed, 1, __ATOMIC_RELEASE);
+    return true;
+#else
+    return false;
+#endif
+}
+
+#ifdef SNAPSHOT_MACHINE
+
+static void get_snapshot_regs(const struct ucontext* uc, uintptr_t* regs) {
+#if defined(__arm__)
+    // arm_r0 .. arm_pc are laid out in order.
+    const unsigned long* gregs = &uc->uc_mcontext.arm_r0;
+    for (int i = 0; i < 16; i++) {
+        regs[i] = gregs[i];
+    }
+#elif defined(__aarch64__)
+    for (int i = 0; i < 31; i++) {
+        regs[i] = uc->uc_mcontext.regs[i];
+    }
+    regs[31] = uc->uc_mcontext.sp;
+    regs[32] = uc->uc_mcontext.pc;
+#elif defined(__x86_64__)
+    const greg_t* gregs = uc->uc_mcontext.gregs;
+    regs[0] = gregs[REG_RAX];
+    regs[1] = gregs[REG_RBX];
+    regs[2] = gregs[REG_RCX];
+    regs[3] = gregs[REG_RDX];
+    regs[4] = gregs[REG_RSI];
+    regs[5] = gregs[REG_RDI];
+    regs[6] = gregs[REG_RBP];
+    regs[7] = gregs[REG_RSP];
+    regs[8] = gregs[REG_RIP];
+    regs[9] = gregs[REG_EFL];
+    regs[16] = gregs[REG_R8];
+    regs[17] = gregs[REG_R9];
+    regs[18] = gregs[REG_R10];
+    regs[19] = gregs[REG_R11];
+    regs[20] = gregs[REG_R12];
+    regs[21] = gregs[REG_R13];
+    regs[22] = gregs[REG_R14];
+    regs[23] = gregs[REG_R15];
+#endif
+}
+
+/* A line of /proc/self/maps. */
+typedef struct {
+    uintptr_t start;
+    uintptr_t end;
+    uintptr_t offset;
+    char perms[4];
+    const char* name;
+} maps_line_t;
+
+static const char* parse_hex(const char* p, uintptr_t* out_value) {
+    uintptr_t value = 0;
+    for (;; p++) {
+        char c = *p;
+        if (c >= '0' && c <= '9') {
+            value = (value << 4) | (c - '0');
+        } else if (c >= 'a' && c <= 'f') {
+            value = (value << 4) | (c - 'a' + 10);
+        } else {
+            break;
+        }
+    }
+    *out_value = value;
+    return p;
+}
+
+/* Parses "start-end perms offset dev inode name"; line is NUL-terminated. */
+static bool parse_maps_line(const char* line, maps_line_t* out) {
+    const char* p = parse_hex(line, &out->start);
+    if (*p++ != '-') {
+        return false;
+    }
+    p = parse_hex(p, &out->end);
+    if (*p++ != ' ' || strlen(p) < 5) {
+        return false;
+    }
+    memcpy(out->perms, p, 4);
+    p += 5;
+    p = parse_hex(p, &out->offset);
+    // Skip the device and inode.
+    for (int field = 0; field < 2; field++) {
+        while (*p == ' ') {
+            p++;
+        }
+        while (*p && *p != ' ') {
+            p++;
+        }
+    }
+    while (*p == ' ') {
+        p++;
+    }
+    out->name = p;
+    return true;
+}
+
+static bool starts_with_elf_magic(const maps_line_t* map) {
+    // Device memory may not be safe to touch.
+    if (map->perms[0] != 'r' || map->name[0] != '/' || !strncmp(map->name, "/dev/", 5)) {
+        return false;
+    }
+    return !memcmp((const void*) map->start, ELFMAG, SELFMAG);
+}
+
+typedef struct {
+    crash_snapshot_t* snapshot;
+    const module_table_t* modules;
+    uintptr_t sp;
+    uintptr_t abort_msg_address;
+    /* The ELF header seen last, which the executable maps after it share. */
+    uintptr_t elf_start;
+    uintptr_t elf_offset;
+    char elf_name[OFFLINE_MODULE_NAME_SIZE];
+    /* Results. */
+    uintptr_t stack_start;
+    uintptr_t stack_end;
+    uintptr_t abort_msg_end;
+} maps_scan_t;
+
+static void scan_map(maps_scan_t* scan, const maps_line_t* map) {
+    crash_snapshot_t* snapshot = scan->snapshot;
+    size_t name_len = strlen(map->name);
+    if (name_len >= OFFLINE_MODULE_NAME_SIZE) {
+        name_len = OFFLINE_MODULE_NAME_SIZE - 1;
+    }
+
+    if (map->perms[0] == 'r') {
+        if (!scan->stack_end && scan->sp < map->end && scan->sp + STACK_GUARD_SLACK > map->start) {
+            scan->stack_start = map->start;
+            scan->stack_end = map->end;
+        }
+        if (scan->abort_msg_address >= map->start && scan->abort_msg_address < map->end) {
+            scan->abort_msg_end = map->end;
+        }
+    }
+
+    if (starts_with_elf_magic(map)) {
+        scan->elf_start = map->start;
+        scan->elf_offset = map->offset;
+        memcpy(scan->elf_name, map->name, name_len);
+        scan->elf_name[name_len] = '\0';
+    }
+
+    if (map->perms[2] != 'x' || snapshot->module_count == CRASH_SNAPSHOT_MAX_MODULES) {
+        return;
+    }
+    offline_module_t* module = &snapshot->modules[snapshot->module_count++];
+    module->start = map->start;
+    module->end = map->end;
+    memcpy(module->name, map->name, name_len);
+    module->name[name_len] = '\0';
+    module->load_bias = 0;
+    module->file_offset = 0;
+    module->build_id_size = 0;
+    const module_entry_t* entry = module_table_find(scan->modules, map->start);
+    if (entry && !strcmp(entry->module.name, module->name)) {
+        module->load_bias = entry->module.load_bias;
+        module->file_offset = entry->module.file_offset;
+        module->build_id_size = entry->module.build_id_size;
+        memcpy(module->build_id, entry->module.build_id, entry->module.build_id_size);
+    } else if (scan->elf_start && !strcmp(scan->elf_name, module->name)
+            && init_offline_module(module, scan->elf_start)) {
+        module->file_offset = scan->elf_offset;
+    }
+}
+
+/* Reads /proc/self/maps a buffer at a time, without allocating. */
+static void scan_maps(maps_scan_t* scan) {
+    int fd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    // Capture runs at most once, and the signal stack is small.
+    static char buffer[4096];
+    static char line[512 + OFFLINE_MODULE_NAME_SIZE];
+    size_t line_len = 0;
+    bool line_truncated = false;
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+        for (ssize_t i = 0; i < n; i++) {
+            char c = buffer[i];
+            if (c != '\n') {
+                if (line_len < sizeof(line) - 1) {
+                    line[line_len++] = c;
+                } else {
+                    line_truncated = true;
+                }
+                continue;
+            }
+            line[line_len] = '\0';
+            maps_line_t map;
+            // A truncated name would match no file, but the range still counts.
+            if (parse_maps_line(line, &map)) {
+                if (line_truncated) {
+                    map.name = "";
+                }
+                scan_map(scan, &map);
+            }
+            line_len = 0;
+            line_truncated = false;
+        }
+    }
+    close(fd);
+}
+
+#endif // SNAPSHOT_MACHINE
+
+bool crash_snapshot_capture(int signal, const siginfo_t* info, const struct ucontext* uc,
+        pid_t tid, uintptr_t abort_msg_address) {
+#ifdef SNAPSHOT_MACHINE
+    if (!__atomic_exchange_n(&g_armed, 0, __ATOMIC_ACQ_REL)) {
+        return false;
+    }
+    crash_snapshot_t* snapshot = g_snapshot;
+    snapshot->tid = tid;
+    snapshot->signal = signal;
+    snapshot->code = info->si_code;
+    snapshot->fault_addr = (uintptr_t) info->si_addr;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    snapshot->time = now.tv_sec;
+    prctl(PR_GET_NAME, snapshot->thread_name, 0, 0, 0);
+    get_snapshot_regs(uc, snapshot->regs);
+
+    maps_scan_t scan;
+    memset(&scan, 0, sizeof(scan));
+    scan.snapshot = snapshot;
+    scan.sp = snapshot->regs[SNAPSHOT_REG_SP];
+    scan.abort_msg_address = abort_msg_address;
+    scan.modules = module_table_acquire();
+    snapshot->module_count = 0;
+    scan_maps(&scan);
+    module_table_release(scan.modules);
+
+    if (scan.stack_end) {
+        uintptr_t start = (scan.sp - SNAPSHOT_RED_ZONE) & ~(uintptr_t) 15;
+        if (start < scan.stack_start) {
+            start = scan.stack_start;
+        }
+        size_t size = scan.stack_end - start;
+        if (size > CRASH_SNAPSHOT_STACK_SIZE) {
+            size = CRASH_SNAPSHOT_STACK_SIZE;
+        }
+        memcpy(snapshot->stack, (const void*) start, size);
+        snapshot->stack_start = start;
+        snapshot->stack_size = size;
+    }
+
+    // The message follows its buffer's length; see dump_abort_message().
+    if (scan.abort_msg_end) {
+        uintptr_t msg = abort_msg_address + sizeof(size_t);
+        size_t size = 0;
+        while (size < CRASH_SNAPSHOT_ABORT_MESSAGE_SIZE - 1 && msg + size < scan.abort_msg_end
+                && ((const char*) msg)[size]) {
+            snapshot->abort_message[size] = ((const char*) msg)[size];
+            size++;
+        }
+        snapshot->abort_message[size] = '\0';
+        snapshot->abort_message_size = size;
+    }
+
+    // The state goes last: a capture that crashed itself is not reported.
+    __atomic_store_n(&snapshot->state, CRASH_SNAPSHOT_CAPTURED, __ATOMIC_RELEASE);
+    return true;
+#else
+    return false;
+#endif
+}
+
+const crash_snapshot_t* crash_snapshot_open(const char* path) {
+#ifdef SNAPSHOT_MACHINE
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size != sizeof(crash_snapshot_t)) {
+        close(fd);
+        return NULL;
+    }
+    void* mapping = mmap(NULL, sizeof(crash_snapshot_t), PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return NULL;
+    }
+    const crash_snapshot_t* snapshot = (const crash_snapshot_t*) mapping;
+    if (snapshot->magic != CRASH_SNAPSHOT_MAGIC || snapshot->version != CRASH_SNAPSHOT_VERSION
+            || snapshot->machine != SNAPSHOT_MACHINE
+            || snapshot->state != CRASH_SNAPSHOT_CAPTURED
+            || snapshot->module_count > CRASH_SNAPSHOT_MAX_MODULES
+            || snapshot->stack_size > CRASH_SNAPSHOT_STACK_SIZE
+            || snapshot->abort_message_size >= CRASH_SNAPSHOT_ABORT_MESSAGE_SIZE) {
+        munmap(mapping, sizeof(crash_snapshot_t));
+        return NULL;
+    }
+    return snapshot;
+#else
+    return NULL;
+#endif
+}
+
+void crash_snapshot_close(const crash_snapshot_t* snapshot) {
+    munmap((void*) snapshot, sizeof(crash_snapshot_t));
+}
@@ -0,0 +1,92 @@
+/* Raw crash snapshots, taken when the process crashes and reported on later. */
+
+#ifndef _DEBUGGERD_CRASH_SNAPSHOT_H
+#define _DEBUGGERD_CRASH_SNAPSHOT_H
+
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "../corkscrew/offline.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct ucontext;
+
+#define CRASH_SNAPSHOT_MAGIC 0x50534e4a     /* "JNSP" */
+#define CRASH_SNAPSHOT_VERSION 1
+
+/* Core registers kept, in the kernel's perf numbering for the architecture. */
+#define CRASH_SNAPSHOT_REGS 33
+/* Bytes of the faulting thread's stack kept, from just below its stack pointer. */
+#define CRASH_SNAPSHOT_STACK_SIZE (32 * 1024)
+#define CRASH_SNAPSHOT_ABORT_MESSAGE_SIZE 512
+#define CRASH_SNAPSHOT_MAX_MODULES 768
+
+enum {
+    CRASH_SNAPSHOT_EMPTY = 0,
+    CRASH_SNAPSHOT_CAPTURED = 1,
+};
+
+/*
+ * The snapshot file, which holds exactly one of these.  It is only ever read
+ * by the same build of the library on the same device, so it is laid out in
+ * native byte order and word size; machine tells builds for different ABIs
+ * of the same app apart.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t machine;           /* EM_* of the build that wrote it */
+    uint32_t state;             /* CRASH_SNAPSHOT_* */
+    pid_t pid;
+    pid_t tid;
+    int32_t signal;
+    int32_t code;
+    uintptr_t fault_addr;
+    int64_t time;               /* seconds since the epoch */
+    char process_name[128];
+    char thread_name[16];
+    uintptr_t regs[CRASH_SNAPSHOT_REGS];
+    uintptr_t stack_start;
+    uint32_t stack_size;
+    uint32_t abort_message_size;
+    uint32_t module_count;
+    char abort_message[CRASH_SNAPSHOT_ABORT_MESSAGE_SIZE];
+    uint8_t stack[CRASH_SNAPSHOT_STACK_SIZE];
+    offline_module_t modules[CRASH_SNAPSHOT_MAX_MODULES];
+} crash_snapshot_t;
+
+/*
+ * Creates the snapshot file at path, allocates its blocks and maps it so a
+ * crash can be captured into it without allocating anything.  Arms capture
+ * on success.  Runs in a normal context.
+ */
+bool crash_snapshot_prepare(const char* path);
+
+/*
+ * Captures the registers and stack of the crashing thread, the abort message
+ * at abort_msg_address if any, and the module list into the prepared file.
+ * Async-signal-safe; only the first call after crash_snapshot_prepare()
+ * captures anything.  Returns false if capture is not armed.
+ */
+bool crash_snapshot_capture(int signal, const siginfo_t* info, const struct ucontext* uc,
+        pid_t tid, uintptr_t abort_msg_address);
+
+/*
+ * Maps a snapshot file written by a previous run.  Returns NULL if there is
+ * none, or it holds no complete capture by this build.
+ */
+const crash_snapshot_t* crash_snapshot_open(const char* path);
+
+/* Unmaps a snapshot returned by crash_snapshot_open(). */
+void crash_snapshot_close(const crash_snapshot_t* snapshot);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _DEBUGGERD_CRASH_SNAPSHOT_H
@@ -0,0 +1,282 @@
+/*
+ * Hang watchdog.
+ *
+ * A hang leaves nothing behind: the app is killed by the system or the user,
+ * and no handler of ours ever runs.  So threads that run loops, such as the
+ * main looper, register with the watchdog and send it heartbeats.  A
+ * heartbeat only sets a flag, which the watchdog clears each time it looks.
+ * Once a thread's flag has stayed clear for the thread's deadline, the
+ * watchdog takes its stack with unwind_backtrace_thread(), and again every
+ * sample interval while the thread stays hung, so the report shows whether
+ * it is stuck in one place or making slow progress.  The report is written
+ * with engrave_hang_report() once the samples are taken or the thread
+ * recovers.  Only one hang is sampled at a time; another thread that misses
+ * its deadline meanwhile is sampled once the first report is written.
+ */
+
+#define LOG_TAG "HangWatchdog"
+//#define LOG_NDEBUG 0
+
+#include "hang_watchdog.h"
+#include "tombstone.h"
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+enum {
+    SLOT_FREE = 0,
+    SLOT_CLAIMED = 1,
+    SLOT_ACTIVE = 2,
+};
+
+/* The watchdog looks at the threads four times per shortest deadline, but
+ * not more often than this or less often than that. */
+#define MIN_CHECK_INTERVAL_MS 50
+#define MAX_CHECK_INTERVAL_MS 1000
+
+static hang_watchdog_thread_t g_threads[HANG_WATCHDOG_MAX_THREADS];
+
+/* What the watchdog thread alone knows of each thread. */
+typedef struct {
+    int64_t last_beat_ms;
+    bool reported;              /* this hang has been reported */
+} watch_t;
+
+static watch_t g_watches[HANG_WATCHDOG_MAX_THREADS];
+static hang_report_t g_report;
+static size_t g_hung = HANG_WATCHDOG_MAX_THREADS;  /* slot g_report is about */
+static int64_t g_next_sample_ms;
+
+static char g_directory[PATH_MAX];
+static int g_sample_interval_ms;
+static int g_sample_count;
+static int g_flags;
+static hang_report_callback_t g_callback;
+
+/* 32-bit bionic only has pthread_condattr_setclock() from API 21, but has
+ * always had a wait with a CLOCK_MONOTONIC deadline. */
+#if defined(__ANDROID__) && !defined(__LP64__)
+#define HAVE_PTHREAD_COND_TIMEDWAIT_MONOTONIC_NP 1
+#endif
+
+/* g_control_mutex serializes start and stop; the watchdog sleeps on
+ * g_watchdog_cond so that stop can wake it.  Its deadlines are on the
+ * monotonic clock, so setting the wall clock cannot stretch a check
+ * interval into a missed hang or cut it short. */
+static pthread_mutex_t g_control_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_watchdog_mutex = PTHREAD_MUTEX_INITIALIZER;
+#ifdef HAVE_PTHREAD_COND_TIMEDWAIT_MONOTONIC_NP
+static pthread_cond_t g_watchdog_cond = PTHREAD_COND_INITIALIZER;
+#else
+static pthread_cond_t g_watchdog_cond;
+static pthread_once_t g_watchdog_cond_once = PTHREAD_ONCE_INIT;
+#endif
+static pthread_t g_watchdog_thread;
+static bool g_running;
+static bool g_stopping;
+
+static int64_t monotonic_ms() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000LL + t.tv_nsec / 1000000;
+}
+
+#ifndef HAVE_PTHREAD_COND_TIMEDWAIT_MONOTONIC_NP
+static void init_watchdog_cond() {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&g_watchdog_cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+#endif
+
+/* Waits on g_watchdog_cond until deadline on CLOCK_MONOTONIC, or a signal. */
+static void wait_until(const struct timespec* deadline) {
+#ifdef HAVE_PTHREAD_COND_TIMEDWAIT_MONOTONIC_NP
+    pthread_cond_timedwait_monotonic_np(&g_watchdog_cond, &g_watchdog_mutex, deadline);
+#else
+    pthread_cond_timedwait(&g_watchdog_cond, &g_watchdog_mutex, deadline);
+#endif
+}
+
+static void finish_report() {
+    g_watches[g_hung].reported = true;
+    g_hung = HANG_WATCHDOG_MAX_THREADS;
+
+    time_t clock = (time_t) g_report.time;
+    struct tm tm_struct;
+    localtime_r(&clock, &tm_struct);
+    char time_string[20];
+    strftime(time_string, sizeof(time_string), "%Y%m%d%H%M%S", &tm_struct);
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s-hang", g_directory, time_string);
+
+    bool written = engrave_hang_report(&g_report, path, g_flags);
+    if (g_callback) {
+        g_callback(path, written);
+    }
+}
+
+static void take_sample(const hang_watchdog_thread_t* thread, int64_t now) {
+    hang_sample_t* sample = &g_report.samples[g_report.sample_count++];
+    ssize_t frames = unwind_backtrace_thread(thread->tid, sample->backtrace, 0,
+            HANG_STACK_DEPTH);
+    sample->frames = frames > 0 ? (size_t) frames : 0;
+    sample->hung_ms = now - g_watches[g_hung].last_beat_ms;
+    g_next_sample_ms = now + g_sample_interval_ms;
+    if (g_report.sample_count == (size_t) g_sample_count) {
+        finish_report();
+    }
+}
+
+static void start_report(size_t slot, const hang_watchdog_thread_t* thread, int64_t now) {
+    g_hung = slot;
+    g_report.tid = thread->tid;
+    strlcpy(g_report.name, thread->name, sizeof(g_report.name));
+    g_report.deadline_ms = thread->deadline_ms;
+    g_report.time = time(NULL);
+    g_report.recovered_ms = 0;
+    g_report.sample_count = 0;
+    take_sample(thread, now);
+}
+
+/* Looks at every thread once; returns how long to sleep until the next look. */
+static int64_t check_threads(int64_t now) {
+    int64_t interval = MAX_CHECK_INTERVAL_MS;
+    for (size_t i = 0; i < HANG_WATCHDOG_MAX_THREADS; i++) {
+        hang_watchdog_thread_t* thread = &g_threads[i];
+        watch_t* watch = &g_watches[i];
+        if (__atomic_load_n(&thread->state, __ATOMIC_ACQUIRE) != SLOT_ACTIVE) {
+            if (i == g_hung) {
+                // Unregistered while hung: report what there is.
+                finish_report();
+            }
+            continue;
+        }
+        if (__atomic_exchange_n(&thread->beat, 0, __ATOMIC_RELAXED)) {
+            if (i == g_hung) {
+                g_report.recovered_ms = now - watch->last_beat_ms;
+                finish_report();
+            }
+            watch->last_beat_ms = now;
+            watch->reported = false;
+        } else if (!watch->reported && now - watch->last_beat_ms >= thread->deadline_ms) {
+            if (g_hung == HANG_WATCHDOG_MAX_THREADS) {
+                start_report(i, thread, now);
+            } else if (i == g_hung && now >= g_next_sample_ms) {
+                take_sample(thread, now);
+            }
+        }
+        if (thread->deadline_ms / 4 < interval) {
+            interval = thread->deadline_ms / 4;
+        }
+    }
+    if (g_hung != HANG_WATCHDOG_MAX_THREADS && g_next_sample_ms - now < interval) {
+        interval = g_next_sample_ms - now;
+    }
+    return interval < MIN_CHECK_INTERVAL_MS ? MIN_CHECK_INTERVAL_MS : interval;
+}
+
+static void* watchdog_main(void* arg) {
+    pthread_mutex_lock(&g_watchdog_mutex);
+    while (!g_stopping) {
+        pthread_mutex_unlock(&g_watchdog_mutex);
+        int64_t interval_ms = check_threads(monotonic_ms());
+        pthread_mutex_lock(&g_watchdog_mutex);
+        if (g_stopping) {
+            break;
+        }
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += interval_ms / 1000;
+        deadline.tv_nsec += (interval_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        wait_until(&deadline);
+    }
+    pthread_mutex_unlock(&g_watchdog_mutex);
+
+    if (g_hung != HANG_WATCHDOG_MAX_THREADS) {
+        finish_report();
+    }
+    return NULL;
+}
+
+bool hang_watchdog_start(const char* directory, int sample_interval_ms, int sample_count,
+        int flags, hang_report_callback_t callback) {
+    if (sample_interval_ms <= 0 || sample_count <= 0 || sample_count > HANG_MAX_SAMPLES) {
+        return false;
+    }
+#ifndef HAVE_PTHREAD_COND_TIMEDWAIT_MONOTONIC_NP
+    pthread_once(&g_watchdog_cond_once, init_watchdog_cond);
+#endif
+    pthread_mutex_lock(&g_control_mutex);
+    if (g_running) {
+        pthread_mutex_unlock(&g_control_mutex);
+        return false;
+    }
+    strlcpy(g_directory, directory, sizeof(g_directory));
+    g_sample_interval_ms = sample_interval_ms;
+    g_sample_count = sample_count;
+    g_flags = flags;
+    g_callback = callback;
+    g_hung = HANG_WATCHDOG_MAX_THREADS;
+    // A thread is only hung once the watchdog has gone a whole deadline
+    // without seeing a heartbeat from it.
+    int64_t now = monotonic_ms();
+    for (size_t i = 0; i < HANG_WATCHDOG_MAX_THREADS; i++) {
+        g_watches[i].last_beat_ms = now;
+        g_watches[i].reported = false;
+    }
+    g_stopping = false;
+    g_running = !pthread_create(&g_watchdog_thread, NULL, watchdog_main, NULL);
+    bool started = g_running;
+    pthread_mutex_unlock(&g_control_mutex);
+    return started;
+}
+
+void hang_watchdog_stop(void) {
+    pthread_mutex_lock(&g_control_mutex);
+    if (g_running) {
+        pthread_mutex_lock(&g_watchdog_mutex);
+        g_stopping = true;
+        pthread_cond_signal(&g_watchdog_cond);
+        pthread_mutex_unlock(&g_watchdog_mutex);
+        pthread_join(g_watchdog_thread, NULL);
+        g_running = false;
+    }
+    pthread_mutex_unlock(&g_control_mutex);
+}
+
+hang_watchdog_thread_t* hang_watchdog_register(const char* name, int deadline_ms) {
+    if (deadline_ms <= 0) {
+        return NULL;
+    }
+    for (size_t i = 0; i < HANG_WATCHDOG_MAX_THREADS; i++) {
+        hang_watchdog_thread_t* thread = &g_threads[i];
+        int32_t expected = SLOT_FREE;
+        if (!__atomic_compare_exchange_n(&thread->state, &expected, SLOT_CLAIMED,
+                false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        thread->tid = gettid();
+        thread->deadline_ms = deadline_ms;
+        strlcpy(thread->name, name ? name : "", sizeof(thread->name));
+        // Counts as a heartbeat, so the watchdog starts the deadline now.
+        __atomic_store_n(&thread->beat, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&thread->state, SLOT_ACTIVE, __ATOMIC_RELEASE);
+        return thread;
+    }
+    return NULL;
+}
+
+void hang_watchdog_unregister(hang_watchdog_thread_t* thread) {
+    __atomic_store_n(&thread->state, SLOT_FREE, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,91 @@
+/* Watchdog that reports threads which stop sending heartbeats. */
+
+#ifndef _DEBUGGERD_HANG_WATCHDOG_H
+#define _DEBUGGERD_HANG_WATCHDOG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "../corkscrew/backtrace.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define HANG_WATCHDOG_MAX_THREADS 32
+#define HANG_WATCHDOG_NAME_SIZE 32
+/* Stacks kept of a thread that is hung, and frames kept of each. */
+#define HANG_MAX_SAMPLES 8
+#define HANG_STACK_DEPTH 64
+
+/*
+ * A thread watched by the watchdog.  beat is the only field the thread
+ * writes; the rest is the watchdog's.
+ */
+typedef struct {
+    int32_t beat;               /* set by hang_watchdog_beat(), cleared by the watchdog */
+    int32_t state;
+    pid_t tid;
+    int deadline_ms;
+    char name[HANG_WATCHDOG_NAME_SIZE];
+} hang_watchdog_thread_t;
+
+/* One stack of a hung thread. */
+typedef struct {
+    int64_t hung_ms;            /* time since the thread's last heartbeat */
+    size_t frames;
+    backtrace_frame_t backtrace[HANG_STACK_DEPTH];
+} hang_sample_t;
+
+/* What the watchdog saw of a thread that missed its deadline. */
+typedef struct {
+    pid_t tid;
+    char name[HANG_WATCHDOG_NAME_SIZE];
+    int deadline_ms;
+    int64_t time;               /* seconds since the epoch, when it was first sampled */
+    int64_t recovered_ms;       /* time without heartbeats if it recovered, else 0 */
+    size_t sample_count;
+    hang_sample_t samples[HANG_MAX_SAMPLES];
+} hang_report_t;
+
+/* Called on the watchdog thread with the path of each report it writes. */
+typedef void (*hang_report_callback_t)(const char* path, bool written);
+
+/*
+ * Starts the watchdog thread.  When a registered thread has not sent a
+ * heartbeat for its deadline, its stack is sampled every sample_interval_ms
+ * until sample_count samples (at most HANG_MAX_SAMPLES) have been taken or
+ * it sends a heartbeat again, and a report is written to directory with the
+ * TOMBSTONE_* flags (see tombstone.h) given.  A thread is reported at most
+ * once per hang.  Returns false if the watchdog is already running or could
+ * not be started.
+ */
+bool hang_watchdog_start(const char* directory, int sample_interval_ms, int sample_count,
+        int flags, hang_report_callback_t callback);
+
+/* Stops the watchdog thread and waits for it, also while it writes a report. */
+void hang_watchdog_stop(void);
+
+/*
+ * Watches the calling thread, which must call hang_watchdog_beat() at least
+ * every deadline_ms from now on.  Threads may be registered whether or not
+ * the watchdog is running.  Returns NULL if HANG_WATCHDOG_MAX_THREADS are
+ * already registered.
+ */
+hang_watchdog_thread_t* hang_watchdog_register(const char* name, int deadline_ms);
+
+/* Stops watching a thread, e.g. before it blocks for good or exits. */
+void hang_watchdog_unregister(hang_watchdog_thread_t* thread);
+
+/* Tells the watchdog the thread is making progress.  A single relaxed store. */
+static inline void hang_watchdog_beat(hang_watchdog_thread_t* thread) {
+    __atomic_store_n(&thread->beat, 1, __ATOMIC_RELAXED);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _DEBUGGERD_HANG_WATCHDOG_H
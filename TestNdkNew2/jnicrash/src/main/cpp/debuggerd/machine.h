@@ -27,5 +27,7 @@
 
 void dump_memory_and_code(const ptrace_context_t* context, log_t* log, pid_t tid, bool at_fault);
 void dump_registers(const ptrace_context_t* context, log_t* log, pid_t tid, bool at_fault);
+/* Dumps the registers of a crash snapshot, which are in the kernel's perf numbering. */
+void dump_snapshot_registers(log_t* log, const uintptr_t* regs);
 
 #endif // _DEBUGGERD_MACHINE_H
@@ -26,11 +26,16 @@
 #include <time.h>
 #include <sys/ptrace.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include "android_filesystem_config.h"
 
 #include "../corkscrew/demangle.h"
 #include "../corkscrew/backtrace.h"
+#include "../corkscrew/backtrace-arch.h"
+#include "../corkscrew/module_table.h"
+#include "../corkscrew/offline.h"
+#include "../corkscrew/ptrace-arch.h"
 
 #include "machine.h"
 #include "tombstone.h"
@@ -43,6 +48,13 @@
 #define STACK_DEPTH 32
 #define STACK_WORDS 16
 
+/* The crashing thread may have overflowed its stack, so its backtrace is
+ * folded: up to FAULT_STACK_DEPTH frames are kept, the first FAULT_STACK_TOP
+ * of them always, and the unwind gives up after FAULT_UNWIND_TIME_MS. */
+#define FAULT_STACK_DEPTH 256
+#define FAULT_STACK_TOP 32
+#define FAULT_UNWIND_TIME_MS 1500
+
 /* Must match the path defined in NativeCrashListener.java */
 #define NCRASH_SOCKET_PATH "/data/system/ndebugsocket"
 
@@ -206,15 +218,14 @@ static void dump_fault_addr(log_t* log, pid_t tid, int sig)
     }
 }
 
-static void dump_thread_info(log_t* log, pid_t pid, pid_t tid, bool at_fault) {
+static char* read_thread_name(pid_t tid, char* buf, size_t size) {
     char path[64];
-    char threadnamebuf[1024];
     char* threadname = NULL;
     FILE *fp;
 
     snprintf(path, sizeof(path), "/proc/%d/comm", tid);
     if ((fp = fopen(path, "r"))) {
-        threadname = fgets(threadnamebuf, sizeof(threadnamebuf), fp);
+        threadname = fgets(buf, size, fp);
         fclose(fp);
         if (threadname) {
             size_t len = strlen(threadname);
@@ -223,6 +234,14 @@ static void dump_thread_info(log_t* log, pid_t pid, pid_t tid, bool at_fault) {
             }
         }
     }
+    return threadname;
+}
+
+static void dump_thread_info(log_t* log, pid_t pid, pid_t tid, bool at_fault) {
+    char path[64];
+    char threadnamebuf[1024];
+    char* threadname = read_thread_name(tid, threadnamebuf, sizeof(threadnamebuf));
+    FILE *fp;
 
     if (at_fault) {
         char procnamebuf[1024];
@@ -243,28 +262,93 @@ static void dump_thread_info(log_t* log, pid_t pid, pid_t tid, bool at_fault) {
     }
 }
 
+/* Depth in the stack of the frame at index, which fold may have moved up. */
+static size_t frame_depth(const backtrace_fold_t* fold, size_t index) {
+    return fold ? get_backtrace_fold_depth(fold, index) : index;
+}
+
+/*
+ * Formats a frame as its pc relative to the module's ELF header and the
+ * module's build ID, which is all an off-device symbolizer needs:
+ *     #00  pc 0000355f  /system/lib/libfoo.so (BuildId: 66cc5d9f...)
+ */
+static void format_raw_backtrace_line(const ptrace_context_t* context, size_t depth,
+        const backtrace_frame_t* frame, char* line, size_t line_size) {
+    const map_info_t* mi = find_map_info(context->map_info_list, frame->absolute_pc);
+    const map_info_data_t* data = mi ? (const map_info_data_t*) mi->data : NULL;
+    if (!data) {
+        snprintf(line, line_size, "#%02zu  pc %08lx  %s", depth,
+                (unsigned long) frame->absolute_pc, mi ? mi->name : "<unknown>");
+        return;
+    }
+    const uint8_t* id;
+    uint32_t id_size = get_map_build_id(mi, &id);
+    char build_id[MAX_BUILD_ID_SIZE * 2 + 1];
+    for (uint32_t i = 0; i < id_size; i++) {
+        snprintf(build_id + i * 2, 3, "%02x", id[i]);
+    }
+    build_id[id_size * 2] = '\0';
+    snprintf(line, line_size, "#%02zu  pc %08lx  %s (BuildId: %s)", depth,
+            (unsigned long) (frame->absolute_pc - data->load_base), mi->name,
+            build_id[0] ? build_id : "-");
+}
+
+/* fold is NULL unless the backtrace was unwound with one.  flags are the
+ * TOMBSTONE_* flags. */
 static void dump_backtrace(const ptrace_context_t* context __attribute((unused)),
         log_t* log, pid_t tid __attribute((unused)), bool at_fault,
-        const backtrace_frame_t* backtrace, size_t frames) {
+        const backtrace_frame_t* backtrace, size_t frames, const backtrace_fold_t* fold,
+        int flags) {
     int scopeFlags = at_fault ? SCOPE_AT_FAULT : 0;
     _LOG(log, scopeFlags, "\nbacktrace:\n");
 
-    backtrace_symbol_t backtrace_symbols[STACK_DEPTH];
-    get_backtrace_symbols_ptrace(context, backtrace, frames, backtrace_symbols);
+    // Raw frames are never symbolized here.
+    bool raw = flags & TOMBSTONE_RAW_FRAMES;
+    backtrace_symbol_t* backtrace_symbols = NULL;
+    if (!raw) {
+        backtrace_symbols = malloc(frames * sizeof(backtrace_symbol_t));
+        if (!backtrace_symbols) {
+            return;
+        }
+        get_backtrace_symbols_ptrace(context, backtrace, frames, backtrace_symbols);
+    }
     for (size_t i = 0; i < frames; i++) {
+        if (fold && fold->elided_frames && i == fold->elided_at) {
+            _LOG(log, scopeFlags, "    ... %zu frames elided ...\n", fold->elided_frames);
+        }
         char line[MAX_BACKTRACE_LINE_LENGTH];
-        format_backtrace_line(i, &backtrace[i], &backtrace_symbols[i],
-                line, MAX_BACKTRACE_LINE_LENGTH);
+        if (raw) {
+            format_raw_backtrace_line(context, frame_depth(fold, i), &backtrace[i],
+                    line, MAX_BACKTRACE_LINE_LENGTH);
+        } else {
+            format_backtrace_line(frame_depth(fold, i), &backtrace[i], &backtrace_symbols[i],
+                    line, MAX_BACKTRACE_LINE_LENGTH);
+        }
         _LOG(log, scopeFlags, "    %s\n", line);
+
+        for (size_t r = 0; fold && r < fold->repeat_count; r++) {
+            const backtrace_repeat_t* repeat = &fold->repeats[r];
+            if (repeat->first + repeat->period - 1 == i) {
+                _LOG(log, scopeFlags, "    ... #%02zu-#%02zu repeated %zu times ...\n",
+                        frame_depth(fold, repeat->first), frame_depth(fold, i),
+                        repeat->repeats);
+            }
+        }
+    }
+    if (fold && fold->timed_out) {
+        _LOG(log, scopeFlags, "    ... unwinding stopped after %d ms\n", FAULT_UNWIND_TIME_MS);
+    }
+    if (backtrace_symbols) {
+        free_backtrace_symbols(backtrace_symbols, frames);
+        free(backtrace_symbols);
     }
-    free_backtrace_symbols(backtrace_symbols, frames);
 }
 
-static void dump_stack_segment(const ptrace_context_t* context, log_t* log, pid_t tid,
-        int scopeFlags, uintptr_t* sp, size_t words, int label) {
+static void dump_stack_segment(const ptrace_context_t* context, log_t* log,
+        const memory_t* memory, int scopeFlags, uintptr_t* sp, size_t words, int label) {
     for (size_t i = 0; i < words; i++) {
         uint32_t stack_content;
-        if (!try_get_word_ptrace(tid, *sp, &stack_content)) {
+        if (!try_get_word(memory, *sp, &stack_content)) {
             break;
         }
 
@@ -314,8 +398,13 @@ static void dump_stack_segment(const ptrace_context_t* context, log_t* log, pid_
     }
 }
 
-static void dump_stack(const ptrace_context_t* context, log_t* log, pid_t tid, bool at_fault,
-        const backtrace_frame_t* backtrace, size_t frames) {
+/* With a fold, only the frames it never drops are dumped. */
+static void dump_stack(const ptrace_context_t* context, log_t* log, const memory_t* memory,
+        bool at_fault, const backtrace_frame_t* backtrace, size_t frames,
+        const backtrace_fold_t* fold) {
+    if (fold && frames > fold->top_frames) {
+        frames = fold->top_frames;
+    }
     bool have_first = false;
     size_t first, last;
     for (size_t i = 0; i < frames; i++) {
@@ -336,7 +425,7 @@ static void dump_stack(const ptrace_context_t* context, log_t* log, pid_t tid, b
 
     // Dump a few words before the first frame.
     uintptr_t sp = backtrace[first].stack_top - STACK_WORDS * sizeof(uint32_t);
-    dump_stack_segment(context, log, tid, scopeFlags, &sp, STACK_WORDS, -1);
+    dump_stack_segment(context, log, memory, scopeFlags, &sp, STACK_WORDS, -1);
 
     // Dump a few words from all successive frames.
     // Only log the first 3 frames, put the rest in the tombstone.
@@ -350,7 +439,8 @@ static void dump_stack(const ptrace_context_t* context, log_t* log, pid_t tid, b
             scopeFlags &= (~SCOPE_AT_FAULT);
         }
         if (i == last) {
-            dump_stack_segment(context, log, tid, scopeFlags, &sp, STACK_WORDS, i);
+            dump_stack_segment(context, log, memory, scopeFlags, &sp, STACK_WORDS,
+                    frame_depth(fold, i));
 //            if (sp < frame->stack_top + frame->stack_size) {
 //                _LOG(log, scopeFlags, "         ........  ........\n");
 //            }
@@ -361,19 +451,28 @@ static void dump_stack(const ptrace_context_t* context, log_t* log, pid_t tid, b
             } else if (words > STACK_WORDS) {
                 words = STACK_WORDS;
             }
-            dump_stack_segment(context, log, tid, scopeFlags, &sp, words, i);
+            dump_stack_segment(context, log, memory, scopeFlags, &sp, words, frame_depth(fold, i));
         }
     }
 }
 
 static void dump_backtrace_and_stack(const ptrace_context_t* context, log_t* log, pid_t tid,
-        bool at_fault) {
-    backtrace_frame_t backtrace[STACK_DEPTH];
-    ssize_t frames = unwind_backtrace_ptrace(tid, context, backtrace, 0, STACK_DEPTH, at_fault);
+        bool at_fault, int flags) {
+    backtrace_frame_t* backtrace = malloc(FAULT_STACK_DEPTH * sizeof(backtrace_frame_t));
+    if (!backtrace) {
+        return;
+    }
+    backtrace_fold_t fold;
+    init_backtrace_fold(&fold, FAULT_STACK_TOP, FAULT_UNWIND_TIME_MS);
+    ssize_t frames = unwind_backtrace_ptrace_folded(tid, context, backtrace, FAULT_STACK_DEPTH,
+            at_fault, &fold);
     if (frames > 0) {
-        dump_backtrace(context, log, tid, at_fault, backtrace, frames);
-        dump_stack(context, log, tid, at_fault, backtrace, frames);
+        memory_t memory;
+        init_memory_ptrace(&memory, tid);
+        dump_backtrace(context, log, tid, at_fault, backtrace, frames, &fold, flags);
+        dump_stack(context, log, &memory, at_fault, backtrace, frames, &fold);
     }
+    free(backtrace);
 }
 
 static void dump_map(log_t* log, map_info_t* m, const char* what, int scopeFlags) {
@@ -473,19 +572,110 @@ static void dump_maps(pid_t tid, log_t* log) {
 	free_map_info_list(head);
 }
 
-static void dump_thread(const ptrace_context_t* context, log_t* log, pid_t tid, bool at_fault) {
+static void dump_thread(const ptrace_context_t* context, log_t* log, pid_t tid, bool at_fault,
+        int flags) {
 
     dump_registers(context, log, tid, at_fault);
-    dump_backtrace_and_stack(context, log, tid, at_fault);
+    dump_backtrace_and_stack(context, log, tid, at_fault, flags);
 //    if (at_fault) {
 //        dump_memory_and_code(context, log, tid, at_fault);
 //        dump_nearby_maps(context, log, tid, at_fault);
 //    }
 }
 
+/* A sibling thread that has been attached and unwound, waiting to be reported. */
+typedef struct {
+    pid_t tid;
+    char name[64];
+    backtrace_frame_t backtrace[STACK_DEPTH];
+    size_t frames;
+    uint32_t hash;
+    /* index of the first thread with an identical stack, or -1 if this is the first */
+    ssize_t group;
+} sibling_thread_t;
+
+/*
+ * Hashes a backtrace by the module and relative PC of each frame so that
+ * threads parked at the same place hash identically.
+ */
+static uint32_t hash_backtrace(const ptrace_context_t* context,
+        const backtrace_frame_t* backtrace, size_t frames) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < frames; i++) {
+        uintptr_t pc = backtrace[i].absolute_pc;
+        const map_info_t* mi = find_map_info(context->map_info_list, pc);
+        if (mi) {
+            pc -= mi->start;
+            for (const char* p = mi->name; *p; p++) {
+                hash = (hash ^ (uint8_t) *p) * 16777619u;
+            }
+        }
+        hash = (hash ^ pc) * 16777619u;
+    }
+    return hash;
+}
+
+static bool same_backtrace(const sibling_thread_t* a, const sibling_thread_t* b) {
+    if (a->hash != b->hash || a->frames != b->frames) {
+        return false;
+    }
+    for (size_t i = 0; i < a->frames; i++) {
+        if (a->backtrace[i].absolute_pc != b->backtrace[i].absolute_pc) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Dumps a group of threads that share one backtrace.  The backtrace is only
+ * symbolized and printed once; registers and stack words of the members are
+ * skipped unless TOMBSTONE_SIBLING_STACKS was requested.
+ */
+static void dump_sibling_group(const ptrace_context_t* context, log_t* log, pid_t pid,
+        const sibling_thread_t* threads, size_t count, size_t first, size_t members, int flags) {
+    _LOG(log, 0, "--- --- --- --- --- --- --- --- --- --- --- --- --- --- --- ---\n");
+    memory_t memory;
+    if (members == 1) {
+        dump_thread_info(log, pid, threads[first].tid, false);
+        dump_registers(context, log, threads[first].tid, false);
+        if (threads[first].frames) {
+            dump_backtrace(context, log, threads[first].tid, false,
+                    threads[first].backtrace, threads[first].frames, NULL, flags);
+            init_memory_ptrace(&memory, threads[first].tid);
+            dump_stack(context, log, &memory, false,
+                    threads[first].backtrace, threads[first].frames, NULL);
+        }
+        return;
+    }
+
+    _LOG(log, 0, "pid: %d, %zu threads with identical backtraces:\n", pid, members);
+    for (size_t i = first; i < count; i++) {
+        if (i == first || threads[i].group == (ssize_t) first) {
+            _LOG(log, 0, "    tid: %d, name: %s\n", threads[i].tid,
+                    threads[i].name[0] ? threads[i].name : "UNKNOWN");
+        }
+    }
+    if (threads[first].frames) {
+        dump_backtrace(context, log, threads[first].tid, false,
+                threads[first].backtrace, threads[first].frames, NULL, flags);
+    }
+    if (flags & TOMBSTONE_SIBLING_STACKS) {
+        for (size_t i = first; i < count; i++) {
+            if (i == first || threads[i].group == (ssize_t) first) {
+                _LOG(log, 0, "\ntid: %d\n", threads[i].tid);
+                dump_registers(context, log, threads[i].tid, false);
+                init_memory_ptrace(&memory, threads[i].tid);
+                dump_stack(context, log, &memory, false,
+                        threads[i].backtrace, threads[i].frames, NULL);
+            }
+        }
+    }
+}
+
 /* Return true if some thread is not detached cleanly */
 static bool dump_sibling_thread_report(const ptrace_context_t* context,
-        log_t* log, pid_t pid, pid_t tid) {
+        log_t* log, pid_t pid, pid_t tid, int flags) {
     char task_path[64];
     snprintf(task_path, sizeof(task_path), "/proc/%d/task", pid);
 
@@ -496,7 +686,13 @@ static bool dump_sibling_thread_report(const ptrace_context_t* context,
         return false;
     }
 
-    bool detach_failed = false;
+    /*
+     * Attach to and unwind every thread first, keeping them stopped, so that
+     * threads with identical stacks can be grouped before anything is printed.
+     */
+    size_t count = 0;
+    size_t capacity = 0;
+    sibling_thread_t* threads = NULL;
     struct dirent* de;
     while ((de = readdir(d)) != NULL) {
         /* Ignore "." and ".." */
@@ -511,21 +707,63 @@ static bool dump_sibling_thread_report(const ptrace_context_t* context,
             continue;
         }
 
+        if (count == capacity) {
+            size_t new_capacity = capacity ? capacity * 2 : 16;
+            sibling_thread_t* new_threads = realloc(threads,
+                    new_capacity * sizeof(sibling_thread_t));
+            if (!new_threads) {
+                break;
+            }
+            threads = new_threads;
+            capacity = new_capacity;
+        }
+
         /* Skip this thread if cannot ptrace it */
         if (ptrace(PTRACE_ATTACH, new_tid, 0, 0) < 0) {
             continue;
         }
 
-        dump_thread_info(log, pid, new_tid, false);
-        dump_thread(context, log, new_tid, false);
+        sibling_thread_t* thread = &threads[count++];
+        thread->tid = new_tid;
+        if (!read_thread_name(new_tid, thread->name, sizeof(thread->name))) {
+            thread->name[0] = '\0';
+        }
+        ssize_t frames = unwind_backtrace_ptrace(new_tid, context, thread->backtrace,
+                0, STACK_DEPTH, false);
+        thread->frames = frames > 0 ? frames : 0;
+        thread->hash = hash_backtrace(context, thread->backtrace, thread->frames);
+        thread->group = -1;
+        for (size_t i = 0; i + 1 < count; i++) {
+            if (threads[i].group < 0 && thread->frames
+                    && same_backtrace(&threads[i], thread)) {
+                thread->group = i;
+                break;
+            }
+        }
+    }
+    closedir(d);
 
-        if (ptrace(PTRACE_DETACH, new_tid, 0, 0) != 0) {
-            LOG("ptrace detach from %d failed: %s\n", new_tid, strerror(errno));
-            detach_failed = true;
+    for (size_t i = 0; i < count; i++) {
+        if (threads[i].group >= 0) {
+            continue;
         }
+        size_t members = 1;
+        for (size_t j = i + 1; j < count; j++) {
+            if (threads[j].group == (ssize_t) i) {
+                members++;
+            }
+        }
+        dump_sibling_group(context, log, pid, threads, count, i, members, flags);
     }
 
-    closedir(d);
+    bool detach_failed = false;
+    for (size_t i = 0; i < count; i++) {
+        if (ptrace(PTRACE_DETACH, threads[i].tid, 0, 0) != 0) {
+            LOG("ptrace detach from %d failed: %s\n", threads[i].tid, strerror(errno));
+            detach_failed = true;
+        }
+    }
+    free(threads);
     return detach_failed;
 }
 
@@ -711,7 +949,8 @@ static void dump_abort_message(log_t* log, pid_t tid, uintptr_t address) {
 /*
  * Dumps all information about the specified pid to the tombstone.
  */
-static bool dump_crash(log_t* log, pid_t pid, pid_t tid, int signal, uintptr_t abort_msg_address)
+static bool dump_crash(log_t* log, pid_t pid, pid_t tid, int signal, uintptr_t abort_msg_address,
+        int flags)
 {
     /* don't copy log messages to tombstone unless this is a dev device */
 //    char value[PROPERTY_VALUE_MAX];
@@ -737,16 +976,19 @@ static bool dump_crash(log_t* log, pid_t pid, pid_t tid, int signal, uintptr_t a
     }
     dump_abort_message(log, tid, abort_msg_address);
 
-    ptrace_context_t* context = load_ptrace_context(tid);
-    dump_thread(context, log, tid, true);
+    // The crashed process cloned us, so its JIT table is where ours is, and
+    // our copy of its module table describes its modules.
+    ptrace_context_t* context = load_ptrace_context_from_module_table(tid, true);
+    dump_thread(context, log, tid, true, flags);
 
 //    if (want_logs) {
 //        dump_logs(log, pid, true);
 //    }
 
-    // 其它线程不打印
-//    bool detach_failed = false;
-//    detach_failed = dump_sibling_thread_report(context, log, pid, tid);
+    // 其它线程默认不打印
+    if (flags & TOMBSTONE_DUMP_SIBLINGS) {
+        dump_sibling_thread_report(context, log, pid, tid, flags);
+    }
 
     free_ptrace_context(context);
 
@@ -797,7 +1039,7 @@ static bool dump_crash(log_t* log, pid_t pid, pid_t tid, int signal, uintptr_t a
 //}
 
 bool engrave_tombstone(pid_t pid, pid_t tid, int sig, uintptr_t abort_msg_address,
-                       const struct ucontext* const uc, const char* path) {
+                       const struct ucontext* const uc, const char* path, int flags) {
     // get crash thread registers
     get_regs_common(uc);
 	int tid_attach_status = -1;
@@ -818,10 +1060,196 @@ bool engrave_tombstone(pid_t pid, pid_t tid, int sig, uintptr_t abort_msg_addres
     log.tfd = fd;
 //    log.amfd = activity_manager_connect();
     log.quiet = true;
-    bool result = dump_crash(&log, pid, tid, sig, abort_msg_address);
+    bool result = dump_crash(&log, pid, tid, sig, abort_msg_address, flags);
 
 //    close(log.amfd);
     close(fd);
     ptrace(PTRACE_DETACH, tid, 0, 0);
     return result;
 }
+
+/* Lists the modules of a snapshot with their build IDs, so that frames in
+ * libraries without symbols on the device can be symbolized elsewhere. */
+static void dump_snapshot_modules(log_t* log, const crash_snapshot_t* snapshot) {
+    _LOG(log, 0, "\nmodules:\n");
+    for (uint32_t i = 0; i < snapshot->module_count; i++) {
+        const offline_module_t* module = &snapshot->modules[i];
+        char build_id[OFFLINE_BUILD_ID_SIZE * 2 + 1];
+        for (uint32_t j = 0; j < module->build_id_size; j++) {
+            snprintf(build_id + j * 2, 3, "%02x", module->build_id[j]);
+        }
+        build_id[module->build_id_size * 2] = '\0';
+        _LOG(log, 0, "    %08lx-%08lx %08lx %s %.*s\n",
+                (unsigned long) module->start, (unsigned long) module->end,
+                (unsigned long) module->load_bias, build_id[0] ? build_id : "-",
+                (int) sizeof(module->name), module->name);
+    }
+}
+
+/*
+ * Dumps a crash that crash_snapshot_capture() recorded in an earlier run.
+ * The stack copy is unwound against the module files as they are now on
+ * disk; modules that have changed since are named but not unwound through.
+ */
+static void dump_snapshot(log_t* log, const crash_snapshot_t* snapshot, int flags) {
+    dump_system_info(log);
+    _LOG(log, SCOPE_AT_FAULT, "pid: %d, tid: %d, name: %.*s  >>> %.*s <<<\n",
+            snapshot->pid, snapshot->tid,
+            (int) sizeof(snapshot->thread_name), snapshot->thread_name,
+            (int) sizeof(snapshot->process_name), snapshot->process_name);
+    int sig = snapshot->signal;
+    if (signal_has_address(sig)) {
+        _LOG(log, SCOPE_AT_FAULT, "signal %d (%s), code %d (%s), fault addr %08lx\n",
+                sig, get_signame(sig), snapshot->code, get_sigcode(sig, snapshot->code),
+                (unsigned long) snapshot->fault_addr);
+    } else {
+        _LOG(log, SCOPE_AT_FAULT, "signal %d (%s), code %d (%s), fault addr --------\n",
+                sig, get_signame(sig), snapshot->code, get_sigcode(sig, snapshot->code));
+    }
+    if (snapshot->abort_message_size) {
+        _LOG(log, SCOPE_AT_FAULT, "Abort message: '%.*s'\n",
+                (int) snapshot->abort_message_size, snapshot->abort_message);
+    }
+    dump_snapshot_registers(log, snapshot->regs);
+
+    ptrace_context_t* context = load_offline_context(snapshot->modules, snapshot->module_count,
+            snapshot->stack_start, snapshot->stack_size);
+    if (!context) {
+        return;
+    }
+    memory_t memory;
+    init_memory_offline(&memory, context, snapshot->tid, snapshot->stack_start,
+            snapshot->stack, snapshot->stack_size);
+    backtrace_frame_t* backtrace = malloc(FAULT_STACK_DEPTH * sizeof(backtrace_frame_t));
+    if (backtrace) {
+        // The stack copy is short enough for the unwind not to need a fold
+        // or a deadline, but only the top frames get their words dumped.
+        ssize_t frames = unwind_backtrace_regs_arch(snapshot->regs, &memory, backtrace, 0,
+                FAULT_STACK_DEPTH);
+        if (frames > 0) {
+            dump_backtrace(context, log, snapshot->tid, true, backtrace, frames, NULL, flags);
+            dump_stack(context, log, &memory, true, backtrace,
+                    frames < FAULT_STACK_TOP ? (size_t) frames : FAULT_STACK_TOP, NULL);
+        }
+        free(backtrace);
+    }
+    dump_snapshot_modules(log, snapshot);
+    free_ptrace_context(context);
+}
+
+bool engrave_tombstone_snapshot(const crash_snapshot_t* snapshot, const char* path,
+        int flags) {
+    int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0600);
+    if (fd < 0) {
+        return false;
+    }
+
+    log_t log;
+    log.tfd = fd;
+    log.quiet = true;
+    dump_snapshot(&log, snapshot, flags);
+    close(fd);
+    return true;
+}
+
+/* As format_raw_backtrace_line, for a frame of this process. */
+static void format_raw_local_backtrace_line(const module_table_t* table, size_t depth,
+        const backtrace_frame_t* frame, char* line, size_t line_size) {
+    const module_entry_t* entry = table ? module_table_find(table, frame->absolute_pc) : NULL;
+    if (!entry) {
+        snprintf(line, line_size, "#%02zu  pc %08lx  <unknown>", depth,
+                (unsigned long) frame->absolute_pc);
+        return;
+    }
+    const offline_module_t* module = &entry->module;
+    char build_id[OFFLINE_BUILD_ID_SIZE * 2 + 1];
+    for (uint32_t i = 0; i < module->build_id_size; i++) {
+        snprintf(build_id + i * 2, 3, "%02x", module->build_id[i]);
+    }
+    build_id[module->build_id_size * 2] = '\0';
+    uintptr_t base = entry->elf_start ? entry->elf_start : module->load_bias;
+    snprintf(line, line_size, "#%02zu  pc %08lx  %.*s (BuildId: %s)", depth,
+            (unsigned long) (frame->absolute_pc - base), (int) sizeof(module->name),
+            module->name, build_id[0] ? build_id : "-");
+}
+
+/* Dumps a backtrace unwound in this process, symbolized in it. */
+static void dump_local_backtrace(log_t* log, const backtrace_frame_t* backtrace,
+        size_t frames, int flags) {
+    if (flags & TOMBSTONE_RAW_FRAMES) {
+        const module_table_t* table = module_table_acquire();
+        for (size_t i = 0; i < frames; i++) {
+            char line[MAX_BACKTRACE_LINE_LENGTH];
+            format_raw_local_backtrace_line(table, i, &backtrace[i], line, sizeof(line));
+            _LOG(log, SCOPE_AT_FAULT, "    %s\n", line);
+        }
+        module_table_release(table);
+        return;
+    }
+    backtrace_symbol_t* backtrace_symbols = malloc(frames * sizeof(backtrace_symbol_t));
+    if (!backtrace_symbols) {
+        return;
+    }
+    get_backtrace_symbols(backtrace, frames, backtrace_symbols);
+    for (size_t i = 0; i < frames; i++) {
+        char line[MAX_BACKTRACE_LINE_LENGTH];
+        format_backtrace_line(i, &backtrace[i], &backtrace_symbols[i], line, sizeof(line));
+        _LOG(log, SCOPE_AT_FAULT, "    %s\n", line);
+    }
+    free_backtrace_symbols(backtrace_symbols, frames);
+    free(backtrace_symbols);
+}
+
+static bool same_hang_stack(const hang_sample_t* a, const hang_sample_t* b) {
+    if (a->frames != b->frames) {
+        return false;
+    }
+    for (size_t i = 0; i < a->frames; i++) {
+        if (a->backtrace[i].absolute_pc != b->backtrace[i].absolute_pc) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Dumps what the hang watchdog saw of a thread of this process.  A sample
+ * with the same stack as the one before is not repeated, so a thread stuck
+ * in one place shows up as a single stack.
+ */
+static void dump_hang(log_t* log, const hang_report_t* report, int flags) {
+    dump_system_info(log);
+    dump_thread_info(log, getpid(), report->tid, true);
+    _LOG(log, SCOPE_AT_FAULT, "hang: '%.*s' sent no heartbeat for %d ms\n",
+            (int) sizeof(report->name), report->name, report->deadline_ms);
+    if (report->recovered_ms) {
+        _LOG(log, SCOPE_AT_FAULT, "recovered after %lld ms\n",
+                (long long) report->recovered_ms);
+    }
+    for (size_t i = 0; i < report->sample_count; i++) {
+        const hang_sample_t* sample = &report->samples[i];
+        _LOG(log, SCOPE_AT_FAULT, "\nsample %zu, %lld ms after the last heartbeat:\n",
+                i + 1, (long long) sample->hung_ms);
+        if (!sample->frames) {
+            _LOG(log, SCOPE_AT_FAULT, "    (no stack)\n");
+        } else if (i && same_hang_stack(sample, &report->samples[i - 1])) {
+            _LOG(log, SCOPE_AT_FAULT, "    (same stack)\n");
+        } else {
+            dump_local_backtrace(log, sample->backtrace, sample->frames, flags);
+        }
+    }
+}
+
+bool engrave_hang_report(const hang_report_t* report, const char* path, int flags) {
+    int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0600);
+    if (fd < 0) {
+        return false;
+    }
+
+    log_t log;
+    log.tfd = fd;
+    log.quiet = true;
+    dump_hang(&log, report, flags);
+    close(fd);
+    return true;
+}
@@ -23,8 +23,33 @@
 
 #include "../corkscrew/ptrace.h"
 
+#include "crash_snapshot.h"
+#include "hang_watchdog.h"
+
+/* Also dump the other threads of the process.  Threads with identical
+ * backtraces are collapsed into a single entry. */
+#define TOMBSTONE_DUMP_SIBLINGS   (1 << 0)
+/* Dump registers and stack words of collapsed sibling threads too. */
+#define TOMBSTONE_SIBLING_STACKS  (1 << 1)
+/* Print frames as module-relative pc and module build ID only, for
+ * symbolizing off the device with tools/symbolize. */
+#define TOMBSTONE_RAW_FRAMES      (1 << 2)
+
 /* Creates a tombstone file and writes the crash dump to it.
+ * flags is a bitmask of the TOMBSTONE_* flags above.
  * Returns the path of the tombstone, which must be freed using free(). */
 bool engrave_tombstone(pid_t pid, pid_t tid, int signal, uintptr_t abort_msg_address,
-        const struct ucontext* const uc, const char* path);
+        const struct ucontext* const uc, const char* path, int flags);
+
+/* Writes a tombstone for a crash recorded by crash_snapshot_capture(),
+ * possibly in an earlier run of the process.  flags are as above.
+ * Returns false if the tombstone file could not be created. */
+bool engrave_tombstone_snapshot(const crash_snapshot_t* snapshot, const char* path,
+        int flags);
+
+/* Writes a report of a thread of this process that the hang watchdog saw
+ * miss its deadline.  Runs in the process itself, not a helper.  flags are
+ * as above; only TOMBSTONE_RAW_FRAMES applies.  Returns false if the report
+ * file could not be created. */
+bool engrave_hang_report(const hang_report_t* report, const char* path, int flags);
 #endif // _DEBUGGERD_TOMBSTONE_H
@@ -0,0 +1,148 @@
+/* Register and memory dumps for x86-64 tombstones. */
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/ptrace.h>
+#include <sys/user.h>
+
+#include "../../corkscrew/ptrace.h"
+
+#include "../utility.h"
+#include "../machine.h"
+
+/* enable to dump memory pointed to by every register */
+#define DUMP_MEMORY_FOR_ALL_REGISTERS 1
+
+extern struct user_regs_struct crash_regs;
+
+static bool get_regs(pid_t tid, bool at_fault, struct user_regs_struct* regs) {
+    if (at_fault) {
+        *regs = crash_regs;
+        return true;
+    }
+    return ptrace(PTRACE_GETREGS, tid, 0, regs) == 0;
+}
+
+static void dump_memory(log_t* log, pid_t tid, uintptr_t addr, int scopeFlags) {
+    uintptr_t p, end;
+
+    p = addr & ~7;
+    p -= 32;
+    if (p > addr) {
+        /* catch underflow */
+        p = 0;
+    }
+    end = p + 256;
+    /* catch overflow; 'end - p' has to be multiples of 16 */
+    while (end < p)
+        end -= 16;
+
+    /* Dump the memory as:
+     *  addr             contents
+     *  00007f2a5c1d0d30 0000000000000000 00007f2a5c1d0d58
+     */
+    while (p < end) {
+        char code_buffer[64];
+
+        sprintf(code_buffer, "%016lx ", (unsigned long) p);
+        for (int i = 0; i < 2; i++) {
+            /* A failed read gives -1, which is as good as anything here. */
+            long data = ptrace(PTRACE_PEEKTEXT, tid, (void*)p, NULL);
+            sprintf(code_buffer + strlen(code_buffer), "%016lx ", data);
+            p += 8;
+        }
+        _LOG(log, scopeFlags, "    %s\n", code_buffer);
+    }
+}
+
+/*
+ * If configured to do so, dump memory around *all* registers
+ * for the crashing thread.
+ */
+void dump_memory_and_code(const ptrace_context_t* context __attribute((unused)),
+        log_t* log, pid_t tid, bool at_fault) {
+    struct user_regs_struct r;
+    if (!get_regs(tid, at_fault, &r)) {
+        return;
+    }
+
+    int scopeFlags = at_fault ? SCOPE_AT_FAULT : 0;
+
+    if (at_fault && DUMP_MEMORY_FOR_ALL_REGISTERS) {
+        static const char REG_NAMES[] = "raxrbxrcxrdxrsirdir8 r9 r10r11r12r13r14r15rbprsp";
+        uintptr_t regs[] = {
+            r.rax, r.rbx, r.rcx, r.rdx, r.rsi, r.rdi, r.r8, r.r9,
+            r.r10, r.r11, r.r12, r.r13, r.r14, r.r15, r.rbp, r.rsp,
+        };
+
+        for (size_t reg = 0; reg < sizeof(regs) / sizeof(regs[0]); reg++) {
+            uintptr_t addr = regs[reg];
+
+            /*
+             * Don't bother if it looks like a small int or ~= null, or if
+             * it's in the kernel area.
+             */
+            if (addr < 4096 || addr >= 0x800000000000UL) {
+                continue;
+            }
+
+            _LOG(log, scopeFlags | SCOPE_SENSITIVE, "\nmemory near %.3s:\n", &REG_NAMES[reg * 3]);
+            dump_memory(log, tid, addr, scopeFlags | SCOPE_SENSITIVE);
+        }
+    }
+
+    /* explicitly allow upload of code dump logging */
+    _LOG(log, scopeFlags, "\ncode around rip:\n");
+    dump_memory(log, tid, (uintptr_t)r.rip, scopeFlags);
+}
+
+void dump_registers(const ptrace_context_t* context __attribute((unused)),
+        log_t* log, pid_t tid, bool at_fault)
+{
+    struct user_regs_struct r;
+    int scopeFlags = at_fault ? SCOPE_AT_FAULT : 0;
+
+    if (!get_regs(tid, at_fault, &r)) {
+        _LOG(log, scopeFlags, "cannot get registers: %s\n", strerror(errno));
+        return;
+    }
+    _LOG(log, scopeFlags, "    rax %016lx  rbx %016lx  rcx %016lx  rdx %016lx\n",
+            (unsigned long) r.rax, (unsigned long) r.rbx, (unsigned long) r.rcx,
+            (unsigned long) r.rdx);
+    _LOG(log, scopeFlags, "    rsi %016lx  rdi %016lx\n",
+            (unsigned long) r.rsi, (unsigned long) r.rdi);
+    _LOG(log, scopeFlags, "    r8  %016lx  r9  %016lx  r10 %016lx  r11 %016lx\n",
+            (unsigned long) r.r8, (unsigned long) r.r9, (unsigned long) r.r10,
+            (unsigned long) r.r11);
+    _LOG(log, scopeFlags, "    r12 %016lx  r13 %016lx  r14 %016lx  r15 %016lx\n",
+            (unsigned long) r.r12, (unsigned long) r.r13, (unsigned long) r.r14,
+            (unsigned long) r.r15);
+    _LOG(log, scopeFlags, "    cs  %016lx  ss  %016lx\n",
+            (unsigned long) r.cs, (unsigned long) r.ss);
+    _LOG(log, scopeFlags, "    rip %016lx  rbp %016lx  rsp %016lx  eflags %016lx\n",
+            (unsigned long) r.rip, (unsigned long) r.rbp, (unsigned long) r.rsp,
+            (unsigned long) r.eflags);
+}
+
+void dump_snapshot_registers(log_t* log, const uintptr_t* regs)
+{
+    _LOG(log, SCOPE_AT_FAULT, "    rax %016lx  rbx %016lx  rcx %016lx  rdx %016lx\n",
+            (unsigned long) regs[0], (unsigned long) regs[1], (unsigned long) regs[2],
+            (unsigned long) regs[3]);
+    _LOG(log, SCOPE_AT_FAULT, "    rsi %016lx  rdi %016lx\n",
+            (unsigned long) regs[4], (unsigned long) regs[5]);
+    _LOG(log, SCOPE_AT_FAULT, "    r8  %016lx  r9  %016lx  r10 %016lx  r11 %016lx\n",
+            (unsigned long) regs[16], (unsigned long) regs[17], (unsigned long) regs[18],
+            (unsigned long) regs[19]);
+    _LOG(log, SCOPE_AT_FAULT, "    r12 %016lx  r13 %016lx  r14 %016lx  r15 %016lx\n",
+            (unsigned long) regs[20], (unsigned long) regs[21], (unsigned long) regs[22],
+            (unsigned long) regs[23]);
+    _LOG(log, SCOPE_AT_FAULT, "    rip %016lx  rbp %016lx  rsp %016lx  eflags %016lx\n",
+            (unsigned long) regs[8], (unsigned long) regs[6], (unsigned long) regs[7],
+            (unsigned long) regs[9]);
+}
@@ -55,6 +55,20 @@
 //                                            V
 //                                         sys_exit
 //
+// WriteDumpNow dumps the calling thread without a crash:
+//
+//   WriteDumpNow (signals the calling thread, so that the kernel saves its
+//        |        registers in a ucontext for DumpNowSignalHandler)
+//        V
+//   DumpNowSignalHandler ---------------------| (forks a copy-on-write snapshot
+//        |                                    |  of the process)
+//   (returns; WriteDumpNow starts             V
+//    ReapSnapshot on a new thread,     DumpSnapshot (runs the dumper as
+//    which waits for the snapshot, or         |      HandleSignal does)
+//    kills it if there is no thread)          |
+//                                             V
+//                                          _exit
+//
 
 // This code is a little fragmented. Different functions of the ExceptionHandler
 // class run in a number of different contexts. Some of them run in a normal
@@ -65,6 +79,7 @@
 
 #include "exception_handler.h"
 
+#include <dlfcn.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <linux/limits.h>
@@ -76,6 +91,7 @@
 #include <sys/prctl.h>
 #include <sys/syscall.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "signal.h"
@@ -90,6 +106,7 @@
 #include <android/log.h>
 
 extern "C" {
+#include "../debuggerd/crash_snapshot.h"
 #include "../debuggerd/tombstone.h"
 }
 #if defined(__ANDROID__)
@@ -219,19 +236,69 @@ namespace google_breakpad {
 // time can use |g_crash_context_|.
         ExceptionHandler::CrashContext g_crash_context_;
 
+// WriteDumpNow asks for the ucontext of the calling thread with a signal to it
+// alone.  SIGURG is ignored by default; one that is not a dump request is
+// passed on to the handler that was installed before.
+        const int kDumpNowSignal = SIGURG;
+        pthread_once_t g_dump_now_once_ = PTHREAD_ONCE_INIT;
+        bool g_dump_now_handler_installed_ = false;
+        struct sigaction g_old_dump_now_action_;
+
+// Only one dump is written at a time, and dumps are at least
+// kMinDumpNowIntervalMs apart, so that a loop of failed assertions cannot
+// fork the process over and over.  A snapshot that has not been dumped after
+// kDumpNowTimeoutMs is killed.
+        const int64_t kMinDumpNowIntervalMs = 10000;
+        const int64_t kDumpNowTimeoutMs = 30000;
+        int g_dumps_in_flight_ = 0;
+        int64_t g_last_dump_now_ms_ = 0;
+
+// The request the signal handler serves.  |tid| is only set while
+// WriteDumpNow waits for the signal; the handler sets |snapshot|.
+        struct DumpNowRequest {
+            pid_t tid;
+            ExceptionHandler *handler;
+            pid_t snapshot;
+        };
+        DumpNowRequest g_dump_now_request_;
+
+// Bionic keeps the message given to android_set_abort_message(), which
+// assert() and the like call before abort(), in an abort_msg_t: the buffer's
+// length followed by the text.  Older releases point __abort_message_ptr at
+// it, a libc-private symbol exported only on 32-bit targets and gone since
+// Android 10; where it is missing the tombstone has no abort message.
+        struct AbortMessage;
+        AbortMessage **g_abort_message_ptr_ = NULL;
+
+// Safe in a compromised context once the constructor has looked it up.
+        uintptr_t AbortMessageAddress() {
+            return g_abort_message_ptr_ ? reinterpret_cast<uintptr_t>(*g_abort_message_ptr_) : 0;
+        }
+
+        int64_t MonotonicMs() {
+            struct timespec t;
+            clock_gettime(CLOCK_MONOTONIC, &t);
+            return t.tv_sec * 1000LL + t.tv_nsec / 1000000;
+        }
+
     }  // namespace
 
 // Runs before crashing: normal context.
     ExceptionHandler::ExceptionHandler(const string &directory, DumpCallback callback,
                                        bool install_handler)
             : directory_(directory),
-              callback_(callback) {
+              callback_(callback),
+              tombstone_flags_(0) {
         pthread_mutex_lock(&g_handler_stack_mutex_);
 
         // Pre-fault the crash context struct. This is to avoid failing due to OOM
         // if handling an exception when the process ran out of virtual memory.
         memset(&g_crash_context_, 0, sizeof(g_crash_context_));
 
+        if (!g_abort_message_ptr_)
+            g_abort_message_ptr_ = reinterpret_cast<AbortMessage **>(
+                    dlsym(RTLD_DEFAULT, "__abort_message_ptr"));
+
         if (!g_handler_stack_)
             g_handler_stack_ = new std::vector < ExceptionHandler * >;
         if (install_handler) {
@@ -400,6 +467,156 @@ namespace google_breakpad {
                                            thread_arg->context_size, thread_arg->path) == false;
     }
 
+// Runs before dumping: normal context.
+// static
+    void ExceptionHandler::InstallDumpNowHandler() {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sigemptyset(&sa.sa_mask);
+        sa.sa_sigaction = DumpNowSignalHandler;
+        sa.sa_flags = SA_RESTART | SA_SIGINFO;
+        g_dump_now_handler_installed_ =
+                sigaction(kDumpNowSignal, &sa, &g_old_dump_now_action_) == 0;
+    }
+
+// Runs on the thread to dump: normal context.
+    bool ExceptionHandler::WriteDumpNow() {
+        int idle = 0;
+        if (!__atomic_compare_exchange_n(&g_dumps_in_flight_, &idle, 1, false,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return false;
+        }
+        int64_t now = MonotonicMs();
+        if (g_last_dump_now_ms_ && now - g_last_dump_now_ms_ < kMinDumpNowIntervalMs) {
+            __atomic_store_n(&g_dumps_in_flight_, 0, __ATOMIC_RELEASE);
+            return false;
+        }
+        pthread_once(&g_dump_now_once_, InstallDumpNowHandler);
+        if (!g_dump_now_handler_installed_) {
+            __atomic_store_n(&g_dumps_in_flight_, 0, __ATOMIC_RELEASE);
+            return false;
+        }
+
+        time_t clock;
+        time(&clock);
+        struct tm tm_struct;
+        localtime_r(&clock, &tm_struct);
+        char time_string[20];
+        strftime(time_string, sizeof(time_string), "%Y%m%d%H%M%S", &tm_struct);
+        dump_now_path_ = directory_ + "/" + time_string + "-dump";
+
+        // The signal is delivered to this thread before tgkill returns, as
+        // long as it is not blocked, so the snapshot is forked right here.
+        pid_t tid = syscall(__NR_gettid);
+        g_dump_now_request_.handler = this;
+        g_dump_now_request_.snapshot = -1;
+        sigset_t dump_now_signal, old_mask;
+        sigemptyset(&dump_now_signal);
+        sigaddset(&dump_now_signal, kDumpNowSignal);
+        pthread_sigmask(SIG_UNBLOCK, &dump_now_signal, &old_mask);
+        __atomic_store_n(&g_dump_now_request_.tid, tid, __ATOMIC_RELEASE);
+        tgkill(getpid(), tid, kDumpNowSignal);
+        __atomic_store_n(&g_dump_now_request_.tid, 0, __ATOMIC_RELEASE);
+        pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+        pid_t snapshot = g_dump_now_request_.snapshot;
+        if (snapshot <= 0) {
+            __atomic_store_n(&g_dumps_in_flight_, 0, __ATOMIC_RELEASE);
+            return false;
+        }
+
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        int error = pthread_create(&thread, &attr, ReapSnapshot,
+                                   reinterpret_cast<void *>(static_cast<intptr_t>(snapshot)));
+        pthread_attr_destroy(&attr);
+        if (error) {
+            // Waiting for the dump here would hold the caller for as long as
+            // kDumpNowTimeoutMs, so the snapshot is dropped instead.  Killed
+            // before it can start the dumper, then its group in case it had.
+            kill(snapshot, SIGKILL);
+            kill(-snapshot, SIGKILL);
+            HANDLE_EINTR(waitpid(snapshot, NULL, 0));
+            __atomic_store_n(&g_dumps_in_flight_, 0, __ATOMIC_RELEASE);
+            return false;
+        }
+        g_last_dump_now_ms_ = now;
+        return true;
+    }
+
+// Runs on the thread WriteDumpNow was called on, as the signal handler of a
+// signal it sent itself: the thread holds no locks, so fork() is safe here.
+// static
+    void ExceptionHandler::DumpNowSignalHandler(int sig, siginfo_t *info, void *uc) {
+        pid_t tid = syscall(__NR_gettid);
+        if (info->si_code != SI_TKILL || info->si_pid != getpid() ||
+            __atomic_load_n(&g_dump_now_request_.tid, __ATOMIC_ACQUIRE) != tid) {
+            // Not one of ours, most likely out-of-band socket data.
+            if (g_old_dump_now_action_.sa_flags & SA_SIGINFO) {
+                g_old_dump_now_action_.sa_sigaction(sig, info, uc);
+            } else if (g_old_dump_now_action_.sa_handler != SIG_DFL &&
+                       g_old_dump_now_action_.sa_handler != SIG_IGN) {
+                g_old_dump_now_action_.sa_handler(sig);
+            }
+            return;
+        }
+        __atomic_store_n(&g_dump_now_request_.tid, 0, __ATOMIC_RELAXED);
+
+        // fork() rather than a raw clone, so that the fork handlers of the
+        // allocator leave malloc usable in the snapshot.  The snapshot's only
+        // thread is this one, stopped in this handler with its stack intact.
+        pid_t snapshot = fork();
+        if (snapshot == 0) {
+            _exit(g_dump_now_request_.handler->DumpSnapshot(uc) ? 0 : 1);
+        }
+        g_dump_now_request_.snapshot = snapshot;
+    }
+
+// Runs in the snapshot forked by DumpNowSignalHandler, which has no other
+// thread.  Writes the dump the same way HandleSignal does, with no signal.
+    bool ExceptionHandler::DumpSnapshot(void *uc) {
+        // A crash while dumping must not be reported as one of the app.
+        for (int i = 0; i < kNumHandledSignals; ++i)
+            InstallDefaultHandler(kExceptionSignals[i]);
+        // The dumper is in the snapshot's process group, so that ReapSnapshot
+        // can kill both.
+        setpgid(0, 0);
+        sys_prctl(PR_SET_DUMPABLE, 1, 0, 0, 0);
+
+        memset(&g_crash_context_, 0, sizeof(g_crash_context_));
+        memcpy(&g_crash_context_.context, uc, sizeof(struct ucontext));
+        g_crash_context_.tid = syscall(__NR_gettid);
+        return RunDumper(&g_crash_context_, dump_now_path_.c_str());
+    }
+
+// Waits for the snapshot forked for WriteDumpNow to exit and reports the
+// dump.  Runs on its own thread: normal context.
+// static
+    void *ExceptionHandler::ReapSnapshot(void *arg) {
+        pid_t snapshot = static_cast<pid_t>(reinterpret_cast<intptr_t>(arg));
+        ExceptionHandler *handler = g_dump_now_request_.handler;
+        int64_t deadline = MonotonicMs() + kDumpNowTimeoutMs;
+        int status = 0;
+        pid_t r;
+        while ((r = HANDLE_EINTR(waitpid(snapshot, &status, WNOHANG))) == 0) {
+            if (MonotonicMs() >= deadline) {
+                __android_log_print(6, TAG, "dump timed out");
+                kill(-snapshot, SIGKILL);
+                kill(snapshot, SIGKILL);
+                r = HANDLE_EINTR(waitpid(snapshot, &status, 0));
+                break;
+            }
+            usleep(10000);
+        }
+        bool success = r == snapshot && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        if (handler->callback_)
+            handler->callback_(1, handler->dump_now_path_.c_str(), success);
+        __atomic_store_n(&g_dumps_in_flight_, 0, __ATOMIC_RELEASE);
+        return NULL;
+    }
+
     bool ExceptionHandler::CheckHandlerValid() {
         string file_path = directory_ + "/" + FLAG_FILE;
         FILE* fp = fopen(file_path.c_str(), "r");
@@ -413,8 +630,6 @@ namespace google_breakpad {
         return true;
     }
 
-    int signal;
-
 // This function runs in a compromised context: see the top of the file.
 // Runs on the crashing thread.
     bool ExceptionHandler::HandleSignal(int sig, siginfo_t *info, void *uc) {
@@ -425,9 +640,15 @@ namespace google_breakpad {
             return false;
         }
 
+        // When snapshot capture is armed, the raw snapshot replaces the dump;
+        // the tombstone is written from it when the app next starts.
+        if (crash_snapshot_capture(sig, info, (const struct ucontext*) uc,
+                                   syscall(__NR_gettid), AbortMessageAddress())) {
+            return false;
+        }
+
         if (callback_)
             callback_(0, c_path_, 0);
-        signal = sig;
         // Allow ourselves to be dumped if the signal is trusted.
         bool signal_trusted = info->si_code > 0;
         bool signal_pid_trusted = info->si_code == SI_USER ||
@@ -473,6 +694,32 @@ namespace google_breakpad {
 //  if (IsOutOfProcess())
 //    return crash_generation_client_->RequestDump(context, sizeof(*context));
 
+        path_.clear();
+        time_t clock;
+        time(&clock);
+        struct tm tm_struct;
+        localtime_r(&clock, &tm_struct);
+        char time_string[20];
+        strftime(time_string, sizeof(time_string), "%Y%m%d%H%M%S", &tm_struct);
+        path_ = directory_ + "/" + time_string;
+        c_path_ = path_.c_str();
+
+        bool success = RunDumper(context, c_path_);
+
+        // 删除标记文件
+        string file_path = directory_ + "/" + FLAG_FILE;
+        int result = remove(file_path.c_str());
+
+        if (callback_)
+            success = callback_(1, c_path_, success);
+        __android_log_print(6, TAG, "finish");
+        return false;
+    }
+
+// Clones the process that writes the dump of |context| to |path|, and waits
+// for it.  This function may run in a compromised context: see the top of the
+// file.
+    bool ExceptionHandler::RunDumper(CrashContext *context, const char *path) {
         // Allocating too much stack isn't a problem, and better to err on the side
         // of caution than smash it into random locations.
         static const unsigned kChildStackSize = 16000;
@@ -484,22 +731,12 @@ namespace google_breakpad {
         stack += kChildStackSize;
         my_memset(stack - 16, 0, 16);
 
-        path_.clear();
-        time_t clock;
-        time(&clock);
-        struct tm tm_struct;
-        localtime_r(&clock, &tm_struct);
-        char time_string[20];
-        strftime(time_string, sizeof(time_string), "%Y%m%d%H%M%S", &tm_struct);
-        path_ = directory_ + "/" + time_string;
-        c_path_ = path_.c_str();
-
         ThreadArgument thread_arg;
         thread_arg.handler = this;
         thread_arg.pid = getpid();
         thread_arg.context = context;
         thread_arg.context_size = sizeof(*context);
-        thread_arg.path = c_path_;
+        thread_arg.path = path;
         // We need to explicitly enable ptrace of parent processes on some
         // kernels, but we need to know the PID of the cloned process before we
         // can do this. Create a pipe here which we can use to block the
@@ -534,16 +771,7 @@ namespace google_breakpad {
             __android_log_print(6, TAG, "generate fail");
         }
 
-        bool success = r != -1 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
-
-        // 删除标记文件
-        string file_path = directory_ + "/" + FLAG_FILE;
-        int result = remove(file_path.c_str());
-
-        if (callback_)
-            success = callback_(1, c_path_, success);
-        __android_log_print(6, TAG, "finish");
-        return false;
+        return r != -1 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
     }
 
 // This function runs in a compromised context: see the top of the file.
@@ -573,8 +801,9 @@ namespace google_breakpad {
                                   size_t context_size, const char *path) {
         const ExceptionHandler::CrashContext *crashContext = reinterpret_cast<const ExceptionHandler::CrashContext *>(context);
 
-        return engrave_tombstone(crashing_process, crashContext->tid, signal, 0,
-                                 &crashContext->context, path);
+        return engrave_tombstone(crashing_process, crashContext->tid,
+                                 crashContext->siginfo.si_signo, AbortMessageAddress(),
+                                 &crashContext->context, path, tombstone_flags_);
     }
 
 // In order to making using EBP to calculate the desired value for ESP
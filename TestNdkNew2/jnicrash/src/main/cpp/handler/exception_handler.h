@@ -59,7 +59,7 @@ namespace google_breakpad {
 // ExceptionHandler
 //
 // ExceptionHandler can write a minidump file when an exception occurs,
-// or when WriteMinidump() is called explicitly by your program.
+// or when WriteDumpNow() is called explicitly by your program.
 //
 // To have the exception handler write minidumps when an uncaught exception
 // (crash) occurs, you should create an instance early in the execution
@@ -70,7 +70,7 @@ namespace google_breakpad {
 //
 // If you want to write minidumps without installing the exception handler,
 // you can create an ExceptionHandler with install_handler set to false,
-// then call WriteMinidump.  You can also use this technique if you want to
+// then call WriteDumpNow.  You can also use this technique if you want to
 // use different minidump callbacks for different call sites.
 //
 // In either case, a callback function is called when a minidump is written,
@@ -96,7 +96,7 @@ namespace google_breakpad {
         // writing the dump file, as described above.
         // If install_handler is true, then a minidump will be written whenever
         // an unhandled exception occurs.  If it is false, minidumps will only
-        // be written when WriteMinidump is called.
+        // be written when WriteDumpNow is called.
         ExceptionHandler(const string &directory, DumpCallback callback, bool install_handler);
 
         ~ExceptionHandler();
@@ -118,6 +118,21 @@ namespace google_breakpad {
         // Report a crash signal from an SA_SIGINFO signal handler.
         bool HandleSignal(int sig, siginfo_t *info, void *uc);
 
+        // Writes a tombstone of the calling thread without crashing, e.g. for a
+        // watchdog timeout or a failed assertion.  The thread only pauses for
+        // the fork() of a copy-on-write snapshot of the process; the tombstone
+        // is written from the snapshot while the process goes on, and the
+        // callback is then called with type 1 from another thread.  The
+        // snapshot holds just the calling thread, so other threads are never
+        // dumped.  Returns false without dumping if a dump is still being
+        // written or the last one started less than ten seconds ago.
+        // Normal context only: not from a signal handler.
+        bool WriteDumpNow();
+
+        // Sets the TOMBSTONE_* flags (see debuggerd/tombstone.h) used when
+        // writing the dump, e.g. to include the other threads of the process.
+        void set_tombstone_flags(int flags) { tombstone_flags_ = flags; }
+
     private:
         // Save the old signal handlers and install new ones.
         static bool InstallHandlersLocked();
@@ -133,6 +148,16 @@ namespace google_breakpad {
 
         static void SignalHandler(int sig, siginfo_t *info, void *uc);
 
+        static void InstallDumpNowHandler();
+
+        static void DumpNowSignalHandler(int sig, siginfo_t *info, void *uc);
+
+        static void *ReapSnapshot(void *arg);
+
+        bool DumpSnapshot(void *uc);
+
+        bool RunDumper(CrashContext *context, const char *path);
+
         static int ThreadEntry(void *arg);
 
         bool DoDump(pid_t crashing_process, const void *context,
@@ -150,6 +175,13 @@ namespace google_breakpad {
         // context.
         const char *c_path_;
 
+        // TOMBSTONE_* flags passed to engrave_tombstone.
+        int tombstone_flags_;
+
+        // The full path of the dump WriteDumpNow is writing.  Set before the
+        // snapshot is forked, so the snapshot has it too.
+        string dump_now_path_;
+
 //  scoped_ptr<CrashGenerationClient> crash_generation_client_;
 
         // We need to explicitly enable ptrace of parent processes on some
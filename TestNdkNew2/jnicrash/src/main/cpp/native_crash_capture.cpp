@@ -1,7 +1,22 @@
 #include "com_crashcapture_NativeCrashCapture_JNI.h"
 
 #include "handler/exception_handler.h"
+extern "C" {
+#include "corkscrew/module_table.h"
+#include "debuggerd/crash_snapshot.h"
+#include "debuggerd/hang_watchdog.h"
+#include "debuggerd/tombstone.h"
+}
+#include "profiler/cpu_profiler.h"
+#include "profiler/heap_profiler.h"
+#include "profiler/lock_profiler.h"
+#include "profiler/wall_profiler.h"
 #include <android/log.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
 
 JavaVM *g_jvm;
 
@@ -68,13 +83,80 @@ namespace native_jnicrash {
         }
         return succeeded;
     }
+
+    // TOMBSTONE_* flags for every tombstone; may be set before nativeInit so
+    // that they also apply to a snapshot reported from there.
+    static int g_tombstone_flags;
+    static google_breakpad::ExceptionHandler *g_handler;
+
+    // A crash captured as a snapshot is reported when the app next starts:
+    // the snapshot is moved aside so capture can be re-armed over the file,
+    // and the tombstone is written from it off the start-up path.
+    static char g_crash_dir[PATH_MAX];
+
+    static void snapshot_path(char *buffer, size_t size, const char *suffix) {
+        snprintf(buffer, size, "%s/crash.snapshot%s", g_crash_dir, suffix);
+    }
+
+    void *do_report_snapshot(void *para) {
+        char pending[PATH_MAX];
+        snapshot_path(pending, sizeof(pending), ".pending");
+        const crash_snapshot_t *snapshot = crash_snapshot_open(pending);
+        if (snapshot != NULL) {
+            time_t clock = (time_t) snapshot->time;
+            struct tm tm_struct;
+            localtime_r(&clock, &tm_struct);
+            char time_string[20];
+            strftime(time_string, sizeof(time_string), "%Y%m%d%H%M%S", &tm_struct);
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%s", g_crash_dir, time_string);
+
+            bool succeeded = engrave_tombstone_snapshot(snapshot, path, g_tombstone_flags);
+            crash_snapshot_close(snapshot);
+            unlink(pending);
+            dump_callback(1, path, succeeded);
+        } else {
+            unlink(pending);
+        }
+        return NULL;
+    }
+
+    void hang_report_written(const char *path, bool written) {
+        dump_callback(1, path, written);
+    }
+
+    void report_pending_snapshot() {
+        char current[PATH_MAX];
+        char pending[PATH_MAX];
+        snapshot_path(current, sizeof(current), "");
+        snapshot_path(pending, sizeof(pending), ".pending");
+        // A pending snapshot may also be left over from a run that did not
+        // get to report it.
+        rename(current, pending);
+        if (access(pending, F_OK) != 0) {
+            return;
+        }
+
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        pthread_create(&thread, &attr, do_report_snapshot, NULL);
+        pthread_attr_destroy(&attr);
+    }
 }
 JNIEXPORT jint
 
 JNICALL Java_com_disasterrecovery_jnicrash_NativeCrashCapture_nativeInit
         (JNIEnv *env, jobject obj, jstring crash_dump_path) {
+    // The crash path and the unwinders read the modules from the table
+    // rather than the maps and the linker.
+    module_table_update();
     const char *path = (char *) env->GetStringUTFChars(crash_dump_path, NULL);
     static google_breakpad::ExceptionHandler eh(path, native_jnicrash::dump_callback, true);
+    eh.set_tombstone_flags(native_jnicrash::g_tombstone_flags);
+    native_jnicrash::g_handler = &eh;
+    snprintf(native_jnicrash::g_crash_dir, sizeof(native_jnicrash::g_crash_dir), "%s", path);
     env->ReleaseStringUTFChars(crash_dump_path, path);
 
     jclass objclass = env->FindClass(
@@ -82,9 +164,44 @@ JNICALL Java_com_disasterrecovery_jnicrash_NativeCrashCapture_nativeInit
     globalobjclass = reinterpret_cast<jclass>(env->NewGlobalRef(objclass));
     env->DeleteLocalRef(objclass);
 
+    native_jnicrash::report_pending_snapshot();
     return 1;
 }
 
+JNIEXPORT void
+
+JNICALL Java_com_disasterrecovery_jnicrash_NativeCrashCapture_nativeSetTombstoneFlags
+        (JNIEnv *env, jobject obj, jint flags) {
+    native_jnicrash::g_tombstone_flags = flags;
+    if (native_jnicrash::g_handler != NULL) {
+        native_jnicrash::g_handler->set_tombstone_flags(flags);
+    }
+}
+
+JNIEXPORT jint
+
+JNICALL Java_com_disasterrecovery_jnicrash_NativeCrashCapture_nativeEnableSnapshotCapture
+        (JNIEnv *env, jobject obj) {
+    if (native_jnicrash::g_crash_dir[0] == '\0') {
+        return 0;
+    }
+    char path[PATH_MAX];
+    native_jnicrash::snapshot_path(path, sizeof(path), "");
+    return crash_snapshot_prepare(path) ? 1 : 0;
+}
+
+// Writes a tombstone of the calling thread and returns at once; the path is
+// passed to crashDumpEnd when it has been written.
+JNIEXPORT jint
+
+JNICALL Java_com_disasterrecovery_jnicrash_NativeCrashCapture_nativeWriteDumpNow
+        (JNIEnv *env, jobject obj) {
+    if (native_jnicrash::g_handler == NULL) {
+        return 0;
+    }
+    return native_jnicrash::g_handler->WriteDumpNow() ? 1 : 0;
+}
+
 JNIEXPORT jint
 
 JNICALL Java_com_disasterrecovery_jnicrash_NativeCrashCapture_nativeCrash
@@ -95,3 +212,138 @@ JNICALL Java_com_disasterrecovery_jnicrash_NativeCrashCapture_nativeCrash
 //    *zero = 0;
     return i;
 }
+
+JNIEXPORT jint
+
+JNICALL Java_com_disasterrecovery_jnicrash_NativeCrashCapture_nativeStartProfiler
+        (JNIEnv *env, jobject obj, jint frequency_hz, jint mode) {
+    return cpu_profiler_start(frequency_hz, (cpu_profiler_mode_t) mode) ? 1 : 0;
+}
+
+JNIEXPORT jint
+
+JNICALL Java_com_disasterrecovery_jnicrash_NativeCrashCapture_nativeStopProfiler
+        (JNIEnv *env, jobject obj, jstring profile_path) {
+    const char *path = env->GetStringUTFChars(profile_path, NULL);
+    bool written = cpu_profiler_stop(path);
+    env->ReleaseStringUTFChars(profile_path, path);
+    return written ? 1 : 0;
+}
+
+JNIEXPORT jint
+
+JNICALL Java_com_disasterrecovery_jnicrash_NativeCrashCapture_nativeStartWallProfiler
+        (JNIEnv *env, jobject obj, jint frequency_hz) {
+    return wall_profiler_start(frequency_hz) ? 1 : 0;
+}
+
+JNIEXPORT jint
+
+JNICALL Java_com_disasterrecovery_jnicrash_NativeCrashCapture_nativeStopWallProfiler
+        (JNIEnv *env, jobject obj, jstring profile_path) {
+    const char *path = env->GetStringUTFChars(profile_path, NULL);
+    bool written = wall_profiler_stop(path);
+    env->ReleaseStringUTFChars(profile_path, path);
+    return written ? 1 : 0;
+}
+
+JNIEXPORT jint
+
+JNICALL Java_com_disasterrecovery_jnicrash_NativeCrashCapture_nativeStartHeapProfiler
+        (JNIEnv *env, jobject obj, jint sample_interval) {
+    if (sample_interval < 0) {
+        return 0;
+    }
+    return heap_profiler_start(sample_interval) ? 1 : 0;
+}
+
+JNIEXPORT void
+
+JNICALL Java_com_disasterrecovery_jnicrash_NativeCrashCapture_nativeStopHeapProfiler
+        (JNIEnv *env, jobject obj) {
+    heap_profiler_stop();
+}
+
+JNIEXPORT jint
+
+JNICALL Java_com_disasterrecovery_jnicrash_NativeCrashCapture_nativeDumpHeapProfile
+        (JNIEnv *env, jobject obj, jstring profile_path) {
+    const char *path = env->GetStringUTFChars(profile_path, NULL);
+    bool written = heap_profiler_dump(path);
+    env->ReleaseStringUTFChars(profile_path, path);
+    return written ? 1 : 0;
+}
+
+JNIEXPORT jint
+
+JNICALL Java_com_disasterrecovery_jnicrash_NativeCrashCapture_nativeStartLockProfiler
+        (JNIEnv *env, jobject obj) {
+    return lock_profiler_start() ? 1 : 0;
+}
+
+JNIEXPORT void
+
+JNICALL Java_com_disasterrecovery_jnicrash_NativeCrashCapture_nativeStopLockProfiler
+        (JNIEnv *env, jobject obj) {
+    lock_profiler_stop();
+}
+
+JNIEXPORT jint
+
+JNICALL Java_com_disasterrecovery_jnicrash_NativeCrashCapture_nativeDumpLockProfile
+        (JNIEnv *env, jobject obj, jstring profile_path) {
+    const char *path = env->GetStringUTFChars(profile_path, NULL);
+    bool written = lock_profiler_dump(path);
+    env->ReleaseStringUTFChars(profile_path, path);
+    return written ? 1 : 0;
+}
+
+JNIEXPORT jint
+
+JNICALL Java_com_disasterrecovery_jnicrash_NativeCrashCapture_nativeStartHangWatchdog
+        (JNIEnv *env, jobject obj, jint sample_interval_ms, jint sample_count) {
+    if (native_jnicrash::g_crash_dir[0] == '\0') {
+        return 0;
+    }
+    return hang_watchdog_start(native_jnicrash::g_crash_dir, sample_interval_ms, sample_count,
+                               native_jnicrash::g_tombstone_flags,
+                               native_jnicrash::hang_report_written) ? 1 : 0;
+}
+
+JNIEXPORT void
+
+JNICALL Java_com_disasterrecovery_jnicrash_NativeCrashCapture_nativeStopHangWatchdog
+        (JNIEnv *env, jobject obj) {
+    hang_watchdog_stop();
+}
+
+// Returns a handle for the calling thread to pass to nativeHangHeartbeat, or
+// 0 if no more threads can be watched.
+JNIEXPORT jlong
+
+JNICALL Java_com_disasterrecovery_jnicrash_NativeCrashCapture_nativeRegisterHangThread
+        (JNIEnv *env, jobject obj, jstring thread_name, jint deadline_ms) {
+    const char *name = env->GetStringUTFChars(thread_name, NULL);
+    hang_watchdog_thread_t *thread = hang_watchdog_register(name, deadline_ms);
+    env->ReleaseStringUTFChars(thread_name, name);
+    return reinterpret_cast<jlong>(thread);
+}
+
+JNIEXPORT void
+
+JNICALL Java_com_disasterrecovery_jnicrash_NativeCrashCapture_nativeHangHeartbeat
+        (JNIEnv *env, jobject obj, jlong handle) {
+    // A thread that could not be registered still beats with its 0 handle.
+    if (handle != 0) {
+        hang_watchdog_beat(reinterpret_cast<hang_watchdog_thread_t *>(handle));
+    }
+}
+
+JNIEXPORT void
+
+JNICALL Java_com_disasterrecovery_jnicrash_NativeCrashCapture_nativeUnregisterHangThread
+        (JNIEnv *env, jobject obj, jlong handle) {
+    if (handle != 0) {
+        hang_watchdog_unregister(reinterpret_cast<hang_watchdog_thread_t *>(handle));
+    }
+}
@@ -0,0 +1,411 @@
+/*
+ * Sampling CPU profiler.
+ *
+ * Every thread of the process owns a timer on its own CPU-time clock
+ * (timer_create with SIGEV_THREAD_ID), so a thread is only interrupted while
+ * it is actually running.  The SIGPROF handler unwinds the interrupted
+ * context with unwind_backtrace_signal_arch(), interns the stack in the stack
+ * depot and pushes the handle into a single-producer, single-consumer ring
+ * owned by that thread.  Nothing in the handler takes a lock or allocates.
+ *
+ * A background thread drains the rings into stack counts every
+ * DRAIN_INTERVAL_MS, picks up newly started threads, frees the slots of
+ * threads that have exited and refreshes the memory map used by the handler.
+ *
+ * CPU_PROFILER_PERF_EVENT hands the sampling to the kernel instead, see
+ * perf_sampler.c.
+ */
+
+#define LOG_TAG "CpuProfiler"
+
+#include "cpu_profiler.h"
+#include "perf_sampler.h"
+#include "stack_counts.h"
+#include "thread_info.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "../corkscrew/backtrace-arch.h"
+#include "../corkscrew/map_info.h"
+#include "../corkscrew/stack_depot.h"
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+#ifndef SIGEV_THREAD_ID
+#define SIGEV_THREAD_ID 4
+#endif
+
+#define MAX_PROFILED_THREADS 256
+#define MAX_SAMPLE_DEPTH 32
+/* Samples per thread ring; must be a power of two. */
+#define RING_SIZE 256
+
+static const int DRAIN_INTERVAL_MS = 20;
+static const int RESCAN_INTERVAL_MS = 1000;
+
+typedef struct {
+    pid_t tid;
+    uint64_t start_time;    /* tells this thread from a later one with its tid */
+    timer_t timer;
+    uint32_t head;      /* advanced by the signal handler of the owning thread */
+    uint32_t tail;      /* advanced by the aggregator */
+    uint32_t dropped;
+    stack_id_t samples[RING_SIZE];   /* 0 if the thread could not be unwound */
+} sample_ring_t;
+
+typedef struct {
+    int32_t stopping;
+    int frequency_hz;
+    size_t thread_count;    /* threads profiled since the start */
+    size_t slot_count;      /* rings[] in use or freed; a free slot is NULL */
+    sample_ring_t* rings[MAX_PROFILED_THREADS];
+    pthread_t aggregator;
+    stack_counts_t counts;
+    uint64_t samples;
+    uint64_t dropped;
+} cpu_profiler_t;
+
+static pthread_mutex_t g_profiler_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool g_running;
+static cpu_profiler_mode_t g_mode;
+/* State of the CPU_PROFILER_SIGNAL backend. */
+static cpu_profiler_t g_profiler;
+
+/* Read by the signal handler; swapped by the aggregator. */
+static map_info_t* g_map_info_list;
+/* Number of signal handlers currently using g_map_info_list. */
+static int32_t g_handlers_in_flight;
+static int32_t g_sampling;
+
+static bool g_handler_installed;
+static struct sigaction g_old_action;
+
+/* The CPU-time clock of another thread, see MAKE_THREAD_CPUCLOCK in the kernel. */
+static clockid_t thread_cpu_clock(pid_t tid) {
+    return (clockid_t) ((~(unsigned int) tid << 3) | 6);
+}
+
+static void profiler_signal_handler(int sig, siginfo_t* info, void* uc) {
+    if (info->si_code != SI_TIMER) {
+        if (g_old_action.sa_flags & SA_SIGINFO) {
+            g_old_action.sa_sigaction(sig, info, uc);
+        } else if (g_old_action.sa_handler != SIG_DFL
+                && g_old_action.sa_handler != SIG_IGN) {
+            g_old_action.sa_handler(sig);
+        }
+        return;
+    }
+
+    int saved_errno = errno;
+    // Counted before anything else is looked at so that cpu_profiler_stop()
+    // can wait for handlers that raced with it before unmapping the rings.
+    __atomic_fetch_add(&g_handlers_in_flight, 1, __ATOMIC_SEQ_CST);
+    int index = info->si_value.sival_int;
+    if (__atomic_load_n(&g_sampling, __ATOMIC_SEQ_CST)
+            && index >= 0 && index < MAX_PROFILED_THREADS) {
+        sample_ring_t* ring = __atomic_load_n(&g_profiler.rings[index], __ATOMIC_ACQUIRE);
+        uint32_t head = ring ? __atomic_load_n(&ring->head, __ATOMIC_RELAXED) : 0;
+        if (!ring) {
+            // Timer fired before its ring was published.
+        } else if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= RING_SIZE) {
+            __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+        } else {
+            const map_info_t* milist = __atomic_load_n(&g_map_info_list, __ATOMIC_SEQ_CST);
+            backtrace_frame_t backtrace[MAX_SAMPLE_DEPTH];
+            // Frame pointers keep the time spent in the handler low; the
+            // tables fill in where the chain is missing.
+            ssize_t frames = unwind_backtrace_signal_arch(info, uc, milist,
+                    backtrace, 0, MAX_SAMPLE_DEPTH, UNWIND_MODE_HYBRID);
+
+            // The depot is lock-free, so the ring only needs the handle.
+            ring->samples[head & (RING_SIZE - 1)] = frames > 0
+                    ? stack_depot_put_backtrace(backtrace, frames) : 0;
+            __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+        }
+    }
+    __atomic_fetch_sub(&g_handlers_in_flight, 1, __ATOMIC_SEQ_CST);
+    errno = saved_errno;
+}
+
+static void wait_for_handlers() {
+    while (__atomic_load_n(&g_handlers_in_flight, __ATOMIC_SEQ_CST)) {
+        sched_yield();
+    }
+}
+
+/* Swaps in a fresh memory map once no handler is still using the old one. */
+static void refresh_map_info_list() {
+    map_info_t* milist = acquire_my_map_info_list();
+    map_info_t* old = __atomic_exchange_n(&g_map_info_list, milist, __ATOMIC_SEQ_CST);
+    wait_for_handlers();
+    release_my_map_info_list(old);
+}
+
+static bool is_profiled(pid_t tid) {
+    for (size_t i = 0; i < g_profiler.slot_count; i++) {
+        if (g_profiler.rings[i] && g_profiler.rings[i]->tid == tid) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void start_thread_timer(pid_t tid) {
+    if (is_profiled(tid)) {
+        return;
+    }
+    // The timer carries the slot index, so a slot is reused rather than moved.
+    size_t index = 0;
+    while (index < g_profiler.slot_count && g_profiler.rings[index]) {
+        index++;
+    }
+    if (index >= MAX_PROFILED_THREADS) {
+        return;
+    }
+    sample_ring_t* ring = mmap(NULL, sizeof(sample_ring_t), PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) {
+        return;
+    }
+    ring->tid = tid;
+    ring->start_time = get_thread_start_time(tid);
+
+    struct sigevent sev;
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_notify_thread_id = tid;
+    sev.sigev_signo = SIGPROF;
+    sev.sigev_value.sival_int = index;
+    if (!ring->start_time || timer_create(thread_cpu_clock(tid), &sev, &ring->timer)) {
+        munmap(ring, sizeof(sample_ring_t));
+        return;
+    }
+
+    // Publish the ring before the first signal can arrive.
+    __atomic_store_n(&g_profiler.rings[index], ring, __ATOMIC_RELEASE);
+    if (index == g_profiler.slot_count) {
+        g_profiler.slot_count++;
+    }
+    g_profiler.thread_count++;
+
+    long interval_ns = 1000000000L / g_profiler.frequency_hz;
+    struct itimerspec its;
+    its.it_interval.tv_sec = interval_ns / 1000000000L;
+    its.it_interval.tv_nsec = interval_ns % 1000000000L;
+    its.it_value = its.it_interval;
+    timer_settime(ring->timer, 0, &its, NULL);
+}
+
+/* Starts a timer for every thread that does not have one yet, except skip_tid. */
+static void scan_threads(pid_t skip_tid) {
+    DIR* d = opendir("/proc/self/task");
+    if (d == NULL) {
+        return;
+    }
+    struct dirent* de;
+    while ((de = readdir(d)) != NULL) {
+        char* end;
+        pid_t tid = strtoul(de->d_name, &end, 10);
+        if (*end || tid == 0 || tid == skip_tid) {
+            continue;
+        }
+        start_thread_timer(tid);
+    }
+    closedir(d);
+}
+
+static void drain_ring(sample_ring_t* ring) {
+    uint32_t tail = ring->tail;
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    for (; tail != head; tail++) {
+        stack_id_t stack = ring->samples[tail & (RING_SIZE - 1)];
+        if (stack) {
+            add_stack_count(&g_profiler.counts, stack, 1, 0);
+        }
+        g_profiler.samples++;
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    g_profiler.dropped += __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+}
+
+static void drain_rings() {
+    for (size_t i = 0; i < g_profiler.slot_count; i++) {
+        if (g_profiler.rings[i]) {
+            drain_ring(g_profiler.rings[i]);
+        }
+    }
+}
+
+/*
+ * Frees the slots of threads that have exited, or whose tid now belongs to
+ * a newer thread, so that their timers and rings do not pile up and the
+ * newer thread gets a timer of its own.  The old timer cannot fire again:
+ * its clock is the CPU time of a thread that is gone.
+ */
+static void reap_threads() {
+    for (size_t i = 0; i < g_profiler.slot_count; i++) {
+        sample_ring_t* ring = g_profiler.rings[i];
+        if (!ring || get_thread_start_time(ring->tid) == ring->start_time) {
+            continue;
+        }
+        timer_delete(ring->timer);
+        __atomic_store_n(&g_profiler.rings[i], NULL, __ATOMIC_RELEASE);
+        wait_for_handlers();
+        drain_ring(ring);
+        munmap(ring, sizeof(sample_ring_t));
+    }
+}
+
+/*
+ * Deletes all timers and waits until no handler can touch the rings any more.
+ * Signals that were already queued find g_sampling cleared and do nothing.
+ */
+static void stop_sampling() {
+    __atomic_store_n(&g_sampling, 0, __ATOMIC_SEQ_CST);
+    for (size_t i = 0; i < g_profiler.slot_count; i++) {
+        if (g_profiler.rings[i]) {
+            timer_delete(g_profiler.rings[i]->timer);
+        }
+    }
+    wait_for_handlers();
+}
+
+static void* aggregator_main(void* arg) {
+    // The aggregator itself is not interesting.
+    pid_t self = syscall(__NR_gettid);
+    int since_rescan = 0;
+    while (!__atomic_load_n(&g_profiler.stopping, __ATOMIC_ACQUIRE)) {
+        usleep(DRAIN_INTERVAL_MS * 1000);
+        drain_rings();
+        since_rescan += DRAIN_INTERVAL_MS;
+        if (since_rescan >= RESCAN_INTERVAL_MS) {
+            since_rescan = 0;
+            refresh_map_info_list();
+            reap_threads();
+            scan_threads(self);
+        }
+    }
+    return NULL;
+}
+
+static bool signal_sampler_start(int frequency_hz) {
+    memset(&g_profiler, 0, sizeof(g_profiler));
+    g_profiler.frequency_hz = frequency_hz;
+    init_stack_counts(&g_profiler.counts);
+    g_map_info_list = acquire_my_map_info_list();
+
+    // The handler is never uninstalled: a SIGPROF from a timer that was
+    // deleted while its signal was queued must not hit the default action,
+    // which would kill the process.
+    if (!g_handler_installed) {
+        struct sigaction act;
+        memset(&act, 0, sizeof(act));
+        act.sa_sigaction = profiler_signal_handler;
+        act.sa_flags = SA_RESTART | SA_SIGINFO | SA_ONSTACK;
+        sigemptyset(&act.sa_mask);
+        if (sigaction(SIGPROF, &act, &g_old_action)) {
+            release_my_map_info_list(g_map_info_list);
+            g_map_info_list = NULL;
+            return false;
+        }
+        g_handler_installed = true;
+    }
+
+    __atomic_store_n(&g_sampling, 1, __ATOMIC_SEQ_CST);
+    scan_threads(0);
+    if (pthread_create(&g_profiler.aggregator, NULL, aggregator_main, NULL)) {
+        stop_sampling();
+        release_my_map_info_list(g_map_info_list);
+        g_map_info_list = NULL;
+        return false;
+    }
+    return true;
+}
+
+static bool signal_sampler_stop(FILE* fp) {
+    __atomic_store_n(&g_profiler.stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(g_profiler.aggregator, NULL);
+    stop_sampling();
+    drain_rings();
+
+    bool written = false;
+    if (fp) {
+        fprintf(fp, "cpu profile: %d Hz, %zu threads, %llu samples, %llu dropped\n",
+                g_profiler.frequency_hz, g_profiler.thread_count,
+                (unsigned long long) g_profiler.samples,
+                (unsigned long long) g_profiler.dropped);
+        // Every sampled stack is in the depot, so each PC is looked up once.
+        stack_depot_symbols_t* symbols = stack_depot_symbolize_all();
+        write_stack_counts(fp, &g_profiler.counts, NULL, NULL, symbols);
+        stack_depot_free_symbols(symbols);
+        written = !ferror(fp);
+    }
+
+    for (size_t i = 0; i < g_profiler.slot_count; i++) {
+        if (g_profiler.rings[i]) {
+            munmap(g_profiler.rings[i], sizeof(sample_ring_t));
+            g_profiler.rings[i] = NULL;
+        }
+    }
+    free_stack_counts(&g_profiler.counts);
+    release_my_map_info_list(g_map_info_list);
+    g_map_info_list = NULL;
+    return written;
+}
+
+bool cpu_profiler_start(int frequency_hz, cpu_profiler_mode_t mode) {
+    if (frequency_hz <= 0 || frequency_hz > 10000) {
+        return false;
+    }
+    pthread_mutex_lock(&g_profiler_mutex);
+    bool started = false;
+    if (!g_running) {
+        if (mode == CPU_PROFILER_PERF_EVENT) {
+            started = perf_sampler_start(frequency_hz);
+        } else {
+            started = signal_sampler_start(frequency_hz);
+        }
+        if (started) {
+            g_running = true;
+            g_mode = mode;
+        }
+    }
+    pthread_mutex_unlock(&g_profiler_mutex);
+    return started;
+}
+
+bool cpu_profiler_stop(const char* path) {
+    pthread_mutex_lock(&g_profiler_mutex);
+    if (!g_running) {
+        pthread_mutex_unlock(&g_profiler_mutex);
+        return false;
+    }
+
+    // Stop even if the file cannot be opened; the backends accept NULL.
+    FILE* fp = fopen(path, "w");
+    bool written;
+    if (g_mode == CPU_PROFILER_PERF_EVENT) {
+        written = perf_sampler_stop(fp);
+    } else {
+        written = signal_sampler_stop(fp);
+    }
+    if (fp) {
+        fclose(fp);
+    }
+    g_running = false;
+    pthread_mutex_unlock(&g_profiler_mutex);
+    return written;
+}
@@ -0,0 +1,49 @@
+/* Sampling CPU profiler built on the in-process unwinder. */
+
+#ifndef _PROFILER_CPU_PROFILER_H
+#define _PROFILER_CPU_PROFILER_H
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    /*
+     * Each thread gets a CPU-time timer that delivers SIGPROF to that thread.
+     * The signal handler unwinds the interrupted thread into a per-thread
+     * ring buffer.
+     */
+    CPU_PROFILER_SIGNAL = 0,
+    /*
+     * Each thread gets a perf_event_open() task clock.  The kernel copies the
+     * registers and the top of the user stack into a ring buffer and the
+     * samples are unwound later on a background thread, so the sampled
+     * threads do no work at all.  Usually requires perf_event_paranoid to
+     * allow it.
+     */
+    CPU_PROFILER_PERF_EVENT = 1,
+} cpu_profiler_mode_t;
+
+/*
+ * Starts sampling every thread of this process frequency_hz times per second
+ * of CPU time it consumes.  A background thread aggregates the samples into
+ * stack counts.  Threads that start later are picked up within a second.
+ *
+ * Returns false if the profiler is already running or could not be started.
+ */
+bool cpu_profiler_start(int frequency_hz, cpu_profiler_mode_t mode);
+
+/*
+ * Stops sampling and writes the aggregated profile, most frequent stacks
+ * first, to the given path.  Returns false if the profiler was not running
+ * or the profile could not be written.
+ */
+bool cpu_profiler_stop(const char* path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _PROFILER_CPU_PROFILER_H
@@ -0,0 +1,545 @@
+/*
+ * Sampling heap profiler.
+ *
+ * malloc() and friends are interposed and forward to the next definition
+ * found with dlsym(RTLD_NEXT).  Each thread counts down the bytes it
+ * allocates and samples the allocation that crosses zero, after which a new
+ * exponentially distributed countdown is drawn.  Unsampled allocations cost
+ * a thread-local subtraction; free() costs one load while any sampled
+ * allocation is alive.
+ *
+ * Sampled allocations that are still alive are kept in a fixed-size open
+ * addressing table that malloc() and free() update with compare-and-swap
+ * only; each slot refers to its stack by stack depot handle.  Next to each
+ * slot is the number of live allocations that hash to it, so free() only
+ * probes the table, whose deleted slots make misses long, for the rare
+ * pointer that may be there.  Cumulative
+ * allocations are summed per stack handle in a second such table with
+ * atomic adds, so no allocation ever waits for another.
+ *
+ * Samples are unwound along the frame-pointer chain alone, so the library is
+ * built with frame pointers when the profiler is in.  The chain ends at the
+ * first caller built without them; arm64 code always has frame records, code
+ * for other targets needs -fno-omit-frame-pointer for whole stacks.
+ */
+
+#define LOG_TAG "HeapProfiler"
+
+#include "heap_profiler.h"
+
+#ifdef JNICRASH_HEAP_PROFILER
+
+#include "stack_counts.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "../corkscrew/backtrace.h"
+#include "../corkscrew/stack_depot.h"
+
+#define MAX_HEAP_DEPTH 24
+/* Slots of the live table; must be a power of two. */
+#define LIVE_TABLE_SIZE 65536
+/* Slots of the cumulative table, one per allocation stack; a power of two. */
+#define CUMULATIVE_TABLE_SIZE 16384
+/* dlsym() may allocate before the real allocator is known. */
+#define BOOTSTRAP_ARENA_SIZE 4096
+
+static const size_t DEFAULT_SAMPLE_INTERVAL = 512 * 1024;
+
+/* Keys of live table slots that do not hold an allocation. */
+static const uintptr_t SLOT_EMPTY = 0;
+static const uintptr_t SLOT_BUSY = 1;
+static const uintptr_t SLOT_DELETED = 2;
+
+typedef struct {
+    uintptr_t key;            /* allocation address or one of the SLOT_* values */
+    size_t size;
+    stack_id_t stack;
+} live_allocation_t;
+
+typedef struct {
+    stack_id_t stack;         /* 0 if the slot is free */
+    uint64_t count;           /* estimated allocations */
+    uint64_t bytes;           /* estimated bytes */
+} cumulative_allocation_t;
+
+typedef struct {
+    bool in_profiler;         /* set while this thread runs profiler code */
+    size_t bytes_until_sample;
+    uint64_t random_state;
+} heap_thread_state_t;
+
+typedef void* (*malloc_fn)(size_t);
+typedef void* (*calloc_fn)(size_t, size_t);
+typedef void* (*realloc_fn)(void*, size_t);
+typedef void (*free_fn)(void*);
+typedef void* (*memalign_fn)(size_t, size_t);
+typedef int (*posix_memalign_fn)(void**, size_t, size_t);
+
+static malloc_fn g_real_malloc;
+static calloc_fn g_real_calloc;
+static realloc_fn g_real_realloc;
+static free_fn g_real_free;
+static memalign_fn g_real_memalign;
+static posix_memalign_fn g_real_posix_memalign;
+
+static int32_t g_resolving;
+static uint8_t g_bootstrap_arena[BOOTSTRAP_ARENA_SIZE] __attribute__((aligned(16)));
+static size_t g_bootstrap_used;
+
+static int32_t g_enabled;
+static size_t g_sample_interval = DEFAULT_SAMPLE_INTERVAL;
+static pthread_once_t g_thread_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t g_thread_key;
+static bool g_thread_key_created;
+
+static live_allocation_t* g_live_table;
+/* Live allocations per home slot of the live table. */
+static uint32_t* g_live_hints;
+/* Number of live sampled allocations; free() skips the table while it is 0. */
+static int32_t g_live_count;
+static uint64_t g_dropped_samples;
+
+static cumulative_allocation_t* g_cumulative_table;
+static uint64_t g_dropped_stacks;
+
+static void* bootstrap_alloc(size_t size) {
+    size = (size + 15) & ~(size_t) 15;
+    size_t offset = __atomic_fetch_add(&g_bootstrap_used, size, __ATOMIC_RELAXED);
+    if (offset + size > BOOTSTRAP_ARENA_SIZE) {
+        return NULL;
+    }
+    return g_bootstrap_arena + offset;
+}
+
+static bool is_bootstrap_pointer(const void* ptr) {
+    return (const uint8_t*) ptr >= g_bootstrap_arena
+            && (const uint8_t*) ptr < g_bootstrap_arena + BOOTSTRAP_ARENA_SIZE;
+}
+
+static void resolve_real_functions() {
+    __atomic_store_n(&g_resolving, 1, __ATOMIC_RELAXED);
+    g_real_calloc = (calloc_fn) dlsym(RTLD_NEXT, "calloc");
+    g_real_free = (free_fn) dlsym(RTLD_NEXT, "free");
+    g_real_realloc = (realloc_fn) dlsym(RTLD_NEXT, "realloc");
+    g_real_memalign = (memalign_fn) dlsym(RTLD_NEXT, "memalign");
+    g_real_posix_memalign = (posix_memalign_fn) dlsym(RTLD_NEXT, "posix_memalign");
+    // malloc last: the wrappers use it to tell whether resolution is complete.
+    __atomic_store_n(&g_real_malloc, (malloc_fn) dlsym(RTLD_NEXT, "malloc"), __ATOMIC_RELEASE);
+    __atomic_store_n(&g_resolving, 0, __ATOMIC_RELAXED);
+}
+
+static bool ensure_real_functions() {
+    if (__atomic_load_n(&g_real_malloc, __ATOMIC_ACQUIRE)) {
+        return true;
+    }
+    if (__atomic_load_n(&g_resolving, __ATOMIC_RELAXED)) {
+        // Called from inside dlsym().
+        return false;
+    }
+    resolve_real_functions();
+    return g_real_malloc != NULL;
+}
+
+static void free_thread_state(void* state) {
+    g_real_free(state);
+}
+
+static void create_thread_key() {
+    g_thread_key_created = !pthread_key_create(&g_thread_key, free_thread_state);
+}
+
+static uint64_t next_random(heap_thread_state_t* state) {
+    // xorshift64*
+    uint64_t x = state->random_state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    state->random_state = x;
+    return x * 2685821657736338717ULL;
+}
+
+/* Draws the distance to the next sample from an exponential distribution. */
+static size_t next_sample_distance(heap_thread_state_t* state) {
+    // 53 random bits give a uniform value in (0, 1].
+    double u = ((next_random(state) >> 11) + 1) * (1.0 / 9007199254740992.0);
+    double distance = -log(u) * g_sample_interval;
+    return distance < 1 ? 1 : distance > SIZE_MAX / 2 ? SIZE_MAX / 2 : (size_t) distance;
+}
+
+static heap_thread_state_t* get_thread_state() {
+    if (!g_thread_key_created) {
+        return NULL;
+    }
+    heap_thread_state_t* state = (heap_thread_state_t*) pthread_getspecific(g_thread_key);
+    if (state) {
+        return state;
+    }
+    // The real allocator does not come back here.
+    state = (heap_thread_state_t*) g_real_malloc(sizeof(heap_thread_state_t));
+    if (!state) {
+        return NULL;
+    }
+    state->in_profiler = false;
+    state->random_state = ((uint64_t) gettid() << 32) ^ (uintptr_t) state ^ time(NULL);
+    if (!state->random_state) {
+        state->random_state = 1;
+    }
+    state->bytes_until_sample = next_sample_distance(state);
+    pthread_setspecific(g_thread_key, state);
+    return state;
+}
+
+static uint32_t hash_pointer(uintptr_t ptr) {
+    // Allocations are at least 8-byte aligned.
+    uint32_t h = (uint32_t) (ptr >> 3);
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    return h;
+}
+
+static void insert_live_allocation(uintptr_t ptr, size_t size, stack_id_t stack) {
+    uint32_t mask = LIVE_TABLE_SIZE - 1;
+    uint32_t index = hash_pointer(ptr) & mask;
+    for (uint32_t probe = 0; probe < LIVE_TABLE_SIZE; probe++, index = (index + 1) & mask) {
+        live_allocation_t* slot = &g_live_table[index];
+        uintptr_t key = __atomic_load_n(&slot->key, __ATOMIC_RELAXED);
+        if (key != SLOT_EMPTY && key != SLOT_DELETED) {
+            continue;
+        }
+        if (!__atomic_compare_exchange_n(&slot->key, &key, SLOT_BUSY,
+                false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        slot->size = size;
+        slot->stack = stack;
+        __atomic_fetch_add(&g_live_hints[hash_pointer(ptr) & mask], 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&g_live_count, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&slot->key, ptr, __ATOMIC_RELEASE);
+        return;
+    }
+    __atomic_fetch_add(&g_dropped_samples, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Finds the slot of a live allocation and marks it BUSY, which keeps
+ * everybody else off it until release_live_allocation().  Returns NULL if
+ * the allocation was not sampled.
+ */
+static live_allocation_t* claim_live_allocation(uintptr_t ptr) {
+    uint32_t mask = LIVE_TABLE_SIZE - 1;
+    uint32_t index = hash_pointer(ptr) & mask;
+    // ptr was inserted before it was returned to the caller, if at all.
+    if (!__atomic_load_n(&g_live_hints[index], __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+    for (uint32_t probe = 0; probe < LIVE_TABLE_SIZE; probe++, index = (index + 1) & mask) {
+        live_allocation_t* slot = &g_live_table[index];
+        uintptr_t key = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+        if (key == SLOT_EMPTY) {
+            return NULL;
+        }
+        if (key != ptr) {
+            continue;
+        }
+        // Only the thread freeing ptr can get here, so the swap cannot fail.
+        return __atomic_compare_exchange_n(&slot->key, &key, SLOT_BUSY,
+                false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) ? slot : NULL;
+    }
+    return NULL;
+}
+
+/* Forgets a claimed allocation, or puts it back if it is still alive. */
+static void release_live_allocation(live_allocation_t* slot, uintptr_t ptr, bool alive) {
+    if (alive) {
+        __atomic_store_n(&slot->key, ptr, __ATOMIC_RELEASE);
+    } else {
+        __atomic_fetch_sub(&g_live_hints[hash_pointer(ptr) & (LIVE_TABLE_SIZE - 1)], 1,
+                __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&g_live_count, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&slot->key, SLOT_DELETED, __ATOMIC_RELEASE);
+    }
+}
+
+static void add_cumulative_allocation(stack_id_t stack, uint64_t count, uint64_t bytes) {
+    uint32_t mask = CUMULATIVE_TABLE_SIZE - 1;
+    uint32_t index = hash_pointer((uintptr_t) stack << 3) & mask;
+    for (uint32_t probe = 0; probe < CUMULATIVE_TABLE_SIZE;
+            probe++, index = (index + 1) & mask) {
+        cumulative_allocation_t* slot = &g_cumulative_table[index];
+        stack_id_t key = __atomic_load_n(&slot->stack, __ATOMIC_ACQUIRE);
+        if (!key && __atomic_compare_exchange_n(&slot->stack, &key, stack,
+                false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            key = stack;
+        }
+        if (key == stack) {
+            __atomic_fetch_add(&slot->count, count, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&slot->bytes, bytes, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+    __atomic_fetch_add(&g_dropped_stacks, 1, __ATOMIC_RELAXED);
+}
+
+__attribute__((noinline))
+static void record_sample(heap_thread_state_t* state, void* ptr, size_t size) {
+    state->in_profiler = true;
+    backtrace_frame_t backtrace[MAX_HEAP_DEPTH];
+    // Skip unwind_backtrace_mode, record_sample, note_allocation and the
+    // interposed function.
+    ssize_t frames = unwind_backtrace_mode(backtrace, 4, MAX_HEAP_DEPTH, UNWIND_MODE_FAST);
+    stack_id_t stack = frames > 0 ? stack_depot_put_backtrace(backtrace, frames) : 0;
+    if (stack) {
+        insert_live_allocation((uintptr_t) ptr, size, stack);
+
+        // A sample stands for 1 / P(sampled) allocations of this size.
+        double scale = 1.0 / (1.0 - exp(-(double) size / g_sample_interval));
+        add_cumulative_allocation(stack, (uint64_t) (scale + 0.5),
+                (uint64_t) (size * scale + 0.5));
+    }
+    state->in_profiler = false;
+}
+
+__attribute__((noinline))
+static void note_allocation(void* ptr, size_t size) {
+    if (!ptr || !__atomic_load_n(&g_enabled, __ATOMIC_RELAXED)) {
+        return;
+    }
+    heap_thread_state_t* state = get_thread_state();
+    if (!state || state->in_profiler) {
+        return;
+    }
+    if (size < state->bytes_until_sample) {
+        state->bytes_until_sample -= size;
+        return;
+    }
+    state->bytes_until_sample = next_sample_distance(state);
+    record_sample(state, ptr, size);
+}
+
+static void note_free(void* ptr) {
+    if (ptr && __atomic_load_n(&g_live_count, __ATOMIC_RELAXED)) {
+        live_allocation_t* slot = claim_live_allocation((uintptr_t) ptr);
+        if (slot) {
+            release_live_allocation(slot, (uintptr_t) ptr, false);
+        }
+    }
+}
+
+__attribute__((visibility("default")))
+void* malloc(size_t size) {
+    if (!ensure_real_functions()) {
+        return bootstrap_alloc(size);
+    }
+    void* ptr = g_real_malloc(size);
+    note_allocation(ptr, size);
+    return ptr;
+}
+
+__attribute__((visibility("default")))
+void* calloc(size_t count, size_t size) {
+    if (!ensure_real_functions()) {
+        // The arena is zero-initialized and never reused.
+        return count && size > SIZE_MAX / count ? NULL : bootstrap_alloc(count * size);
+    }
+    void* ptr = g_real_calloc(count, size);
+    note_allocation(ptr, count * size);
+    return ptr;
+}
+
+__attribute__((visibility("default")))
+void* realloc(void* old_ptr, size_t size) {
+    if (!ensure_real_functions()) {
+        return NULL;
+    }
+    if (is_bootstrap_pointer(old_ptr)) {
+        void* ptr = g_real_malloc(size);
+        if (ptr) {
+            size_t available = g_bootstrap_arena + BOOTSTRAP_ARENA_SIZE - (uint8_t*) old_ptr;
+            memcpy(ptr, old_ptr, size < available ? size : available);
+        }
+        return ptr;
+    }
+    // The sample is claimed first so the address cannot be sampled again
+    // before it is forgotten, but only forgotten once the block is gone.
+    live_allocation_t* slot = old_ptr && __atomic_load_n(&g_live_count, __ATOMIC_RELAXED)
+            ? claim_live_allocation((uintptr_t) old_ptr) : NULL;
+    void* ptr = g_real_realloc(old_ptr, size);
+    if (slot) {
+        // realloc(p, 0) frees p and may return NULL; otherwise NULL means p
+        // is untouched.
+        release_live_allocation(slot, (uintptr_t) old_ptr, !ptr && size);
+    }
+    note_allocation(ptr, size);
+    return ptr;
+}
+
+__attribute__((visibility("default")))
+void free(void* ptr) {
+    if (is_bootstrap_pointer(ptr)) {
+        return;
+    }
+    // Forget the sample before the address can be handed out again.
+    note_free(ptr);
+    if (ensure_real_functions()) {
+        g_real_free(ptr);
+    }
+}
+
+__attribute__((visibility("default")))
+void* memalign(size_t alignment, size_t size) {
+    if (!ensure_real_functions()) {
+        return NULL;
+    }
+    void* ptr = g_real_memalign(alignment, size);
+    note_allocation(ptr, size);
+    return ptr;
+}
+
+__attribute__((visibility("default")))
+int posix_memalign(void** out_ptr, size_t alignment, size_t size) {
+    if (!ensure_real_functions()) {
+        return ENOMEM;
+    }
+    int result = g_real_posix_memalign(out_ptr, alignment, size);
+    if (!result) {
+        note_allocation(*out_ptr, size);
+    }
+    return result;
+}
+
+bool heap_profiler_start(size_t sample_interval) {
+    // Our malloc() must be the one everybody calls, or nothing is sampled.
+    if (!ensure_real_functions() || dlsym(RTLD_DEFAULT, "malloc") == (void*) g_real_malloc) {
+        return false;
+    }
+    pthread_once(&g_thread_key_once, create_thread_key);
+    if (!g_thread_key_created) {
+        return false;
+    }
+    if (!g_live_table) {
+        void* table = mmap(NULL,
+                LIVE_TABLE_SIZE * (sizeof(live_allocation_t) + sizeof(uint32_t)),
+                PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (table == MAP_FAILED) {
+            return false;
+        }
+        g_live_hints = (uint32_t*) ((live_allocation_t*) table + LIVE_TABLE_SIZE);
+        g_live_table = (live_allocation_t*) table;
+    }
+    if (!g_cumulative_table) {
+        void* table = mmap(NULL, CUMULATIVE_TABLE_SIZE * sizeof(cumulative_allocation_t),
+                PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (table == MAP_FAILED) {
+            return false;
+        }
+        g_cumulative_table = (cumulative_allocation_t*) table;
+    }
+    g_sample_interval = sample_interval ? sample_interval : DEFAULT_SAMPLE_INTERVAL;
+    __atomic_store_n(&g_enabled, 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+void heap_profiler_stop() {
+    __atomic_store_n(&g_enabled, 0, __ATOMIC_RELEASE);
+}
+
+/* Copies the live table into stack counts, skipping slots that change meanwhile. */
+static void collect_live_allocations(stack_counts_t* live) {
+    for (size_t i = 0; i < LIVE_TABLE_SIZE; i++) {
+        live_allocation_t* slot = &g_live_table[i];
+        uintptr_t key = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+        if (key == SLOT_EMPTY || key == SLOT_BUSY || key == SLOT_DELETED) {
+            continue;
+        }
+        size_t size = slot->size;
+        stack_id_t stack = slot->stack;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->key, __ATOMIC_RELAXED) != key) {
+            continue;
+        }
+        double scale = 1.0 / (1.0 - exp(-(double) size / g_sample_interval));
+        add_stack_count(live, stack, (uint64_t) (scale + 0.5),
+                (uint64_t) (size * scale + 0.5));
+    }
+}
+
+/* Copies the cumulative table into stack counts. */
+static void collect_cumulative_allocations(stack_counts_t* cumulative) {
+    for (size_t i = 0; i < CUMULATIVE_TABLE_SIZE; i++) {
+        cumulative_allocation_t* slot = &g_cumulative_table[i];
+        stack_id_t stack = __atomic_load_n(&slot->stack, __ATOMIC_ACQUIRE);
+        if (stack) {
+            add_stack_count(cumulative, stack, __atomic_load_n(&slot->count, __ATOMIC_RELAXED),
+                    __atomic_load_n(&slot->bytes, __ATOMIC_RELAXED));
+        }
+    }
+}
+
+bool heap_profiler_dump(const char* path) {
+    if (!g_live_table || !g_cumulative_table) {
+        return false;
+    }
+    heap_thread_state_t* state = get_thread_state();
+    if (!state) {
+        return false;
+    }
+    state->in_profiler = true;
+
+    stack_counts_t live;
+    init_stack_counts(&live);
+    collect_live_allocations(&live);
+    stack_counts_t cumulative;
+    init_stack_counts(&cumulative);
+    collect_cumulative_allocations(&cumulative);
+
+    bool written = false;
+    FILE* fp = fopen(path, "w");
+    if (fp) {
+        fprintf(fp, "heap profile: sample interval %zu bytes, %d live samples, "
+                "%llu samples dropped, %llu stacks dropped\n", g_sample_interval,
+                __atomic_load_n(&g_live_count, __ATOMIC_RELAXED),
+                (unsigned long long) __atomic_load_n(&g_dropped_samples, __ATOMIC_RELAXED),
+                (unsigned long long) __atomic_load_n(&g_dropped_stacks, __ATOMIC_RELAXED));
+        // Both profiles are of depot stacks; their PCs are looked up once.
+        stack_depot_symbols_t* symbols = stack_depot_symbolize_all();
+        fprintf(fp, "\nlive heap:\n");
+        write_stack_counts(fp, &live, "bytes", NULL, symbols);
+        fprintf(fp, "\ncumulative allocations:\n");
+        write_stack_counts(fp, &cumulative, "bytes", NULL, symbols);
+        stack_depot_free_symbols(symbols);
+        written = !ferror(fp);
+        fclose(fp);
+    }
+    free_stack_counts(&live);
+    free_stack_counts(&cumulative);
+
+    state->in_profiler = false;
+    return written;
+}
+
+#else
+
+bool heap_profiler_start(size_t sample_interval) {
+    return false;
+}
+
+void heap_profiler_stop() {
+}
+
+bool heap_profiler_dump(const char* path) {
+    return false;
+}
+
+#endif
@@ -0,0 +1,43 @@
+/* Sampling heap profiler built on malloc interposition. */
+
+#ifndef _PROFILER_HEAP_PROFILER_H
+#define _PROFILER_HEAP_PROFILER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Starts sampling allocations.  On average one allocation is sampled every
+ * sample_interval bytes, or every 512 KiB if sample_interval is 0; the
+ * distance between samples is exponentially distributed so that every byte
+ * is equally likely to be sampled.  Sampled allocations are unwound with the
+ * in-process unwinder.
+ *
+ * Only available when the library is built with JNICRASH_HEAP_PROFILER and
+ * its malloc() is the one the process uses, e.g. through LD_PRELOAD.
+ * Returns false otherwise.
+ */
+bool heap_profiler_start(size_t sample_interval);
+
+/*
+ * Stops sampling new allocations.  Sampled allocations stay tracked until
+ * they are freed, and the profile collected so far can still be dumped.
+ */
+void heap_profiler_stop();
+
+/*
+ * Writes the sampled allocations that are still live and the cumulative
+ * allocations since the profiler was started, both scaled up to estimated
+ * bytes.  Returns false if the profile could not be written.
+ */
+bool heap_profiler_dump(const char* path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _PROFILER_HEAP_PROFILER_H
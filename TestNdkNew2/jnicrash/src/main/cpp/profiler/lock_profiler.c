@@ -0,0 +1,564 @@
+/*
+ * Lock contention profiler.
+ *
+ * pthread_mutex_lock() and the blocking pthread_rwlock functions are
+ * interposed.  Every acquisition is first attempted with the matching
+ * trylock; the uncontended path is that call plus, once any lock has been
+ * contended, one probe of the contended-lock table to record the caller as
+ * the lock's holder site.  One in HOLDER_SAMPLE_PERIOD such acquisitions
+ * also unwinds the holder into the stack depot, as does every acquisition
+ * after a wait, so the holder site usually comes with a stack.  When the
+ * trylock fails the waiter is unwound into the stack depot, the blocking
+ * call is timed, and the wait is charged to the pair of waiter stack handle
+ * and the holder site the lock had when the wait began.
+ *
+ * Profiler code itself takes locks (the unwinder's map cache, malloc), so a
+ * per-thread flag sends those straight to the real functions.
+ */
+
+#define LOG_TAG "LockProfiler"
+
+#include "lock_profiler.h"
+
+#ifdef JNICRASH_LOCK_PROFILER
+
+#include "stack_counts.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "../corkscrew/backtrace.h"
+#include "../corkscrew/stack_depot.h"
+
+#define MAX_LOCK_DEPTH 24
+/* Slots of the contended-lock table; must be a power of two. */
+#define CONTENDED_TABLE_SIZE 4096
+/* Slots of the contention table; must be a power of two. */
+#define CONTENTION_TABLE_SIZE 4096
+/* Uncontended acquisitions of a contended lock per holder stack sampled. */
+#define HOLDER_SAMPLE_PERIOD 8192
+
+typedef struct {
+    uintptr_t lock;           /* address of the lock, 0 if the slot is free */
+    uintptr_t holder_pc;      /* call site of the latest acquisition */
+    stack_id_t holder_stack;  /* stack of an acquisition at holder_pc, or 0 */
+} contended_lock_t;
+
+typedef struct {
+    stack_id_t waiter_stack;  /* 0 if the slot is free */
+    stack_id_t holder_stack;  /* latest stack seen at holder_pc, or 0 */
+    uintptr_t holder_pc;
+    uint64_t contentions;
+    uint64_t wait_ns;
+} contention_t;
+
+/* Contentions of one holder site, put together for a dump. */
+typedef struct {
+    uintptr_t holder_pc;
+    stack_id_t holder_stack;
+    uint64_t contentions;
+    uint64_t wait_ns;
+    stack_counts_t waiters;   /* waiter stacks weighted by nanoseconds waited */
+} holder_site_t;
+
+typedef struct {
+    bool in_profiler;
+    uint32_t acquisitions_until_sample;
+} lock_thread_state_t;
+
+typedef int (*mutex_fn)(pthread_mutex_t*);
+typedef int (*rwlock_fn)(pthread_rwlock_t*);
+
+static mutex_fn g_real_mutex_lock;
+static mutex_fn g_real_mutex_trylock;
+static mutex_fn g_real_mutex_unlock;
+static rwlock_fn g_real_rwlock_rdlock;
+static rwlock_fn g_real_rwlock_tryrdlock;
+static rwlock_fn g_real_rwlock_wrlock;
+static rwlock_fn g_real_rwlock_trywrlock;
+
+static int32_t g_enabled;
+static pthread_key_t g_thread_key;
+static bool g_thread_key_created;
+
+static contended_lock_t* g_contended_locks;
+/* Number of locks in g_contended_locks; acquisitions skip the table while it is 0. */
+static int32_t g_contended_lock_count;
+
+/* Always taken with g_real_mutex_lock. */
+static pthread_mutex_t g_contentions_mutex = PTHREAD_MUTEX_INITIALIZER;
+static size_t g_contention_count;
+static uint64_t g_dropped_contentions;
+static contention_t g_contentions[CONTENTION_TABLE_SIZE];
+
+static void resolve_real_functions() {
+    g_real_mutex_trylock = (mutex_fn) dlsym(RTLD_NEXT, "pthread_mutex_trylock");
+    g_real_mutex_unlock = (mutex_fn) dlsym(RTLD_NEXT, "pthread_mutex_unlock");
+    g_real_rwlock_rdlock = (rwlock_fn) dlsym(RTLD_NEXT, "pthread_rwlock_rdlock");
+    g_real_rwlock_tryrdlock = (rwlock_fn) dlsym(RTLD_NEXT, "pthread_rwlock_tryrdlock");
+    g_real_rwlock_wrlock = (rwlock_fn) dlsym(RTLD_NEXT, "pthread_rwlock_wrlock");
+    g_real_rwlock_trywrlock = (rwlock_fn) dlsym(RTLD_NEXT, "pthread_rwlock_trywrlock");
+    // Last, so that a non-NULL g_real_mutex_lock means everything is resolved.
+    __atomic_store_n(&g_real_mutex_lock,
+            (mutex_fn) dlsym(RTLD_NEXT, "pthread_mutex_lock"), __ATOMIC_RELEASE);
+}
+
+static bool ensure_real_functions() {
+    if (!__atomic_load_n(&g_real_mutex_lock, __ATOMIC_ACQUIRE)) {
+        resolve_real_functions();
+    }
+    return g_real_mutex_lock != NULL;
+}
+
+static void free_thread_state(void* state) {
+    munmap(state, sizeof(lock_thread_state_t));
+}
+
+/*
+ * Thread state lives in its own mapping: malloc() may take locks of its own
+ * and must not be reached from here.
+ */
+static lock_thread_state_t* get_thread_state() {
+    lock_thread_state_t* state = (lock_thread_state_t*) pthread_getspecific(g_thread_key);
+    if (state) {
+        return state;
+    }
+    void* mapping = mmap(NULL, sizeof(lock_thread_state_t), PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) {
+        return NULL;
+    }
+    state = (lock_thread_state_t*) mapping;
+    state->in_profiler = false;
+    state->acquisitions_until_sample = HOLDER_SAMPLE_PERIOD;
+    pthread_setspecific(g_thread_key, state);
+    return state;
+}
+
+static uint32_t hash_lock(uintptr_t lock) {
+    uint32_t h = (uint32_t) (lock >> 2);
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    return h;
+}
+
+/* Finds the table slot of a lock, adding it if create is set. */
+static contended_lock_t* find_contended_lock(uintptr_t lock, bool create) {
+    uint32_t mask = CONTENDED_TABLE_SIZE - 1;
+    uint32_t index = hash_lock(lock) & mask;
+    for (uint32_t probe = 0; probe < CONTENDED_TABLE_SIZE; probe++, index = (index + 1) & mask) {
+        contended_lock_t* slot = &g_contended_locks[index];
+        uintptr_t key = __atomic_load_n(&slot->lock, __ATOMIC_ACQUIRE);
+        if (key == lock) {
+            return slot;
+        }
+        if (key) {
+            continue;
+        }
+        if (!create) {
+            return NULL;
+        }
+        if (__atomic_compare_exchange_n(&slot->lock, &key, lock,
+                false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            __atomic_fetch_add(&g_contended_lock_count, 1, __ATOMIC_RELAXED);
+            return slot;
+        }
+        if (key == lock) {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Unwinds the caller of the interposed function into the stack depot.
+ * Must be called directly from the function the interposed one called.
+ */
+static inline __attribute__((always_inline)) stack_id_t unwind_lock_caller() {
+    backtrace_frame_t backtrace[MAX_LOCK_DEPTH];
+    // Skip unwind_backtrace, the profiler function and the interposed one.
+    ssize_t frames = unwind_backtrace(backtrace, 3, MAX_LOCK_DEPTH);
+    return frames > 0 ? stack_depot_put_backtrace(backtrace, frames) : 0;
+}
+
+/*
+ * Remembers the holder of a lock that has been contended before.  The pc
+ * and the stack are two stores, so a racing waiter may see a stack from an
+ * earlier acquisition at the same site; it never sees one from another site
+ * for long.
+ */
+__attribute__((noinline))
+static void note_contended_lock_acquired(contended_lock_t* slot, uintptr_t caller) {
+    // A lock mostly taken from one site keeps its cache line clean.
+    if (__atomic_load_n(&slot->holder_pc, __ATOMIC_RELAXED) != caller) {
+        __atomic_store_n(&slot->holder_pc, caller, __ATOMIC_RELAXED);
+        __atomic_store_n(&slot->holder_stack, 0, __ATOMIC_RELAXED);
+    }
+    lock_thread_state_t* state = get_thread_state();
+    if (!state || state->in_profiler || --state->acquisitions_until_sample) {
+        return;
+    }
+    state->acquisitions_until_sample = HOLDER_SAMPLE_PERIOD;
+    state->in_profiler = true;
+    __atomic_store_n(&slot->holder_stack, unwind_lock_caller(), __ATOMIC_RELAXED);
+    state->in_profiler = false;
+}
+
+static inline void note_acquired(const void* lock, uintptr_t caller) {
+    if (!__atomic_load_n(&g_contended_lock_count, __ATOMIC_RELAXED)) {
+        return;
+    }
+    contended_lock_t* slot = find_contended_lock((uintptr_t) lock, false);
+    if (slot) {
+        note_contended_lock_acquired(slot, caller);
+    }
+}
+
+static int64_t monotonic_ns() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static uint32_t hash_contention(stack_id_t waiter_stack, uintptr_t holder_pc) {
+    uint32_t h = waiter_stack * 0x9e3779b1u ^ hash_lock(holder_pc);
+    h ^= h >> 15;
+    return h;
+}
+
+static void record_contention(uintptr_t holder_pc, stack_id_t holder_stack,
+        stack_id_t waiter_stack, int64_t wait_ns) {
+    if (!waiter_stack) {
+        __atomic_fetch_add(&g_dropped_contentions, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    g_real_mutex_lock(&g_contentions_mutex);
+    uint32_t mask = CONTENTION_TABLE_SIZE - 1;
+    uint32_t index = hash_contention(waiter_stack, holder_pc) & mask;
+    contention_t* contention = NULL;
+    for (uint32_t probe = 0; probe < CONTENTION_TABLE_SIZE; probe++, index = (index + 1) & mask) {
+        contention_t* slot = &g_contentions[index];
+        if (!slot->waiter_stack) {
+            slot->waiter_stack = waiter_stack;
+            slot->holder_stack = 0;
+            slot->holder_pc = holder_pc;
+            g_contention_count++;
+            contention = slot;
+            break;
+        }
+        if (slot->waiter_stack == waiter_stack && slot->holder_pc == holder_pc) {
+            contention = slot;
+            break;
+        }
+    }
+    if (contention) {
+        if (holder_stack) {
+            contention->holder_stack = holder_stack;
+        }
+        contention->contentions++;
+        contention->wait_ns += wait_ns;
+    } else {
+        g_dropped_contentions++;
+    }
+    g_real_mutex_unlock(&g_contentions_mutex);
+}
+
+/*
+ * Blocks on a lock whose trylock failed.  block is the real blocking
+ * function for the kind of lock, called with lock.
+ */
+__attribute__((noinline))
+static int lock_contended(void* lock, int (*block)(void*), uintptr_t caller) {
+    lock_thread_state_t* state = get_thread_state();
+    if (!state || state->in_profiler) {
+        return block(lock);
+    }
+    state->in_profiler = true;
+
+    contended_lock_t* slot = find_contended_lock((uintptr_t) lock, true);
+    uintptr_t holder_pc = 0;
+    stack_id_t holder_stack = 0;
+    if (slot) {
+        holder_pc = __atomic_load_n(&slot->holder_pc, __ATOMIC_RELAXED);
+        holder_stack = __atomic_load_n(&slot->holder_stack, __ATOMIC_RELAXED);
+    }
+
+    // Unwound before blocking so that only the waiter pays for it.
+    stack_id_t waiter_stack = unwind_lock_caller();
+
+    int64_t start_ns = monotonic_ns();
+    int result = block(lock);
+    int64_t wait_ns = monotonic_ns() - start_ns;
+
+    if (result == 0 && slot) {
+        // The waiter is the holder now, and its stack is at hand.
+        __atomic_store_n(&slot->holder_pc, caller, __ATOMIC_RELAXED);
+        __atomic_store_n(&slot->holder_stack, waiter_stack, __ATOMIC_RELAXED);
+    }
+    record_contention(holder_pc, holder_stack, waiter_stack, wait_ns);
+    state->in_profiler = false;
+    return result;
+}
+
+static int block_on_mutex(void* lock) {
+    return g_real_mutex_lock((pthread_mutex_t*) lock);
+}
+
+static int block_on_rdlock(void* lock) {
+    return g_real_rwlock_rdlock((pthread_rwlock_t*) lock);
+}
+
+static int block_on_wrlock(void* lock) {
+    return g_real_rwlock_wrlock((pthread_rwlock_t*) lock);
+}
+
+__attribute__((visibility("default")))
+int pthread_mutex_lock(pthread_mutex_t* mutex) {
+    if (!ensure_real_functions()) {
+        return EINVAL;
+    }
+    if (!__atomic_load_n(&g_enabled, __ATOMIC_RELAXED)) {
+        return g_real_mutex_lock(mutex);
+    }
+    int result = g_real_mutex_trylock(mutex);
+    if (result == 0) {
+        note_acquired(mutex, (uintptr_t) __builtin_return_address(0));
+        return 0;
+    }
+    if (result != EBUSY) {
+        return g_real_mutex_lock(mutex);
+    }
+    return lock_contended(mutex, block_on_mutex, (uintptr_t) __builtin_return_address(0));
+}
+
+__attribute__((visibility("default")))
+int pthread_rwlock_rdlock(pthread_rwlock_t* rwlock) {
+    if (!ensure_real_functions()) {
+        return EINVAL;
+    }
+    if (!__atomic_load_n(&g_enabled, __ATOMIC_RELAXED)) {
+        return g_real_rwlock_rdlock(rwlock);
+    }
+    int result = g_real_rwlock_tryrdlock(rwlock);
+    if (result == 0) {
+        note_acquired(rwlock, (uintptr_t) __builtin_return_address(0));
+        return 0;
+    }
+    if (result != EBUSY) {
+        return g_real_rwlock_rdlock(rwlock);
+    }
+    return lock_contended(rwlock, block_on_rdlock, (uintptr_t) __builtin_return_address(0));
+}
+
+__attribute__((visibility("default")))
+int pthread_rwlock_wrlock(pthread_rwlock_t* rwlock) {
+    if (!ensure_real_functions()) {
+        return EINVAL;
+    }
+    if (!__atomic_load_n(&g_enabled, __ATOMIC_RELAXED)) {
+        return g_real_rwlock_wrlock(rwlock);
+    }
+    int result = g_real_rwlock_trywrlock(rwlock);
+    if (result == 0) {
+        note_acquired(rwlock, (uintptr_t) __builtin_return_address(0));
+        return 0;
+    }
+    if (result != EBUSY) {
+        return g_real_rwlock_wrlock(rwlock);
+    }
+    return lock_contended(rwlock, block_on_wrlock, (uintptr_t) __builtin_return_address(0));
+}
+
+bool lock_profiler_start() {
+    // Our pthread_mutex_lock() must be the one everybody calls.
+    if (!ensure_real_functions()
+            || dlsym(RTLD_DEFAULT, "pthread_mutex_lock") == (void*) g_real_mutex_lock) {
+        return false;
+    }
+    if (!g_thread_key_created) {
+        if (pthread_key_create(&g_thread_key, free_thread_state)) {
+            return false;
+        }
+        g_thread_key_created = true;
+    }
+    if (!g_contended_locks) {
+        void* table = mmap(NULL, CONTENDED_TABLE_SIZE * sizeof(contended_lock_t),
+                PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (table == MAP_FAILED) {
+            return false;
+        }
+        g_contended_locks = (contended_lock_t*) table;
+    }
+    __atomic_store_n(&g_enabled, 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+void lock_profiler_stop() {
+    __atomic_store_n(&g_enabled, 0, __ATOMIC_RELEASE);
+}
+
+static int compare_sites(const void* a, const void* b) {
+    const holder_site_t* sa = (const holder_site_t*) a;
+    const holder_site_t* sb = (const holder_site_t*) b;
+    if (sa->wait_ns != sb->wait_ns) {
+        return sa->wait_ns < sb->wait_ns ? 1 : -1;
+    }
+    return 0;
+}
+
+static int compare_contention_sites(const void* a, const void* b) {
+    const contention_t* ca = (const contention_t*) a;
+    const contention_t* cb = (const contention_t*) b;
+    if (ca->holder_pc != cb->holder_pc) {
+        return ca->holder_pc < cb->holder_pc ? -1 : 1;
+    }
+    return 0;
+}
+
+/*
+ * Groups the contentions by holder site.  Returns the number of sites, or
+ * -1 if memory ran out.
+ */
+static ssize_t collect_holder_sites(holder_site_t** out_sites) {
+    contention_t* contentions = (contention_t*) malloc(sizeof(g_contentions));
+    holder_site_t* sites = (holder_site_t*) malloc(
+            (g_contention_count ? g_contention_count : 1) * sizeof(holder_site_t));
+    if (!contentions || !sites) {
+        free(contentions);
+        free(sites);
+        return -1;
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < CONTENTION_TABLE_SIZE; i++) {
+        if (g_contentions[i].waiter_stack) {
+            contentions[count++] = g_contentions[i];
+        }
+    }
+    qsort(contentions, count, sizeof(contention_t), compare_contention_sites);
+
+    ssize_t site_count = 0;
+    holder_site_t* site = NULL;
+    for (size_t i = 0; i < count; i++) {
+        const contention_t* contention = &contentions[i];
+        if (!site || site->holder_pc != contention->holder_pc) {
+            site = &sites[site_count++];
+            site->holder_pc = contention->holder_pc;
+            site->holder_stack = 0;
+            site->contentions = 0;
+            site->wait_ns = 0;
+            init_stack_counts(&site->waiters);
+        }
+        if (contention->holder_stack) {
+            site->holder_stack = contention->holder_stack;
+        }
+        site->contentions += contention->contentions;
+        site->wait_ns += contention->wait_ns;
+        if (contention->waiter_stack) {
+            add_stack_count(&site->waiters, contention->waiter_stack,
+                    contention->contentions, contention->wait_ns);
+        }
+    }
+    free(contentions);
+    *out_sites = sites;
+    return site_count;
+}
+
+/* Writes the holder's stack if one was sampled, or else its call site. */
+static void write_holder_site(FILE* fp, const holder_site_t* site) {
+    const uintptr_t* pcs;
+    size_t frames = site->holder_stack ? stack_depot_get(site->holder_stack, &pcs) : 0;
+    if (!frames && site->holder_pc) {
+        pcs = &site->holder_pc;
+        frames = 1;
+    }
+    if (!frames) {
+        fprintf(fp, "\nheld at: unknown\n");
+    } else {
+        fprintf(fp, "\nheld at:\n");
+        backtrace_frame_t backtrace[MAX_LOCK_DEPTH];
+        backtrace_symbol_t symbols[MAX_LOCK_DEPTH];
+        char line[MAX_BACKTRACE_LINE_LENGTH];
+        if (frames > MAX_LOCK_DEPTH) {
+            frames = MAX_LOCK_DEPTH;
+        }
+        for (size_t i = 0; i < frames; i++) {
+            backtrace[i].absolute_pc = pcs[i];
+            backtrace[i].stack_top = 0;
+            backtrace[i].stack_size = 0;
+            backtrace[i].flags = 0;
+        }
+        get_backtrace_symbols(backtrace, frames, symbols);
+        for (size_t i = 0; i < frames; i++) {
+            format_backtrace_line(i, &backtrace[i], &symbols[i], line, sizeof(line));
+            fprintf(fp, "  %s\n", line);
+        }
+        free_backtrace_symbols(symbols, frames);
+    }
+    fprintf(fp, "%llu contentions, %llu us waited\n",
+            (unsigned long long) site->contentions,
+            (unsigned long long) (site->wait_ns / 1000));
+}
+
+bool lock_profiler_dump(const char* path) {
+    if (!g_thread_key_created) {
+        return false;
+    }
+    lock_thread_state_t* state = get_thread_state();
+    if (!state) {
+        return false;
+    }
+    state->in_profiler = true;
+
+    bool written = false;
+    FILE* fp = fopen(path, "w");
+    if (fp) {
+        stack_depot_symbols_t* symbols = stack_depot_symbolize_all();
+        g_real_mutex_lock(&g_contentions_mutex);
+        holder_site_t* sites;
+        ssize_t site_count = collect_holder_sites(&sites);
+        uint64_t dropped = g_dropped_contentions;
+        g_real_mutex_unlock(&g_contentions_mutex);
+        if (site_count >= 0) {
+            fprintf(fp, "lock profile: %zd holder sites, %d contended locks, "
+                    "%llu contentions dropped\n", site_count,
+                    __atomic_load_n(&g_contended_lock_count, __ATOMIC_RELAXED),
+                    (unsigned long long) dropped);
+            qsort(sites, site_count, sizeof(holder_site_t), compare_sites);
+            for (ssize_t i = 0; i < site_count; i++) {
+                write_holder_site(fp, &sites[i]);
+                write_stack_counts(fp, &sites[i].waiters, "ns", NULL, symbols);
+                free_stack_counts(&sites[i].waiters);
+            }
+            free(sites);
+        }
+        stack_depot_free_symbols(symbols);
+        written = site_count >= 0 && !ferror(fp);
+        fclose(fp);
+    }
+
+    state->in_profiler = false;
+    return written;
+}
+
+#else
+
+bool lock_profiler_start() {
+    return false;
+}
+
+void lock_profiler_stop() {
+}
+
+bool lock_profiler_dump(const char* path) {
+    return false;
+}
+
+#endif
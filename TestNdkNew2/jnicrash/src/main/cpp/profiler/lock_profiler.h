@@ -0,0 +1,40 @@
+/* Lock contention profiler built on pthread interposition. */
+
+#ifndef _PROFILER_LOCK_PROFILER_H
+#define _PROFILER_LOCK_PROFILER_H
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Starts profiling contention on pthread mutexes and rwlocks.
+ *
+ * A lock is first tried without blocking; only when that fails is the wait
+ * timed and the waiter unwound with the in-process unwinder.  Locks that
+ * have been contended also remember the call site of their latest holder,
+ * with its stack for a sample of acquisitions, and wait time is aggregated
+ * per waiter stack and holder site.
+ *
+ * Only available when the library is built with JNICRASH_LOCK_PROFILER and
+ * its pthread_mutex_lock() is the one the process uses, e.g. through
+ * LD_PRELOAD.  Returns false otherwise.
+ */
+bool lock_profiler_start();
+
+/* Stops recording contention; what was collected can still be dumped. */
+void lock_profiler_stop();
+
+/*
+ * Writes the contention collected so far, most waited-on holder sites first.
+ * Returns false if the profile could not be written.
+ */
+bool lock_profiler_dump(const char* path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _PROFILER_LOCK_PROFILER_H
@@ -0,0 +1,393 @@
+/*
+ * perf_event_open() backend of the CPU profiler.
+ *
+ * Every thread gets a software task-clock event that records the user
+ * registers and a copy of the top of the user stack with each sample.  The
+ * kernel writes the samples into a ring buffer per thread, so the sampled
+ * threads never run any profiler code.  A background thread reads the
+ * buffers and unwinds each sample afterwards over a memory_t backed by the
+ * stack copy; code and unwind tables are read from this process directly.
+ * It also closes the events of threads that have exited once a second.
+ */
+
+#define LOG_TAG "CpuProfiler"
+
+#include "perf_sampler.h"
+#include "stack_counts.h"
+#include "thread_info.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "../corkscrew/backtrace-arch.h"
+#include "../corkscrew/map_info.h"
+#include "../corkscrew/ptrace.h"
+#include "../corkscrew/stack_depot.h"
+
+#define MAX_SAMPLED_THREADS 256
+#define MAX_SAMPLE_DEPTH 32
+/* Bytes of user stack the kernel copies with each sample. */
+#define SAMPLE_STACK_SIZE 8192
+/* Data pages of each ring buffer; must be a power of two. */
+#define RING_DATA_PAGES 16
+/* perf_event_header.size is 16 bits wide. */
+#define MAX_RECORD_SIZE 65536
+
+/* The registers sampled, as a mask of perf register numbers, one past the
+ * highest of them, and the stack pointer's number. */
+#if defined(__arm__)
+/* PERF_REG_ARM_R0 .. PERF_REG_ARM_PC */
+#define SAMPLE_REGS_MASK 0xffffULL
+#define SAMPLE_REGS_COUNT 16
+#define SAMPLE_REG_SP 13
+#elif defined(__aarch64__)
+/* PERF_REG_ARM64_X0 .. PERF_REG_ARM64_PC */
+#define SAMPLE_REGS_MASK 0x1ffffffffULL
+#define SAMPLE_REGS_COUNT 33
+#define SAMPLE_REG_SP 31
+#elif defined(__x86_64__)
+/* PERF_REG_X86_AX .. PERF_REG_X86_IP and PERF_REG_X86_R8 .. PERF_REG_X86_R15;
+ * the kernel refuses the segment registers in between. */
+#define SAMPLE_REGS_MASK 0xff01ffULL
+#define SAMPLE_REGS_COUNT 24
+#define SAMPLE_REG_SP 7
+#endif
+
+#ifdef SAMPLE_REGS_COUNT
+
+static const int READ_INTERVAL_MS = 20;
+static const int RESCAN_INTERVAL_MS = 1000;
+
+typedef struct {
+    pid_t tid;
+    uint64_t start_time;    /* tells this thread from a later one with its tid */
+    int fd;
+    struct perf_event_mmap_page* page;
+    const uint8_t* data;
+    size_t data_size;
+} sampled_thread_t;
+
+typedef struct {
+    int frequency_hz;
+    int32_t stopping;
+    size_t thread_count;    /* threads[] open now */
+    size_t threads_sampled; /* threads sampled since the start */
+    sampled_thread_t threads[MAX_SAMPLED_THREADS];
+    pthread_t reader;
+    map_info_t* map_info_list;
+    stack_counts_t counts;
+    uint64_t samples;
+    uint64_t lost;
+    /* Scratch space for a record that wraps around the end of a ring. */
+    uint8_t* record;
+} perf_sampler_t;
+
+static perf_sampler_t g_sampler;
+
+static size_t ring_mmap_size() {
+    return (1 + RING_DATA_PAGES) * getpagesize();
+}
+
+static bool is_sampled(pid_t tid) {
+    for (size_t i = 0; i < g_sampler.thread_count; i++) {
+        if (g_sampler.threads[i].tid == tid) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void open_thread_event(pid_t tid) {
+    if (g_sampler.thread_count >= MAX_SAMPLED_THREADS || is_sampled(tid)) {
+        return;
+    }
+    uint64_t start_time = get_thread_start_time(tid);
+    if (!start_time) {
+        return;
+    }
+
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_SOFTWARE;
+    attr.config = PERF_COUNT_SW_TASK_CLOCK;
+    attr.sample_freq = g_sampler.frequency_hz;
+    attr.freq = 1;
+    attr.sample_type = PERF_SAMPLE_REGS_USER | PERF_SAMPLE_STACK_USER;
+    attr.sample_regs_user = SAMPLE_REGS_MASK;
+    attr.sample_stack_user = SAMPLE_STACK_SIZE;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    int fd = syscall(__NR_perf_event_open, &attr, tid, -1, -1, 0);
+    if (fd < 0) {
+        return;
+    }
+    void* base = mmap(NULL, ring_mmap_size(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        close(fd);
+        return;
+    }
+
+    sampled_thread_t* thread = &g_sampler.threads[g_sampler.thread_count++];
+    g_sampler.threads_sampled++;
+    thread->tid = tid;
+    thread->start_time = start_time;
+    thread->fd = fd;
+    thread->page = (struct perf_event_mmap_page*) base;
+    thread->data = (const uint8_t*) base + getpagesize();
+    thread->data_size = RING_DATA_PAGES * getpagesize();
+}
+
+static void scan_threads(pid_t skip_tid) {
+    DIR* d = opendir("/proc/self/task");
+    if (d == NULL) {
+        return;
+    }
+    struct dirent* de;
+    while ((de = readdir(d)) != NULL) {
+        char* end;
+        pid_t tid = strtoul(de->d_name, &end, 10);
+        if (*end || tid == 0 || tid == skip_tid) {
+            continue;
+        }
+        open_thread_event(tid);
+    }
+    closedir(d);
+}
+
+static void copy_from_ring(const sampled_thread_t* thread, uint64_t offset,
+        void* out, size_t size) {
+    size_t start = offset & (thread->data_size - 1);
+    size_t first = thread->data_size - start;
+    if (first >= size) {
+        memcpy(out, thread->data + start, size);
+    } else {
+        memcpy(out, thread->data + start, first);
+        memcpy((uint8_t*) out + first, thread->data, size - first);
+    }
+}
+
+/*
+ * Unwinds one PERF_RECORD_SAMPLE.  With our sample_type its body is
+ *   u64 abi; u64 regs[popcount(SAMPLE_REGS_MASK)];  (regs only if abi != 0)
+ *   u64 size; char data[size]; u64 dyn_size;    (dyn_size only if size != 0)
+ */
+static void add_sample(const uint8_t* record, size_t size) {
+    const uint8_t* p = record + sizeof(struct perf_event_header);
+    const uint8_t* end = record + size;
+    g_sampler.samples++;
+
+    uint64_t abi;
+    if (p + sizeof(abi) > end) {
+        return;
+    }
+    memcpy(&abi, p, sizeof(abi));
+    p += sizeof(abi);
+    if (abi == PERF_SAMPLE_REGS_ABI_NONE) {
+        // No user context, e.g. a thread that is exiting.
+        return;
+    }
+
+    uint64_t sampled_regs[__builtin_popcountll(SAMPLE_REGS_MASK)];
+    uint64_t stack_size;
+    if (p + sizeof(sampled_regs) + sizeof(stack_size) > end) {
+        return;
+    }
+    memcpy(sampled_regs, p, sizeof(sampled_regs));
+    p += sizeof(sampled_regs);
+    memcpy(&stack_size, p, sizeof(stack_size));
+    p += sizeof(stack_size);
+
+    const uint8_t* stack = p;
+    uint64_t dyn_size = 0;
+    if (stack_size) {
+        if ((uint64_t) (end - p) < sizeof(dyn_size)
+                || stack_size > (uint64_t) (end - p) - sizeof(dyn_size)) {
+            return;
+        }
+        memcpy(&dyn_size, p + stack_size, sizeof(dyn_size));
+        // dyn_size is how much of the copy is actually valid.
+        if (dyn_size > stack_size) {
+            dyn_size = stack_size;
+        }
+    }
+
+    // The kernel packs the sampled registers; spread them out by number.
+    uintptr_t regs[SAMPLE_REGS_COUNT];
+    for (int i = 0, sampled = 0; i < SAMPLE_REGS_COUNT; i++) {
+        regs[i] = SAMPLE_REGS_MASK & (1ULL << i) ? (uintptr_t) sampled_regs[sampled++] : 0;
+    }
+
+    memory_t memory;
+    init_memory_snapshot(&memory, g_sampler.map_info_list, regs[SAMPLE_REG_SP],
+            stack, dyn_size);
+    backtrace_frame_t backtrace[MAX_SAMPLE_DEPTH];
+    ssize_t frames = unwind_backtrace_regs_arch(regs, &memory, backtrace, 0, MAX_SAMPLE_DEPTH);
+    if (frames <= 0) {
+        return;
+    }
+    uintptr_t pcs[MAX_SAMPLE_DEPTH];
+    for (ssize_t i = 0; i < frames; i++) {
+        pcs[i] = backtrace[i].absolute_pc;
+    }
+    stack_id_t stack = stack_depot_put(pcs, frames);
+    if (stack) {
+        add_stack_count(&g_sampler.counts, stack, 1, 0);
+    }
+}
+
+static void read_ring(sampled_thread_t* thread) {
+    uint64_t head = __atomic_load_n(&thread->page->data_head, __ATOMIC_ACQUIRE);
+    uint64_t tail = thread->page->data_tail;
+    while (tail < head) {
+        struct perf_event_header header;
+        copy_from_ring(thread, tail, &header, sizeof(header));
+        if (header.size < sizeof(header) || header.size > head - tail) {
+            // Should not happen; resynchronize with the writer.
+            tail = head;
+            break;
+        }
+        if (header.type == PERF_RECORD_SAMPLE) {
+            copy_from_ring(thread, tail, g_sampler.record, header.size);
+            add_sample(g_sampler.record, header.size);
+        } else if (header.type == PERF_RECORD_LOST) {
+            // struct { header; u64 id; u64 lost; }
+            uint64_t lost;
+            copy_from_ring(thread, tail + sizeof(header) + sizeof(uint64_t),
+                    &lost, sizeof(lost));
+            g_sampler.lost += lost;
+        }
+        tail += header.size;
+    }
+    // Hands the space back to the kernel.
+    __atomic_store_n(&thread->page->data_tail, tail, __ATOMIC_RELEASE);
+}
+
+static void read_rings() {
+    for (size_t i = 0; i < g_sampler.thread_count; i++) {
+        read_ring(&g_sampler.threads[i]);
+    }
+}
+
+static void close_thread_event(const sampled_thread_t* thread) {
+    munmap(thread->page, ring_mmap_size());
+    close(thread->fd);
+}
+
+/*
+ * Closes the events of threads that have exited, or whose tid now belongs to
+ * a newer thread, after reading what they sampled, so that their fds do not
+ * pile up and the newer thread gets an event of its own.
+ */
+static void reap_threads() {
+    for (size_t i = 0; i < g_sampler.thread_count;) {
+        sampled_thread_t* thread = &g_sampler.threads[i];
+        if (get_thread_start_time(thread->tid) == thread->start_time) {
+            i++;
+            continue;
+        }
+        read_ring(thread);
+        close_thread_event(thread);
+        *thread = g_sampler.threads[--g_sampler.thread_count];
+    }
+}
+
+static void* reader_main(void* arg) {
+    // The reader itself is not interesting.
+    pid_t self = syscall(__NR_gettid);
+    int since_rescan = 0;
+    while (!__atomic_load_n(&g_sampler.stopping, __ATOMIC_ACQUIRE)) {
+        usleep(READ_INTERVAL_MS * 1000);
+        read_rings();
+        since_rescan += READ_INTERVAL_MS;
+        if (since_rescan >= RESCAN_INTERVAL_MS) {
+            since_rescan = 0;
+            // Only this thread unwinds, so the map can be swapped freely.
+            release_my_map_info_list(g_sampler.map_info_list);
+            g_sampler.map_info_list = acquire_my_map_info_list();
+            reap_threads();
+            scan_threads(self);
+        }
+    }
+    return NULL;
+}
+
+static void close_thread_events() {
+    for (size_t i = 0; i < g_sampler.thread_count; i++) {
+        close_thread_event(&g_sampler.threads[i]);
+    }
+    g_sampler.thread_count = 0;
+}
+
+bool perf_sampler_start(int frequency_hz) {
+    memset(&g_sampler, 0, sizeof(g_sampler));
+    g_sampler.frequency_hz = frequency_hz;
+    g_sampler.record = malloc(MAX_RECORD_SIZE);
+    if (!g_sampler.record) {
+        return false;
+    }
+    init_stack_counts(&g_sampler.counts);
+    g_sampler.map_info_list = acquire_my_map_info_list();
+
+    scan_threads(0);
+    if (g_sampler.thread_count == 0
+            || pthread_create(&g_sampler.reader, NULL, reader_main, NULL)) {
+        close_thread_events();
+        release_my_map_info_list(g_sampler.map_info_list);
+        free(g_sampler.record);
+        return false;
+    }
+    return true;
+}
+
+bool perf_sampler_stop(FILE* fp) {
+    __atomic_store_n(&g_sampler.stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(g_sampler.reader, NULL);
+    for (size_t i = 0; i < g_sampler.thread_count; i++) {
+        ioctl(g_sampler.threads[i].fd, PERF_EVENT_IOC_DISABLE, 0);
+    }
+    read_rings();
+    close_thread_events();
+
+    bool written = false;
+    if (fp) {
+        fprintf(fp, "cpu profile (perf_event): %d Hz, %zu threads, %llu samples, %llu lost\n",
+                g_sampler.frequency_hz, g_sampler.threads_sampled,
+                (unsigned long long) g_sampler.samples,
+                (unsigned long long) g_sampler.lost);
+        stack_depot_symbols_t* symbols = stack_depot_symbolize_all();
+        write_stack_counts(fp, &g_sampler.counts, NULL, NULL, symbols);
+        stack_depot_free_symbols(symbols);
+        written = !ferror(fp);
+    }
+
+    free_stack_counts(&g_sampler.counts);
+    release_my_map_info_list(g_sampler.map_info_list);
+    g_sampler.map_info_list = NULL;
+    free(g_sampler.record);
+    g_sampler.record = NULL;
+    return written;
+}
+
+#else
+
+bool perf_sampler_start(int frequency_hz) {
+    // No unwinder for perf register dumps on this architecture.
+    return false;
+}
+
+bool perf_sampler_stop(FILE* fp) {
+    return false;
+}
+
+#endif
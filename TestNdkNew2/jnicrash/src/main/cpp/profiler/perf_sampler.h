@@ -0,0 +1,31 @@
+/* perf_event_open() backend of the CPU profiler. */
+
+#ifndef _PROFILER_PERF_SAMPLER_H
+#define _PROFILER_PERF_SAMPLER_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Opens a task-clock sampling event for every thread of this process.
+ * Returns false if the kernel refused to open any event, for example
+ * because perf_event_paranoid forbids it.
+ * Not thread-safe; serialized by cpu_profiler_start().
+ */
+bool perf_sampler_start(int frequency_hz);
+
+/*
+ * Closes all events, unwinds what is left in the buffers and writes the
+ * profile to fp.  Returns false if the profile could not be written.
+ */
+bool perf_sampler_stop(FILE* fp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _PROFILER_PERF_SAMPLER_H
@@ -0,0 +1,182 @@
+#include "stack_counts.h"
+
+#include <stdlib.h>
+
+#include "../corkscrew/backtrace.h"
+#include "../corkscrew/stack_depot.h"
+
+static uint32_t hash_stack(stack_id_t stack) {
+    // Handles are word offsets of variable-size records; mix the low bits.
+    uint32_t hash = stack * 2654435761u;
+    return hash ^ (hash >> 16);
+}
+
+void init_stack_counts(stack_counts_t* counts) {
+    counts->entries = NULL;
+    counts->capacity = 0;
+    counts->size = 0;
+}
+
+void free_stack_counts(stack_counts_t* counts) {
+    free(counts->entries);
+    init_stack_counts(counts);
+}
+
+static stack_count_t* find_slot(stack_count_t* entries, size_t capacity, stack_id_t stack) {
+    size_t mask = capacity - 1;
+    for (size_t i = hash_stack(stack) & mask;; i = (i + 1) & mask) {
+        stack_count_t* entry = &entries[i];
+        if (!entry->used || entry->stack == stack) {
+            return entry;
+        }
+    }
+}
+
+static bool grow(stack_counts_t* counts) {
+    size_t capacity = counts->capacity ? counts->capacity * 2 : 256;
+    stack_count_t* entries = calloc(capacity, sizeof(stack_count_t));
+    if (!entries) {
+        return false;
+    }
+    for (size_t i = 0; i < counts->capacity; i++) {
+        stack_count_t* old = &counts->entries[i];
+        if (old->used) {
+            *find_slot(entries, capacity, old->stack) = *old;
+        }
+    }
+    free(counts->entries);
+    counts->entries = entries;
+    counts->capacity = capacity;
+    return true;
+}
+
+bool add_stack_count(stack_counts_t* counts, stack_id_t stack, uint64_t count,
+        uint64_t value) {
+    // Keep the load factor under 3/4 so probing stays short.
+    if ((counts->size + 1) * 4 > counts->capacity * 3 && !grow(counts)) {
+        return false;
+    }
+    stack_count_t* entry = find_slot(counts->entries, counts->capacity, stack);
+    if (!entry->used) {
+        entry->used = true;
+        entry->stack = stack;
+        entry->count = 0;
+        entry->value = 0;
+        counts->size++;
+    }
+    entry->count += count;
+    entry->value += value;
+    return true;
+}
+
+static int compare_by_count(const void* a, const void* b) {
+    const stack_count_t* sa = *(const stack_count_t* const*) a;
+    const stack_count_t* sb = *(const stack_count_t* const*) b;
+    if (sa->count != sb->count) {
+        return sa->count < sb->count ? 1 : -1;
+    }
+    return 0;
+}
+
+static int compare_by_value(const void* a, const void* b) {
+    const stack_count_t* sa = *(const stack_count_t* const*) a;
+    const stack_count_t* sb = *(const stack_count_t* const*) b;
+    if (sa->value != sb->value) {
+        return sa->value < sb->value ? 1 : -1;
+    }
+    return compare_by_count(a, b);
+}
+
+/* Fills in the symbols of a stack from symbols; false if some PC is missing. */
+static bool find_stack_symbols(const stack_depot_symbols_t* symbols, const uintptr_t* pcs,
+        size_t frames, backtrace_symbol_t* out_symbols) {
+    for (size_t i = 0; i < frames; i++) {
+        const backtrace_symbol_t* symbol = stack_depot_find_symbol(symbols, pcs[i]);
+        if (!symbol) {
+            return false;
+        }
+        out_symbols[i] = *symbol;
+    }
+    return true;
+}
+
+void write_stack_counts(FILE* fp, const stack_counts_t* counts, const char* value_label,
+        const ptrace_context_t* context, const stack_depot_symbols_t* stack_symbols) {
+    const stack_count_t** sorted = malloc((counts->size ? counts->size : 1)
+            * sizeof(stack_count_t*));
+    if (!sorted) {
+        return;
+    }
+    size_t n = 0;
+    uint64_t total_count = 0;
+    uint64_t total_value = 0;
+    for (size_t i = 0; i < counts->capacity; i++) {
+        if (counts->entries[i].used) {
+            sorted[n++] = &counts->entries[i];
+            total_count += counts->entries[i].count;
+            total_value += counts->entries[i].value;
+        }
+    }
+    qsort(sorted, n, sizeof(stack_count_t*), value_label ? compare_by_value : compare_by_count);
+
+    fprintf(fp, "stacks: %zu, samples: %llu", n, (unsigned long long) total_count);
+    if (value_label) {
+        fprintf(fp, ", %s: %llu", value_label, (unsigned long long) total_value);
+    }
+    fprintf(fp, "\n");
+
+    backtrace_frame_t* backtrace = NULL;
+    backtrace_symbol_t* symbols = NULL;
+    size_t max_frames = 0;
+    for (size_t i = 0; i < n; i++) {
+        const stack_count_t* entry = sorted[i];
+        const uintptr_t* pcs = NULL;
+        size_t frames = entry->stack ? stack_depot_get(entry->stack, &pcs) : 0;
+        if (frames > max_frames) {
+            free(backtrace);
+            free(symbols);
+            max_frames = frames;
+            backtrace = calloc(max_frames, sizeof(backtrace_frame_t));
+            symbols = calloc(max_frames, sizeof(backtrace_symbol_t));
+            if (!backtrace || !symbols) {
+                break;
+            }
+        }
+
+        fprintf(fp, "\n%llu samples (%.2f%%)", (unsigned long long) entry->count,
+                total_count ? entry->count * 100.0 / total_count : 0.0);
+        if (value_label) {
+            fprintf(fp, ", %s: %llu (%.2f%%)", value_label, (unsigned long long) entry->value,
+                    total_value ? entry->value * 100.0 / total_value : 0.0);
+        }
+        fprintf(fp, "\n");
+
+        for (size_t j = 0; j < frames; j++) {
+            backtrace[j].absolute_pc = pcs[j];
+            backtrace[j].stack_top = 0;
+            backtrace[j].stack_size = 0;
+            backtrace[j].flags = 0;
+        }
+        // Symbols found in stack_symbols belong to it.
+        bool shared = false;
+        if (context) {
+            get_backtrace_symbols_ptrace(context, backtrace, frames, symbols);
+        } else if (stack_symbols
+                && find_stack_symbols(stack_symbols, pcs, frames, symbols)) {
+            shared = true;
+        } else {
+            get_backtrace_symbols(backtrace, frames, symbols);
+        }
+        for (size_t j = 0; j < frames; j++) {
+            char line[MAX_BACKTRACE_LINE_LENGTH];
+            format_backtrace_line(j, &backtrace[j], &symbols[j], line, sizeof(line));
+            fprintf(fp, "    %s\n", line);
+        }
+        if (!shared) {
+            free_backtrace_symbols(symbols, frames);
+        }
+    }
+    free(backtrace);
+    free(symbols);
+    free(sorted);
+}
@@ -0,0 +1,65 @@
+/* Aggregation of sampled stacks shared by the profilers. */
+
+#ifndef _PROFILER_STACK_COUNTS_H
+#define _PROFILER_STACK_COUNTS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "../corkscrew/ptrace.h"
+#include "../corkscrew/stack_depot.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * One distinct stack and what has been attributed to it.
+ */
+typedef struct {
+    bool used;
+    stack_id_t stack;    /* depot handle, or 0 for samples without a stack */
+    uint64_t count;      /* number of samples */
+    uint64_t value;      /* summed weight of the samples (bytes, nanoseconds, ...) */
+} stack_count_t;
+
+/*
+ * A hash table of stack_count_t keyed by the depot handle of the stack.
+ * Not thread-safe; each profiler only touches it from its own thread or
+ * under its own lock.
+ */
+typedef struct {
+    stack_count_t* entries;
+    size_t capacity;
+    size_t size;
+} stack_counts_t;
+
+void init_stack_counts(stack_counts_t* counts);
+
+void free_stack_counts(stack_counts_t* counts);
+
+/*
+ * Adds count samples weighing value in total to the given stack.
+ * Returns false if memory for a new entry could not be allocated.
+ */
+bool add_stack_count(stack_counts_t* counts, stack_id_t stack, uint64_t count,
+        uint64_t value);
+
+/*
+ * Symbolizes and writes all stacks, heaviest first.  Stacks are ordered by
+ * value, or by count when value_label is NULL.  The PCs are symbolized
+ * against context if given, otherwise from symbols if given, otherwise
+ * against this process; stacks with PCs that symbols lacks are symbolized
+ * on their own.  One stack_depot_symbolize_all() serves all the stack
+ * counts of an export.
+ */
+void write_stack_counts(FILE* fp, const stack_counts_t* counts, const char* value_label,
+        const ptrace_context_t* context, const stack_depot_symbols_t* symbols);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _PROFILER_STACK_COUNTS_H
@@ -0,0 +1,34 @@
+#include "thread_info.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* starttime is the 22nd field of stat, the 20th after the command name. */
+#define STAT_START_TIME_FIELD 20
+
+uint64_t get_thread_start_time(pid_t tid) {
+    char path[64];
+    char buf[512];
+    snprintf(path, sizeof(path), "/proc/self/task/%d/stat", tid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    ssize_t n = TEMP_FAILURE_RETRY(read(fd, buf, sizeof(buf) - 1));
+    close(fd);
+    if (n <= 0) {
+        return 0;
+    }
+    buf[n] = '\0';
+
+    // The command name may itself contain ") ", so look for the last one.
+    char* p = strrchr(buf, ')');
+    for (int field = 0; p && field < STAT_START_TIME_FIELD; field++) {
+        p = strchr(p + 1, ' ');
+    }
+    return p ? strtoull(p + 1, NULL, 10) : 0;
+}
@@ -0,0 +1,25 @@
+/* What the profilers that keep state per thread need to know of a thread. */
+
+#ifndef _PROFILER_THREAD_INFO_H
+#define _PROFILER_THREAD_INFO_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The time thread tid of this process started, in clock ticks since boot,
+ * or 0 if there is no such thread.  A tid whose start time has changed has
+ * been reused by a newer thread, so the two identify a thread for as long
+ * as per-thread state about it is kept.
+ */
+uint64_t get_thread_start_time(pid_t tid);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _PROFILER_THREAD_INFO_H
@@ -0,0 +1,763 @@
+/*
+ * Wall-clock sampler.
+ *
+ * A helper process forked from this one periodically stops every thread of
+ * this process with ptrace(), unwinds it with unwind_backtrace_ptrace() and
+ * lets it continue.  Unlike the CPU profiler it also sees threads that are
+ * blocked, so each stack is counted under the scheduler state and wait
+ * channel the thread was in just before it was stopped.
+ *
+ * This process has other threads, which may have held the malloc, stdio or
+ * symbolizer locks when it forked, so the helper only makes
+ * async-signal-safe calls into memory set up before the fork.  The unwind
+ * context is loaded here and inherited.  A thread of this process, the
+ * aggregator, reads the stacks the helper sends over a pipe and counts
+ * them; when the module table changes it replaces the helper with one
+ * forked with a new context.  The stacks are interned in the stack depot
+ * and symbolized here, against this process, when the profile is written.
+ *
+ * The helper is controlled over a socket, which unlike a pipe can be
+ * written to without a SIGPIPE if the helper died: one byte once it is
+ * allowed to trace us, then one more to stop it.
+ */
+
+#define LOG_TAG "WallProfiler"
+
+#include "wall_profiler.h"
+#include "stack_counts.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/ptrace.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "../corkscrew/backtrace.h"
+#include "../corkscrew/jit_code.h"
+#include "../corkscrew/module_table.h"
+#include "../corkscrew/ptrace.h"
+#include "../corkscrew/stack_depot.h"
+
+#ifndef PR_SET_PTRACER
+#define PR_SET_PTRACER 0x59616d61
+#endif
+
+#ifndef PTRACE_SEIZE
+#define PTRACE_SEIZE 0x4206
+#endif
+
+#ifndef PTRACE_INTERRUPT
+#define PTRACE_INTERRUPT 0x4207
+#endif
+
+#ifndef PTRACE_EVENT_STOP
+#define PTRACE_EVENT_STOP 128
+#endif
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0x4000
+#endif
+
+#define MAX_SAMPLED_THREADS 512
+#define MAX_SAMPLE_DEPTH 32
+#define MAX_STATE_BUCKETS 64
+#define WCHAN_LENGTH 64
+
+/* The helper copies the JIT table while the process is frozen, so not too
+ * often; the aggregator looks for new modules as often. */
+static const int64_t CONTEXT_RELOAD_NS = 5 * 1000000000LL;
+
+/* frames of the record that ends a sample. */
+#define SAMPLE_END UINT32_MAX
+
+/*
+ * What the helper sends after each sample: a record for every thread it
+ * unwound, followed by its frames PCs, then one whose frames is SAMPLE_END
+ * with the time the process was frozen.
+ */
+typedef struct {
+    uint32_t frames;
+    char state;
+    char wchan[WCHAN_LENGTH];
+    int64_t freeze_ns;
+} sample_record_t;
+
+typedef struct {
+    pid_t tid;
+    char state;
+    char wchan[WCHAN_LENGTH];
+    bool stopped;
+    int pending_signal;
+    ssize_t frames;
+    backtrace_frame_t backtrace[MAX_SAMPLE_DEPTH];
+} thread_sample_t;
+
+/* State of the helper process, all set up before the fork. */
+typedef struct {
+    pid_t pid;
+    pid_t aggregator_tid;       /* not sampled */
+    int control_fd;
+    int data_fd;
+    ptrace_context_t* context;
+    jit_code_t* jit_code;       /* JIT_CODE_MAX entries */
+    int64_t jit_code_loaded_ns;
+    thread_sample_t threads[MAX_SAMPLED_THREADS];
+    uint8_t records[MAX_SAMPLED_THREADS
+            * (sizeof(sample_record_t) + MAX_SAMPLE_DEPTH * sizeof(uintptr_t))
+            + sizeof(sample_record_t)];
+} wall_helper_t;
+
+static wall_helper_t g_helper;
+
+typedef struct {
+    char state;
+    char wchan[WCHAN_LENGTH];
+    uint64_t samples;
+    stack_counts_t counts;
+} state_bucket_t;
+
+/* State of the profiled process, owned by the aggregator while it runs. */
+typedef struct {
+    int frequency_hz;
+    pthread_t aggregator;
+    bool start_done;
+    bool started;
+    int stop_fds[2];
+    pid_t helper_pid;
+    int control_fd;
+    int data_fd;
+    uint32_t module_generation; /* of the helper's context */
+    bool helper_failed;
+    size_t bucket_count;
+    state_bucket_t buckets[MAX_STATE_BUCKETS];
+    uint64_t samples;
+    uint64_t unbucketed;
+    int64_t total_freeze_ns;
+    int64_t max_freeze_ns;
+} wall_profile_t;
+
+static pthread_mutex_t g_wall_profiler_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_wall_profiler_started = PTHREAD_COND_INITIALIZER;
+static bool g_running;
+static wall_profile_t g_profile;
+
+static int64_t monotonic_ns() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+/* Appends s to buf; snprintf() is not async-signal-safe. */
+static size_t append_string(char* buf, size_t length, const char* s) {
+    while (*s) {
+        buf[length++] = *s++;
+    }
+    buf[length] = '\0';
+    return length;
+}
+
+static size_t append_number(char* buf, size_t length, unsigned long value) {
+    char digits[24];
+    size_t count = 0;
+    do {
+        digits[count++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    while (count) {
+        buf[length++] = digits[--count];
+    }
+    buf[length] = '\0';
+    return length;
+}
+
+/* Makes /proc/<pid>/task, or /proc/<pid>/task/<tid>/<file> if tid is set. */
+static void format_task_path(char* path, pid_t pid, pid_t tid, const char* file) {
+    size_t length = append_string(path, 0, "/proc/");
+    length = append_number(path, length, pid);
+    length = append_string(path, length, "/task");
+    if (tid) {
+        length = append_string(path, length, "/");
+        length = append_number(path, length, tid);
+        length = append_string(path, length, "/");
+        append_string(path, length, file);
+    }
+}
+
+static ssize_t read_file(const char* path, char* buf, size_t size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        buf[0] = '\0';
+        return -1;
+    }
+    ssize_t n = TEMP_FAILURE_RETRY(read(fd, buf, size - 1));
+    close(fd);
+    buf[n > 0 ? n : 0] = '\0';
+    return n;
+}
+
+static bool write_fully(int fd, const void* data, size_t size) {
+    const uint8_t* bytes = (const uint8_t*) data;
+    while (size) {
+        ssize_t n = TEMP_FAILURE_RETRY(write(fd, bytes, size));
+        if (n <= 0) {
+            return false;
+        }
+        bytes += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool read_fully(int fd, void* data, size_t size) {
+    uint8_t* bytes = (uint8_t*) data;
+    while (size) {
+        ssize_t n = TEMP_FAILURE_RETRY(read(fd, bytes, size));
+        if (n <= 0) {
+            return false;
+        }
+        bytes += n;
+        size -= n;
+    }
+    return true;
+}
+
+/* Reads the state letter from stat and the wait channel of a thread. */
+static void read_thread_state(pid_t pid, thread_sample_t* thread) {
+    char path[64];
+    char buf[512];
+    thread->state = '?';
+    format_task_path(path, pid, thread->tid, "stat");
+    if (read_file(path, buf, sizeof(buf)) > 0) {
+        // The command name may itself contain ") ", so look for the last one.
+        char* end = strrchr(buf, ')');
+        if (end && end[1] == ' ' && end[2]) {
+            thread->state = end[2];
+        }
+    }
+
+    format_task_path(path, pid, thread->tid, "wchan");
+    if (read_file(path, thread->wchan, sizeof(thread->wchan)) > 0
+            && !strcmp(thread->wchan, "0")) {
+        thread->wchan[0] = '\0';
+    }
+}
+
+/* Parses a directory entry that names a thread; 0 if it does not. */
+static pid_t parse_tid(const char* name) {
+    pid_t tid = 0;
+    for (; *name; name++) {
+        if (*name < '0' || *name > '9') {
+            return 0;
+        }
+        tid = tid * 10 + (*name - '0');
+    }
+    return tid;
+}
+
+/* What getdents64() returns; opendir() allocates. */
+typedef struct {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} linux_dirent64_t;
+
+static size_t list_threads(pid_t pid) {
+    char path[64];
+    format_task_path(path, pid, 0, NULL);
+    int fd = open(path, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        return 0;
+    }
+    size_t count = 0;
+    uint64_t buf[512];
+    long n;
+    while (count < MAX_SAMPLED_THREADS
+            && (n = syscall(__NR_getdents64, fd, buf, sizeof(buf))) > 0) {
+        for (long offset = 0; offset < n && count < MAX_SAMPLED_THREADS; ) {
+            const linux_dirent64_t* de = (const linux_dirent64_t*) ((uint8_t*) buf + offset);
+            offset += de->d_reclen;
+            pid_t tid = parse_tid(de->d_name);
+            if (tid && tid != g_helper.aggregator_tid) {
+                g_helper.threads[count++].tid = tid;
+            }
+        }
+    }
+    close(fd);
+    return count;
+}
+
+/*
+ * Stops a thread without sending it a signal.  If a signal was about to be
+ * delivered to it instead, it is handed back when the thread is detached.
+ */
+static bool seize_thread(thread_sample_t* thread) {
+    thread->stopped = false;
+    thread->pending_signal = 0;
+    if (ptrace(PTRACE_SEIZE, thread->tid, 0, 0)) {
+        return false;
+    }
+    if (ptrace(PTRACE_INTERRUPT, thread->tid, 0, 0)) {
+        ptrace(PTRACE_DETACH, thread->tid, 0, 0);
+        return false;
+    }
+    int status;
+    if (TEMP_FAILURE_RETRY(waitpid(thread->tid, &status, __WALL)) < 0
+            || !WIFSTOPPED(status)) {
+        // The thread exited.
+        return false;
+    }
+    if (status >> 16 != PTRACE_EVENT_STOP) {
+        thread->pending_signal = WSTOPSIG(status);
+    }
+    thread->stopped = true;
+    return true;
+}
+
+/* Sends the stacks of a sample to the aggregator, once the threads run again:
+ * writing to a full pipe while they are stopped could wait for them. */
+static void send_sample(size_t count, int64_t freeze_ns) {
+    uint8_t* p = g_helper.records;
+    sample_record_t record;
+    memset(&record, 0, sizeof(record));
+    for (size_t i = 0; i < count; i++) {
+        const thread_sample_t* thread = &g_helper.threads[i];
+        if (thread->frames <= 0) {
+            continue;
+        }
+        record.frames = thread->frames;
+        record.state = thread->state;
+        memcpy(record.wchan, thread->wchan, sizeof(record.wchan));
+        memcpy(p, &record, sizeof(record));
+        p += sizeof(record);
+        for (ssize_t j = 0; j < thread->frames; j++) {
+            memcpy(p, &thread->backtrace[j].absolute_pc, sizeof(uintptr_t));
+            p += sizeof(uintptr_t);
+        }
+    }
+    memset(&record, 0, sizeof(record));
+    record.frames = SAMPLE_END;
+    record.freeze_ns = freeze_ns;
+    memcpy(p, &record, sizeof(record));
+    p += sizeof(record);
+    write_fully(g_helper.data_fd, g_helper.records, p - g_helper.records);
+}
+
+static void take_sample() {
+    pid_t pid = g_helper.pid;
+    size_t count = list_threads(pid);
+    // Read the states first: once stopped, every thread is in ptrace_stop.
+    for (size_t i = 0; i < count; i++) {
+        read_thread_state(pid, &g_helper.threads[i]);
+    }
+
+    int64_t freeze_start = monotonic_ns();
+    pid_t stopped_tid = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (seize_thread(&g_helper.threads[i]) && !stopped_tid) {
+            stopped_tid = g_helper.threads[i].tid;
+        }
+    }
+
+    // The JIT table is peeked at through any stopped thread, into the
+    // buffer mapped before the fork.
+    ptrace_context_t* context = g_helper.context;
+    if (stopped_tid && freeze_start - g_helper.jit_code_loaded_ns >= CONTEXT_RELOAD_NS) {
+        if (copy_jit_code_ptrace(stopped_tid, g_helper.jit_code, JIT_CODE_MAX,
+                        &context->jit_code_count)) {
+            g_helper.jit_code_loaded_ns = freeze_start;
+        }
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        thread_sample_t* thread = &g_helper.threads[i];
+        thread->frames = 0;
+        if (thread->stopped) {
+            thread->frames = unwind_backtrace_ptrace(thread->tid, context,
+                    thread->backtrace, 0, MAX_SAMPLE_DEPTH, false);
+        }
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        thread_sample_t* thread = &g_helper.threads[i];
+        if (thread->stopped) {
+            ptrace(PTRACE_DETACH, thread->tid, 0, (void*) (intptr_t) thread->pending_signal);
+        }
+    }
+    send_sample(count, monotonic_ns() - freeze_start);
+}
+
+/* Runs in the helper process until the aggregator stops it. */
+static int helper_main(int frequency_hz) {
+    char go;
+    if (TEMP_FAILURE_RETRY(read(g_helper.control_fd, &go, 1)) != 1) {
+        return 1;
+    }
+
+    g_helper.context->jit_code = g_helper.jit_code;
+    g_helper.context->jit_code_count = 0;
+    g_helper.jit_code_loaded_ns = monotonic_ns() - CONTEXT_RELOAD_NS;
+    int64_t interval_ns = 1000000000LL / frequency_hz;
+    int64_t next_ns = monotonic_ns();
+    for (;;) {
+        int64_t now_ns = monotonic_ns();
+        struct pollfd pfd;
+        pfd.fd = g_helper.control_fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        int timeout_ms = next_ns > now_ns ? (next_ns - now_ns + 999999) / 1000000 : 0;
+        int r = poll(&pfd, 1, timeout_ms);
+        if (r > 0 || (r < 0 && errno != EINTR)) {
+            break;
+        }
+        if (monotonic_ns() < next_ns) {
+            continue;
+        }
+        take_sample();
+        // Skip samples that are already overdue rather than bursting.
+        next_ns += interval_ns;
+        now_ns = monotonic_ns();
+        if (next_ns < now_ns) {
+            next_ns = now_ns;
+        }
+    }
+    return 0;
+}
+
+/* Forks a helper with a context of the modules loaded now.  Runs on the
+ * aggregator. */
+static bool start_helper() {
+    module_table_update();
+    uint32_t generation = module_table_generation();
+    ptrace_context_t* context = load_ptrace_context_from_module_table(getpid(), false);
+    if (!context) {
+        return false;
+    }
+    size_t jit_code_size = JIT_CODE_MAX * sizeof(jit_code_t);
+    jit_code_t* jit_code = (jit_code_t*) mmap(NULL, jit_code_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    int control_fds[2];
+    int data_fds[2];
+    if (jit_code == MAP_FAILED) {
+        free_ptrace_context(context);
+        return false;
+    }
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, control_fds)) {
+        munmap(jit_code, jit_code_size);
+        free_ptrace_context(context);
+        return false;
+    }
+    if (pipe2(data_fds, O_CLOEXEC)) {
+        close(control_fds[0]);
+        close(control_fds[1]);
+        munmap(jit_code, jit_code_size);
+        free_ptrace_context(context);
+        return false;
+    }
+
+    // Same-uid tracing still needs the process to be dumpable.
+    prctl(PR_SET_DUMPABLE, 1, 0, 0, 0);
+    g_helper.pid = getpid();
+    g_helper.aggregator_tid = syscall(__NR_gettid);
+    g_helper.control_fd = control_fds[0];
+    g_helper.data_fd = data_fds[1];
+    g_helper.context = context;
+    g_helper.jit_code = jit_code;
+    pid_t child = fork();
+    if (child == 0) {
+        close(control_fds[1]);
+        close(data_fds[0]);
+        _exit(helper_main(g_profile.frequency_hz));
+    }
+    // The helper has its own copies.
+    close(control_fds[0]);
+    close(data_fds[1]);
+    munmap(jit_code, jit_code_size);
+    free_ptrace_context(context);
+    if (child < 0) {
+        close(control_fds[1]);
+        close(data_fds[0]);
+        return false;
+    }
+
+    // Allow the helper to trace us under Yama before it starts sampling.
+    prctl(PR_SET_PTRACER, child, 0, 0, 0);
+    char go = 1;
+    TEMP_FAILURE_RETRY(send(control_fds[1], &go, 1, MSG_NOSIGNAL));
+
+    g_profile.helper_pid = child;
+    g_profile.control_fd = control_fds[1];
+    g_profile.data_fd = data_fds[0];
+    g_profile.module_generation = generation;
+    return true;
+}
+
+static state_bucket_t* find_bucket(char state, const char* wchan) {
+    for (size_t i = 0; i < g_profile.bucket_count; i++) {
+        state_bucket_t* bucket = &g_profile.buckets[i];
+        if (bucket->state == state && !strcmp(bucket->wchan, wchan)) {
+            return bucket;
+        }
+    }
+    if (g_profile.bucket_count == MAX_STATE_BUCKETS) {
+        return NULL;
+    }
+    state_bucket_t* bucket = &g_profile.buckets[g_profile.bucket_count++];
+    bucket->state = state;
+    strlcpy(bucket->wchan, wchan, sizeof(bucket->wchan));
+    bucket->samples = 0;
+    init_stack_counts(&bucket->counts);
+    return bucket;
+}
+
+/* Reads and counts one record from the helper.  Returns false once the
+ * helper is gone. */
+static bool read_record() {
+    sample_record_t record;
+    if (!read_fully(g_profile.data_fd, &record, sizeof(record))) {
+        return false;
+    }
+    if (record.frames == SAMPLE_END) {
+        g_profile.samples++;
+        g_profile.total_freeze_ns += record.freeze_ns;
+        if (record.freeze_ns > g_profile.max_freeze_ns) {
+            g_profile.max_freeze_ns = record.freeze_ns;
+        }
+        return true;
+    }
+    uintptr_t pcs[MAX_SAMPLE_DEPTH];
+    if (record.frames > MAX_SAMPLE_DEPTH
+            || !read_fully(g_profile.data_fd, pcs, record.frames * sizeof(uintptr_t))) {
+        return false;
+    }
+    record.wchan[WCHAN_LENGTH - 1] = '\0';
+    state_bucket_t* bucket = find_bucket(record.state, record.wchan);
+    if (!bucket) {
+        g_profile.unbucketed++;
+        return true;
+    }
+    stack_id_t stack = stack_depot_put(pcs, record.frames);
+    if (stack) {
+        add_stack_count(&bucket->counts, stack, 1, 0);
+    }
+    bucket->samples++;
+    return true;
+}
+
+/* Stops the helper and counts what it sent before it exited. */
+static void stop_helper() {
+    if (!g_profile.helper_pid) {
+        return;
+    }
+    char stop = 0;
+    TEMP_FAILURE_RETRY(send(g_profile.control_fd, &stop, 1, MSG_NOSIGNAL));
+    close(g_profile.control_fd);
+
+    // Something forked from this process may hold the pipe open after the
+    // helper exits, so EOF is not waited for.
+    bool exited = false;
+    int status = 0;
+    for (;;) {
+        struct pollfd pfd;
+        pfd.fd = g_profile.data_fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        int r = poll(&pfd, 1, exited ? 0 : 100);
+        if (r > 0) {
+            if (!read_record()) {
+                break;
+            }
+            continue;
+        }
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (exited || r < 0) {
+            break;
+        }
+        pid_t waited = TEMP_FAILURE_RETRY(waitpid(g_profile.helper_pid, &status, WNOHANG));
+        if (waited == g_profile.helper_pid) {
+            exited = true;
+        } else if (waited < 0) {
+            g_profile.helper_failed = true;
+            break;
+        }
+    }
+    if (!exited && TEMP_FAILURE_RETRY(waitpid(g_profile.helper_pid, &status, 0))
+            != g_profile.helper_pid) {
+        g_profile.helper_failed = true;
+    } else if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+        g_profile.helper_failed = true;
+    }
+    close(g_profile.data_fd);
+    g_profile.helper_pid = 0;
+    g_profile.control_fd = -1;
+    g_profile.data_fd = -1;
+}
+
+/* The aggregator: counts what the helper sends until it is told to stop. */
+static void* aggregate_main(void* arg) {
+    bool started = start_helper();
+    pthread_mutex_lock(&g_wall_profiler_mutex);
+    g_profile.start_done = true;
+    g_profile.started = started;
+    pthread_cond_signal(&g_wall_profiler_started);
+    pthread_mutex_unlock(&g_wall_profiler_mutex);
+    if (!started) {
+        return NULL;
+    }
+
+    int64_t next_check_ns = monotonic_ns() + CONTEXT_RELOAD_NS;
+    for (;;) {
+        struct pollfd pfds[2];
+        pfds[0].fd = g_profile.stop_fds[0];
+        pfds[0].events = POLLIN;
+        pfds[0].revents = 0;
+        pfds[1].fd = g_profile.data_fd;
+        pfds[1].events = POLLIN;
+        pfds[1].revents = 0;
+        int64_t now_ns = monotonic_ns();
+        int timeout_ms = next_check_ns > now_ns
+                ? (next_check_ns - now_ns + 999999) / 1000000 : 0;
+        int r = poll(pfds, g_profile.helper_pid ? 2 : 1, timeout_ms);
+        if (r < 0 && errno != EINTR) {
+            break;
+        }
+        if (r > 0 && pfds[0].revents) {
+            break;
+        }
+        if (r > 0 && g_profile.helper_pid && pfds[1].revents && !read_record()) {
+            // The helper died.
+            stop_helper();
+            g_profile.helper_failed = true;
+        }
+        if (monotonic_ns() >= next_check_ns) {
+            // A helper cannot load a context, so modules loaded since it
+            // was forked take a new one.
+            module_table_update();
+            if (g_profile.helper_pid
+                    && module_table_generation() != g_profile.module_generation) {
+                stop_helper();
+                if (!start_helper()) {
+                    g_profile.helper_failed = true;
+                }
+            }
+            next_check_ns = monotonic_ns() + CONTEXT_RELOAD_NS;
+        }
+    }
+    stop_helper();
+    return NULL;
+}
+
+static int compare_buckets(const void* a, const void* b) {
+    const state_bucket_t* ba = (const state_bucket_t*) a;
+    const state_bucket_t* bb = (const state_bucket_t*) b;
+    if (ba->samples != bb->samples) {
+        return ba->samples < bb->samples ? 1 : -1;
+    }
+    return 0;
+}
+
+static bool write_profile(const char* path) {
+    FILE* fp = fopen(path, "w");
+    if (!fp) {
+        return false;
+    }
+    fprintf(fp, "wall profile: %d Hz, %llu samples, %zu states, %llu thread samples dropped\n",
+            g_profile.frequency_hz, (unsigned long long) g_profile.samples,
+            g_profile.bucket_count, (unsigned long long) g_profile.unbucketed);
+    fprintf(fp, "freeze time: avg %lld us, max %lld us, total %lld ms\n",
+            g_profile.samples ? g_profile.total_freeze_ns / g_profile.samples / 1000 : 0LL,
+            g_profile.max_freeze_ns / 1000,
+            g_profile.total_freeze_ns / 1000000);
+
+    qsort(g_profile.buckets, g_profile.bucket_count, sizeof(state_bucket_t), compare_buckets);
+    stack_depot_symbols_t* symbols = stack_depot_symbolize_all();
+    for (size_t i = 0; i < g_profile.bucket_count; i++) {
+        const state_bucket_t* bucket = &g_profile.buckets[i];
+        fprintf(fp, "\nstate %c (%s): %llu thread samples\n", bucket->state,
+                bucket->wchan[0] ? bucket->wchan : "-",
+                (unsigned long long) bucket->samples);
+        write_stack_counts(fp, &bucket->counts, NULL, NULL, symbols);
+    }
+    stack_depot_free_symbols(symbols);
+    bool written = !ferror(fp);
+    fclose(fp);
+    return written;
+}
+
+static void free_profile() {
+    for (size_t i = 0; i < g_profile.bucket_count; i++) {
+        free_stack_counts(&g_profile.buckets[i].counts);
+    }
+    close(g_profile.stop_fds[0]);
+    close(g_profile.stop_fds[1]);
+    memset(&g_profile, 0, sizeof(g_profile));
+}
+
+bool wall_profiler_start(int frequency_hz) {
+    if (frequency_hz <= 0 || frequency_hz > 1000) {
+        return false;
+    }
+    pthread_mutex_lock(&g_wall_profiler_mutex);
+    if (g_running) {
+        pthread_mutex_unlock(&g_wall_profiler_mutex);
+        return false;
+    }
+
+    memset(&g_profile, 0, sizeof(g_profile));
+    g_profile.frequency_hz = frequency_hz;
+    g_profile.control_fd = -1;
+    g_profile.data_fd = -1;
+    if (pipe2(g_profile.stop_fds, O_CLOEXEC)) {
+        pthread_mutex_unlock(&g_wall_profiler_mutex);
+        return false;
+    }
+    if (pthread_create(&g_profile.aggregator, NULL, aggregate_main, NULL)) {
+        free_profile();
+        pthread_mutex_unlock(&g_wall_profiler_mutex);
+        return false;
+    }
+    while (!g_profile.start_done) {
+        pthread_cond_wait(&g_wall_profiler_started, &g_wall_profiler_mutex);
+    }
+    if (!g_profile.started) {
+        pthread_join(g_profile.aggregator, NULL);
+        free_profile();
+        pthread_mutex_unlock(&g_wall_profiler_mutex);
+        return false;
+    }
+    g_running = true;
+    pthread_mutex_unlock(&g_wall_profiler_mutex);
+    return true;
+}
+
+bool wall_profiler_stop(const char* path) {
+    pthread_mutex_lock(&g_wall_profiler_mutex);
+    if (!g_running) {
+        pthread_mutex_unlock(&g_wall_profiler_mutex);
+        return false;
+    }
+
+    char stop = 0;
+    TEMP_FAILURE_RETRY(write(g_profile.stop_fds[1], &stop, 1));
+    pthread_join(g_profile.aggregator, NULL);
+    bool succeeded = !g_profile.helper_failed && write_profile(path);
+    free_profile();
+    g_running = false;
+    pthread_mutex_unlock(&g_wall_profiler_mutex);
+    return succeeded;
+}
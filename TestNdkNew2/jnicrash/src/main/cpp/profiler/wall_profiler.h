@@ -0,0 +1,36 @@
+/* Wall-clock sampler that freezes the process from a helper process. */
+
+#ifndef _PROFILER_WALL_PROFILER_H
+#define _PROFILER_WALL_PROFILER_H
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Starts a helper process that samples every thread of this process
+ * frequency_hz times per second, whether the threads are running or not.
+ *
+ * For each sample the helper records the scheduler state and wait channel
+ * of every thread, stops all threads with ptrace(), unwinds them and lets
+ * them continue.  Stacks are counted separately for each thread state, and
+ * the time the process spent frozen is measured for every sample.
+ *
+ * Returns false if the sampler is already running or could not be started.
+ */
+bool wall_profiler_start(int frequency_hz);
+
+/*
+ * Stops the helper process and writes the profile to the given path.
+ * Returns false if the sampler was not running, a helper failed or the
+ * profile could not be written.
+ */
+bool wall_profiler_stop(const char* path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _PROFILER_WALL_PROFILER_H
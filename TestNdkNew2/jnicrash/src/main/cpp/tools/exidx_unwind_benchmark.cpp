@@ -0,0 +1,197 @@
+// jnicrash-exidx-unwind-benchmark: how many local unwinds per second the ARM
+// unwinder manages when it finds each frame's EXIDX section through the
+// dynamic linker and when it finds it through the module table.
+//
+// Each thread recurses a few frames deep and unwinds itself there with
+// unwind_backtrace() in a loop.  The runs without the table come first, since
+// the table cannot be taken down once built; each variant's fastest run is
+// reported.  Only meaningful on 32-bit ARM, where the unwinder reads EXIDX.
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include "backtrace.h"
+#include "module_table.h"
+
+namespace jnicrash {
+
+namespace {
+
+const int kDefaultUnwinds = 20000;
+const int kDefaultRuns = 5;
+const int kDefaultDepth = 16;
+const int kMaxFrames = 64;
+
+// Keeps the frames of Recurse() from being folded into one.
+volatile int g_sink;
+
+struct Worker {
+  pthread_t thread;
+  int depth;
+  int unwinds;
+  pthread_barrier_t* barrier;
+  uint64_t frames;
+  uint64_t failures;
+};
+
+void Unwind(Worker* worker) {
+  backtrace_frame_t backtrace[kMaxFrames];
+  for (int i = 0; i < worker->unwinds; i++) {
+    ssize_t frames = unwind_backtrace(backtrace, 0, kMaxFrames);
+    if (frames > worker->depth) {
+      worker->frames += frames;
+    } else {
+      worker->failures++;
+    }
+  }
+}
+
+// Unwinds depth frames below the caller.
+void __attribute__((noinline)) Recurse(Worker* worker, int depth) {
+  if (depth == 0) {
+    Unwind(worker);
+    return;
+  }
+  Recurse(worker, depth - 1);
+  g_sink++;
+}
+
+void* Work(void* arg) {
+  Worker* worker = static_cast<Worker*>(arg);
+  pthread_barrier_wait(worker->barrier);
+  Recurse(worker, worker->depth);
+  pthread_barrier_wait(worker->barrier);
+  return NULL;
+}
+
+// Runs unwinds unwinds on each of thread_count threads; returns the seconds
+// it took.
+double Measure(int thread_count, int unwinds, int depth, uint64_t* frames,
+               uint64_t* failures) {
+  std::vector<Worker> workers(thread_count);
+  pthread_barrier_t barrier;
+  pthread_barrier_init(&barrier, NULL, thread_count + 1);
+  for (int i = 0; i < thread_count; i++) {
+    workers[i].depth = depth;
+    workers[i].unwinds = unwinds;
+    workers[i].barrier = &barrier;
+    workers[i].frames = 0;
+    workers[i].failures = 0;
+    pthread_create(&workers[i].thread, NULL, Work, &workers[i]);
+  }
+  pthread_barrier_wait(&barrier);
+  std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+  pthread_barrier_wait(&barrier);
+  std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+  *frames = 0;
+  *failures = 0;
+  for (int i = 0; i < thread_count; i++) {
+    pthread_join(workers[i].thread, NULL);
+    *frames += workers[i].frames;
+    *failures += workers[i].failures;
+  }
+  pthread_barrier_destroy(&barrier);
+  return std::chrono::duration<double>(end - begin).count();
+}
+
+void Usage() {
+  fprintf(stderr,
+          "usage: jnicrash-exidx-unwind-benchmark [-n UNWINDS] [-r RUNS] [-d DEPTH]\n"
+          "                                       [THREADS...]\n"
+          "\n"
+          "Unwinds DEPTH frames (default 16) UNWINDS times (default 20000) on each of\n"
+          "THREADS threads (default 1 4), finding EXIDX through the dynamic linker and\n"
+          "through the module table, RUNS times each (default 5).\n");
+}
+
+}  // namespace
+
+}  // namespace jnicrash
+
+int main(int argc, char** argv) {
+  int unwinds = jnicrash::kDefaultUnwinds;
+  int runs = jnicrash::kDefaultRuns;
+  int depth = jnicrash::kDefaultDepth;
+  int c;
+  while ((c = getopt(argc, argv, "n:r:d:h")) != -1) {
+    switch (c) {
+      case 'n':
+        unwinds = atoi(optarg);
+        break;
+      case 'r':
+        runs = atoi(optarg);
+        break;
+      case 'd':
+        depth = atoi(optarg);
+        break;
+      default:
+        jnicrash::Usage();
+        return 2;
+    }
+  }
+  std::vector<int> thread_counts;
+  for (int i = optind; i < argc; i++) {
+    thread_counts.push_back(atoi(argv[i]));
+  }
+  if (thread_counts.empty()) {
+    thread_counts.push_back(1);
+    thread_counts.push_back(4);
+  }
+  if (unwinds <= 0 || runs <= 0 || depth < 0 || depth > jnicrash::kMaxFrames - 16
+      || *std::min_element(thread_counts.begin(), thread_counts.end()) <= 0) {
+    jnicrash::Usage();
+    return 2;
+  }
+
+  const char* const kVariants[] = {"linker", "table"};
+  std::vector<double> fastest[2];
+  std::vector<uint64_t> frames[2];
+  std::vector<uint64_t> failures[2];
+  for (int variant = 0; variant < 2; variant++) {
+    if (variant == 1 && !module_table_update()) {
+      fprintf(stderr, "could not build the module table\n");
+      return 1;
+    }
+    for (size_t i = 0; i < thread_counts.size(); i++) {
+      double best = 0;
+      for (int run = 0; run < runs; run++) {
+        uint64_t run_frames;
+        uint64_t run_failures;
+        double seconds = jnicrash::Measure(thread_counts[i], unwinds, depth, &run_frames,
+                                           &run_failures);
+        best = run ? std::min(best, seconds) : seconds;
+        if (!run) {
+          frames[variant].push_back(run_frames);
+          failures[variant].push_back(run_failures);
+        }
+      }
+      fastest[variant].push_back(best);
+    }
+  }
+
+  printf("%d unwinds per thread, %d+ frames deep; %d runs each\n", unwinds, depth, runs);
+  printf("%8s %-8s %14s %12s %12s %9s\n", "threads", "exidx", "unwinds/s", "us/unwind",
+         "frames", "failed");
+  int status = 0;
+  for (size_t i = 0; i < thread_counts.size(); i++) {
+    for (int variant = 0; variant < 2; variant++) {
+      uint64_t total = static_cast<uint64_t>(thread_counts[i]) * unwinds;
+      uint64_t failed = failures[variant][i];
+      double seconds = fastest[variant][i];
+      printf("%8d %-8s %14.0f %12.2f %12.1f %9llu\n", thread_counts[i], kVariants[variant],
+             total / seconds, seconds * 1e6 * thread_counts[i] / total,
+             total > failed ? static_cast<double>(frames[variant][i]) / (total - failed) : 0.0,
+             static_cast<unsigned long long>(failed));
+      if (failed) {
+        status = 1;
+      }
+    }
+  }
+  return status;
+}
@@ -0,0 +1,199 @@
+// jnicrash-heap-profiler-benchmark: what the sampling heap profiler costs an
+// allocation-heavy program.
+//
+// The benchmark is linked with the profiler's malloc(), so it is the malloc()
+// the process uses.  Its threads each keep a working set of blocks and keep
+// replacing random ones with blocks of random size that they then write to.
+// The same work is timed against the C library's allocator, against the
+// profiler's malloc() while it is stopped, and while it samples; the three
+// take turns, and each one's fastest run is reported.
+
+#include <dlfcn.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include "heap_profiler.h"
+
+namespace jnicrash {
+
+namespace {
+
+const int kDefaultOperations = 2000000;
+const int kDefaultRuns = 5;
+const int kWorkingSet = 4096;
+const size_t kMaxBlock = 4096;
+
+typedef void* (*MallocFn)(size_t);
+typedef void (*FreeFn)(void*);
+
+struct Allocator {
+  const char* name;
+  MallocFn malloc_fn;
+  FreeFn free_fn;
+  bool sampling;
+};
+
+struct Worker {
+  pthread_t thread;
+  const Allocator* allocator;
+  int operations;
+  uint64_t random_state;
+  pthread_barrier_t* barrier;
+};
+
+uint64_t NextRandom(uint64_t* state) {
+  // xorshift64*, like the profiler.
+  uint64_t x = *state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+  return x * 2685821657736338717ULL;
+}
+
+void* Churn(void* arg) {
+  Worker* worker = static_cast<Worker*>(arg);
+  const Allocator* allocator = worker->allocator;
+  std::vector<void*> blocks(kWorkingSet);
+  pthread_barrier_wait(worker->barrier);
+  for (int i = 0; i < worker->operations; i++) {
+    uint64_t random = NextRandom(&worker->random_state);
+    void*& block = blocks[random % kWorkingSet];
+    size_t size = 16 + (random >> 32) % kMaxBlock;
+    allocator->free_fn(block);
+    block = allocator->malloc_fn(size);
+    memset(block, 0, size);
+  }
+  pthread_barrier_wait(worker->barrier);
+  for (int i = 0; i < kWorkingSet; i++) {
+    allocator->free_fn(blocks[i]);
+  }
+  return NULL;
+}
+
+// Runs operations allocations on each of thread_count threads; returns the
+// seconds it took.
+double Measure(const Allocator& allocator, int thread_count, int operations) {
+  std::vector<Worker> workers(thread_count);
+  pthread_barrier_t barrier;
+  pthread_barrier_init(&barrier, NULL, thread_count + 1);
+  for (int i = 0; i < thread_count; i++) {
+    workers[i].allocator = &allocator;
+    workers[i].operations = operations;
+    workers[i].random_state = 0x9e3779b97f4a7c15ULL * (i + 1);
+    workers[i].barrier = &barrier;
+    pthread_create(&workers[i].thread, NULL, Churn, &workers[i]);
+  }
+  pthread_barrier_wait(&barrier);
+  std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+  pthread_barrier_wait(&barrier);
+  std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+  for (int i = 0; i < thread_count; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+  pthread_barrier_destroy(&barrier);
+  return std::chrono::duration<double>(end - begin).count();
+}
+
+void Usage() {
+  fprintf(stderr,
+          "usage: jnicrash-heap-profiler-benchmark [-n OPERATIONS] [-r RUNS] [-i INTERVAL]\n"
+          "                                        [THREADS...]\n"
+          "\n"
+          "Replaces OPERATIONS blocks (default 2000000) on each of THREADS threads\n"
+          "(default 1 4) with the C library's allocator and with the heap profiler\n"
+          "stopped and sampling every INTERVAL bytes (default the profiler's), RUNS\n"
+          "times each (default 5).\n");
+}
+
+}  // namespace
+
+}  // namespace jnicrash
+
+int main(int argc, char** argv) {
+  int operations = jnicrash::kDefaultOperations;
+  int runs = jnicrash::kDefaultRuns;
+  size_t sample_interval = 0;
+  int c;
+  while ((c = getopt(argc, argv, "n:r:i:h")) != -1) {
+    switch (c) {
+      case 'n':
+        operations = atoi(optarg);
+        break;
+      case 'r':
+        runs = atoi(optarg);
+        break;
+      case 'i':
+        sample_interval = strtoul(optarg, NULL, 0);
+        break;
+      default:
+        jnicrash::Usage();
+        return 2;
+    }
+  }
+  std::vector<int> thread_counts;
+  for (int i = optind; i < argc; i++) {
+    thread_counts.push_back(atoi(argv[i]));
+  }
+  if (thread_counts.empty()) {
+    thread_counts.push_back(1);
+    thread_counts.push_back(4);
+  }
+  if (operations <= 0 || runs <= 0
+      || *std::min_element(thread_counts.begin(), thread_counts.end()) <= 0) {
+    jnicrash::Usage();
+    return 2;
+  }
+
+  jnicrash::Allocator allocators[3];
+  allocators[0].name = "libc";
+  allocators[0].malloc_fn = reinterpret_cast<jnicrash::MallocFn>(dlsym(RTLD_NEXT, "malloc"));
+  allocators[0].free_fn = reinterpret_cast<jnicrash::FreeFn>(dlsym(RTLD_NEXT, "free"));
+  allocators[0].sampling = false;
+  allocators[1].name = "stopped";
+  allocators[1].malloc_fn = malloc;
+  allocators[1].free_fn = free;
+  allocators[1].sampling = false;
+  allocators[2] = allocators[1];
+  allocators[2].name = "sampling";
+  allocators[2].sampling = true;
+  if (!allocators[0].malloc_fn || !allocators[0].free_fn
+      || allocators[0].malloc_fn == allocators[1].malloc_fn) {
+    fprintf(stderr, "the profiler's malloc() is not the process's\n");
+    return 1;
+  }
+
+  printf("%d operations per thread, blocks of 16-%zu bytes; %d runs each\n", operations,
+         jnicrash::kMaxBlock + 15, runs);
+  printf("%8s %-10s %14s %10s\n", "threads", "allocator", "ns/operation", "overhead");
+  for (size_t i = 0; i < thread_counts.size(); i++) {
+    double fastest[3];
+    for (int run = 0; run < runs; run++) {
+      for (int j = 0; j < 3; j++) {
+        const jnicrash::Allocator& allocator = allocators[j];
+        if (allocator.sampling && !heap_profiler_start(sample_interval)) {
+          fprintf(stderr, "could not start the heap profiler\n");
+          return 1;
+        }
+        double seconds = jnicrash::Measure(allocator, thread_counts[i], operations);
+        if (allocator.sampling) {
+          heap_profiler_stop();
+        }
+        fastest[j] = run ? std::min(fastest[j], seconds) : seconds;
+      }
+    }
+    for (int j = 0; j < 3; j++) {
+      printf("%8d %-10s %14.1f %9.2f%%\n", thread_counts[i], allocators[j].name,
+             fastest[j] * 1e9 / operations, (fastest[j] / fastest[0] - 1) * 100);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,211 @@
+// jnicrash-lock-profiler-benchmark: what the lock contention profiler costs
+// a lock that is not contended.
+//
+// The benchmark is linked with the profiler's pthread_mutex_lock(), so it is
+// the one the process uses.  Its threads each lock and unlock a mutex of
+// their own in a loop, so no acquisition ever waits.  The loop is timed with
+// the C library's pthread_mutex_lock(), with the profiler's while it is
+// stopped and while it runs, and while it runs on mutexes that have been
+// contended before, whose acquisitions record their holder; the four take
+// turns, and each one's fastest run is reported.
+
+#include <dlfcn.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include "lock_profiler.h"
+
+namespace jnicrash {
+
+namespace {
+
+const int kDefaultIterations = 10000000;
+const int kDefaultRuns = 5;
+
+typedef int (*MutexFn)(pthread_mutex_t*);
+
+struct Variant {
+  const char* name;
+  MutexFn lock_fn;
+  bool profiling;
+  bool contended;
+};
+
+struct Locker {
+  pthread_t thread;
+  MutexFn lock_fn;
+  MutexFn unlock_fn;
+  pthread_mutex_t* mutex;
+  int iterations;
+  pthread_barrier_t* barrier;
+};
+
+void* LockLoop(void* arg) {
+  Locker* locker = static_cast<Locker*>(arg);
+  pthread_barrier_wait(locker->barrier);
+  for (int i = 0; i < locker->iterations; i++) {
+    locker->lock_fn(locker->mutex);
+    locker->unlock_fn(locker->mutex);
+  }
+  pthread_barrier_wait(locker->barrier);
+  return NULL;
+}
+
+void* LockOnce(void* arg) {
+  pthread_mutex_t* mutex = static_cast<pthread_mutex_t*>(arg);
+  pthread_mutex_lock(mutex);
+  pthread_mutex_unlock(mutex);
+  return NULL;
+}
+
+// Makes a thread wait for mutex once, which puts it in the profiler's
+// contended-lock table.
+void Contend(pthread_mutex_t* mutex) {
+  pthread_mutex_lock(mutex);
+  pthread_t thread;
+  pthread_create(&thread, NULL, LockOnce, mutex);
+  usleep(10000);
+  pthread_mutex_unlock(mutex);
+  pthread_join(thread, NULL);
+}
+
+// Runs iterations lock-unlock pairs on each of the mutexes, one thread
+// each; returns the seconds it took.
+double Measure(MutexFn lock_fn, MutexFn unlock_fn, std::vector<pthread_mutex_t>* mutexes,
+               int iterations) {
+  size_t thread_count = mutexes->size();
+  std::vector<Locker> lockers(thread_count);
+  pthread_barrier_t barrier;
+  pthread_barrier_init(&barrier, NULL, thread_count + 1);
+  for (size_t i = 0; i < thread_count; i++) {
+    lockers[i].lock_fn = lock_fn;
+    lockers[i].unlock_fn = unlock_fn;
+    lockers[i].mutex = &(*mutexes)[i];
+    lockers[i].iterations = iterations;
+    lockers[i].barrier = &barrier;
+    pthread_create(&lockers[i].thread, NULL, LockLoop, &lockers[i]);
+  }
+  pthread_barrier_wait(&barrier);
+  std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+  pthread_barrier_wait(&barrier);
+  std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < thread_count; i++) {
+    pthread_join(lockers[i].thread, NULL);
+  }
+  pthread_barrier_destroy(&barrier);
+  return std::chrono::duration<double>(end - begin).count();
+}
+
+void Usage() {
+  fprintf(stderr,
+          "usage: jnicrash-lock-profiler-benchmark [-n ITERATIONS] [-r RUNS] [THREADS...]\n"
+          "\n"
+          "Locks and unlocks a mutex per thread ITERATIONS times (default 10000000) on\n"
+          "each of THREADS threads (default 1 4), with the C library and with the lock\n"
+          "profiler stopped and running, RUNS times each (default 5).\n");
+}
+
+}  // namespace
+
+}  // namespace jnicrash
+
+int main(int argc, char** argv) {
+  int iterations = jnicrash::kDefaultIterations;
+  int runs = jnicrash::kDefaultRuns;
+  int c;
+  while ((c = getopt(argc, argv, "n:r:h")) != -1) {
+    switch (c) {
+      case 'n':
+        iterations = atoi(optarg);
+        break;
+      case 'r':
+        runs = atoi(optarg);
+        break;
+      default:
+        jnicrash::Usage();
+        return 2;
+    }
+  }
+  std::vector<int> thread_counts;
+  for (int i = optind; i < argc; i++) {
+    thread_counts.push_back(atoi(argv[i]));
+  }
+  if (thread_counts.empty()) {
+    thread_counts.push_back(1);
+    thread_counts.push_back(4);
+  }
+  if (iterations <= 0 || runs <= 0
+      || *std::min_element(thread_counts.begin(), thread_counts.end()) <= 0) {
+    jnicrash::Usage();
+    return 2;
+  }
+
+  jnicrash::MutexFn real_lock =
+      reinterpret_cast<jnicrash::MutexFn>(dlsym(RTLD_NEXT, "pthread_mutex_lock"));
+  jnicrash::MutexFn unlock =
+      reinterpret_cast<jnicrash::MutexFn>(dlsym(RTLD_NEXT, "pthread_mutex_unlock"));
+  if (!real_lock || !unlock || real_lock == pthread_mutex_lock) {
+    fprintf(stderr, "the profiler's pthread_mutex_lock() is not the process's\n");
+    return 1;
+  }
+  const jnicrash::Variant variants[] = {
+    {"libc", real_lock, false, false},
+    {"stopped", pthread_mutex_lock, false, false},
+    {"running", pthread_mutex_lock, true, false},
+    {"contended", pthread_mutex_lock, true, true},
+  };
+  const int kVariants = sizeof(variants) / sizeof(variants[0]);
+
+  printf("%d lock-unlock pairs per thread; %d runs each\n", iterations, runs);
+  printf("%8s %-10s %12s %12s\n", "threads", "profiler", "ns/lock", "+ns/lock");
+  for (size_t i = 0; i < thread_counts.size(); i++) {
+    // Separate mutexes for locks the profiler has and has not seen contended.
+    std::vector<pthread_mutex_t> mutexes(thread_counts[i]);
+    std::vector<pthread_mutex_t> contended_mutexes(thread_counts[i]);
+    for (int j = 0; j < thread_counts[i]; j++) {
+      pthread_mutex_init(&mutexes[j], NULL);
+      pthread_mutex_init(&contended_mutexes[j], NULL);
+    }
+    if (!lock_profiler_start()) {
+      fprintf(stderr, "could not start the lock profiler\n");
+      return 1;
+    }
+    for (int j = 0; j < thread_counts[i]; j++) {
+      jnicrash::Contend(&contended_mutexes[j]);
+    }
+    lock_profiler_stop();
+
+    double fastest[kVariants];
+    for (int run = 0; run < runs; run++) {
+      for (int j = 0; j < kVariants; j++) {
+        const jnicrash::Variant& variant = variants[j];
+        if (variant.profiling) {
+          lock_profiler_start();
+        }
+        double seconds = jnicrash::Measure(variant.lock_fn, unlock,
+                                           variant.contended ? &contended_mutexes : &mutexes,
+                                           iterations);
+        if (variant.profiling) {
+          lock_profiler_stop();
+        }
+        fastest[j] = run ? std::min(fastest[j], seconds) : seconds;
+      }
+    }
+    for (int j = 0; j < kVariants; j++) {
+      printf("%8d %-10s %12.2f %12.2f\n", thread_counts[i], variants[j].name,
+             fastest[j] * 1e9 / iterations, (fastest[j] - fastest[0]) * 1e9 / iterations);
+    }
+    for (int j = 0; j < thread_counts[i]; j++) {
+      pthread_mutex_destroy(&mutexes[j]);
+      pthread_mutex_destroy(&contended_mutexes[j]);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,178 @@
+// jnicrash-map-cache-benchmark: what an in-process backtrace pays for the
+// map of the process, by how many threads take backtraces at once.
+//
+// Each thread does what unwind_backtrace() and get_backtrace_symbols() do
+// around the unwind itself: acquires the map of the process, finds the maps
+// of a few frames in it and releases it.  With -l, another thread also loads
+// and unloads a library every so many milliseconds, which changes the set of
+// modules and so invalidates the map.
+
+#include <dlfcn.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <vector>
+
+#include "map_info.h"
+#include "module_table.h"
+
+namespace jnicrash {
+
+namespace {
+
+const int kMaxFrames = 64;
+
+struct Run {
+  volatile bool stopping;
+  int frames_per_call;
+  int reload_interval_ms;
+  const char* library;
+};
+
+struct Worker {
+  pthread_t thread;
+  Run* run;
+  uint64_t calls;
+  uint64_t misses;
+};
+
+// Frames spread over the executable and libraries.
+void* Backtraces(void* arg) {
+  Worker* worker = static_cast<Worker*>(arg);
+  const int frame_count = worker->run->frames_per_call;
+  uintptr_t frames[kMaxFrames];
+  for (int i = 0; i < frame_count; i++) {
+    switch (i % 4) {
+      case 0: frames[i] = reinterpret_cast<uintptr_t>(&Backtraces); break;
+      case 1: frames[i] = reinterpret_cast<uintptr_t>(&printf); break;
+      case 2: frames[i] = reinterpret_cast<uintptr_t>(&pthread_create); break;
+      default: frames[i] = reinterpret_cast<uintptr_t>(&strlen); break;
+    }
+  }
+  while (!worker->run->stopping) {
+    map_info_t* milist = acquire_my_map_info_list();
+    for (int i = 0; i < frame_count; i++) {
+      if (!find_map_info(milist, frames[i])) {
+        worker->misses++;
+      }
+    }
+    release_my_map_info_list(milist);
+    worker->calls++;
+  }
+  return NULL;
+}
+
+void* Reloads(void* arg) {
+  Run* run = static_cast<Run*>(arg);
+  while (!run->stopping) {
+    usleep(run->reload_interval_ms * 1000);
+    void* handle = module_table_dlopen(run->library, RTLD_NOW | RTLD_LOCAL);
+    if (handle) {
+      module_table_dlclose(handle);
+    }
+  }
+  return NULL;
+}
+
+// Runs thread_count threads for seconds; returns calls per second.
+double Measure(int thread_count, double seconds, Run* run, uint64_t* misses) {
+  run->stopping = false;
+  std::vector<Worker> workers(thread_count);
+  pthread_t reloader;
+  if (run->reload_interval_ms > 0) {
+    pthread_create(&reloader, NULL, Reloads, run);
+  }
+  std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+  for (int i = 0; i < thread_count; i++) {
+    workers[i].run = run;
+    workers[i].calls = 0;
+    workers[i].misses = 0;
+    pthread_create(&workers[i].thread, NULL, Backtraces, &workers[i]);
+  }
+  usleep(static_cast<useconds_t>(seconds * 1e6));
+  run->stopping = true;
+  uint64_t calls = 0;
+  *misses = 0;
+  for (int i = 0; i < thread_count; i++) {
+    pthread_join(workers[i].thread, NULL);
+    calls += workers[i].calls;
+    *misses += workers[i].misses;
+  }
+  std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+  if (run->reload_interval_ms > 0) {
+    pthread_join(reloader, NULL);
+  }
+  return calls / std::chrono::duration<double>(end - begin).count();
+}
+
+void Usage() {
+  fprintf(stderr,
+          "usage: jnicrash-map-cache-benchmark [-t SECONDS] [-f FRAMES] [-l MS]\n"
+          "                                    [-L LIBRARY] [THREADS...]\n"
+          "\n"
+          "Times acquiring the map of the process, finding FRAMES (default 8,\n"
+          "at most 64) addresses in it and releasing it, from THREADS threads\n"
+          "at once (default 1 2 4 8).  -l loads and unloads LIBRARY (default\n"
+          "libz.so.1) every MS milliseconds meanwhile.\n");
+}
+
+}  // namespace
+
+}  // namespace jnicrash
+
+int main(int argc, char** argv) {
+  double seconds = 1;
+  jnicrash::Run run;
+  run.frames_per_call = 8;
+  run.reload_interval_ms = 0;
+  run.library = "libz.so.1";
+  int c;
+  while ((c = getopt(argc, argv, "t:f:l:L:h")) != -1) {
+    switch (c) {
+      case 't':
+        seconds = atof(optarg);
+        break;
+      case 'f':
+        run.frames_per_call = atoi(optarg);
+        if (run.frames_per_call < 0 || run.frames_per_call > jnicrash::kMaxFrames) {
+          jnicrash::Usage();
+          return 2;
+        }
+        break;
+      case 'l':
+        run.reload_interval_ms = atoi(optarg);
+        break;
+      case 'L':
+        run.library = optarg;
+        break;
+      default:
+        jnicrash::Usage();
+        return 2;
+    }
+  }
+  std::vector<int> thread_counts;
+  for (int i = optind; i < argc; i++) {
+    thread_counts.push_back(atoi(argv[i]));
+  }
+  if (thread_counts.empty()) {
+    thread_counts.push_back(1);
+    thread_counts.push_back(2);
+    thread_counts.push_back(4);
+    thread_counts.push_back(8);
+  }
+
+  module_table_update();
+  printf("%8s %14s %12s %8s\n", "threads", "calls/s", "ns/call", "misses");
+  for (size_t i = 0; i < thread_counts.size(); i++) {
+    uint64_t misses;
+    double rate = jnicrash::Measure(thread_counts[i], seconds, &run, &misses);
+    printf("%8d %14.0f %12.1f %8llu\n", thread_counts[i], rate,
+           thread_counts[i] * 1e9 / rate, static_cast<unsigned long long>(misses));
+  }
+  return 0;
+}
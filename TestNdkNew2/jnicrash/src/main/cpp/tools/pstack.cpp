@@ -0,0 +1,560 @@
+// jnicrash-pstack: backtraces of every thread of a live process, from the
+// library's own ptrace unwinder.
+//
+// Every thread of the target is seized and interrupted, which stops it
+// without sending it a signal.  While the target is stopped, each thread's
+// registers are read and its stack unwound and symbolized; then every
+// thread is detached and handed back any signal that was about to be
+// delivered to it.  Symbols are loaded from a module the first time one of
+// its addresses is looked up, so only the modules on the stacks are read.
+//
+// With -n, the target is sampled repeatedly.  The symbols stay loaded
+// between samples; the map of the target is only reloaded when
+// /proc/PID/maps changes.
+
+#include <dirent.h>
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/uio.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "backtrace.h"
+#include "ptrace.h"
+
+#ifndef PTRACE_SEIZE
+#define PTRACE_SEIZE 0x4206
+#endif
+
+#ifndef PTRACE_INTERRUPT
+#define PTRACE_INTERRUPT 0x4207
+#endif
+
+#ifndef PTRACE_EVENT_STOP
+#define PTRACE_EVENT_STOP 128
+#endif
+
+namespace jnicrash {
+
+namespace {
+
+const int kDefaultDepth = 64;
+const int kMaxDepth = 1024;
+
+struct Register {
+  const char* name;
+  size_t offset;
+};
+
+// The registers printed, in the layout of PTRACE_GETREGSET's NT_PRSTATUS.
+#if defined(__x86_64__)
+typedef struct user_regs_struct Registers;
+#define REGISTER(name) {#name, offsetof(Registers, name)}
+const Register kRegisters[] = {
+  REGISTER(rax), REGISTER(rbx), REGISTER(rcx), REGISTER(rdx),
+  REGISTER(rsi), REGISTER(rdi), REGISTER(rbp), REGISTER(rsp),
+  REGISTER(r8), REGISTER(r9), REGISTER(r10), REGISTER(r11),
+  REGISTER(r12), REGISTER(r13), REGISTER(r14), REGISTER(r15),
+  REGISTER(rip), REGISTER(eflags),
+};
+#undef REGISTER
+#elif defined(__aarch64__)
+typedef struct user_regs_struct Registers;
+#define REGISTER(name, field) {name, offsetof(Registers, field)}
+const Register kRegisters[] = {
+  REGISTER("x0", regs[0]), REGISTER("x1", regs[1]), REGISTER("x2", regs[2]),
+  REGISTER("x3", regs[3]), REGISTER("x4", regs[4]), REGISTER("x5", regs[5]),
+  REGISTER("x6", regs[6]), REGISTER("x7", regs[7]), REGISTER("x8", regs[8]),
+  REGISTER("x9", regs[9]), REGISTER("x10", regs[10]), REGISTER("x11", regs[11]),
+  REGISTER("x12", regs[12]), REGISTER("x13", regs[13]), REGISTER("x14", regs[14]),
+  REGISTER("x15", regs[15]), REGISTER("x16", regs[16]), REGISTER("x17", regs[17]),
+  REGISTER("x18", regs[18]), REGISTER("x19", regs[19]), REGISTER("x20", regs[20]),
+  REGISTER("x21", regs[21]), REGISTER("x22", regs[22]), REGISTER("x23", regs[23]),
+  REGISTER("x24", regs[24]), REGISTER("x25", regs[25]), REGISTER("x26", regs[26]),
+  REGISTER("x27", regs[27]), REGISTER("x28", regs[28]), REGISTER("x29", regs[29]),
+  REGISTER("x30", regs[30]), REGISTER("sp", sp), REGISTER("pc", pc),
+  REGISTER("pstate", pstate),
+};
+#undef REGISTER
+#elif defined(__arm__)
+typedef struct user_regs Registers;
+#define REGISTER(name, index) {name, offsetof(Registers, uregs) + index * sizeof(long)}
+const Register kRegisters[] = {
+  REGISTER("r0", 0), REGISTER("r1", 1), REGISTER("r2", 2), REGISTER("r3", 3),
+  REGISTER("r4", 4), REGISTER("r5", 5), REGISTER("r6", 6), REGISTER("r7", 7),
+  REGISTER("r8", 8), REGISTER("r9", 9), REGISTER("r10", 10), REGISTER("fp", 11),
+  REGISTER("ip", 12), REGISTER("sp", 13), REGISTER("lr", 14), REGISTER("pc", 15),
+  REGISTER("cpsr", 16),
+};
+#undef REGISTER
+#else
+#error "jnicrash-pstack does not know the registers of this architecture"
+#endif
+
+const size_t kRegisterCount = sizeof(kRegisters) / sizeof(kRegisters[0]);
+
+struct Options {
+  bool json;
+  bool registers;
+  int depth;
+  int samples;
+  int interval_ms;
+  bool timing;
+};
+
+struct Thread {
+  pid_t tid;
+  char state;
+  std::string name;
+  bool stopped;
+  int pending_signal;
+  bool have_registers;
+  Registers registers;
+  std::vector<backtrace_frame_t> frames;
+  std::vector<backtrace_symbol_t> symbols;
+};
+
+// How long each step of a sample took.
+struct Timing {
+  int64_t list_ns;
+  int64_t seize_ns;
+  int64_t context_ns;
+  int64_t unwind_ns;
+  int64_t symbolize_ns;
+  int64_t detach_ns;
+};
+
+int64_t MonotonicNs() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+bool ReadFile(const std::string& path, std::string* contents) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  contents->clear();
+  char buffer[4096];
+  ssize_t n;
+  while ((n = TEMP_FAILURE_RETRY(read(fd, buffer, sizeof(buffer)))) > 0) {
+    contents->append(buffer, n);
+  }
+  close(fd);
+  return n == 0;
+}
+
+// Lists the threads of pid with their names and scheduler states, which are
+// read before they are stopped: once stopped, every thread is in "t".
+std::vector<Thread> ListThreads(pid_t pid) {
+  std::vector<Thread> threads;
+  std::string task = "/proc/" + std::to_string(pid) + "/task";
+  DIR* d = opendir(task.c_str());
+  if (d == NULL) {
+    return threads;
+  }
+  struct dirent* de;
+  while ((de = readdir(d)) != NULL) {
+    char* end;
+    pid_t tid = strtoul(de->d_name, &end, 10);
+    if (*end || tid == 0) {
+      continue;
+    }
+    Thread thread;
+    thread.tid = tid;
+    thread.state = '?';
+    thread.stopped = false;
+    thread.pending_signal = 0;
+    thread.have_registers = false;
+    std::string dir = task + "/" + de->d_name;
+    std::string contents;
+    if (ReadFile(dir + "/comm", &contents)) {
+      if (!contents.empty() && contents[contents.size() - 1] == '\n') {
+        contents.resize(contents.size() - 1);
+      }
+      thread.name = contents;
+    }
+    // The command name may itself contain ") ", so look for the last one.
+    if (ReadFile(dir + "/stat", &contents)) {
+      size_t end = contents.rfind(')');
+      if (end != std::string::npos && end + 2 < contents.size()) {
+        thread.state = contents[end + 2];
+      }
+    }
+    threads.push_back(thread);
+  }
+  closedir(d);
+  return threads;
+}
+
+// Stops a thread without sending it a signal.  If a signal was about to be
+// delivered to it instead, it is handed back when the thread is detached.
+bool Seize(Thread* thread) {
+  if (ptrace(PTRACE_SEIZE, thread->tid, 0, 0)) {
+    return false;
+  }
+  if (ptrace(PTRACE_INTERRUPT, thread->tid, 0, 0)) {
+    ptrace(PTRACE_DETACH, thread->tid, 0, 0);
+    return false;
+  }
+  int status;
+  if (TEMP_FAILURE_RETRY(waitpid(thread->tid, &status, __WALL)) < 0 ||
+      !WIFSTOPPED(status)) {
+    // The thread exited.
+    return false;
+  }
+  if (status >> 16 != PTRACE_EVENT_STOP) {
+    thread->pending_signal = WSTOPSIG(status);
+  }
+  thread->stopped = true;
+  return true;
+}
+
+void Detach(const Thread& thread) {
+  if (thread.stopped) {
+    ptrace(PTRACE_DETACH, thread.tid, 0,
+           reinterpret_cast<void*>(static_cast<intptr_t>(thread.pending_signal)));
+  }
+}
+
+bool ReadRegisters(Thread* thread) {
+  struct iovec iov;
+  iov.iov_base = &thread->registers;
+  iov.iov_len = sizeof(thread->registers);
+  return !ptrace(PTRACE_GETREGSET, thread->tid, reinterpret_cast<void*>(NT_PRSTATUS), &iov);
+}
+
+unsigned long RegisterValue(const Registers& registers, const Register& r) {
+  unsigned long value;
+  memcpy(&value, reinterpret_cast<const char*>(&registers) + r.offset, sizeof(value));
+  return value;
+}
+
+// The map of the target, reloaded only when it changes.
+class Target {
+ public:
+  explicit Target(pid_t pid) : pid_(pid), context_(NULL) {}
+  ~Target() {
+    if (context_) {
+      free_ptrace_context(context_);
+    }
+  }
+
+  // Must be called with the main thread stopped: loading the context peeks
+  // at the ELF headers through it.
+  const ptrace_context_t* Context() {
+    std::string maps;
+    if (!ReadFile("/proc/" + std::to_string(pid_) + "/maps", &maps)) {
+      return context_;
+    }
+    if (!context_ || maps != maps_) {
+      // The target is not a fork of ours, so its JIT table is not where
+      // ours is.
+      ptrace_context_t* context = load_ptrace_context(pid_, false);
+      if (context) {
+        if (context_) {
+          free_ptrace_context(context_);
+        }
+        context_ = context;
+        maps_.swap(maps);
+      }
+    }
+    return context_;
+  }
+
+ private:
+  pid_t pid_;
+  ptrace_context_t* context_;
+  std::string maps_;
+};
+
+// Takes one sample of every thread of the target.  The symbols of a frame
+// are only looked up while the target is stopped, since loading a module's
+// embedded symbols reads its memory.
+bool Sample(pid_t pid, const Options& options, Target* target,
+            std::vector<Thread>* threads, Timing* timing, int64_t* frozen_ns) {
+  int64_t t0 = MonotonicNs();
+  *threads = ListThreads(pid);
+  if (threads->empty()) {
+    return false;
+  }
+  int64_t t1 = MonotonicNs();
+  bool main_stopped = false;
+  for (size_t i = 0; i < threads->size(); i++) {
+    if (Seize(&(*threads)[i]) && (*threads)[i].tid == pid) {
+      main_stopped = true;
+    }
+  }
+  int64_t t2 = MonotonicNs();
+  const ptrace_context_t* context = main_stopped ? target->Context() : NULL;
+  int64_t t3 = MonotonicNs();
+  for (size_t i = 0; i < threads->size(); i++) {
+    Thread* thread = &(*threads)[i];
+    if (!thread->stopped) {
+      continue;
+    }
+    thread->have_registers = ReadRegisters(thread);
+    if (context) {
+      thread->frames.resize(options.depth);
+      ssize_t frames = unwind_backtrace_ptrace(thread->tid, context, &thread->frames[0], 0,
+                                               options.depth, false);
+      thread->frames.resize(frames > 0 ? frames : 0);
+    }
+  }
+  int64_t t4 = MonotonicNs();
+  for (size_t i = 0; i < threads->size(); i++) {
+    Thread* thread = &(*threads)[i];
+    thread->symbols.resize(thread->frames.size());
+    if (!thread->frames.empty()) {
+      get_backtrace_symbols_ptrace(context, &thread->frames[0], thread->frames.size(),
+                                   &thread->symbols[0]);
+    }
+  }
+  int64_t t5 = MonotonicNs();
+  for (size_t i = 0; i < threads->size(); i++) {
+    Detach((*threads)[i]);
+  }
+  int64_t t6 = MonotonicNs();
+
+  timing->list_ns += t1 - t0;
+  timing->seize_ns += t2 - t1;
+  timing->context_ns += t3 - t2;
+  timing->unwind_ns += t4 - t3;
+  timing->symbolize_ns += t5 - t4;
+  timing->detach_ns += t6 - t5;
+  *frozen_ns = t6 - t1;
+  return main_stopped;
+}
+
+void FreeSymbols(std::vector<Thread>* threads) {
+  for (size_t i = 0; i < threads->size(); i++) {
+    Thread* thread = &(*threads)[i];
+    if (!thread->symbols.empty()) {
+      free_backtrace_symbols(&thread->symbols[0], thread->symbols.size());
+    }
+  }
+}
+
+void PrintText(pid_t pid, int sample, const std::vector<Thread>& threads,
+               const Options& options, int64_t frozen_ns) {
+  if (options.samples > 1) {
+    printf("--- sample %d\n", sample + 1);
+  }
+  printf("pid %d: %zu threads, stopped for %.3f ms\n", pid, threads.size(),
+         frozen_ns / 1e6);
+  for (size_t i = 0; i < threads.size(); i++) {
+    const Thread& thread = threads[i];
+    printf("\n\"%s\" tid %d state %c\n", thread.name.c_str(), thread.tid, thread.state);
+    if (!thread.stopped) {
+      printf("    (could not be stopped)\n");
+      continue;
+    }
+    if (options.registers && thread.have_registers) {
+      for (size_t r = 0; r < kRegisterCount; r++) {
+        printf("%s%6s %0*lx", r % 4 ? "  " : "    ", kRegisters[r].name,
+               static_cast<int>(sizeof(long) * 2),
+               RegisterValue(thread.registers, kRegisters[r]));
+        if (r % 4 == 3 || r == kRegisterCount - 1) {
+          printf("\n");
+        }
+      }
+    }
+    for (size_t f = 0; f < thread.frames.size(); f++) {
+      char line[MAX_BACKTRACE_LINE_LENGTH];
+      format_backtrace_line(f, &thread.frames[f], &thread.symbols[f], line, sizeof(line));
+      printf("    %s\n", line);
+    }
+  }
+  if (options.samples > 1) {
+    printf("\n");
+  }
+}
+
+void PrintJsonString(const char* s) {
+  putchar('"');
+  for (; *s; s++) {
+    unsigned char c = *s;
+    if (c == '"' || c == '\\') {
+      printf("\\%c", c);
+    } else if (c < 0x20) {
+      printf("\\u%04x", c);
+    } else {
+      putchar(c);
+    }
+  }
+  putchar('"');
+}
+
+// One object per sample, on a line of its own.
+void PrintJson(pid_t pid, int sample, const std::vector<Thread>& threads,
+               int64_t frozen_ns) {
+  printf("{\"pid\":%d,\"sample\":%d,\"stopped_us\":%lld,\"threads\":[", pid, sample,
+         static_cast<long long>(frozen_ns / 1000));
+  for (size_t i = 0; i < threads.size(); i++) {
+    const Thread& thread = threads[i];
+    printf("%s{\"tid\":%d,\"name\":", i ? "," : "", thread.tid);
+    PrintJsonString(thread.name.c_str());
+    printf(",\"state\":\"%c\",\"stopped\":%s", thread.state,
+           thread.stopped ? "true" : "false");
+    if (thread.have_registers) {
+      printf(",\"registers\":{");
+      for (size_t r = 0; r < kRegisterCount; r++) {
+        printf("%s\"%s\":\"0x%lx\"", r ? "," : "", kRegisters[r].name,
+               RegisterValue(thread.registers, kRegisters[r]));
+      }
+      printf("}");
+    }
+    printf(",\"frames\":[");
+    for (size_t f = 0; f < thread.frames.size(); f++) {
+      const backtrace_frame_t& frame = thread.frames[f];
+      const backtrace_symbol_t& symbol = thread.symbols[f];
+      printf("%s{\"pc\":\"0x%lx\",\"rel_pc\":\"0x%lx\"", f ? "," : "",
+             static_cast<unsigned long>(frame.absolute_pc),
+             static_cast<unsigned long>(symbol.relative_pc));
+      if (symbol.map_name) {
+        printf(",\"map\":");
+        PrintJsonString(symbol.map_name);
+      }
+      if (symbol.symbol_name) {
+        printf(",\"symbol\":");
+        PrintJsonString(symbol.demangled_name ? symbol.demangled_name : symbol.symbol_name);
+        printf(",\"offset\":%lu",
+               static_cast<unsigned long>(symbol.relative_pc - symbol.relative_symbol_addr));
+      }
+      printf("}");
+    }
+    printf("]}");
+  }
+  printf("]}\n");
+}
+
+void Usage() {
+  fprintf(stderr,
+          "usage: jnicrash-pstack [-j] [-R] [-d DEPTH] [-n SAMPLES] [-i MS] [-t] PID\n"
+          "\n"
+          "Prints the registers, backtrace and name of every thread of PID.\n"
+          "  -j  print JSON, one object per sample per line\n"
+          "  -R  leave out the registers of the text output\n"
+          "  -d  unwind at most DEPTH frames (default 64)\n"
+          "  -n  take SAMPLES samples, MS milliseconds apart (default 1000)\n"
+          "  -t  print how long each step took to stderr\n");
+}
+
+}  // namespace
+
+}  // namespace jnicrash
+
+int main(int argc, char** argv) {
+  jnicrash::Options options;
+  options.json = false;
+  options.registers = true;
+  options.depth = jnicrash::kDefaultDepth;
+  options.samples = 1;
+  options.interval_ms = 1000;
+  options.timing = false;
+  int c;
+  while ((c = getopt(argc, argv, "jRd:n:i:th")) != -1) {
+    switch (c) {
+      case 'j':
+        options.json = true;
+        break;
+      case 'R':
+        options.registers = false;
+        break;
+      case 'd':
+        options.depth = atoi(optarg);
+        if (options.depth <= 0 || options.depth > jnicrash::kMaxDepth) {
+          jnicrash::Usage();
+          return 2;
+        }
+        break;
+      case 'n':
+        options.samples = atoi(optarg);
+        if (options.samples <= 0) {
+          jnicrash::Usage();
+          return 2;
+        }
+        break;
+      case 'i':
+        options.interval_ms = atoi(optarg);
+        break;
+      case 't':
+        options.timing = true;
+        break;
+      default:
+        jnicrash::Usage();
+        return 2;
+    }
+  }
+  if (optind != argc - 1) {
+    jnicrash::Usage();
+    return 2;
+  }
+  pid_t pid = atoi(argv[optind]);
+  if (pid <= 0) {
+    jnicrash::Usage();
+    return 2;
+  }
+
+  jnicrash::Target target(pid);
+  jnicrash::Timing timing;
+  memset(&timing, 0, sizeof(timing));
+  int64_t total_frozen_ns = 0;
+  int64_t max_frozen_ns = 0;
+  int taken = 0;
+  int64_t next_ns = jnicrash::MonotonicNs();
+  for (int sample = 0; sample < options.samples; sample++) {
+    if (sample) {
+      next_ns += options.interval_ms * 1000000LL;
+      int64_t wait_ns = next_ns - jnicrash::MonotonicNs();
+      if (wait_ns > 0) {
+        usleep(wait_ns / 1000);
+      }
+    }
+    std::vector<jnicrash::Thread> threads;
+    int64_t frozen_ns;
+    if (!jnicrash::Sample(pid, options, &target, &threads, &timing, &frozen_ns)) {
+      fprintf(stderr, "jnicrash-pstack: cannot stop process %d: %s\n", pid,
+              threads.empty() ? "no such process" : strerror(errno));
+      return 1;
+    }
+    if (options.json) {
+      jnicrash::PrintJson(pid, sample, threads, frozen_ns);
+    } else {
+      jnicrash::PrintText(pid, sample, threads, options, frozen_ns);
+    }
+    fflush(stdout);
+    jnicrash::FreeSymbols(&threads);
+    taken++;
+    total_frozen_ns += frozen_ns;
+    if (frozen_ns > max_frozen_ns) {
+      max_frozen_ns = frozen_ns;
+    }
+  }
+
+  if (options.timing) {
+    fprintf(stderr,
+            "%d samples; per sample: list %.3f ms, seize %.3f ms, map %.3f ms, "
+            "unwind %.3f ms, symbolize %.3f ms, detach %.3f ms; "
+            "stopped avg %.3f ms, max %.3f ms\n",
+            taken, timing.list_ns / 1e6 / taken, timing.seize_ns / 1e6 / taken,
+            timing.context_ns / 1e6 / taken, timing.unwind_ns / 1e6 / taken,
+            timing.symbolize_ns / 1e6 / taken, timing.detach_ns / 1e6 / taken,
+            total_frozen_ns / 1e6 / taken, max_frozen_ns / 1e6);
+  }
+  return 0;
+}
@@ -0,0 +1,244 @@
+// jnicrash-pstack-benchmark: how long it takes to get the backtraces of
+// every thread of a process with many threads, with jnicrash-pstack and with
+// the debuggers commonly used for it.
+//
+// The benchmark forks a target whose threads each recurse a few frames deep
+// and block there, then runs each tool on it several times and reports the
+// fastest, median and slowest run.  A tool that is not installed is skipped.
+// Every tool is run with its output thrown away, so only the time to stop,
+// unwind, symbolize and let go of the target is measured.
+
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+namespace jnicrash {
+
+namespace {
+
+const int kDefaultThreads = 200;
+const int kDefaultRuns = 5;
+const int kDefaultDepth = 8;
+
+// Keeps the frames of Recurse() from being folded into one.
+volatile int g_sink;
+
+// Never set: the blocked threads last as long as the process.  Testing it
+// lets Recurse() return, so its recursion is visibly bounded.
+volatile bool g_stop;
+
+int g_ready_pipe[2];
+
+void __attribute__((noinline)) Recurse(int depth) {
+  if (depth > 0) {
+    Recurse(depth - 1);
+    g_sink++;
+    return;
+  }
+  char ready = 1;
+  write(g_ready_pipe[1], &ready, 1);
+  while (!g_stop) {
+    pause();
+  }
+}
+
+void* Blocked(void* arg) {
+  Recurse(static_cast<int>(reinterpret_cast<intptr_t>(arg)));
+  return NULL;
+}
+
+// Forks the target and returns once all its threads are blocked.
+pid_t StartTarget(int thread_count, int depth) {
+  if (pipe(g_ready_pipe)) {
+    return -1;
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    close(g_ready_pipe[0]);
+    for (int i = 1; i < thread_count; i++) {
+      pthread_t thread;
+      pthread_create(&thread, NULL, Blocked,
+                     reinterpret_cast<void*>(static_cast<intptr_t>(depth + i % 4)));
+    }
+    Recurse(depth);
+  }
+  close(g_ready_pipe[1]);
+  for (int ready = 0; pid > 0 && ready < thread_count; ready++) {
+    char c;
+    if (read(g_ready_pipe[0], &c, 1) != 1) {
+      kill(pid, SIGKILL);
+      waitpid(pid, NULL, 0);
+      pid = -1;
+    }
+  }
+  close(g_ready_pipe[0]);
+  return pid;
+}
+
+// Whether program can be run, looked up in PATH unless it has a slash.
+bool Available(const std::string& program) {
+  if (program.find('/') != std::string::npos) {
+    return access(program.c_str(), X_OK) == 0;
+  }
+  const char* path = getenv("PATH");
+  std::string dirs = path ? path : "/usr/bin:/bin";
+  size_t begin = 0;
+  while (begin <= dirs.size()) {
+    size_t end = dirs.find(':', begin);
+    if (end == std::string::npos) {
+      end = dirs.size();
+    }
+    std::string candidate = dirs.substr(begin, end - begin) + "/" + program;
+    if (access(candidate.c_str(), X_OK) == 0) {
+      return true;
+    }
+    begin = end + 1;
+  }
+  return false;
+}
+
+// Runs argv with its output thrown away; returns the seconds it took, or a
+// negative number if it failed.
+double Time(const std::vector<std::string>& argv) {
+  std::vector<char*> args;
+  for (size_t i = 0; i < argv.size(); i++) {
+    args.push_back(const_cast<char*>(argv[i].c_str()));
+  }
+  args.push_back(NULL);
+  fflush(stdout);
+  std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+  pid_t pid = fork();
+  if (pid == 0) {
+    freopen("/dev/null", "w", stdout);
+    freopen("/dev/null", "w", stderr);
+    execvp(args[0], &args[0]);
+    _exit(127);
+  }
+  int status;
+  if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status)
+      || WEXITSTATUS(status)) {
+    return -1;
+  }
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+}
+
+void Usage() {
+  fprintf(stderr,
+          "usage: jnicrash-pstack-benchmark [-n THREADS] [-r RUNS] [-d DEPTH] [-p PSTACK]\n"
+          "\n"
+          "Times taking the backtraces of a process of THREADS threads (default 200)\n"
+          "blocked DEPTH frames deep (default 8), RUNS times (default 5), with\n"
+          "jnicrash-pstack (PSTACK, default next to the benchmark), gdb and eu-stack.\n");
+}
+
+}  // namespace
+
+}  // namespace jnicrash
+
+int main(int argc, char** argv) {
+  int thread_count = jnicrash::kDefaultThreads;
+  int runs = jnicrash::kDefaultRuns;
+  int depth = jnicrash::kDefaultDepth;
+  std::string pstack = argv[0];
+  size_t slash = pstack.rfind('/');
+  pstack = (slash == std::string::npos ? std::string() : pstack.substr(0, slash + 1))
+      + "jnicrash-pstack";
+  int c;
+  while ((c = getopt(argc, argv, "n:r:d:p:h")) != -1) {
+    switch (c) {
+      case 'n':
+        thread_count = atoi(optarg);
+        break;
+      case 'r':
+        runs = atoi(optarg);
+        break;
+      case 'd':
+        depth = atoi(optarg);
+        break;
+      case 'p':
+        pstack = optarg;
+        break;
+      default:
+        jnicrash::Usage();
+        return 2;
+    }
+  }
+  if (thread_count <= 0 || runs <= 0 || depth < 0) {
+    jnicrash::Usage();
+    return 2;
+  }
+
+  pid_t pid = jnicrash::StartTarget(thread_count, depth);
+  if (pid < 0) {
+    fprintf(stderr, "could not start the target\n");
+    return 1;
+  }
+  char pid_string[16];
+  snprintf(pid_string, sizeof(pid_string), "%d", pid);
+
+  struct Tool {
+    const char* name;
+    std::vector<std::string> argv;
+  };
+  std::vector<Tool> tools;
+  Tool tool;
+  tool.name = "jnicrash-pstack";
+  tool.argv.push_back(pstack);
+  tool.argv.push_back(pid_string);
+  tools.push_back(tool);
+  tool.name = "gdb";
+  tool.argv.clear();
+  const char* gdb_args[] = {"gdb", "-batch", "-nx", "-p", pid_string,
+                            "-ex", "thread apply all bt"};
+  tool.argv.assign(gdb_args, gdb_args + sizeof(gdb_args) / sizeof(gdb_args[0]));
+  tools.push_back(tool);
+  tool.name = "eu-stack";
+  tool.argv.clear();
+  tool.argv.push_back("eu-stack");
+  tool.argv.push_back("-p");
+  tool.argv.push_back(pid_string);
+  tools.push_back(tool);
+
+  printf("target %d: %d threads, %d+ frames deep; %d runs each\n", pid, thread_count,
+         depth, runs);
+  printf("%-16s %10s %10s %10s\n", "tool", "min ms", "median ms", "max ms");
+  int status = 0;
+  for (size_t i = 0; i < tools.size(); i++) {
+    if (!jnicrash::Available(tools[i].argv[0])) {
+      printf("%-16s %10s\n", tools[i].name, "not found");
+      continue;
+    }
+    std::vector<double> times;
+    for (int run = 0; run < runs; run++) {
+      double seconds = jnicrash::Time(tools[i].argv);
+      if (seconds < 0) {
+        break;
+      }
+      times.push_back(seconds * 1000);
+    }
+    if (times.size() != static_cast<size_t>(runs)) {
+      printf("%-16s %10s\n", tools[i].name, "failed");
+      status = 1;
+      continue;
+    }
+    std::sort(times.begin(), times.end());
+    printf("%-16s %10.1f %10.1f %10.1f\n", tools[i].name, times.front(),
+           times[times.size() / 2], times.back());
+  }
+
+  kill(pid, SIGKILL);
+  waitpid(pid, NULL, 0);
+  return status;
+}
@@ -0,0 +1,199 @@
+// jnicrash-snapshot-replay-test: checks that a crash snapshot unwinds, in
+// another process, to the same frames the crashing process saw.
+//
+// For each depth the test runs itself as a child that prepares a snapshot,
+// recurses that deep and crashes.  The child's handler captures the snapshot
+// and writes the backtrace the live unwinder gets from the crash context
+// next to it.  The test then opens the snapshot, builds the offline context
+// from its modules and stack copy as the tombstone code does, unwinds it
+// and compares.  The child has its own address space layout, so every
+// module has to be found where the snapshot says it was.
+
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "backtrace.h"
+#include "backtrace-arch.h"
+#include "crash_snapshot.h"
+#include "offline.h"
+
+namespace jnicrash {
+
+namespace {
+
+const int kDepths[] = {0, 1, 8, 64};
+const size_t kMaxFrames = 128;
+
+// Set up by the child before it crashes.
+const map_info_t* g_map_info_list;
+const char* g_expected_path;
+
+// Keeps the frames of Recurse() from being folded into one.
+volatile int g_sink;
+
+void CrashHandler(int signal_number, siginfo_t* info, void* context) {
+  crash_snapshot_capture(signal_number, info, static_cast<struct ucontext*>(context),
+                         static_cast<pid_t>(syscall(__NR_gettid)), 0);
+  backtrace_frame_t backtrace[kMaxFrames];
+  ssize_t frames = unwind_backtrace_signal(info, context, g_map_info_list, backtrace, 0,
+                                           kMaxFrames, UNWIND_MODE_ACCURATE);
+  FILE* fp = fopen(g_expected_path, "w");
+  for (ssize_t i = 0; fp && i < frames; i++) {
+    fprintf(fp, "%" PRIxPTR "\n", backtrace[i].absolute_pc);
+  }
+  if (fp) {
+    fclose(fp);
+  }
+  _exit(frames > 0 ? 0 : 1);
+}
+
+// Crashes depth frames below the caller.
+void __attribute__((noinline)) Recurse(int depth) {
+  if (depth == 0) {
+    *static_cast<volatile int*>(NULL) = g_sink;
+    return;
+  }
+  Recurse(depth - 1);
+  g_sink++;
+}
+
+int Record(const char* snapshot_path, const char* expected_path, int depth) {
+  if (!crash_snapshot_prepare(snapshot_path)) {
+    fprintf(stderr, "could not prepare %s\n", snapshot_path);
+    return 1;
+  }
+  g_map_info_list = acquire_my_map_info_list();
+  g_expected_path = expected_path;
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = CrashHandler;
+  action.sa_flags = SA_SIGINFO;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGSEGV, &action, NULL);
+  Recurse(depth);
+  return 1;
+}
+
+std::vector<uintptr_t> ReadExpected(const std::string& path) {
+  std::vector<uintptr_t> pcs;
+  FILE* fp = fopen(path.c_str(), "r");
+  uintptr_t pc;
+  while (fp && fscanf(fp, "%" SCNxPTR, &pc) == 1) {
+    pcs.push_back(pc);
+  }
+  if (fp) {
+    fclose(fp);
+  }
+  return pcs;
+}
+
+std::vector<uintptr_t> Replay(const crash_snapshot_t* snapshot) {
+  std::vector<uintptr_t> pcs;
+  ptrace_context_t* context = load_offline_context(snapshot->modules, snapshot->module_count,
+                                                   snapshot->stack_start,
+                                                   snapshot->stack_size);
+  if (!context) {
+    return pcs;
+  }
+  memory_t memory;
+  init_memory_offline(&memory, context, snapshot->tid, snapshot->stack_start, snapshot->stack,
+                      snapshot->stack_size);
+  backtrace_frame_t backtrace[kMaxFrames];
+  ssize_t frames = unwind_backtrace_regs_arch(snapshot->regs, &memory, backtrace, 0,
+                                              kMaxFrames);
+  for (ssize_t i = 0; i < frames; i++) {
+    pcs.push_back(backtrace[i].absolute_pc);
+  }
+  free_ptrace_context(context);
+  return pcs;
+}
+
+void PrintFrames(const char* label, const std::vector<uintptr_t>& pcs) {
+  fprintf(stderr, "  %s:", label);
+  for (size_t i = 0; i < pcs.size(); i++) {
+    fprintf(stderr, " %" PRIxPTR, pcs[i]);
+  }
+  fprintf(stderr, "\n");
+}
+
+// Records a crash depth frames deep in a child and replays it; returns
+// whether the frames matched.
+bool Test(const char* self, const std::string& directory, int depth) {
+  std::string snapshot_path = directory + "/snapshot";
+  std::string expected_path = directory + "/expected";
+  unlink(snapshot_path.c_str());
+  unlink(expected_path.c_str());
+  char depth_string[16];
+  snprintf(depth_string, sizeof(depth_string), "%d", depth);
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    execl(self, self, "--record", snapshot_path.c_str(), expected_path.c_str(), depth_string,
+          static_cast<char*>(NULL));
+    _exit(127);
+  }
+  int status;
+  if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status)
+      || WEXITSTATUS(status)) {
+    fprintf(stderr, "depth %d: the recording crash did not complete\n", depth);
+    return false;
+  }
+
+  std::vector<uintptr_t> expected = ReadExpected(expected_path);
+  const crash_snapshot_t* snapshot = crash_snapshot_open(snapshot_path.c_str());
+  if (!snapshot) {
+    fprintf(stderr, "depth %d: no snapshot was captured\n", depth);
+    return false;
+  }
+  std::vector<uintptr_t> replayed = Replay(snapshot);
+  crash_snapshot_close(snapshot);
+
+  // The crash is depth frames of Recurse() below Test()'s caller chain.
+  bool passed = expected.size() > static_cast<size_t>(depth) && replayed == expected;
+  printf("depth %3d: %3zu live frames, %3zu replayed: %s\n", depth, expected.size(),
+         replayed.size(), passed ? "ok" : "FAILED");
+  if (!passed) {
+    PrintFrames("live", expected);
+    PrintFrames("replayed", replayed);
+  }
+  return passed;
+}
+
+}  // namespace
+
+}  // namespace jnicrash
+
+int main(int argc, char** argv) {
+  if (argc == 5 && !strcmp(argv[1], "--record")) {
+    return jnicrash::Record(argv[2], argv[3], atoi(argv[4]));
+  }
+  if (argc != 1) {
+    fprintf(stderr, "usage: jnicrash-snapshot-replay-test\n");
+    return 2;
+  }
+
+  char directory[] = "/tmp/jnicrash-snapshot-XXXXXX";
+  if (!mkdtemp(directory)) {
+    perror("mkdtemp");
+    return 1;
+  }
+  int failures = 0;
+  for (size_t i = 0; i < sizeof(jnicrash::kDepths) / sizeof(jnicrash::kDepths[0]); i++) {
+    if (!jnicrash::Test("/proc/self/exe", directory, jnicrash::kDepths[i])) {
+      failures++;
+    }
+  }
+  unlink((std::string(directory) + "/snapshot").c_str());
+  unlink((std::string(directory) + "/expected").c_str());
+  rmdir(directory);
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,685 @@
+// Symbols and line tables of one module, for symbolizing on the host.
+//
+// Only what symbolizing needs is read: function symbols, and the rows of
+// the DWARF line program (versions 2 to 5).  Inlined frames would need
+// .debug_info and are not expanded.
+
+#include "symbol_module.h"
+
+#include <elf.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <unordered_map>
+
+namespace jnicrash {
+
+namespace {
+
+// Reads little-endian DWARF data, stopping at the end of its range.  Reads
+// past the end give zeros and clear ok.
+class Cursor {
+ public:
+  Cursor(const uint8_t* start, const uint8_t* end) : p_(start), end_(end), ok_(start <= end) {}
+
+  bool ok() const { return ok_; }
+  const uint8_t* position() const { return p_; }
+  bool at_end() const { return p_ >= end_; }
+
+  void Skip(uint64_t size) {
+    if (size > static_cast<uint64_t>(end_ - p_)) {
+      ok_ = false;
+      p_ = end_;
+    } else {
+      p_ += size;
+    }
+  }
+
+  uint64_t Read(size_t size) {
+    uint64_t value = 0;
+    if (size > 8 || size > static_cast<size_t>(end_ - p_)) {
+      ok_ = false;
+      p_ = end_;
+      return 0;
+    }
+    for (size_t i = 0; i < size; i++) {
+      value |= static_cast<uint64_t>(p_[i]) << (8 * i);
+    }
+    p_ += size;
+    return value;
+  }
+
+  uint8_t U8() { return static_cast<uint8_t>(Read(1)); }
+  uint16_t U16() { return static_cast<uint16_t>(Read(2)); }
+  uint32_t U32() { return static_cast<uint32_t>(Read(4)); }
+
+  uint64_t Uleb() {
+    uint64_t value = 0;
+    for (int shift = 0; p_ < end_; shift += 7) {
+      uint8_t byte = *p_++;
+      if (shift < 64) {
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      }
+      if (!(byte & 0x80)) {
+        return value;
+      }
+    }
+    ok_ = false;
+    return value;
+  }
+
+  int64_t Sleb() {
+    int64_t value = 0;
+    int shift = 0;
+    while (p_ < end_) {
+      uint8_t byte = *p_++;
+      if (shift < 64) {
+        value |= static_cast<int64_t>(byte & 0x7f) << shift;
+      }
+      shift += 7;
+      if (!(byte & 0x80)) {
+        if (shift < 64 && (byte & 0x40)) {
+          value |= -(static_cast<int64_t>(1) << shift);
+        }
+        return value;
+      }
+    }
+    ok_ = false;
+    return value;
+  }
+
+  const char* String() {
+    const uint8_t* start = p_;
+    const uint8_t* nul = static_cast<const uint8_t*>(memchr(p_, 0, end_ - p_));
+    if (!nul) {
+      ok_ = false;
+      p_ = end_;
+      return "";
+    }
+    p_ = nul + 1;
+    return reinterpret_cast<const char*>(start);
+  }
+
+ private:
+  const uint8_t* p_;
+  const uint8_t* end_;
+  bool ok_;
+};
+
+// A string section referenced by offset, such as .debug_line_str.
+struct StringSection {
+  const char* data;
+  uint64_t size;
+
+  const char* At(uint64_t offset) const {
+    if (!data || offset >= size || !memchr(data + offset, 0, size - offset)) {
+      return "";
+    }
+    return data + offset;
+  }
+};
+
+// DWARF 5 forms that directory and file entries use.
+enum {
+  kFormBlock = 0x09,
+  kFormData1 = 0x0b,
+  kFormData2 = 0x05,
+  kFormData4 = 0x06,
+  kFormData8 = 0x07,
+  kFormData16 = 0x1e,
+  kFormString = 0x08,
+  kFormStrp = 0x0e,
+  kFormUdata = 0x0f,
+  kFormLineStrp = 0x1f,
+};
+
+enum {
+  kLnctPath = 1,
+  kLnctDirectoryIndex = 2,
+};
+
+// Line program opcodes.
+enum {
+  kLnsCopy = 1,
+  kLnsAdvancePc = 2,
+  kLnsAdvanceLine = 3,
+  kLnsSetFile = 4,
+  kLnsConstAddPc = 8,
+  kLnsFixedAdvancePc = 9,
+  kLneEndSequence = 1,
+  kLneSetAddress = 2,
+};
+
+// Reads one attribute of a DWARF 5 entry.  Returns false for a form it
+// cannot skip, which ends the unit.
+bool ReadForm(Cursor* cursor, uint64_t form, bool dwarf64, const StringSection& str,
+              const StringSection& line_str, const char** string_value, uint64_t* value) {
+  switch (form) {
+    case kFormString:
+      *string_value = cursor->String();
+      return true;
+    case kFormStrp:
+      *string_value = str.At(cursor->Read(dwarf64 ? 8 : 4));
+      return true;
+    case kFormLineStrp:
+      *string_value = line_str.At(cursor->Read(dwarf64 ? 8 : 4));
+      return true;
+    case kFormUdata:
+      *value = cursor->Uleb();
+      return true;
+    case kFormData1:
+      *value = cursor->U8();
+      return true;
+    case kFormData2:
+      *value = cursor->U16();
+      return true;
+    case kFormData4:
+      *value = cursor->U32();
+      return true;
+    case kFormData8:
+      *value = cursor->Read(8);
+      return true;
+    case kFormData16:
+      cursor->Skip(16);
+      return true;
+    case kFormBlock:
+      cursor->Skip(cursor->Uleb());
+      return true;
+    default:
+      return false;
+  }
+}
+
+std::string JoinPath(const std::string& directory, const char* name) {
+  if (name[0] == '/' || directory.empty()) {
+    return name;
+  }
+  return directory + "/" + name;
+}
+
+}  // namespace
+
+ElfImage::ElfImage() : data_(NULL), size_(0), is_64bit_(false), machine_(0) {}
+
+ElfImage::~ElfImage() {
+  if (data_) {
+    munmap(const_cast<uint8_t*>(data_), size_);
+  }
+}
+
+bool ElfImage::Open(const std::string& path) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)
+      || st.st_size < static_cast<off_t>(sizeof(Elf32_Ehdr))) {
+    close(fd);
+    return false;
+  }
+  void* mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    return false;
+  }
+  data_ = static_cast<const uint8_t*>(mapping);
+  size_ = st.st_size;
+
+  if (memcmp(data_, ELFMAG, SELFMAG) || data_[EI_DATA] != ELFDATA2LSB) {
+    return false;
+  }
+  uint64_t shoff;
+  uint32_t shentsize, shnum, shstrndx;
+  if (data_[EI_CLASS] == ELFCLASS64 && size_ >= sizeof(Elf64_Ehdr)) {
+    Elf64_Ehdr ehdr;
+    memcpy(&ehdr, data_, sizeof(ehdr));
+    is_64bit_ = true;
+    machine_ = ehdr.e_machine;
+    shoff = ehdr.e_shoff;
+    shentsize = ehdr.e_shentsize;
+    shnum = ehdr.e_shnum;
+    shstrndx = ehdr.e_shstrndx;
+    if (shentsize != sizeof(Elf64_Shdr)) {
+      return true;
+    }
+  } else if (data_[EI_CLASS] == ELFCLASS32) {
+    Elf32_Ehdr ehdr;
+    memcpy(&ehdr, data_, sizeof(ehdr));
+    machine_ = ehdr.e_machine;
+    shoff = ehdr.e_shoff;
+    shentsize = ehdr.e_shentsize;
+    shnum = ehdr.e_shnum;
+    shstrndx = ehdr.e_shstrndx;
+    if (shentsize != sizeof(Elf32_Shdr)) {
+      return true;
+    }
+  } else {
+    return false;
+  }
+  if (shoff > size_ || shnum > (size_ - shoff) / shentsize) {
+    return true;
+  }
+
+  std::vector<uint32_t> name_offsets;
+  for (uint32_t i = 0; i < shnum; i++) {
+    const uint8_t* p = data_ + shoff + i * static_cast<uint64_t>(shentsize);
+    Section section;
+    uint32_t name;
+    if (is_64bit_) {
+      Elf64_Shdr shdr;
+      memcpy(&shdr, p, sizeof(shdr));
+      name = shdr.sh_name;
+      section.type = shdr.sh_type;
+      section.flags = shdr.sh_flags;
+      section.offset = shdr.sh_offset;
+      section.size = shdr.sh_size;
+      section.link = shdr.sh_link;
+      section.entsize = shdr.sh_entsize;
+    } else {
+      Elf32_Shdr shdr;
+      memcpy(&shdr, p, sizeof(shdr));
+      name = shdr.sh_name;
+      section.type = shdr.sh_type;
+      section.flags = shdr.sh_flags;
+      section.offset = shdr.sh_offset;
+      section.size = shdr.sh_size;
+      section.link = shdr.sh_link;
+      section.entsize = shdr.sh_entsize;
+    }
+    sections_.push_back(section);
+    name_offsets.push_back(name);
+  }
+  // Names need the section name table, which is itself a section.
+  if (shstrndx < sections_.size()) {
+    const uint8_t* names = Contents(sections_[shstrndx]);
+    uint64_t names_size = sections_[shstrndx].size;
+    for (size_t i = 0; i < sections_.size(); i++) {
+      uint32_t offset = name_offsets[i];
+      if (names && offset < names_size && memchr(names + offset, 0, names_size - offset)) {
+        sections_[i].name = reinterpret_cast<const char*>(names + offset);
+      }
+    }
+  }
+  return true;
+}
+
+const ElfImage::Section* ElfImage::FindSection(const char* name) const {
+  for (size_t i = 0; i < sections_.size(); i++) {
+    if (sections_[i].name == name) {
+      return &sections_[i];
+    }
+  }
+  return NULL;
+}
+
+const ElfImage::Section* ElfImage::FindSectionByType(uint32_t type) const {
+  for (size_t i = 0; i < sections_.size(); i++) {
+    if (sections_[i].type == type) {
+      return &sections_[i];
+    }
+  }
+  return NULL;
+}
+
+const uint8_t* ElfImage::Contents(const Section& section) const {
+  if (section.type == SHT_NOBITS || section.offset > size_
+      || section.size > size_ - section.offset) {
+    return NULL;
+  }
+  return data_ + section.offset;
+}
+
+std::string ElfImage::BuildId() const {
+  static const char kHex[] = "0123456789abcdef";
+  for (size_t i = 0; i < sections_.size(); i++) {
+    const Section& section = sections_[i];
+    const uint8_t* notes = section.type == SHT_NOTE ? Contents(section) : NULL;
+    if (!notes) {
+      continue;
+    }
+    Cursor cursor(notes, notes + section.size);
+    while (!cursor.at_end()) {
+      uint32_t name_size = cursor.U32();
+      uint32_t desc_size = cursor.U32();
+      uint32_t type = cursor.U32();
+      const uint8_t* name = cursor.position();
+      cursor.Skip((name_size + 3) & ~3u);
+      const uint8_t* desc = cursor.position();
+      cursor.Skip((desc_size + 3) & ~3u);
+      if (!cursor.ok()) {
+        break;
+      }
+      if (type == NT_GNU_BUILD_ID && name_size == 4 && !memcmp(name, "GNU", 4)) {
+        std::string build_id;
+        for (uint32_t j = 0; j < desc_size; j++) {
+          build_id += kHex[desc[j] >> 4];
+          build_id += kHex[desc[j] & 15];
+        }
+        return build_id;
+      }
+    }
+  }
+  return std::string();
+}
+
+bool SymbolModule::Load(const std::string& path) {
+  ElfImage elf;
+  if (!elf.Open(path)) {
+    return false;
+  }
+  LoadSymbols(elf);
+  LoadLines(elf);
+  return true;
+}
+
+void SymbolModule::LoadSymbols(const ElfImage& elf) {
+  const ElfImage::Section* symtab = elf.FindSectionByType(SHT_SYMTAB);
+  if (!symtab || !elf.Contents(*symtab)) {
+    symtab = elf.FindSectionByType(SHT_DYNSYM);
+  }
+  if (!symtab || symtab->link >= elf.sections().size()) {
+    return;
+  }
+  const ElfImage::Section& strtab = elf.sections()[symtab->link];
+  const uint8_t* symbols = elf.Contents(*symtab);
+  const char* strings = reinterpret_cast<const char*>(elf.Contents(strtab));
+  size_t entry_size = elf.is_64bit() ? sizeof(Elf64_Sym) : sizeof(Elf32_Sym);
+  if (!symbols || !strings) {
+    return;
+  }
+
+  // Names are copied into one string, so the file need not stay mapped.
+  std::unordered_map<std::string, uint32_t> interned;
+  size_t count = symtab->size / entry_size;
+  for (size_t i = 0; i < count; i++) {
+    uint64_t value, size;
+    uint32_t name;
+    uint16_t shndx;
+    uint8_t type;
+    if (elf.is_64bit()) {
+      Elf64_Sym sym;
+      memcpy(&sym, symbols + i * entry_size, sizeof(sym));
+      value = sym.st_value;
+      size = sym.st_size;
+      name = sym.st_name;
+      shndx = sym.st_shndx;
+      type = ELF64_ST_TYPE(sym.st_info);
+    } else {
+      Elf32_Sym sym;
+      memcpy(&sym, symbols + i * entry_size, sizeof(sym));
+      value = sym.st_value;
+      size = sym.st_size;
+      name = sym.st_name;
+      shndx = sym.st_shndx;
+      type = ELF32_ST_TYPE(sym.st_info);
+    }
+    if ((type != STT_FUNC && type != STT_GNU_IFUNC) || shndx == SHN_UNDEF
+        || name >= strtab.size || !strings[name]) {
+      continue;
+    }
+    if (elf.machine() == EM_ARM) {
+      value &= ~static_cast<uint64_t>(1);   // the Thumb bit
+    }
+    std::string symbol_name(strings + name, strnlen(strings + name, strtab.size - name));
+    std::unordered_map<std::string, uint32_t>::iterator it = interned.find(symbol_name);
+    uint32_t offset;
+    if (it == interned.end()) {
+      offset = names_.size();
+      names_.append(symbol_name).push_back('\0');
+      interned[symbol_name] = offset;
+    } else {
+      offset = it->second;
+    }
+    Symbol symbol = { value, size, offset };
+    symbols_.push_back(symbol);
+  }
+
+  // Aliases share an address; the sized one with the most bytes wins.
+  std::sort(symbols_.begin(), symbols_.end(), [](const Symbol& a, const Symbol& b) {
+    return a.start != b.start ? a.start < b.start : a.size > b.size;
+  });
+  symbols_.erase(std::unique(symbols_.begin(), symbols_.end(),
+                             [](const Symbol& a, const Symbol& b) { return a.start == b.start; }),
+                 symbols_.end());
+}
+
+void SymbolModule::LoadLines(const ElfImage& elf) {
+  const ElfImage::Section* section = elf.FindSection(".debug_line");
+  const uint8_t* data = section ? elf.Contents(*section) : NULL;
+  if (!data || (section->flags & SHF_COMPRESSED)) {
+    return;
+  }
+  StringSection str = { NULL, 0 };
+  StringSection line_str = { NULL, 0 };
+  const ElfImage::Section* s = elf.FindSection(".debug_str");
+  if (s && !(s->flags & SHF_COMPRESSED)) {
+    str.data = reinterpret_cast<const char*>(elf.Contents(*s));
+    str.size = s->size;
+  }
+  s = elf.FindSection(".debug_line_str");
+  if (s && !(s->flags & SHF_COMPRESSED)) {
+    line_str.data = reinterpret_cast<const char*>(elf.Contents(*s));
+    line_str.size = s->size;
+  }
+
+  std::unordered_map<std::string, uint32_t> interned;
+  Cursor units(data, data + section->size);
+  while (!units.at_end() && units.ok()) {
+    uint64_t unit_length = units.U32();
+    bool dwarf64 = false;
+    if (unit_length == 0xffffffff) {
+      unit_length = units.Read(8);
+      dwarf64 = true;
+    }
+    const uint8_t* unit_start = units.position();
+    units.Skip(unit_length);
+    if (!units.ok()) {
+      break;
+    }
+    Cursor cursor(unit_start, units.position());
+
+    uint16_t version = cursor.U16();
+    if (version < 2 || version > 5) {
+      continue;
+    }
+    uint8_t address_size = elf.is_64bit() ? 8 : 4;
+    if (version >= 5) {
+      address_size = cursor.U8();
+      cursor.U8();    // segment selector size
+    }
+    uint64_t header_length = cursor.Read(dwarf64 ? 8 : 4);
+    const uint8_t* program = cursor.position() + header_length;
+    uint8_t min_instruction_length = cursor.U8();
+    if (version >= 4) {
+      cursor.U8();    // maximum operations per instruction, 1 but for VLIW
+    }
+    cursor.U8();      // default is_stmt
+    int8_t line_base = static_cast<int8_t>(cursor.U8());
+    uint8_t line_range = cursor.U8();
+    uint8_t opcode_base = cursor.U8();
+    std::vector<uint8_t> opcode_lengths(opcode_base ? opcode_base - 1 : 0);
+    for (size_t i = 0; i < opcode_lengths.size(); i++) {
+      opcode_lengths[i] = cursor.U8();
+    }
+    if (!cursor.ok() || !line_range) {
+      continue;
+    }
+
+    // Files in the order the program numbers them, as indices in files_.
+    std::vector<std::string> directories;
+    std::vector<uint32_t> files;
+    if (version < 5) {
+      directories.push_back(std::string());   // the compilation directory
+      for (const char* dir = cursor.String(); dir[0] && cursor.ok(); dir = cursor.String()) {
+        directories.push_back(dir);
+      }
+      files.push_back(0);   // numbering starts at 1
+      for (const char* name = cursor.String(); name[0] && cursor.ok(); name = cursor.String()) {
+        uint64_t dir = cursor.Uleb();
+        cursor.Uleb();    // modification time
+        cursor.Uleb();    // length
+        std::string path = JoinPath(dir < directories.size() ? directories[dir] : "", name);
+        std::unordered_map<std::string, uint32_t>::iterator it = interned.find(path);
+        if (it == interned.end()) {
+          it = interned.insert(std::make_pair(path, files_.size())).first;
+          files_.push_back(path);
+        }
+        files.push_back(it->second);
+      }
+    } else {
+      bool readable = true;
+      for (int table = 0; table < 2 && readable; table++) {
+        std::vector<std::pair<uint64_t, uint64_t> > format(cursor.U8());
+        for (size_t i = 0; i < format.size(); i++) {
+          format[i].first = cursor.Uleb();
+          format[i].second = cursor.Uleb();
+        }
+        uint64_t count = cursor.Uleb();
+        for (uint64_t i = 0; i < count && readable && cursor.ok(); i++) {
+          const char* name = "";
+          uint64_t dir = 0;
+          for (size_t f = 0; f < format.size() && readable; f++) {
+            const char* string_value = "";
+            uint64_t value = 0;
+            readable = ReadForm(&cursor, format[f].second, dwarf64, str, line_str,
+                                &string_value, &value);
+            if (format[f].first == kLnctPath) {
+              name = string_value;
+            } else if (format[f].first == kLnctDirectoryIndex) {
+              dir = value;
+            }
+          }
+          if (table == 0) {
+            directories.push_back(name);
+          } else {
+            std::string path = JoinPath(dir < directories.size() ? directories[dir] : "", name);
+            std::unordered_map<std::string, uint32_t>::iterator it = interned.find(path);
+            if (it == interned.end()) {
+              it = interned.insert(std::make_pair(path, files_.size())).first;
+              files_.push_back(path);
+            }
+            files.push_back(it->second);
+          }
+        }
+      }
+      if (!readable) {
+        continue;
+      }
+    }
+    if (!cursor.ok() || files.empty()) {
+      continue;
+    }
+
+    // The line program.  Only rows are kept; columns and flags other
+    // than the end of a sequence do not matter for symbolizing.
+    Cursor op(program, units.position());
+    uint64_t address = 0;
+    uint64_t file = 1;
+    int64_t line = 1;
+    std::vector<LineRow> sequence;
+    while (!op.at_end() && op.ok()) {
+      bool emit = false;
+      bool end_sequence = false;
+      uint8_t opcode = op.U8();
+      if (opcode >= opcode_base) {
+        uint8_t adjusted = opcode - opcode_base;
+        address += (adjusted / line_range) * min_instruction_length;
+        line += line_base + adjusted % line_range;
+        emit = true;
+      } else if (opcode == 0) {
+        uint64_t length = op.Uleb();
+        const uint8_t* next = op.position() + length;
+        uint8_t extended = length ? op.U8() : 0;
+        if (extended == kLneEndSequence) {
+          emit = true;
+          end_sequence = true;
+        } else if (extended == kLneSetAddress) {
+          address = op.Read(length - 1 <= 8 ? length - 1 : address_size);
+        }
+        op.Skip(next - op.position());
+      } else if (opcode == kLnsCopy) {
+        emit = true;
+      } else if (opcode == kLnsAdvancePc) {
+        address += op.Uleb() * min_instruction_length;
+      } else if (opcode == kLnsAdvanceLine) {
+        line += op.Sleb();
+      } else if (opcode == kLnsSetFile) {
+        file = op.Uleb();
+      } else if (opcode == kLnsConstAddPc) {
+        address += ((255 - opcode_base) / line_range) * min_instruction_length;
+      } else if (opcode == kLnsFixedAdvancePc) {
+        address += op.U16();
+      } else {
+        for (uint8_t i = 0; i < opcode_lengths[opcode - 1]; i++) {
+          op.Uleb();
+        }
+      }
+
+      if (emit) {
+        LineRow row;
+        row.address = address;
+        row.file = file < files.size() ? files[file] : 0;
+        row.line = end_sequence ? 0 : static_cast<uint32_t>(line > 0 ? line : 1);
+        sequence.push_back(row);
+      }
+      if (end_sequence) {
+        // Functions the linker dropped keep their rows, at address 0.
+        if (sequence.front().address != 0) {
+          lines_.insert(lines_.end(), sequence.begin(), sequence.end());
+        }
+        sequence.clear();
+        address = 0;
+        file = 1;
+        line = 1;
+      }
+    }
+  }
+
+  // Where one sequence ends and the next begins, the begin must win.
+  std::stable_sort(lines_.begin(), lines_.end(), [](const LineRow& a, const LineRow& b) {
+    return a.address != b.address ? a.address < b.address : a.line == 0 && b.line != 0;
+  });
+  if (files_.empty()) {
+    files_.push_back(std::string());
+  }
+}
+
+bool SymbolModule::Symbolize(uint64_t pc, SymbolInfo* info) const {
+  info->function.clear();
+  info->function_offset = 0;
+  info->file.clear();
+  info->line = 0;
+
+  std::vector<Symbol>::const_iterator symbol = std::upper_bound(
+      symbols_.begin(), symbols_.end(), pc,
+      [](uint64_t address, const Symbol& s) { return address < s.start; });
+  if (symbol != symbols_.begin()) {
+    --symbol;
+    std::vector<Symbol>::const_iterator next = symbol + 1;
+    bool inside = symbol->size ? pc < symbol->start + symbol->size
+                               : next == symbols_.end() || pc < next->start;
+    if (inside) {
+      info->function = names_.c_str() + symbol->name;
+      info->function_offset = pc - symbol->start;
+    }
+  }
+
+  std::vector<LineRow>::const_iterator row = std::upper_bound(
+      lines_.begin(), lines_.end(), pc,
+      [](uint64_t address, const LineRow& r) { return address < r.address; });
+  if (row != lines_.begin()) {
+    --row;
+    if (row->line) {
+      info->file = files_[row->file];
+      info->line = row->line;
+    }
+  }
+  return !info->function.empty() || info->line;
+}
+
+}  // namespace jnicrash
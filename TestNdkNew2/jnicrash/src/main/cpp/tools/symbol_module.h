@@ -0,0 +1,109 @@
+// Symbols and line tables of one module, for symbolizing on the host.
+
+#ifndef JNICRASH_TOOLS_SYMBOL_MODULE_H_
+#define JNICRASH_TOOLS_SYMBOL_MODULE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+namespace jnicrash {
+
+// The part of an ELF file the symbolizer reads, mapped read-only.  Both
+// classes and little-endian byte order are understood, whatever the host.
+class ElfImage {
+ public:
+  struct Section {
+    std::string name;
+    uint32_t type;
+    uint64_t flags;
+    uint64_t offset;
+    uint64_t size;
+    uint32_t link;
+    uint64_t entsize;
+  };
+
+  ElfImage();
+  ~ElfImage();
+
+  // Maps the file at path.  Returns false if it is not an ELF file.
+  bool Open(const std::string& path);
+
+  bool is_64bit() const { return is_64bit_; }
+  uint16_t machine() const { return machine_; }
+  const std::vector<Section>& sections() const { return sections_; }
+
+  // The first section with the given name or type, NULL if there is none.
+  const Section* FindSection(const char* name) const;
+  const Section* FindSectionByType(uint32_t type) const;
+
+  // The contents of a section, NULL if they are not in the file.
+  const uint8_t* Contents(const Section& section) const;
+
+  // The GNU build ID as lower-case hex, empty if there is none.
+  std::string BuildId() const;
+
+ private:
+  ElfImage(const ElfImage&);
+  void operator=(const ElfImage&);
+
+  const uint8_t* data_;
+  size_t size_;
+  bool is_64bit_;
+  uint16_t machine_;
+  std::vector<Section> sections_;
+};
+
+// A symbolized address.  function and file are empty when unknown.
+struct SymbolInfo {
+  std::string function;
+  uint64_t function_offset;
+  std::string file;
+  uint32_t line;
+};
+
+// Functions from .symtab (or .dynsym when there is none) and the line
+// table from .debug_line, loaded once and read-only afterwards, so one
+// module can be shared by any number of threads.
+class SymbolModule {
+ public:
+  SymbolModule() {}
+
+  // Loads the tables of the ELF file at path.  Returns false if it cannot
+  // be read; a file without tables loads but symbolizes nothing.
+  bool Load(const std::string& path);
+
+  // Symbolizes pc, an ELF virtual address.  The unwinder has already moved
+  // the pc of every frame but the innermost from the return address back
+  // into the call, so pcs are looked up as they are.
+  bool Symbolize(uint64_t pc, SymbolInfo* info) const;
+
+  size_t symbol_count() const { return symbols_.size(); }
+  size_t line_count() const { return lines_.size(); }
+
+ private:
+  struct Symbol {
+    uint64_t start;
+    uint64_t size;
+    uint32_t name;    // offset in names_
+  };
+  struct LineRow {
+    uint64_t address;
+    uint32_t file;    // index in files_
+    uint32_t line;    // 0 ends a sequence
+  };
+
+  void LoadSymbols(const ElfImage& elf);
+  void LoadLines(const ElfImage& elf);
+
+  std::vector<Symbol> symbols_;
+  std::string names_;
+  std::vector<LineRow> lines_;
+  std::vector<std::string> files_;
+};
+
+}  // namespace jnicrash
+
+#endif  // JNICRASH_TOOLS_SYMBOL_MODULE_H_
@@ -0,0 +1,432 @@
+// jnicrash-symbolize: symbolizes tombstones off the device.
+//
+// Tombstones written with TOMBSTONE_RAW_FRAMES carry frames as
+//     #00  pc 0000355f  /data/app/.../libfoo.so (BuildId: 66cc5d9f...)
+// which this tool rewrites, from unstripped copies of the modules, as
+//     #00  pc 0000355f  /data/app/.../libfoo.so (Foo::bar()+12) foo.cpp:42
+// Everything else in a report is copied through.
+//
+// The symbol directories are indexed by build ID once, any depth, and each
+// module is loaded the first time a frame needs it, then shared by all
+// workers.  Each worker remembers the frames it has resolved, so reports of
+// the same crash cost little more than reading and writing them.
+
+#include <cxxabi.h>
+#include <dirent.h>
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "symbol_module.h"
+
+namespace jnicrash {
+
+namespace {
+
+const char kBuildIdTag[] = " (BuildId: ";
+const char kOutputSuffix[] = ".sym";
+// Bounds the frames a worker remembers; most crashes repeat far fewer.
+const size_t kMaxMemoizedFrames = 1 << 20;
+
+// Finds what in s[start, end), returning end if it is not there.
+size_t FindInLine(const std::string& s, size_t start, size_t end, const char* what) {
+  const char* found = static_cast<const char*>(
+      memmem(s.data() + start, end - start, what, strlen(what)));
+  return found ? found - s.data() : end;
+}
+
+bool EndsWith(const std::string& s, const char* suffix) {
+  size_t length = strlen(suffix);
+  return s.size() >= length && s.compare(s.size() - length, length, suffix) == 0;
+}
+
+// Calls visit with the path of every regular file under path, or path
+// itself if it is a file.
+template <typename Visitor>
+void WalkFiles(const std::string& path, Visitor visit) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) {
+    fprintf(stderr, "jnicrash-symbolize: %s: %s\n", path.c_str(), strerror(errno));
+    return;
+  }
+  if (S_ISREG(st.st_mode)) {
+    visit(path);
+    return;
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    return;
+  }
+  DIR* dir = opendir(path.c_str());
+  if (!dir) {
+    return;
+  }
+  std::vector<std::string> children;
+  while (struct dirent* entry = readdir(dir)) {
+    if (strcmp(entry->d_name, ".") && strcmp(entry->d_name, "..")) {
+      children.push_back(path + "/" + entry->d_name);
+    }
+  }
+  closedir(dir);
+  for (size_t i = 0; i < children.size(); i++) {
+    WalkFiles(children[i], visit);
+  }
+}
+
+bool MakeDirectories(const std::string& path) {
+  for (size_t slash = path.find('/', 1); ; slash = path.find('/', slash + 1)) {
+    std::string prefix = path.substr(0, slash);
+    if (mkdir(prefix.c_str(), 0755) != 0 && errno != EEXIST) {
+      return false;
+    }
+    if (slash == std::string::npos) {
+      return true;
+    }
+  }
+}
+
+bool ReadFile(const std::string& path, std::string* contents) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  contents->clear();
+  char buffer[65536];
+  ssize_t n;
+  while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+    contents->append(buffer, n);
+  }
+  close(fd);
+  return n == 0;
+}
+
+bool WriteFile(const std::string& path, const std::string& contents) {
+  FILE* fp = fopen(path.c_str(), "w");
+  if (!fp) {
+    return false;
+  }
+  bool written = fwrite(contents.data(), 1, contents.size(), fp) == contents.size();
+  return fclose(fp) == 0 && written;
+}
+
+}  // namespace
+
+// Modules by build ID, from the symbol directories.
+class SymbolStore {
+ public:
+  // Indexes the ELF files under path.  Where several share a build ID, the
+  // one with the most symbol information wins.
+  void Index(const std::string& path) {
+    WalkFiles(path, [this](const std::string& file) {
+      ElfImage elf;
+      if (!elf.Open(file)) {
+        return;
+      }
+      std::string build_id = elf.BuildId();
+      if (build_id.empty()) {
+        return;
+      }
+      int score = (elf.FindSectionByType(SHT_SYMTAB) ? 2 : 0)
+          + (elf.FindSection(".debug_line") ? 1 : 0);
+      Entry& entry = entries_[build_id];
+      if (!entry.module || score > entry.score) {
+        entry.path = file;
+        entry.score = score;
+        entry.module.reset(new Slot);
+      }
+    });
+  }
+
+  size_t size() const { return entries_.size(); }
+
+  // The module with the build ID, loaded on first use.  NULL if there is
+  // none.  The index must not change once lookups start.
+  const SymbolModule* Find(const std::string& build_id) {
+    std::unordered_map<std::string, Entry>::iterator it = entries_.find(build_id);
+    if (it == entries_.end()) {
+      return NULL;
+    }
+    Entry& entry = it->second;
+    std::call_once(entry.module->once, [&entry]() {
+      SymbolModule* module = new SymbolModule;
+      if (module->Load(entry.path)) {
+        entry.module->loaded.reset(module);
+      } else {
+        delete module;
+      }
+    });
+    return entry.module->loaded.get();
+  }
+
+ private:
+  struct Slot {
+    std::once_flag once;
+    std::unique_ptr<SymbolModule> loaded;
+  };
+  struct Entry {
+    std::string path;
+    int score;
+    std::unique_ptr<Slot> module;
+  };
+
+  std::unordered_map<std::string, Entry> entries_;
+};
+
+struct Totals {
+  std::atomic<size_t> reports;
+  std::atomic<size_t> frames;
+  std::atomic<size_t> resolved;
+  std::atomic<size_t> failures;
+};
+
+// Symbolizes reports on one thread, remembering what it resolved.
+class Worker {
+ public:
+  Worker(SymbolStore* store, Totals* totals) : store_(store), totals_(totals) {}
+
+  bool Process(const std::string& input, const std::string& output) {
+    std::string report;
+    if (!ReadFile(input, &report)) {
+      fprintf(stderr, "jnicrash-symbolize: %s: %s\n", input.c_str(), strerror(errno));
+      return false;
+    }
+    std::string result;
+    result.reserve(report.size() + report.size() / 2);
+    size_t frames = 0, resolved = 0;
+    for (size_t start = 0; start < report.size(); ) {
+      size_t end = report.find('\n', start);
+      end = end == std::string::npos ? report.size() : end + 1;
+      bool is_frame = false;
+      if (SymbolizeLine(report, start, end, &result, &is_frame)) {
+        resolved++;
+      }
+      frames += is_frame;
+      start = end;
+    }
+    totals_->reports++;
+    totals_->frames += frames;
+    totals_->resolved += resolved;
+    if (!WriteFile(output, result)) {
+      fprintf(stderr, "jnicrash-symbolize: %s: %s\n", output.c_str(), strerror(errno));
+      return false;
+    }
+    return true;
+  }
+
+ private:
+  struct FrameKey {
+    const SymbolModule* module;
+    uint64_t pc;
+
+    bool operator==(const FrameKey& other) const {
+      return module == other.module && pc == other.pc;
+    }
+  };
+  struct FrameKeyHash {
+    size_t operator()(const FrameKey& key) const {
+      return std::hash<uint64_t>()(key.pc) ^ std::hash<const void*>()(key.module);
+    }
+  };
+
+  // Appends the line report[start, end) to result, symbolized if it is a
+  // raw frame of a module in the store.  Returns true if it was.
+  bool SymbolizeLine(const std::string& report, size_t start, size_t end, std::string* result,
+                     bool* is_frame) {
+    // "    #00  pc 0000355f  <path> (BuildId: <hex>)"
+    size_t hash = report.find_first_not_of(' ', start);
+    if (hash >= end || report[hash] != '#') {
+      result->append(report, start, end - start);
+      return false;
+    }
+    size_t tag = FindInLine(report, hash, end, kBuildIdTag);
+    size_t pc_field = FindInLine(report, hash, tag, "  pc ");
+    size_t close = FindInLine(report, tag, end, ")");
+    if (pc_field >= tag || close >= end) {
+      result->append(report, start, end - start);
+      return false;
+    }
+    *is_frame = true;
+    uint64_t pc = strtoull(report.c_str() + pc_field + 5, NULL, 16);
+    size_t build_id_start = tag + sizeof(kBuildIdTag) - 1;
+    std::string build_id = report.substr(build_id_start, close - build_id_start);
+
+    const SymbolModule* module = store_->Find(build_id);
+    if (!module) {
+      result->append(report, start, end - start);
+      return false;
+    }
+    FrameKey key = { module, pc };
+    std::unordered_map<FrameKey, std::string, FrameKeyHash>::iterator it = memo_.find(key);
+    if (it == memo_.end()) {
+      if (memo_.size() >= kMaxMemoizedFrames) {
+        memo_.clear();
+      }
+      it = memo_.insert(std::make_pair(key, Describe(module, key))).first;
+    }
+    if (it->second.empty()) {
+      result->append(report, start, end - start);
+      return false;
+    }
+    result->append(report, start, tag - start);
+    result->append(it->second);
+    result->append(report, close + 1, end - close - 1);
+    return true;
+  }
+
+  // " (function+offset) file:line", or empty if nothing is known.
+  static std::string Describe(const SymbolModule* module, const FrameKey& key) {
+    SymbolInfo info;
+    if (!module->Symbolize(key.pc, &info)) {
+      return std::string();
+    }
+    std::string description;
+    if (!info.function.empty()) {
+      int status;
+      char* demangled = abi::__cxa_demangle(info.function.c_str(), NULL, NULL, &status);
+      description = " (";
+      description += demangled ? demangled : info.function.c_str();
+      free(demangled);
+      if (info.function_offset) {
+        description += "+" + std::to_string(info.function_offset);
+      }
+      description += ")";
+    }
+    if (info.line) {
+      description += " " + info.file + ":" + std::to_string(info.line);
+    }
+    return description;
+  }
+
+  SymbolStore* store_;
+  Totals* totals_;
+  std::unordered_map<FrameKey, std::string, FrameKeyHash> memo_;
+};
+
+}  // namespace jnicrash
+
+namespace {
+
+void Usage() {
+  fprintf(stderr,
+          "usage: jnicrash-symbolize -s SYMBOL_DIR [-s SYMBOL_DIR...] [-j THREADS]\n"
+          "                          [-o OUTPUT_DIR] REPORT_OR_DIR...\n"
+          "\n"
+          "Symbolizes raw frames of tombstones from unstripped modules under the\n"
+          "symbol directories, matched by build ID.  Each report is written to\n"
+          "REPORT.sym, or under OUTPUT_DIR with its path relative to its argument.\n");
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  std::vector<std::string> symbol_dirs;
+  std::string output_dir;
+  unsigned threads = std::thread::hardware_concurrency();
+  int c;
+  while ((c = getopt(argc, argv, "s:j:o:h")) != -1) {
+    switch (c) {
+      case 's':
+        symbol_dirs.push_back(optarg);
+        break;
+      case 'j':
+        threads = atoi(optarg);
+        break;
+      case 'o':
+        output_dir = optarg;
+        break;
+      default:
+        Usage();
+        return 2;
+    }
+  }
+  if (symbol_dirs.empty() || optind == argc) {
+    Usage();
+    return 2;
+  }
+  if (threads == 0) {
+    threads = 1;
+  }
+
+  std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+  jnicrash::SymbolStore store;
+  for (size_t i = 0; i < symbol_dirs.size(); i++) {
+    store.Index(symbol_dirs[i]);
+  }
+
+  // Inputs and where each goes.
+  std::vector<std::pair<std::string, std::string> > jobs;
+  for (int i = optind; i < argc; i++) {
+    std::string root = argv[i];
+    while (root.size() > 1 && root[root.size() - 1] == '/') {
+      root.erase(root.size() - 1);
+    }
+    jnicrash::WalkFiles(root, [&](const std::string& input) {
+      if (jnicrash::EndsWith(input, jnicrash::kOutputSuffix)) {
+        return;
+      }
+      std::string output;
+      if (output_dir.empty()) {
+        output = input + jnicrash::kOutputSuffix;
+      } else {
+        // A file argument keeps its name; files under a directory keep
+        // their path below it.
+        std::string relative = input == root ? input.substr(input.rfind('/') + 1)
+                                             : input.substr(root.size() + 1);
+        output = output_dir + "/" + relative;
+      }
+      jobs.push_back(std::make_pair(input, output));
+    });
+  }
+  if (!output_dir.empty()) {
+    for (size_t i = 0; i < jobs.size(); i++) {
+      std::string directory = jobs[i].second.substr(0, jobs[i].second.rfind('/'));
+      if (!jnicrash::MakeDirectories(directory)) {
+        fprintf(stderr, "jnicrash-symbolize: %s: %s\n", directory.c_str(), strerror(errno));
+        return 1;
+      }
+    }
+  }
+
+  jnicrash::Totals totals;
+  totals.reports = 0;
+  totals.frames = 0;
+  totals.resolved = 0;
+  totals.failures = 0;
+  std::atomic<size_t> next(0);
+  std::vector<std::thread> workers;
+  for (unsigned t = 0; t < threads && t < jobs.size(); t++) {
+    workers.push_back(std::thread([&]() {
+      jnicrash::Worker worker(&store, &totals);
+      for (size_t i = next++; i < jobs.size(); i = next++) {
+        if (!worker.Process(jobs[i].first, jobs[i].second)) {
+          totals.failures++;
+        }
+      }
+    }));
+  }
+  for (size_t t = 0; t < workers.size(); t++) {
+    workers[t].join();
+  }
+
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+  fprintf(stderr,
+          "%zu reports, %zu of %zu frames symbolized, %zu modules indexed, "
+          "%.2f s (%.0f reports/min)\n",
+          totals.reports.load(), totals.resolved.load(), totals.frames.load(), store.size(),
+          seconds, seconds > 0 ? totals.reports.load() * 60 / seconds : 0.0);
+  return totals.failures ? 1 : 0;
+}
@@ -0,0 +1,160 @@
+// jnicrash-symbolize-test: checks that jnicrash-symbolize puts a frame on
+// the line of its call when the call is the first instruction of that line.
+//
+// The unwinder already moves the pc of every frame but the innermost from
+// the return address back into the call; on ARM it lands on the call's
+// first byte.  A symbolizer that moved it back once more would name the
+// line before.  The test finds such a call in itself, writes a raw report
+// with its pc as an outer and as the innermost frame, runs the symbolizer
+// given on the command line with this executable as the symbol file and
+// checks the line of both frames.
+
+#include <limits.h>
+#include <link.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "offline.h"
+
+namespace jnicrash {
+
+namespace {
+
+#if defined(__x86_64__)
+const uintptr_t kCallSize = 5;  // call rel32
+#elif defined(__aarch64__)
+const uintptr_t kCallSize = 4;  // bl
+#else
+#error "unsupported host architecture"
+#endif
+
+volatile int g_sink;
+uintptr_t g_return_address;
+
+void __attribute__((noinline)) Callee() {
+  g_return_address = reinterpret_cast<uintptr_t>(__builtin_return_address(0));
+}
+
+const int kCallLine = __LINE__ + 4;
+void __attribute__((noinline)) Caller() {
+  g_sink = 1;
+  // The call has no arguments to set up, so it starts its line.
+  Callee();
+  g_sink = 2;
+}
+
+int FindLoadBias(struct dl_phdr_info* info, size_t size, void* data) {
+  // The executable comes first.
+  *static_cast<uintptr_t*>(data) = info->dlpi_addr;
+  return 1;
+}
+
+std::string ReadFile(const std::string& path) {
+  std::string contents;
+  FILE* fp = fopen(path.c_str(), "r");
+  char buffer[4096];
+  size_t n;
+  while (fp && (n = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+    contents.append(buffer, n);
+  }
+  if (fp) {
+    fclose(fp);
+  }
+  return contents;
+}
+
+bool RunSymbolizer(const char* symbolizer, const char* symbols, const std::string& report) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    execl(symbolizer, symbolizer, "-j", "1", "-s", symbols, report.c_str(),
+          static_cast<char*>(NULL));
+    _exit(127);
+  }
+  int status;
+  return pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status)
+      && WEXITSTATUS(status) == 0;
+}
+
+}  // namespace
+
+}  // namespace jnicrash
+
+int main(int argc, char** argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: jnicrash-symbolize-test JNICRASH_SYMBOLIZE\n");
+    return 2;
+  }
+  char self[PATH_MAX];
+  ssize_t length = readlink("/proc/self/exe", self, sizeof(self) - 1);
+  if (length <= 0) {
+    perror("readlink");
+    return 1;
+  }
+  self[length] = '\0';
+  uint8_t build_id[OFFLINE_BUILD_ID_SIZE];
+  uint32_t build_id_size = read_build_id(self, 0, build_id, sizeof(build_id));
+  if (!build_id_size) {
+    fprintf(stderr, "%s has no build ID\n", self);
+    return 1;
+  }
+  std::string build_id_hex;
+  for (uint32_t i = 0; i < build_id_size; i++) {
+    char hex[3];
+    snprintf(hex, sizeof(hex), "%02x", build_id[i]);
+    build_id_hex += hex;
+  }
+
+  jnicrash::Caller();
+  uintptr_t load_bias = 0;
+  dl_iterate_phdr(jnicrash::FindLoadBias, &load_bias);
+  uintptr_t pc = jnicrash::g_return_address - jnicrash::kCallSize - load_bias;
+
+  char directory[] = "/tmp/jnicrash-symbolize-XXXXXX";
+  if (!mkdtemp(directory)) {
+    perror("mkdtemp");
+    return 1;
+  }
+  std::string report_path = std::string(directory) + "/tombstone";
+  FILE* fp = fopen(report_path.c_str(), "w");
+  if (!fp) {
+    perror(report_path.c_str());
+    return 1;
+  }
+  for (int depth = 0; depth < 2; depth++) {
+    fprintf(fp, "    #%02d  pc %016llx  %s (BuildId: %s)\n", depth,
+            static_cast<unsigned long long>(pc), self, build_id_hex.c_str());
+  }
+  fclose(fp);
+
+  bool ran = jnicrash::RunSymbolizer(argv[1], self, report_path);
+  std::string symbolized = jnicrash::ReadFile(report_path + ".sym");
+  unlink(report_path.c_str());
+  unlink((report_path + ".sym").c_str());
+  rmdir(directory);
+  if (!ran) {
+    fprintf(stderr, "%s failed\n", argv[1]);
+    return 1;
+  }
+
+  std::string expected = "symbolize_test.cpp:" + std::to_string(jnicrash::kCallLine) + "\n";
+  int failures = 0;
+  size_t start = 0;
+  for (int depth = 0; depth < 2; depth++) {
+    size_t end = symbolized.find('\n', start);
+    std::string line = symbolized.substr(start, end == std::string::npos ? end : end - start + 1);
+    bool passed = line.size() >= expected.size()
+        && !line.compare(line.size() - expected.size(), expected.size(), expected);
+    printf("frame #%02d at the call's first byte: %s", depth, passed ? "ok\n" : "FAILED\n");
+    if (!passed) {
+      fprintf(stderr, "  expected line %d, got: %s", jnicrash::kCallLine, line.c_str());
+      failures++;
+    }
+    start = end == std::string::npos ? symbolized.size() : end + 1;
+  }
+  return failures ? 1 : 0;
+}
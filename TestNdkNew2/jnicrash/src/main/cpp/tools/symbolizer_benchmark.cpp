@@ -0,0 +1,211 @@
+// jnicrash-symbolizer-benchmark: how fast threads of a process can name
+// addresses of its own code at once, with the library's symbolizer or with
+// dladdr().
+//
+// The addresses are spread over functions of the benchmark, libc, libm and
+// zlib.  Each thread looks all of them up in turn, from a different starting
+// point, for as long as the run lasts.  Before timing, the two are compared
+// on every address: the symbolizer must name each function dladdr() names.
+
+#include <dlfcn.h>
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <chrono>
+#include <vector>
+
+#include "module_table.h"
+#include "symbolizer.h"
+
+namespace jnicrash {
+
+namespace {
+
+// Addresses looked up in each function.
+const int kPcsPerFunction = 8;
+const int kPcStride = 4;
+
+enum Mode { kSymbolizer, kDladdr };
+
+struct Run {
+  volatile bool stopping;
+  Mode mode;
+  const std::vector<uintptr_t>* pcs;
+};
+
+struct Worker {
+  pthread_t thread;
+  Run* run;
+  size_t first;
+  uint64_t lookups;
+  uint64_t named;
+};
+
+// A name for the address, or NULL; what is measured.
+const char* Lookup(Mode mode, uintptr_t pc) {
+  if (mode == kSymbolizer) {
+    pc_symbol_t symbol;
+    return symbolize_pc(pc, &symbol) ? symbol.symbol_name : NULL;
+  }
+  Dl_info info;
+  return dladdr(reinterpret_cast<void*>(pc), &info) ? info.dli_sname : NULL;
+}
+
+void* Lookups(void* arg) {
+  Worker* worker = static_cast<Worker*>(arg);
+  const std::vector<uintptr_t>& pcs = *worker->run->pcs;
+  size_t i = worker->first;
+  while (!worker->run->stopping) {
+    if (Lookup(worker->run->mode, pcs[i])) {
+      worker->named++;
+    }
+    worker->lookups++;
+    if (++i == pcs.size()) {
+      i = 0;
+    }
+  }
+  return NULL;
+}
+
+// Runs thread_count threads for seconds; returns lookups per second and
+// sets *named to the share of lookups that found a name.
+double Measure(Mode mode, int thread_count, double seconds,
+               const std::vector<uintptr_t>& pcs, double* named) {
+  Run run;
+  run.stopping = false;
+  run.mode = mode;
+  run.pcs = &pcs;
+  std::vector<Worker> workers(thread_count);
+  std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+  for (int i = 0; i < thread_count; i++) {
+    workers[i].run = &run;
+    workers[i].first = pcs.size() * i / thread_count;
+    workers[i].lookups = 0;
+    workers[i].named = 0;
+    pthread_create(&workers[i].thread, NULL, Lookups, &workers[i]);
+  }
+  usleep(static_cast<useconds_t>(seconds * 1e6));
+  run.stopping = true;
+  uint64_t lookups = 0;
+  uint64_t named_lookups = 0;
+  for (int i = 0; i < thread_count; i++) {
+    pthread_join(workers[i].thread, NULL);
+    lookups += workers[i].lookups;
+    named_lookups += workers[i].named;
+  }
+  std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+  *named = lookups ? static_cast<double>(named_lookups) / lookups : 0;
+  return lookups / std::chrono::duration<double>(end - begin).count();
+}
+
+// Counts the addresses dladdr() names and the symbolizer names otherwise,
+// printing the first few.
+size_t Compare(const std::vector<uintptr_t>& pcs) {
+  size_t differences = 0;
+  for (size_t i = 0; i < pcs.size(); i++) {
+    const char* expected = Lookup(kDladdr, pcs[i]);
+    const char* actual = Lookup(kSymbolizer, pcs[i]);
+    if (expected && (!actual || strcmp(expected, actual))) {
+      if (++differences <= 5) {
+        fprintf(stderr, "%#zx: dladdr() says %s, the symbolizer %s\n",
+                static_cast<size_t>(pcs[i]), expected, actual ? actual : "nothing");
+      }
+    }
+  }
+  return differences;
+}
+
+void Usage() {
+  fprintf(stderr,
+          "usage: jnicrash-symbolizer-benchmark [-t SECONDS] [-m symbolizer|dladdr]\n"
+          "                                     [THREADS...]\n"
+          "\n"
+          "Times naming addresses of the process's own code from THREADS threads\n"
+          "at once (default 1 16), with both the symbolizer and dladdr() unless\n"
+          "-m picks one.\n");
+}
+
+}  // namespace
+
+}  // namespace jnicrash
+
+int main(int argc, char** argv) {
+  double seconds = 1;
+  bool modes[2] = {true, true};
+  int c;
+  while ((c = getopt(argc, argv, "t:m:h")) != -1) {
+    switch (c) {
+      case 't':
+        seconds = atof(optarg);
+        break;
+      case 'm':
+        modes[jnicrash::kSymbolizer] = !strcmp(optarg, "symbolizer");
+        modes[jnicrash::kDladdr] = !strcmp(optarg, "dladdr");
+        if (!modes[jnicrash::kSymbolizer] && !modes[jnicrash::kDladdr]) {
+          jnicrash::Usage();
+          return 2;
+        }
+        break;
+      default:
+        jnicrash::Usage();
+        return 2;
+    }
+  }
+  std::vector<int> thread_counts;
+  for (int i = optind; i < argc; i++) {
+    thread_counts.push_back(atoi(argv[i]));
+  }
+  if (thread_counts.empty()) {
+    thread_counts.push_back(1);
+    thread_counts.push_back(16);
+  }
+
+  const void* functions[] = {
+    reinterpret_cast<const void*>(&main),
+    reinterpret_cast<const void*>(&jnicrash::Lookups),
+    reinterpret_cast<const void*>(&jnicrash::Measure),
+    reinterpret_cast<const void*>(&fprintf),
+    reinterpret_cast<const void*>(&qsort),
+    reinterpret_cast<const void*>(&malloc),
+    reinterpret_cast<const void*>(&pthread_create),
+    reinterpret_cast<const void*>(&getopt),
+    reinterpret_cast<const void*>(static_cast<double (*)(double)>(&sin)),
+    reinterpret_cast<const void*>(static_cast<double (*)(double)>(&exp)),
+    reinterpret_cast<const void*>(&inflate),
+    reinterpret_cast<const void*>(&deflate),
+    reinterpret_cast<const void*>(&crc32),
+  };
+  std::vector<uintptr_t> pcs;
+  for (size_t i = 0; i < sizeof(functions) / sizeof(functions[0]); i++) {
+    for (int j = 0; j < jnicrash::kPcsPerFunction; j++) {
+      pcs.push_back(reinterpret_cast<uintptr_t>(functions[i]) + j * jnicrash::kPcStride);
+    }
+  }
+
+  module_table_update();
+  size_t differences = jnicrash::Compare(pcs);
+  printf("%zu addresses, %zu named differently\n", pcs.size(), differences);
+
+  const char* mode_names[] = {"symbolizer", "dladdr"};
+  printf("%-10s %8s %14s %12s %8s\n", "mode", "threads", "lookups/s", "ns/lookup",
+         "named");
+  for (int mode = 0; mode < 2; mode++) {
+    if (!modes[mode]) {
+      continue;
+    }
+    for (size_t i = 0; i < thread_counts.size(); i++) {
+      double named;
+      double rate = jnicrash::Measure(static_cast<jnicrash::Mode>(mode),
+                                      thread_counts[i], seconds, pcs, &named);
+      printf("%-10s %8d %14.0f %12.1f %7.1f%%\n", mode_names[mode], thread_counts[i],
+             rate, thread_counts[i] * 1e9 / rate, named * 100);
+    }
+  }
+  return differences ? 1 : 0;
+}
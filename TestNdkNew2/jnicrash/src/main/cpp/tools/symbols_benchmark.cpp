@@ -0,0 +1,308 @@
+// jnicrash-symbols-benchmark: what loading a module's symbols costs, by how
+// they are stored and how many there are.
+//
+// For each count, writes a module with that many functions three ways and
+// times load_symbol_table() on each:
+//     plain   .symtab and .strtab as the linker writes them
+//     zlib    the same sections compressed (SHF_COMPRESSED), as a stripped
+//             module could still carry them
+//     ranges  a gzipped function-range table, as embed_symbols.cmake adds
+//             with FORMAT gzip
+// The file is in the page cache, as a module on the device would be, so the
+// times are parsing and inflating, not I/O.
+
+#include <elf.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "embedded_symbols.h"
+#include "symbol_table.h"
+
+namespace jnicrash {
+
+namespace {
+
+// Symbols are loaded by the word size of the process, the host's here.
+#if __LP64__
+typedef Elf64_Ehdr Ehdr;
+typedef Elf64_Shdr Shdr;
+typedef Elf64_Sym Sym;
+typedef Elf64_Chdr Chdr;
+const unsigned char kElfClass = ELFCLASS64;
+#else
+typedef Elf32_Ehdr Ehdr;
+typedef Elf32_Shdr Shdr;
+typedef Elf32_Sym Sym;
+typedef Elf32_Chdr Chdr;
+const unsigned char kElfClass = ELFCLASS32;
+#endif
+
+struct Section {
+  std::string name;
+  uint32_t type;
+  uint64_t flags;
+  uint32_t link;
+  uint64_t entsize;
+  std::string contents;
+};
+
+template <typename T>
+void Append(std::string* out, const T& value) {
+  out->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+// Names look like those of a C++ library, so they compress like them.
+std::string FunctionName(size_t i) {
+  static const char* const kClasses[] = {"ExceptionHandler", "MinidumpWriter",
+                                         "LinuxDumper", "ThreadInfo", "Profiler"};
+  static const char* const kVerbs[] = {"Write", "Read", "Find", "Handle", "Dump",
+                                       "Load", "Resolve"};
+  char name[128];
+  snprintf(name, sizeof(name), "_ZN8jnicrash%zu%s%zu%s%zuEPKvm",
+           strlen(kClasses[i % 5]), kClasses[i % 5],
+           strlen(kVerbs[i % 7]) + 4, kVerbs[i % 7], i);
+  return name;
+}
+
+uint64_t FunctionStart(size_t i) { return 0x10000 + i * 64; }
+
+std::string Deflate(const std::string& in, int window_bits) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, window_bits, 8,
+               Z_DEFAULT_STRATEGY);
+  std::string out(deflateBound(&stream, in.size()) + 32, '\0');
+  stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+  stream.avail_in = in.size();
+  stream.next_out = reinterpret_cast<Bytef*>(&out[0]);
+  stream.avail_out = out.size();
+  deflate(&stream, Z_FINISH);
+  out.resize(stream.total_out);
+  deflateEnd(&stream);
+  return out;
+}
+
+std::string Compress(const std::string& in) {
+  Chdr chdr;
+  memset(&chdr, 0, sizeof(chdr));
+  chdr.ch_type = ELFCOMPRESS_ZLIB;
+  chdr.ch_size = in.size();
+  chdr.ch_addralign = 8;
+  std::string out;
+  Append(&out, chdr);
+  return out + Deflate(in, MAX_WBITS);
+}
+
+void SymbolSections(size_t count, bool compressed, std::vector<Section>* sections) {
+  std::string symtab;
+  std::string strtab(1, '\0');
+  Sym null_symbol;
+  memset(&null_symbol, 0, sizeof(null_symbol));
+  Append(&symtab, null_symbol);
+  for (size_t i = 0; i < count; i++) {
+    Sym sym;
+    memset(&sym, 0, sizeof(sym));
+    sym.st_name = strtab.size();
+    sym.st_info = (STB_LOCAL << 4) | STT_FUNC;
+    sym.st_shndx = 1;
+    sym.st_value = FunctionStart(i);
+    sym.st_size = 48;
+    Append(&symtab, sym);
+    strtab += FunctionName(i);
+    strtab += '\0';
+  }
+  uint64_t flags = compressed ? SHF_COMPRESSED : 0;
+  // .symtab links to .strtab, the section after it; WriteElf() puts the
+  // null section and .shstrtab first.
+  Section symtab_section = {".symtab", SHT_SYMTAB, flags,
+                            static_cast<uint32_t>(sections->size() + 3), sizeof(Sym),
+                            compressed ? Compress(symtab) : symtab};
+  Section strtab_section = {".strtab", SHT_STRTAB, flags, 0, 0,
+                            compressed ? Compress(strtab) : strtab};
+  sections->push_back(symtab_section);
+  sections->push_back(strtab_section);
+}
+
+void RangesSection(size_t count, std::vector<Section>* sections) {
+  std::string names;
+  std::string ranges;
+  for (size_t i = 0; i < count; i++) {
+    embedded_symbol_t range = {static_cast<uint32_t>(FunctionStart(i)), 48,
+                               static_cast<uint32_t>(names.size())};
+    Append(&ranges, range);
+    names += FunctionName(i);
+    names += '\0';
+  }
+  embedded_symbols_header_t header = {
+      EMBEDDED_SYMBOLS_MAGIC, static_cast<uint32_t>(count),
+      static_cast<uint32_t>(sizeof(header) + ranges.size()),
+      static_cast<uint32_t>(names.size())};
+  std::string table;
+  Append(&table, header);
+  table += ranges + names;
+  table.resize((table.size() + 3) & ~3);
+  Section section = {".jnicrash.symbols.gz", SHT_PROGBITS, 0, 0, 0,
+                     Deflate(table, 16 + MAX_WBITS)};
+  sections->push_back(section);
+}
+
+// Lays out the header, the sections' contents, then the section headers.
+std::string WriteElf(std::vector<Section> sections) {
+  Section shstrtab = {".shstrtab", SHT_STRTAB, 0, 0, 0, std::string(1, '\0')};
+  sections.insert(sections.begin(), shstrtab);
+  std::vector<uint32_t> name_offsets;
+  for (size_t i = 0; i < sections.size(); i++) {
+    name_offsets.push_back(sections[0].contents.size());
+    sections[0].contents += sections[i].name;
+    sections[0].contents += '\0';
+  }
+
+  std::string file(sizeof(Ehdr), '\0');
+  std::vector<Shdr> headers(sections.size() + 1);
+  memset(&headers[0], 0, sizeof(Shdr) * headers.size());
+  for (size_t i = 0; i < sections.size(); i++) {
+    file.resize((file.size() + 7) & ~7);
+    Shdr& header = headers[i + 1];
+    header.sh_name = name_offsets[i];
+    header.sh_type = sections[i].type;
+    header.sh_flags = sections[i].flags;
+    header.sh_offset = file.size();
+    header.sh_size = sections[i].contents.size();
+    header.sh_link = sections[i].link;
+    header.sh_entsize = sections[i].entsize;
+    header.sh_addralign = 1;
+    file += sections[i].contents;
+  }
+  file.resize((file.size() + 7) & ~7);
+
+  Ehdr ehdr;
+  memset(&ehdr, 0, sizeof(ehdr));
+  memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+  ehdr.e_ident[EI_CLASS] = kElfClass;
+  ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+  ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+  ehdr.e_type = ET_DYN;
+  ehdr.e_version = EV_CURRENT;
+  ehdr.e_ehsize = sizeof(Ehdr);
+  ehdr.e_shoff = file.size();
+  ehdr.e_shentsize = sizeof(Shdr);
+  ehdr.e_shnum = headers.size();
+  ehdr.e_shstrndx = 1;
+  memcpy(&file[0], &ehdr, sizeof(ehdr));
+  file.append(reinterpret_cast<const char*>(&headers[0]), sizeof(Shdr) * headers.size());
+  return file;
+}
+
+// Bytes of the sections the symbols are loaded from.
+size_t SymbolBytes(const std::vector<Section>& sections) {
+  size_t size = 0;
+  for (size_t i = 0; i < sections.size(); i++) {
+    size += sections[i].contents.size();
+  }
+  return size;
+}
+
+// Times load_symbol_table() on the module, in microseconds per load.
+// Returns a negative time if the symbols do not load.
+double TimeLoad(const std::string& path, size_t count, int repeats) {
+  double total = 0;
+  for (int i = 0; i < repeats; i++) {
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    symbol_table_t* table = load_symbol_table(path.c_str());
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    bool ok = table && table->num_symbols == count;
+    free_symbol_table(table);
+    if (!ok) {
+      return -1;
+    }
+    total += std::chrono::duration<double, std::micro>(end - begin).count();
+  }
+  return total / repeats;
+}
+
+void Usage() {
+  fprintf(stderr,
+          "usage: jnicrash-symbols-benchmark [-r REPEATS] [SYMBOL_COUNT...]\n"
+          "\n"
+          "Times loading SYMBOL_COUNT symbols (default 1000 10000 100000) from\n"
+          "plain, zlib-compressed and gzipped range-table sections.\n");
+}
+
+}  // namespace
+
+}  // namespace jnicrash
+
+int main(int argc, char** argv) {
+  int repeats = 20;
+  int c;
+  while ((c = getopt(argc, argv, "r:h")) != -1) {
+    switch (c) {
+      case 'r':
+        repeats = atoi(optarg);
+        break;
+      default:
+        jnicrash::Usage();
+        return 2;
+    }
+  }
+  if (repeats <= 0) {
+    repeats = 1;
+  }
+  std::vector<size_t> counts;
+  for (int i = optind; i < argc; i++) {
+    counts.push_back(strtoul(argv[i], NULL, 10));
+  }
+  if (counts.empty()) {
+    counts.push_back(1000);
+    counts.push_back(10000);
+    counts.push_back(100000);
+  }
+
+  char path[] = "/tmp/jnicrash-symbols-XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    perror("jnicrash-symbols-benchmark: mkstemp");
+    return 1;
+  }
+  close(fd);
+
+  static const char* const kFormats[] = {"plain", "zlib", "ranges"};
+  printf("%10s  %-7s %12s %12s %12s\n", "symbols", "format", "bytes", "us/load",
+         "ns/symbol");
+  for (size_t i = 0; i < counts.size(); i++) {
+    for (int format = 0; format < 3; format++) {
+      std::vector<jnicrash::Section> sections;
+      if (format == 2) {
+        jnicrash::RangesSection(counts[i], &sections);
+      } else {
+        jnicrash::SymbolSections(counts[i], format == 1, &sections);
+      }
+      std::string elf = jnicrash::WriteElf(sections);
+      FILE* file = fopen(path, "wb");
+      if (!file || fwrite(elf.data(), 1, elf.size(), file) != elf.size()) {
+        perror("jnicrash-symbols-benchmark: write");
+        return 1;
+      }
+      fclose(file);
+      double us = jnicrash::TimeLoad(path, counts[i], repeats);
+      if (us < 0) {
+        fprintf(stderr, "jnicrash-symbols-benchmark: %zu %s symbols did not load\n",
+                counts[i], kFormats[format]);
+        unlink(path);
+        return 1;
+      }
+      printf("%10zu  %-7s %12zu %12.1f %12.1f\n", counts[i], kFormats[format],
+             jnicrash::SymbolBytes(sections), us, us * 1000 / counts[i]);
+    }
+  }
+  unlink(path);
+  return 0;
+}
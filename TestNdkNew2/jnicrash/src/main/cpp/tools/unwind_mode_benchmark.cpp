@@ -0,0 +1,151 @@
+// jnicrash-unwind-mode-benchmark: how fast each unwind mode walks a stack
+// from a signal handler, in frames per microsecond.
+//
+// The benchmark recurses to a known depth, raises a signal there and, in the
+// handler, unwinds the interrupted context over and over with
+// unwind_backtrace_signal() in each mode.  It is built with frame pointers,
+// like the code the fast modes are meant for.
+
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <vector>
+
+#include "backtrace.h"
+
+namespace jnicrash {
+
+namespace {
+
+const int kDefaultIterations = 20000;
+const int kMaxFrames = 256;
+
+struct Mode {
+  const char* name;
+  unwind_mode_t mode;
+};
+
+const Mode kModes[] = {
+  {"accurate", UNWIND_MODE_ACCURATE},
+  {"hybrid", UNWIND_MODE_HYBRID},
+  {"fast", UNWIND_MODE_FAST},
+};
+const int kModeCount = sizeof(kModes) / sizeof(kModes[0]);
+
+// Read by the handler; set before the signal is raised.
+const map_info_t* g_map_info_list;
+int g_iterations;
+
+// Written by the handler.
+double g_seconds[kModeCount];
+ssize_t g_frames[kModeCount];
+
+// Keeps the frames of Recurse() from being folded into one.
+volatile int g_sink;
+
+double Now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+void Handler(int signal_number, siginfo_t* siginfo, void* sigcontext) {
+  backtrace_frame_t backtrace[kMaxFrames];
+  for (int i = 0; i < kModeCount; i++) {
+    ssize_t frames = 0;
+    double begin = Now();
+    for (int j = 0; j < g_iterations; j++) {
+      frames = unwind_backtrace_signal(siginfo, sigcontext, g_map_info_list, backtrace, 0,
+                                       kMaxFrames, kModes[i].mode);
+    }
+    g_seconds[i] = Now() - begin;
+    g_frames[i] = frames;
+  }
+}
+
+// Raises the signal depth frames below the caller.
+void __attribute__((noinline)) Recurse(int depth) {
+  if (depth == 0) {
+    raise(SIGUSR1);
+    return;
+  }
+  Recurse(depth - 1);
+  g_sink++;
+}
+
+void Usage() {
+  fprintf(stderr,
+          "usage: jnicrash-unwind-mode-benchmark [-n ITERATIONS] [DEPTHS...]\n"
+          "\n"
+          "Unwinds a signal context DEPTHS frames deep (default 8 32 128) ITERATIONS\n"
+          "times (default 20000) in each unwind mode.\n");
+}
+
+}  // namespace
+
+}  // namespace jnicrash
+
+int main(int argc, char** argv) {
+  int iterations = jnicrash::kDefaultIterations;
+  int c;
+  while ((c = getopt(argc, argv, "n:h")) != -1) {
+    switch (c) {
+      case 'n':
+        iterations = atoi(optarg);
+        break;
+      default:
+        jnicrash::Usage();
+        return 2;
+    }
+  }
+  std::vector<int> depths;
+  for (int i = optind; i < argc; i++) {
+    depths.push_back(atoi(argv[i]));
+  }
+  if (depths.empty()) {
+    depths.push_back(8);
+    depths.push_back(32);
+    depths.push_back(128);
+  }
+  if (iterations <= 0) {
+    jnicrash::Usage();
+    return 2;
+  }
+  for (size_t i = 0; i < depths.size(); i++) {
+    if (depths[i] < 0 || depths[i] > jnicrash::kMaxFrames - 16) {
+      jnicrash::Usage();
+      return 2;
+    }
+  }
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = jnicrash::Handler;
+  action.sa_flags = SA_SIGINFO;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGUSR1, &action, NULL);
+
+  jnicrash::g_map_info_list = acquire_my_map_info_list();
+  jnicrash::g_iterations = iterations;
+  printf("%d unwinds per mode and depth\n", iterations);
+  printf("%8s %-10s %8s %12s %12s\n", "depth", "mode", "frames", "us/unwind", "frames/us");
+  int status = 0;
+  for (size_t i = 0; i < depths.size(); i++) {
+    jnicrash::Recurse(depths[i]);
+    for (int j = 0; j < jnicrash::kModeCount; j++) {
+      double us = jnicrash::g_seconds[j] * 1e6 / iterations;
+      ssize_t frames = jnicrash::g_frames[j];
+      printf("%8d %-10s %8zd %12.2f %12.1f\n", depths[i], jnicrash::kModes[j].name, frames,
+             us, frames > 0 ? frames / us : 0.0);
+      if (frames <= depths[i]) {
+        status = 1;
+      }
+    }
+  }
+  release_my_map_info_list(const_cast<map_info_t*>(jnicrash::g_map_info_list));
+  return status;
+}
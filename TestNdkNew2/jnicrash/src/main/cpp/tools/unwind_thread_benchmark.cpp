@@ -0,0 +1,213 @@
+// jnicrash-unwind-thread-benchmark: how long unwind_backtrace_thread() takes
+// to unwind every thread of a process with many threads, from one thread or
+// from several at once.
+//
+// The benchmark starts its threads, lets each recurse a few frames deep and
+// block there, then unwinds all of them in rounds.  Each round is split
+// between the unwinding threads given on the command line; every unwind is
+// a signal to the target and a futex handshake with it.
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include "backtrace.h"
+
+namespace jnicrash {
+
+namespace {
+
+const int kDefaultThreads = 200;
+const int kDefaultRounds = 20;
+const int kDefaultDepth = 8;
+const int kMaxFrames = 64;
+
+// Keeps the frames of Recurse() from being folded into one.
+volatile int g_sink;
+
+// Never set: the blocked threads last as long as the process.  Testing it
+// lets Recurse() return, so its recursion is visibly bounded.
+volatile bool g_stop;
+
+struct Target {
+  pthread_t thread;
+  pid_t tid;
+  int depth;
+  volatile bool ready;
+};
+
+void __attribute__((noinline)) Recurse(Target* target, int depth) {
+  if (depth > 0) {
+    Recurse(target, depth - 1);
+    g_sink++;
+    return;
+  }
+  target->tid = static_cast<pid_t>(syscall(__NR_gettid));
+  __atomic_store_n(&target->ready, true, __ATOMIC_RELEASE);
+  // The unwind signal interrupts pause(), so it is called again.
+  while (!g_stop) {
+    pause();
+  }
+}
+
+void* Blocked(void* arg) {
+  Target* target = static_cast<Target*>(arg);
+  Recurse(target, target->depth);
+  return NULL;
+}
+
+struct Unwinder {
+  pthread_t thread;
+  const std::vector<Target>* targets;
+  size_t first;
+  size_t end;
+  int rounds;
+  pthread_barrier_t* barrier;
+  uint64_t unwinds;
+  uint64_t frames;
+  uint64_t failures;
+};
+
+void* Unwinds(void* arg) {
+  Unwinder* unwinder = static_cast<Unwinder*>(arg);
+  backtrace_frame_t backtrace[kMaxFrames];
+  pthread_barrier_wait(unwinder->barrier);
+  for (int round = 0; round < unwinder->rounds; round++) {
+    for (size_t i = unwinder->first; i < unwinder->end; i++) {
+      ssize_t frames = unwind_backtrace_thread((*unwinder->targets)[i].tid, backtrace, 0,
+                                               kMaxFrames);
+      unwinder->unwinds++;
+      if (frames > 0) {
+        unwinder->frames += frames;
+      } else {
+        unwinder->failures++;
+      }
+    }
+  }
+  return NULL;
+}
+
+// Unwinds every target rounds times from unwinder_count threads; returns
+// the seconds it took.
+double Measure(const std::vector<Target>& targets, int unwinder_count, int rounds,
+               uint64_t* frames, uint64_t* failures) {
+  std::vector<Unwinder> unwinders(unwinder_count);
+  pthread_barrier_t barrier;
+  pthread_barrier_init(&barrier, NULL, unwinder_count + 1);
+  for (int i = 0; i < unwinder_count; i++) {
+    Unwinder* unwinder = &unwinders[i];
+    unwinder->targets = &targets;
+    unwinder->first = targets.size() * i / unwinder_count;
+    unwinder->end = targets.size() * (i + 1) / unwinder_count;
+    unwinder->rounds = rounds;
+    unwinder->barrier = &barrier;
+    unwinder->unwinds = 0;
+    unwinder->frames = 0;
+    unwinder->failures = 0;
+    pthread_create(&unwinder->thread, NULL, Unwinds, unwinder);
+  }
+  std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+  pthread_barrier_wait(&barrier);
+  *frames = 0;
+  *failures = 0;
+  for (int i = 0; i < unwinder_count; i++) {
+    pthread_join(unwinders[i].thread, NULL);
+    *frames += unwinders[i].frames;
+    *failures += unwinders[i].failures;
+  }
+  std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+  pthread_barrier_destroy(&barrier);
+  return std::chrono::duration<double>(end - begin).count();
+}
+
+void Usage() {
+  fprintf(stderr,
+          "usage: jnicrash-unwind-thread-benchmark [-n THREADS] [-r ROUNDS] [-d DEPTH]\n"
+          "                                        [UNWINDERS...]\n"
+          "\n"
+          "Unwinds each of THREADS threads (default 200), blocked DEPTH frames deep\n"
+          "(default 8), ROUNDS times (default 20), from UNWINDERS threads at once\n"
+          "(default 1 4).\n");
+}
+
+}  // namespace
+
+}  // namespace jnicrash
+
+int main(int argc, char** argv) {
+  int thread_count = jnicrash::kDefaultThreads;
+  int rounds = jnicrash::kDefaultRounds;
+  int depth = jnicrash::kDefaultDepth;
+  int c;
+  while ((c = getopt(argc, argv, "n:r:d:h")) != -1) {
+    switch (c) {
+      case 'n':
+        thread_count = atoi(optarg);
+        break;
+      case 'r':
+        rounds = atoi(optarg);
+        break;
+      case 'd':
+        depth = atoi(optarg);
+        break;
+      default:
+        jnicrash::Usage();
+        return 2;
+    }
+  }
+  std::vector<int> unwinder_counts;
+  for (int i = optind; i < argc; i++) {
+    unwinder_counts.push_back(atoi(argv[i]));
+  }
+  if (unwinder_counts.empty()) {
+    unwinder_counts.push_back(1);
+    unwinder_counts.push_back(4);
+  }
+  if (thread_count <= 0 || rounds <= 0 || depth < 0
+      || *std::min_element(unwinder_counts.begin(), unwinder_counts.end()) <= 0) {
+    jnicrash::Usage();
+    return 2;
+  }
+
+  std::vector<jnicrash::Target> targets(thread_count);
+  for (int i = 0; i < thread_count; i++) {
+    targets[i].depth = depth + i % 4;
+    targets[i].ready = false;
+    if (pthread_create(&targets[i].thread, NULL, jnicrash::Blocked, &targets[i])) {
+      fprintf(stderr, "could not start thread %d\n", i);
+      return 1;
+    }
+  }
+  for (int i = 0; i < thread_count; i++) {
+    while (!__atomic_load_n(&targets[i].ready, __ATOMIC_ACQUIRE)) {
+      usleep(1000);
+    }
+  }
+
+  printf("%d threads, %d+ frames deep; %d rounds\n", thread_count, depth, rounds);
+  printf("%10s %14s %14s %12s %9s\n", "unwinders", "ms/round", "us/unwind", "frames",
+         "failed");
+  int status = 0;
+  for (size_t i = 0; i < unwinder_counts.size(); i++) {
+    uint64_t frames;
+    uint64_t failures;
+    double seconds = jnicrash::Measure(targets, unwinder_counts[i], rounds, &frames,
+                                       &failures);
+    uint64_t unwinds = static_cast<uint64_t>(thread_count) * rounds;
+    printf("%10d %14.2f %14.1f %12.1f %9llu\n", unwinder_counts[i], seconds * 1e3 / rounds,
+           seconds * 1e6 / unwinds,
+           unwinds > failures ? static_cast<double>(frames) / (unwinds - failures) : 0.0,
+           static_cast<unsigned long long>(failures));
+    if (failures) {
+      status = 1;
+    }
+  }
+  return status;
+}